@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+#include "log.h"
+#include "stats.h"
+
+/* Placement of the server on hosts with many cores and NUMA nodes.
+ *
+ * A worker is one wserver process with its event loop.  With -P, workers
+ * share the port through SO_REUSEPORT, and each can be pinned to a CPU of
+ * its own.  The listening socket of a pinned worker carries
+ * SO_INCOMING_CPU set to that CPU, so the kernel (6.1 and later) hands it
+ * the connections whose packets arrive on its CPU: a connection is then
+ * handled where its socket is already in the cache, from the interrupt to
+ * the response.  Otherwise the kernel picks a worker by hash.
+ *
+ * CGI programs and the compression thread would inherit the single CPU
+ * of a pinned worker and compete with it.  affinityNode lets them run on
+ * any CPU of its NUMA node instead, near the buffers the worker reads
+ * their output into.
+ *
+ * Pinned or not, /_stats counts how often the event loop moved to another
+ * CPU, and the connections whose packets arrived on a CPU, or a node,
+ * other than the one accepting them.  Nodes come from
+ * /sys/devices/system/node; without it every CPU is on node 0.
+ */
+
+static int worker = AFFINITY_NONE;  /* the -P argument */
+static cpu_set_t node_cpus;         /* for affinityNode */
+static short cpu_node[AFFINITY_MAX_CPUS];
+static int last_cpu = -1;           /* where affinityCheck last found us */
+
+/* Record that the CPUs of the sysfs list (such as "0-3,8-11") are on
+ * node.
+ */
+static void parseCpuList(const char *list, int node) {
+    const char *p = list;
+    for (;;) {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if (end == p) {
+            return;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for (long cpu = lo; cpu <= hi && cpu < AFFINITY_MAX_CPUS; cpu++) {
+            cpu_node[cpu] = node;
+        }
+        if (*end != ',') {
+            return;
+        }
+        p = end + 1;
+    }
+}
+
+/* Fill cpu_node from sysfs. */
+static void readNodes(void) {
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        int node;
+        if (sscanf(e->d_name, "node%d", &node) != 1) {
+            continue;
+        }
+        char path[320];
+        char list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", e->d_name);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), f) != NULL) {
+            parseCpuList(list, node);
+        }
+        fclose(f);
+    }
+    closedir(dir);
+}
+
+static int nodeOf(int cpu) {
+    return cpu >= 0 && cpu < AFFINITY_MAX_CPUS ? cpu_node[cpu] : 0;
+}
+
+/* Place this worker as wserver -P asked: on cpu, or unpinned if cpu is
+ * AFFINITY_ANY or AFFINITY_NONE.  Return 0, or -1 if cpu is not one we
+ * may run on.
+ */
+int affinityInit(int cpu) {
+    readNodes();
+    worker = cpu;
+    if (cpu < 0) {
+        return 0;
+    }
+    cpu_set_t allowed;
+    if (cpu >= AFFINITY_MAX_CPUS || sched_getaffinity(0, sizeof(allowed), &allowed) == -1 ||
+            !CPU_ISSET(cpu, &allowed)) {
+        LOG_ERROR("CPU %d is not available\n", cpu);
+        return -1;
+    }
+    // Helpers get the CPUs of our node that we were allowed, or all of
+    // those if sysfs knows no better
+    CPU_ZERO(&node_cpus);
+    for (int i = 0; i < AFFINITY_MAX_CPUS; i++) {
+        if (CPU_ISSET(i, &allowed) && cpu_node[i] == cpu_node[cpu]) {
+            CPU_SET(i, &node_cpus);
+        }
+    }
+    cpu_set_t mine;
+    CPU_ZERO(&mine);
+    CPU_SET(cpu, &mine);
+    if (sched_setaffinity(0, sizeof(mine), &mine) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    LOG_INFO("worker pinned to CPU %d, node %d (%d CPUs)\n", cpu, cpu_node[cpu],
+            CPU_COUNT(&node_cpus));
+    return 0;
+}
+
+/* Return 1 if the port is shared with other workers (SO_REUSEPORT). */
+int affinityShared(void) {
+    return worker != AFFINITY_NONE;
+}
+
+/* Ask the kernel for the connections that arrive on our CPU. */
+void affinityListen(int listenfd) {
+    if (worker < 0) {
+        return;
+    }
+    if (setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &worker, sizeof(worker)) < 0) {
+        perror("setsockopt SO_INCOMING_CPU");
+    }
+}
+
+/* Let the calling process or thread, a CGI program or helper of a pinned
+ * worker, run on any CPU of the worker's node.
+ */
+void affinityNode(void) {
+    if (worker >= 0) {
+        sched_setaffinity(0, sizeof(node_cpus), &node_cpus);
+    }
+}
+
+/* Count the accepted connection fd if its packets came in on another CPU
+ * or node than ours.
+ */
+void affinityAccepted(int fd) {
+    int incoming;
+    socklen_t len = sizeof(incoming);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &len) < 0 || incoming < 0) {
+        return;
+    }
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu == incoming) {
+        return;
+    }
+    statsAdd(STAT_CONN_OTHER_CPU, 1);
+    if (nodeOf(cpu) != nodeOf(incoming)) {
+        statsAdd(STAT_CONN_CROSS_NODE, 1);
+    }
+}
+
+/* Called once per event loop iteration: count it if the scheduler moved
+ * us to another CPU since the last one.
+ */
+void affinityCheck(void) {
+    int cpu = sched_getcpu();
+    if (last_cpu != -1 && cpu != last_cpu) {
+        statsAdd(STAT_CPU_MIGRATIONS, 1);
+        if (nodeOf(cpu) != nodeOf(last_cpu)) {
+            statsAdd(STAT_NODE_MIGRATIONS, 1);
+        }
+    }
+    last_cpu = cpu;
+}
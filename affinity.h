@@ -0,0 +1,11 @@
+/* CPU and NUMA placement of the event loop and its helpers; see affinity.c */
+#define AFFINITY_MAX_CPUS 1024  /* CPUs whose node we know */
+#define AFFINITY_NONE -2        /* no wserver -P: alone on the port, unpinned */
+#define AFFINITY_ANY -1         /* wserver -P any: share the port, unpinned */
+
+int affinityInit(int cpu);
+int affinityShared(void);
+void affinityListen(int listenfd);
+void affinityNode(void);
+void affinityAccepted(int fd);
+void affinityCheck(void);
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Compare WORKERS wservers sharing the port (wserver -P): unpinned, and
+# pinned one per CPU so that the kernel steers each connection to the
+# worker on the CPU its packets arrive on.  Prints one JSON object per
+# scenario and saves them to bench-affinity-<commit>.jsonl, followed by
+# the placement counters of each worker, asked from its own CPU.
+#
+# On loopback the packets of a connection arrive on the CPU of the client
+# that sent them, so wbench threads and workers compete for the same
+# CPUs; the counters show whether steering worked, and the throughput is
+# best compared on a real NIC with the client on another host.
+#
+# Environment: PORT (default 30000 + uid % 10000), DURATION (seconds per
+# scenario, default 5), THREADS (default 2), ENGINE (wserver -e, default
+# select), WORKERS (default: the number of CPUs, at most 4).
+
+PORT=${PORT:-$((30000 + $(id -u) % 10000))}
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+ENGINE=${ENGINE:-select}
+NCPU=$(nproc)
+WORKERS=${WORKERS:-$((NCPU < 4 ? NCPU : 4))}
+OUT=${OUT:-bench-affinity-$COMMIT.jsonl}
+
+PIDS=
+trap 'kill $PIDS 2>/dev/null' EXIT INT TERM
+
+run() {
+    ./wbench -j -t "$THREADS" -d "$DURATION" "$@" 127.0.0.1 "$PORT" "$PATHNAME" |
+        sed "s/^{/{\"commit\":\"$COMMIT\",\"engine\":\"$ENGINE\",\"workers\":$WORKERS,\"placement\":\"$MODE\",\"scenario\":\"$NAME\",/"
+}
+
+: > "$OUT"
+for MODE in unpinned pinned; do
+    for CPU in $(seq 0 $((WORKERS - 1))); do
+        WHERE=any
+        [ "$MODE" = pinned ] && WHERE=$CPU
+        ./wserver -e "$ENGINE" -P "$WHERE" "$PORT" 2>/dev/null &
+        PIDS="$PIDS $!"
+    done
+    sleep 0.5
+    {
+        NAME=simple PATHNAME='/simple?name=bench&x=1' run -c 8
+        NAME=large PATHNAME=/large run -c 8
+    } | tee -a "$OUT"
+    for CPU in $(seq 0 $((WORKERS - 1))); do
+        taskset -c "$CPU" curl -s http://127.0.0.1:"$PORT"/_stats |
+            grep -E '^wserver_(cpu_|node_|connections_)' | sed "s/^/# $MODE cpu $CPU: /"
+    done
+    kill $PIDS 2>/dev/null
+    wait 2>/dev/null
+    PIDS=
+done
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Benchmark proxied programs (wserver -u) against two stubserver upstreams:
+# once with equal latency and once with one of them DELAY ms slower, which
+# least-outstanding balancing should steer around.  Prints one JSON object
+# per scenario and saves them to bench-proxy-<commit>.jsonl, followed by
+# the per-upstream request counts from /_stats.
+#
+# Environment: PORT (default 30000 + uid % 10000; the upstreams use the
+# next two ports), DURATION (seconds per scenario, default 5), THREADS
+# (default 2), ENGINE (wserver -e, default select), DELAY (default 5).
+
+PORT=${PORT:-$((30000 + $(id -u) % 10000))}
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+ENGINE=${ENGINE:-select}
+DELAY=${DELAY:-5}
+OUT=${OUT:-bench-proxy-$COMMIT.jsonl}
+UP1=$((PORT + 1))
+UP2=$((PORT + 2))
+
+PIDS=
+trap 'kill $PIDS 2>/dev/null' EXIT INT TERM
+
+run() {
+    ./wbench -j -t "$THREADS" -d "$DURATION" "$@" 127.0.0.1 "$PORT" "$PATHNAME" |
+        sed "s/^{/{\"commit\":\"$COMMIT\",\"engine\":\"$ENGINE\",\"upstreams\":\"$MODE\",\"scenario\":\"$NAME\",/"
+}
+
+: > "$OUT"
+for MODE in equal skewed; do
+    SLOW=
+    [ "$MODE" = skewed ] && SLOW="-d $DELAY"
+    ./stubserver "$UP1" &
+    PIDS="$PIDS $!"
+    ./stubserver $SLOW "$UP2" &
+    PIDS="$PIDS $!"
+    ./wserver -e "$ENGINE" -u stub=127.0.0.1:"$UP1",127.0.0.1:"$UP2" "$PORT" 2>/dev/null &
+    PIDS="$PIDS $!"
+    sleep 0.5
+    {
+        NAME=small-closed PATHNAME=/stub run -c 8
+        NAME=small-open PATHNAME=/stub run -c 8 -r 2000
+        NAME=large-closed PATHNAME='/stub?size=200000' run -c 8
+    } | tee -a "$OUT"
+    curl -s http://127.0.0.1:"$PORT"/_stats |
+        grep -E '^wserver_(upstream_requests|proxy_)' | sed "s/^/# $MODE: /"
+    kill $PIDS 2>/dev/null
+    wait 2>/dev/null
+    PIDS=
+done
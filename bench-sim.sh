@@ -0,0 +1,37 @@
+#!/bin/sh
+# Run the simbench scenario suite: the coroutine loop against simulated
+# clients in virtual time (see loopback.c).  Prints one JSON object per
+# scenario and saves them to bench-sim-<commit>.jsonl.  Everything but
+# wall_s is exactly reproducible, so runs of two commits can be diffed
+# for changes in behaviour as well as in cost, e.g.
+#   make bench-sim && git checkout other && make bench-sim
+#   diff bench-sim-abc1234.jsonl bench-sim-def5678.jsonl
+#
+# Environment: CLIENTS (per scenario, default 20000).
+
+CLIENTS=${CLIENTS:-20000}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+OUT=${OUT:-bench-sim-$COMMIT.jsonl}
+
+run() {
+    ./simbench -j -n "$CLIENTS" "$@" |
+        sed "s/^{/{\"commit\":\"$COMMIT\",\"scenario\":\"$NAME\",/"
+}
+
+: > "$OUT"
+{
+    NAME=burst run -a 10
+    NAME=steady run -a 100
+    # Requests in 7-byte writes, one per ms: the parser resumes each time
+    NAME=fragmented run -a 100 -f 7
+    # One client in twenty never finishes its request header
+    NAME=stalled run -a 100 -f 16 -x 5
+    # Large responses read at 100 bytes/ms through 16KB windows, with
+    # and without enough memory for all of them; every client reads every
+    # ms, so these take a quarter of the clients
+    NAME=slow-readers run -n $((CLIENTS / 4)) -a 200 -s 200000 -r 100 -w 16384 -M 4096
+    NAME=slow-readers-short run -n $((CLIENTS / 4)) -a 200 -s 200000 -r 100 -w 16384 -M 64
+    # Many connections from a few addresses, at most 4 each
+    NAME=few-addresses run -a 10 -A 16 -l 4
+    NAME=notfound run -a 10 /nothere
+} | tee -a "$OUT"
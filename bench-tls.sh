@@ -0,0 +1,52 @@
+#!/bin/sh
+# Compare TLS termination modes: wserver with kernel TLS (-c/-k) and with
+# the user-space relay (-T), each under resumed (wbench -s) and full (-S)
+# handshakes.  Prints one JSON object per scenario and saves them to
+# bench-tls-<commit>.jsonl.  A throwaway self-signed certificate is made
+# with openssl(1).
+#
+# Whether kTLS was really used shows in wserver_ktls_connections_total on
+# /_stats; it stays 0 when the kernel has no "tls" module.
+#
+# Environment: PORT (default 30000 + uid % 10000), DURATION (seconds per
+# scenario, default 5), THREADS (default 2), ENGINE (wserver -e, default
+# select).
+
+PORT=${PORT:-$((30000 + $(id -u) % 10000))}
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+ENGINE=${ENGINE:-select}
+OUT=${OUT:-bench-tls-$COMMIT.jsonl}
+
+DIR=$(mktemp -d)
+SERVER=
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT INT TERM
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+    -subj /CN=localhost -days 1 -keyout "$DIR/key.pem" -out "$DIR/cert.pem" \
+    2>/dev/null || exit 1
+
+run() {
+    ./wbench -j -t "$THREADS" -d "$DURATION" "$@" 127.0.0.1 "$PORT" "$PATHNAME" |
+        sed "s/^{/{\"commit\":\"$COMMIT\",\"engine\":\"$ENGINE\",\"termination\":\"$MODE\",\"scenario\":\"$NAME\",/"
+}
+
+: > "$OUT"
+for MODE in ktls relay; do
+    FLAGS=
+    [ "$MODE" = relay ] && FLAGS=-T
+    ./wserver -e "$ENGINE" -c "$DIR/cert.pem" -k "$DIR/key.pem" $FLAGS "$PORT" 2>/dev/null &
+    SERVER=$!
+    sleep 0.5
+    {
+        NAME=simple-resumed PATHNAME='/simple?name=bench&x=1' run -c 8 -s
+        NAME=simple-full PATHNAME='/simple?name=bench&x=1' run -c 8 -S
+        NAME=large-resumed PATHNAME=/large run -c 8 -s
+        NAME=large-full PATHNAME=/large run -c 8 -S
+    } | tee -a "$OUT"
+    printf 'GET /_stats HTTP/1.0\r\n\r\n' |
+        openssl s_client -quiet -connect 127.0.0.1:"$PORT" 2>/dev/null |
+        grep -E '^wserver_(tls|ktls)_' | sed "s/^/# $MODE: /"
+    kill $SERVER
+    wait $SERVER 2>/dev/null
+done
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Run the wbench scenario suite against a local wserver and print one JSON
+# object per scenario.  Results are also saved to bench-<commit>-<engine>.jsonl so
+# runs can be compared across commits, e.g.
+#   make bench && git checkout other && make bench
+#   diff bench-abc1234-select.jsonl bench-def5678-select.jsonl
+#
+# Environment: PORT (default 30000 + uid % 10000), DURATION (seconds per
+# scenario, default 5), THREADS (default 2), ENGINE (wserver -e, default
+# select).
+
+PORT=${PORT:-$((30000 + $(id -u) % 10000))}
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+ENGINE=${ENGINE:-select}
+OUT=${OUT:-bench-$COMMIT-$ENGINE.jsonl}
+
+./wserver -e "$ENGINE" "$PORT" 2>/dev/null &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT INT TERM
+sleep 0.5
+
+# wserver serves at most MAXCLIENTS (10) connections at once, so keep the
+# concurrency below that.
+run() {
+    ./wbench -j -t "$THREADS" -d "$DURATION" "$@" 127.0.0.1 "$PORT" "$PATHNAME" |
+        sed "s/^{/{\"commit\":\"$COMMIT\",\"engine\":\"$ENGINE\",\"scenario\":\"$NAME\",/"
+}
+
+: > "$OUT"
+{
+    NAME=simple-closed PATHNAME='/simple?name=bench&x=1' run -c 8
+    NAME=simple-open PATHNAME='/simple?name=bench&x=1' run -c 8 -r 500
+    NAME=large-closed PATHNAME=/large run -c 8
+    NAME=large-open PATHNAME=/large run -c 8 -r 200
+    NAME=stats-closed PATHNAME=/_stats run -c 8
+    NAME=notfound-closed PATHNAME=/nothere run -c 8
+    # slowcgi and term take five seconds per request
+    NAME=slowcgi-closed PATHNAME=/slowcgi DURATION=$((DURATION > 6 ? DURATION : 6)) run -c 4
+    NAME=term-closed PATHNAME=/term DURATION=$((DURATION > 6 ? DURATION : 6)) run -c 2
+} | tee "$OUT"
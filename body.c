@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "ws_helpers.h"
+#include "body.h"
+#include "wrapsock.h"
+#include "transport.h"
+#include "mem.h"
+#include "stats.h"
+#include "log.h"
+
+/* Request bodies.
+ *
+ * The body of a POST or PUT request goes to the standard input of its CGI
+ * program as it arrives.  The program is started as soon as the header is
+ * in, with a second pipe on its standard input whose write end is
+ * cs->fd[1], and the event loop moves the body from the socket to that
+ * pipe with bodyPump, BODY_BUF bytes at a time.  While the pipe is full
+ * the socket is not read, so a program that reads slowly holds the client
+ * back through TCP flow control rather than with our memory.  Its output
+ * is read all along as for any request, so a program that writes before
+ * it has read everything cannot deadlock with us.
+ *
+ * The body is framed by Content-Length or by the chunked transfer coding,
+ * which is decoded on the way (RFC 9112, section 7.1).  The program gets
+ * CONTENT_LENGTH when the length is known and reads to EOF otherwise (RFC
+ * 3875, section 4.1.2).  A body over the limit (wserver -B) is refused
+ * with 413, up front if its length is known and otherwise once it gets
+ * there, and a malformed one with 400; either kills the program.
+ *
+ * Every pump that gets body bytes re-arms the CGI deadline, so an upload
+ * has CGI_TIMEOUT_MS between reads rather than in all.  A client that
+ * stops sending half way gets a 408.
+ */
+
+enum chunk_state {
+    CHUNK_NONE,         /* Content-Length framing */
+    CHUNK_SIZE,         /* hex digits of a chunk size */
+    CHUNK_EXT,          /* chunk extension, up to CR */
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,      /* at the start of a trailer line */
+    CHUNK_TRAILER_LINE, /* in one */
+    CHUNK_END_LF,       /* of the blank line after the trailers */
+    CHUNK_DONE
+};
+
+struct req_body {
+    char method[8];
+    char *type;             /* Content-Type, or NULL */
+    int64_t length;         /* Content-Length, or -1 if chunked */
+    int64_t left;           /* bytes of the body or of the current chunk */
+    int64_t received;       /* decoded so far */
+    int chunk;              /* enum chunk_state */
+    int digits;             /* of the current chunk size */
+    int expect;             /* a 100 Continue is to be sent */
+    int status;             /* 400, 408 or 413 once it failed, else 0 */
+    int waiting;            /* last result of bodyPump */
+    int sent, data;         /* buf[sent, data) is decoded, not yet written */
+    char buf[BODY_BUF];
+};
+
+static int64_t body_max = BODY_MAX_DEFAULT;
+
+/* Refuse request bodies over bytes from now on. */
+void bodyLimit(int64_t bytes) {
+    body_max = bytes;
+}
+
+/* Return the value of the header name (lowercase, without the colon) of
+ * the request header block that ends at end, with its length in *len, or
+ * NULL.
+ */
+static const char *requestHeader(const char *request, const char *end,
+        const char *name, int *len) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(request, "\r\n");
+    while (line != NULL && line < end) {
+        line += 2;
+        const char *eol = strstr(line, "\r\n");
+        if (eol - line > (long) name_len && line[name_len] == ':' &&
+                strncasecmp(line, name, name_len) == 0) {
+            const char *v = line + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            const char *v_end = eol;
+            while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+                v_end--;
+            }
+            *len = v_end - v;
+            return v;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+static int complete(const struct req_body *b) {
+    return b->chunk == CHUNK_DONE || (b->chunk == CHUNK_NONE && b->left == 0);
+}
+
+static int hexValue(char c) {
+    return isdigit((unsigned char) c) ? c - '0' : tolower((unsigned char) c) - 'a' + 10;
+}
+
+/* Decode the n bytes of the body that were just put at the start of
+ * b->buf in place, leaving what goes to the program in b->buf[0, b->data).
+ * Bytes after the end of the body are dropped.  Return 0, or the status
+ * to answer with if the body is malformed or too large.
+ */
+static int decode(struct req_body *b, int n) {
+    int out = 0;
+    int i = 0;
+    while (i < n && !complete(b)) {
+        if (b->chunk == CHUNK_NONE || b->chunk == CHUNK_DATA) {
+            int take = n - i < b->left ? n - i : (int) b->left;
+            memmove(b->buf + out, b->buf + i, take);
+            out += take;
+            i += take;
+            b->left -= take;
+            if (b->chunk == CHUNK_DATA && b->left == 0) {
+                b->chunk = CHUNK_DATA_CR;
+            }
+            continue;
+        }
+        char c = b->buf[i++];
+        switch (b->chunk) {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char) c)) {
+                b->left = b->left * 16 + hexValue(c);
+                b->digits++;
+                if (b->received + out + b->left > body_max) {
+                    return 413;
+                }
+            } else if (b->digits > 0 && c == ';') {
+                b->chunk = CHUNK_EXT;
+            } else if (b->digits > 0 && c == '\r') {
+                b->chunk = CHUNK_SIZE_LF;
+            } else {
+                return 400;
+            }
+            break;
+        case CHUNK_EXT:
+            if (c == '\r') {
+                b->chunk = CHUNK_SIZE_LF;
+            }
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n') {
+                return 400;
+            }
+            b->chunk = b->left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+        case CHUNK_DATA_CR:
+            if (c != '\r') {
+                return 400;
+            }
+            b->chunk = CHUNK_DATA_LF;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n') {
+                return 400;
+            }
+            b->chunk = CHUNK_SIZE;
+            b->digits = 0;
+            break;
+        case CHUNK_TRAILER:
+            b->chunk = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n') {
+                b->chunk = CHUNK_TRAILER;
+            }
+            break;
+        case CHUNK_END_LF:
+            if (c != '\n') {
+                return 400;
+            }
+            b->chunk = CHUNK_DONE;
+            break;
+        }
+    }
+    b->sent = 0;
+    b->data = out;
+    b->received += out;
+    statsAdd(STAT_BODY_BYTES, out);
+    return b->received > body_max ? 413 : 0;
+}
+
+/* Return 1 if the complete request header at request is a POST or PUT that
+ * announces a body, whether or not bodyStart would take it.
+ */
+int bodyAnnounced(const char *request) {
+    int method_len = strcspn(request, " ");
+    const char *end = strstr(request, "\r\n\r\n");
+    if (end == NULL || (!(method_len == 4 && strncmp(request, "POST", 4) == 0) &&
+            !(method_len == 3 && strncmp(request, "PUT", 3) == 0))) {
+        return 0;
+    }
+    int len;
+    const char *cl = requestHeader(request, end, "content-length", &len);
+    return requestHeader(request, end, "transfer-encoding", &len) != NULL ||
+            (cl != NULL && strtoll(cl, NULL, 10) != 0);
+}
+
+/* If the complete request header in cs (see handleClient) is a POST or
+ * PUT, set cs->body up to stream its body to the program, starting with
+ * the rest_len bytes at rest that came in after the header.  Without
+ * Content-Length or Transfer-Encoding the body is empty.  Return 0, or the
+ * status to answer with instead of running the program: 400 if the
+ * framing is wrong, 413 if the body is over the limit.
+ */
+int bodyStart(struct clientstate *cs, const char *rest, int rest_len) {
+    const char *request = cs->request;
+    int method_len = strcspn(request, " ");
+    if (!(method_len == 4 && strncmp(request, "POST", 4) == 0) &&
+            !(method_len == 3 && strncmp(request, "PUT", 3) == 0)) {
+        return 0;
+    }
+    const char *end = strstr(request, "\r\n\r\n");
+    int te_len, cl_len, len;
+    const char *te = requestHeader(request, end, "transfer-encoding", &te_len);
+    const char *cl = requestHeader(request, end, "content-length", &cl_len);
+    int64_t length = 0;
+    if (te != NULL) {
+        // Both framings at once is how requests get smuggled, and codings
+        // other than chunked we could not undo
+        if (cl != NULL || te_len != 7 || strncasecmp(te, "chunked", 7) != 0) {
+            return 400;
+        }
+        length = -1;
+    } else if (cl != NULL) {
+        char *stop;
+        errno = 0;
+        length = strtoll(cl, &stop, 10);
+        if (!isdigit((unsigned char) *cl) || stop != cl + cl_len) {
+            return 400;
+        }
+        if (errno == ERANGE) {
+            return 413;
+        }
+    }
+    if (length > body_max) {
+        return 413;
+    }
+
+    struct req_body *b = malloc(sizeof(*b));
+    memAdd(MEM_REQUEST, sizeof(*b));
+    memcpy(b->method, request, method_len);
+    b->method[method_len] = '\0';
+    const char *type = requestHeader(request, end, "content-type", &len);
+    b->type = type != NULL ? strndup(type, len) : NULL;
+    b->length = length;
+    b->left = length > 0 ? length : 0;
+    b->received = 0;
+    b->chunk = length == -1 ? CHUNK_SIZE : CHUNK_NONE;
+    b->digits = 0;
+    const char *expect = requestHeader(request, end, "expect", &len);
+    b->expect = expect != NULL && len == 12 && strncasecmp(expect, "100-continue", 12) == 0;
+    b->status = 0;
+    b->waiting = BODY_DONE;
+    cs->body = b;
+
+    memcpy(b->buf, rest, rest_len);
+    int status = decode(b, rest_len);
+    if (status != 0) {
+        bodyEnd(cs);
+        return status;
+    }
+    if (complete(b)) {
+        // Nothing left to ask for
+        b->expect = 0;
+    }
+    return 0;
+}
+
+/* Close the standard input of the program of cs. */
+static void closeInput(struct clientstate *cs) {
+    if (cs->fd[1] != -1) {
+        Close(cs->fd[1]);
+        cs->fd[1] = -1;
+    }
+}
+
+/* Give up on the body of cs, and on its program: answer with status. */
+static void bodyFail(struct clientstate *cs, int status) {
+    LOG_DEBUG("Request body on %d failed with %d\n", cs->sock, status);
+    cs->body->status = status;
+    closeInput(cs);
+    stopProgram(cs->cgi_pid);
+}
+
+/* Move the body of cs on towards its program: write what is decoded to
+ * cs->fd[1], and once that is all written read and decode more from
+ * cs->sock, until one of them would block.  Return BODY_READ or
+ * BODY_WRITE for the descriptor to wait for (see bodyWait) before calling
+ * again, or BODY_DONE once there is nothing more to do: the body is all
+ * written and the pipe closed, the program quit reading, or the body
+ * failed, in which case cgiRespond answers with bodyStatus.
+ */
+int bodyPump(struct clientstate *cs) {
+    struct req_body *b = cs->body;
+    if (b == NULL || cs->fd[1] == -1) {
+        return BODY_DONE;
+    }
+    if (b->expect) {
+        // The client holds the body back until it hears from us
+        static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        struct iovec iov = {(void *) go_on, sizeof(go_on) - 1};
+        ioSend(cs->sock, &iov, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        b->expect = 0;
+    }
+    for (;;) {
+        while (b->sent < b->data) {
+            struct iovec iov = {b->buf + b->sent, b->data - b->sent};
+            ssize_t n = ioWritev(cs->fd[1], &iov, 1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    return b->waiting = BODY_WRITE;
+                }
+                // EPIPE: the program is done without the rest
+                closeInput(cs);
+                return b->waiting = BODY_DONE;
+            }
+            b->sent += n;
+        }
+        if (complete(b)) {
+            closeInput(cs);
+            return b->waiting = BODY_DONE;
+        }
+        ssize_t n = ioRead(cs->sock, b->buf, BODY_BUF);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return b->waiting = BODY_READ;
+        }
+        if (n <= 0) {
+            // The client went away half way
+            bodyFail(cs, 400);
+            return b->waiting = BODY_DONE;
+        }
+        int status = decode(b, n);
+        if (status != 0) {
+            bodyFail(cs, status);
+            return b->waiting = BODY_DONE;
+        }
+        // The CGI deadline grows with the body at BODY_MIN_RATE, so that a
+        // large upload has the time it needs but a client trickling bytes
+        // cannot hold the program and its slot past it
+        armDeadline(cs, TIMER_CGI, cs->t_spawned / 1000 + CGI_TIMEOUT_MS +
+                b->received * 1000 / BODY_MIN_RATE);
+    }
+}
+
+/* Return the descriptor that the body of cs waits for after bodyPump
+ * returned result, with the poll events in *events, or -1.
+ */
+int bodyWait(struct clientstate *cs, int result, int *events) {
+    if (result == BODY_READ) {
+        *events = POLLIN;
+        return cs->sock;
+    }
+    if (result == BODY_WRITE) {
+        *events = POLLOUT;
+        return cs->fd[1];
+    }
+    *events = 0;
+    return -1;
+}
+
+/* Stop streaming the body of cs, whose program is done (see cgiDone), and
+ * close the pipe.  A body still waiting for the client when the CGI
+ * deadline killed the program fails with 408.
+ */
+void bodyStop(struct clientstate *cs) {
+    struct req_body *b = cs->body;
+    if (b == NULL || cs->fd[1] == -1) {
+        return;
+    }
+    if (b->status == 0 && cs->timed_out == TIMER_CGI && b->waiting == BODY_READ) {
+        b->status = 408;
+    }
+    closeInput(cs);
+}
+
+/* Return the status cs must be answered with because of its request body
+ * (see bodyPump), or 0 if there is nothing wrong with it.
+ */
+int bodyStatus(struct clientstate *cs) {
+    return cs->body != NULL ? cs->body->status : 0;
+}
+
+/* Free the body state of cs, if it has one, closing the pipe. */
+void bodyEnd(struct clientstate *cs) {
+    struct req_body *b = cs->body;
+    if (b == NULL) {
+        return;
+    }
+    closeInput(cs);
+    free(b->type);
+    free(b);
+    memAdd(MEM_REQUEST, -(int64_t) sizeof(*b));
+    cs->body = NULL;
+}
+
+const char *bodyMethod(const struct req_body *b) {
+    return b->method;
+}
+
+/* Return the Content-Type of b, or NULL if the request had none. */
+const char *bodyType(const struct req_body *b) {
+    return b->type;
+}
+
+/* Return the Content-Length of b, or -1 if it is chunked. */
+int64_t bodyLength(const struct req_body *b) {
+    return b->length;
+}
@@ -0,0 +1,28 @@
+#include <stdint.h>
+
+/* Request bodies (POST and PUT) streamed to the standard input of CGI
+ * programs; see body.c
+ */
+#define BODY_MAX_DEFAULT 1048576 /* largest request body, wserver -B */
+#define BODY_BUF 16384          /* body bytes on their way to the pipe */
+#define BODY_MIN_RATE 16384     /* bytes/s a body must arrive at, see bodyPump */
+
+/* Results of bodyPump */
+#define BODY_DONE 0     /* all of it went to the program, or it failed */
+#define BODY_READ 1     /* wait until cs->sock is readable */
+#define BODY_WRITE 2    /* wait until cs->fd[1] is writable */
+
+struct clientstate;
+struct req_body;
+
+void bodyLimit(int64_t bytes);
+int bodyAnnounced(const char *request);
+int bodyStart(struct clientstate *cs, const char *rest, int rest_len);
+int bodyPump(struct clientstate *cs);
+int bodyWait(struct clientstate *cs, int result, int *events);
+void bodyStop(struct clientstate *cs);
+int bodyStatus(struct clientstate *cs);
+void bodyEnd(struct clientstate *cs);
+const char *bodyMethod(const struct req_body *b);
+const char *bodyType(const struct req_body *b);
+int64_t bodyLength(const struct req_body *b);
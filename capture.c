@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "capture.h"
+#include "log.h"
+
+/* Traffic capture (wserver -C), for replaying production traffic with
+ * wreplay.
+ *
+ * Every HTTP/1 request is recorded as it arrived, with the time its
+ * connection was accepted and the id of the connection, and then the
+ * status of its response and the time it went out, from which wreplay
+ * gets the latencies of the original run.  Times are relative to the
+ * start of the capture; a wserver that appends to the file of an older
+ * one (after an upgrade) continues its time line.  A POST or PUT with a
+ * body is recorded by its header alone and flagged CAPTURE_BODY, since
+ * the body streams through to its program and is never held whole.
+ *
+ * As with the access log, the event loop never blocks on the file: it
+ * copies each record into a single-producer/single-consumer byte ring, or
+ * counts it as dropped if the ring is full, and a background thread
+ * writes out whatever is in the ring with one or two write() calls.
+ */
+#define DRAIN_INTERVAL_NS 50000000  /* 50ms between drains when idle */
+#define RING_MASK (CAPTURE_RING - 1)
+
+struct capture_ring {
+    _Atomic uint32_t head;      /* bytes the producer has written */
+    char pad1[60];              /* keep producer and consumer indices on */
+    _Atomic uint32_t tail;      /* different cache lines */
+    char pad2[60];
+    _Atomic uint32_t dropped;
+    char data[CAPTURE_RING];
+};
+
+static struct capture_ring ring;
+static int capture_fd = -1;
+static uint64_t start;          /* nowUsec() when we opened the file */
+static uint64_t base;           /* the time of the file then */
+static pthread_t writer;
+static atomic_int stopping;
+
+/* Copy n bytes from src into the ring at position pos. */
+static void copyIn(uint32_t pos, const void *src, uint32_t n) {
+    uint32_t off = pos & RING_MASK;
+    uint32_t first = n < CAPTURE_RING - off ? n : CAPTURE_RING - off;
+    memcpy(ring.data + off, src, first);
+    memcpy(ring.data, (const char *) src + first, n - first);
+}
+
+static void push(const struct capture_record *rec, const char *data, int len) {
+    uint32_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+    uint32_t need = sizeof(*rec) + len;
+    if (CAPTURE_RING - (head - tail) < need) {
+        atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    copyIn(head, rec, sizeof(*rec));
+    copyIn(head + sizeof(*rec), data, len);
+    atomic_store_explicit(&ring.head, head + need, memory_order_release);
+}
+
+/* Time of the capture at t, a nowUsec() time. */
+static uint64_t captureTime(uint64_t t) {
+    return base + (t > start ? t - start : 0);
+}
+
+/* Record the request of len bytes that arrived on the connection conn,
+ * accepted at t_accept (nowUsec() time), with flags (CAPTURE_BODY).
+ */
+void captureRequest(uint64_t conn, uint64_t t_accept, const char *request, int len, int flags) {
+    if (capture_fd == -1) {
+        return;
+    }
+    struct capture_record rec = {CAPTURE_REQUEST, flags, 0, (uint32_t) conn, captureTime(t_accept)};
+    rec.len = len < UINT16_MAX ? len : UINT16_MAX;
+    push(&rec, request, rec.len);
+}
+
+/* Record that the response to the request on conn, with status, is done. */
+void captureDone(uint64_t conn, int status) {
+    if (capture_fd == -1) {
+        return;
+    }
+    struct capture_record rec = {CAPTURE_DONE, 0, status, (uint32_t) conn, captureTime(nowUsec())};
+    push(&rec, NULL, 0);
+}
+
+static void writeAll(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(capture_fd, buf, len);
+        if (n < 0) {
+            perror("write capture");
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Write everything currently in the ring.  Return the number of bytes
+ * written.
+ */
+static uint32_t drainRing(void) {
+    uint32_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+    uint32_t n = head - tail;
+    if (n > 0) {
+        uint32_t off = tail & RING_MASK;
+        uint32_t first = n < CAPTURE_RING - off ? n : CAPTURE_RING - off;
+        writeAll(ring.data + off, first);
+        writeAll(ring.data, n - first);
+        atomic_store_explicit(&ring.tail, head, memory_order_release);
+    }
+    uint32_t dropped = atomic_exchange_explicit(&ring.dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        struct capture_record rec = {CAPTURE_DROPPED, 0, 0, 0, captureTime(nowUsec())};
+        rec.len = dropped < UINT16_MAX ? dropped : UINT16_MAX;
+        writeAll((const char *) &rec, sizeof(rec));
+    }
+    return n;
+}
+
+static void *writerMain(void *arg) {
+    (void) arg;
+    struct timespec idle = {0, DRAIN_INTERVAL_NS};
+    while (!atomic_load(&stopping)) {
+        if (drainRing() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    drainRing();
+    return NULL;
+}
+
+/* Start capturing to filename: a new capture, or one to append to.
+ * Return 0 on success and -1 on error.
+ */
+int captureOpen(const char *filename) {
+    capture_fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (capture_fd == -1) {
+        perror(filename);
+        return -1;
+    }
+    start = nowUsec();
+    struct capture_header h;
+    ssize_t n = pread(capture_fd, &h, sizeof(h), 0);
+    if (n == sizeof(h) && memcmp(h.magic, CAPTURE_MAGIC, sizeof(h.magic)) == 0) {
+        // Carry on with the time line of the file
+        base = wallUsec() - h.start_us;
+    } else if (n == 0) {
+        memcpy(h.magic, CAPTURE_MAGIC, sizeof(h.magic));
+        h.start_us = wallUsec();
+        writeAll((const char *) &h, sizeof(h));
+    } else {
+        fprintf(stderr, "%s: not a capture file\n", filename);
+        goto fail;
+    }
+    if (pthread_create(&writer, NULL, writerMain, NULL) != 0) {
+        fprintf(stderr, "could not start capture writer\n");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(capture_fd);
+    capture_fd = -1;
+    return -1;
+}
+
+/* Write out what is queued and stop capturing. */
+void captureClose(void) {
+    if (capture_fd == -1) {
+        return;
+    }
+    atomic_store(&stopping, 1);
+    pthread_join(writer, NULL);
+    close(capture_fd);
+    capture_fd = -1;
+}
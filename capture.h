@@ -0,0 +1,37 @@
+#include <stdint.h>
+
+/* Traffic capture (wserver -C) and the format of its file; see capture.c
+ * and wreplay.c
+ */
+#define CAPTURE_MAGIC "WSCAP001"    /* first 8 bytes of the file */
+#define CAPTURE_RING (4 << 20)      /* bytes queued for the writer, a power of two */
+
+/* The file starts with this */
+struct capture_header {
+    char magic[8];
+    uint64_t start_us;          /* wall-clock time of the start, us since the epoch */
+};
+
+enum capture_type {
+    CAPTURE_REQUEST = 1,        /* len bytes of request follow */
+    CAPTURE_DONE,               /* the response went out; len is its status */
+    CAPTURE_DROPPED             /* len records were lost, the ring was full */
+};
+
+/* Flags of a CAPTURE_REQUEST */
+#define CAPTURE_BODY 1          /* it had a body, which is not recorded */
+
+/* Then records, in host byte order */
+struct capture_record {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t len;
+    uint32_t conn;              /* connection id */
+    uint64_t time_us;           /* since start_us: when the connection was
+                                 * accepted, or the response done */
+};
+
+int captureOpen(const char *filename);
+void captureRequest(uint64_t conn, uint64_t t_accept, const char *request, int len, int flags);
+void captureDone(uint64_t conn, int status);
+void captureClose(void);
@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "cgi.h"
 
 /* Return the number of name=value pairs in a query string. */
@@ -98,3 +99,78 @@ void fdata_free(Fdata *f) {
     }
     free(f);
 }
+
+/* Decode a URL-encoded string in place: '+' is a space and %XX the byte
+ * with hex value XX.
+ */
+void url_decode(char *str) {
+    char *out = str;
+    for(; *str != '\0'; str++) {
+        if(*str == '+') {
+            *out++ = ' ';
+        } else if(*str == '%' && isxdigit((unsigned char) str[1]) &&
+                isxdigit((unsigned char) str[2])) {
+            char hex[3] = {str[1], str[2], '\0'};
+            *out++ = (char) strtol(hex, NULL, 16);
+            str += 2;
+        } else {
+            *out++ = *str;
+        }
+    }
+    *out = '\0';
+}
+
+/* Decode the name=value pair in buf and hand it to field. */
+static void form_field(char *buf, void (*field)(char *name, char *value, void *arg), void *arg) {
+    char *value = strchr(buf, '=');
+    if(value != NULL) {
+        *value++ = '\0';
+    } else {
+        value = buf + strlen(buf);
+    }
+    url_decode(buf);
+    url_decode(value);
+    field(buf, value, arg);
+}
+
+/* Read a form posted as application/x-www-form-urlencoded from in: the
+ * CONTENT_LENGTH bytes the server promised, or up to EOF if it did not
+ * say (a chunked request).  Call field(name, value, arg) for each
+ * name=value pair, URL-decoded, as soon as it is complete, so that only
+ * one pair at a time is held in memory however large the body is.
+ *
+ * Return the number of pairs, or -1 if one is longer than MAX_FIELD.
+ */
+int read_form(FILE *in, void (*field)(char *name, char *value, void *arg), void *arg) {
+    char buf[MAX_FIELD + 1];
+    int len = 0;
+    int count = 0;
+    long left = -1;
+    char *length = getenv("CONTENT_LENGTH");
+    if(length != NULL) {
+        left = atol(length);
+    }
+
+    for(;;) {
+        int c = left == 0 ? EOF : getc(in);
+        if(left > 0) {
+            left--;
+        }
+        if(c == EOF || c == '&') {
+            if(len > 0) {
+                buf[len] = '\0';
+                form_field(buf, field, arg);
+                count++;
+                len = 0;
+            }
+            if(c == EOF) {
+                return count;
+            }
+        } else if(len == MAX_FIELD) {
+            fprintf(stderr, "Error: form field longer than %d bytes\n", MAX_FIELD);
+            return -1;
+        } else {
+            buf[len++] = c;
+        }
+    }
+}
@@ -1,3 +1,5 @@
+#include <stdio.h>
+
 #define MAX_LENGTH 1024
 
 typedef struct formdata {
@@ -8,3 +10,8 @@ typedef struct formdata {
 Fdata *parse_query(char *str);
 char *fdata2html(Fdata *f);
 void fdata_free(Fdata *f);
+
+#define MAX_FIELD 4096
+
+void url_decode(char *str);
+int read_form(FILE *in, void (*field)(char *name, char *value, void *arg), void *arg);
@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "wrapsock.h"
+#include "ws_helpers.h"
+#include "log.h"
+#include "coro.h"
+#include "coloop.h"
+#include "upgrade.h"
+#include "h2.h"
+#include "tls.h"
+#include "proxy.h"
+#include "affinity.h"
+#include "transport.h"
+#include "body.h"
+
+/* Coroutine event loop (wserver -e coro).
+ *
+ * Each HTTP/1 connection is served by serveClient, running as a coroutine
+ * (see coro.c) from the moment it is accepted, or its TLS handshake is
+ * done, until it is closed.  It reads the request, reads the output of the
+ * CGI program and writes the response as straight-line code: where the
+ * select loop returns and dispatches on a result code when a descriptor
+ * would block, serveClient names the descriptor and the events it needs
+ * and yields, and the loop resumes it when poll(2) reports them.  It also
+ * yields while its body is on the compression thread, and while its pipe
+ * is paused for lack of memory (see resumedClient).
+ *
+ * A connection deadline that expires while its coroutine waits resumes it
+ * with cs->timed_out set; the wait fails and the coroutine ends the
+ * connection with clientTimedOut.  CGI deadlines kill the program, whose
+ * pipe then reaches EOF as in the other loops.
+ *
+ * While a CGI program reads a request body (see body.c) its coroutine
+ * waits on two descriptors at once: the program's output, and the socket
+ * or the program's input, whichever the body waits for.
+ *
+ * HTTP/2 connections (see h2.c), TLS handshakes and relays (see tls.c) and
+ * connections to upstreams (see proxy.c) are not coroutines: they do their
+ * own reads and writes when the descriptors they ask for are ready, as
+ * with the other loops.  A connection that switches to HTTP/2 ends its
+ * coroutine.
+ *
+ * The loop polls, and its coroutines read and write, through the
+ * transport (see transport.c), so that simbench can run it against
+ * simulated clients.
+ */
+
+/* What the coroutine of a client is waiting for */
+enum wait_kind {
+    WAIT_NONE,
+    WAIT_FD,            /* events on a descriptor */
+    WAIT_COMPRESS,      /* its body, from compressedClient */
+    WAIT_RESUME         /* room for CGI output, from resumedClient */
+};
+
+struct task {
+    struct coro *co;    /* NULL if the client has none */
+    int wait;
+    int fd;             /* for WAIT_FD */
+    int events;
+    int fd2;            /* a second descriptor for WAIT_FD, or -1 */
+    int events2;
+    int ready;          /* which of them poll reported: 1 fd, 2 fd2 */
+    int polled;         /* the wait is in this round's poll set */
+};
+
+static struct clientstate *clients;
+static struct task *tasks;
+static int *watched;    /* events h2.c, tls.c and proxy.c asked for, by fd */
+static int watched_size;
+
+static struct task *taskOf(struct clientstate *cs) {
+    return &tasks[cs - clients];
+}
+
+/* Run the coroutine of t until it waits again or is done. */
+static void runTask(struct task *t) {
+    t->polled = 0;
+    if (!coroResume(t->co)) {
+        t->co = NULL;
+        t->wait = WAIT_NONE;
+    }
+}
+
+/* In the coroutine of cs: wait until fd has one of events, or fd2 (if
+ * not -1) one of events2.  Return which did, as in task.ready, or -1 if
+ * the deadline of cs expired in the meantime.
+ */
+static int waitFds(struct clientstate *cs, int fd, int events, int fd2, int events2) {
+    struct task *t = taskOf(cs);
+    t->wait = WAIT_FD;
+    t->fd = fd;
+    t->events = events;
+    t->fd2 = fd2;
+    t->events2 = events2;
+    t->ready = 0;
+    coroYield();
+    t->wait = WAIT_NONE;
+    return cs->timed_out != TIMER_NONE && cs->timed_out != TIMER_CGI ? -1 : t->ready;
+}
+
+/* In the coroutine of cs: wait until fd has one of events.  Return 0, or
+ * -1 if the deadline of cs expired in the meantime.
+ */
+static int waitFd(struct clientstate *cs, int fd, int events) {
+    return waitFds(cs, fd, events, -1, 0) == -1 ? -1 : 0;
+}
+
+/* In the coroutine of cs: wait for the loop to resume it for what. */
+static void waitFor(struct clientstate *cs, int what) {
+    struct task *t = taskOf(cs);
+    t->wait = what;
+    coroYield();
+    t->wait = WAIT_NONE;
+}
+
+/* In the coroutine of cs: read the output of its CGI program and answer
+ * with it.  Return as cgiRespond, once the response is ready to send.
+ */
+static int relayCGI(struct clientstate *cs) {
+    int ret_code;
+    int body_events;
+    int body_fd = bodyWait(cs, bodyPump(cs), &body_events);
+    for (;;) {
+        int ready = waitFds(cs, cs->fd[0], POLLIN, body_fd, body_events);
+        if (ready & 2) {
+            // The request body can move on
+            body_fd = bodyWait(cs, bodyPump(cs), &body_events);
+            if (!(ready & 1)) {
+                continue;
+            }
+        }
+        ret_code = handle_pipe_data(cs);
+        if (ret_code == 2) {
+            waitFor(cs, WAIT_RESUME);
+        } else if (ret_code != 1) {
+            break;
+        }
+    }
+    cgiDone(cs);
+
+    // Respond
+    int result = cgiRespond(cs, ret_code);
+    if (result == CLIENT_COMPRESS) {
+        waitFor(cs, WAIT_COMPRESS);
+        result = sendOK(cs);
+    }
+    return result;
+}
+
+/* Serve the HTTP/1 connection cs, from its request to closing it. */
+static void serveClient(void *arg) {
+    struct clientstate *cs = arg;
+    char line[MAXLINE + 1]; // Add one extra byte for null terminator
+    int result;
+
+    // Read the request
+    do {
+        int n = ioRead(cs->sock, line, MAXLINE);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (waitFd(cs, cs->sock, POLLIN) == -1) {
+                // A 408 to send, or nothing
+                result = clientTimedOut(cs);
+                break;
+            }
+            result = CLIENT_MORE;
+            continue;
+        }
+        if (n <= 0) {
+            clientGone(cs);
+            return;
+        }
+        line[n] = '\0';
+        result = clientInput(cs, line, n);
+    } while (result == CLIENT_MORE);
+    if (result == CLIENT_STATIC) {
+        // From the content pack; there is nothing to run
+        result = sendOK(cs);
+    } else if (result == CLIENT_CGI) {
+        result = relayCGI(cs);
+    } else if (result != CLIENT_SEND) {
+        // Answered, or HTTP/2 from now on
+        return;
+    }
+    while (result == CLIENT_SEND) {
+        if (waitFd(cs, cs->sock, POLLOUT) == -1) {
+            clientTimedOut(cs);
+            return;
+        }
+        result = clientWritable(cs);
+    }
+}
+
+/* Start serving cs, a new connection or one whose TLS handshake is done. */
+static void startTask(struct clientstate *cs) {
+    struct task *t = taskOf(cs);
+    t->co = coroNew(serveClient, cs);
+    if (t->co == NULL) {
+        clientGone(cs);
+        return;
+    }
+    runTask(t);
+}
+
+/* A deadline of cs expired while its coroutine waited: let it end the
+ * connection.
+ */
+static void coroTimeout(struct clientstate *cs, void *arg) {
+    (void) arg;
+    struct task *t = taskOf(cs);
+    if (t->co != NULL) {
+        runTask(t);
+    } else {
+        clientTimedOut(cs);
+    }
+}
+
+/* h2.c, tls.c or proxy.c wants to hear about events on fd. */
+static void coroWatch(int fd, int events, void *arg) {
+    (void) arg;
+    if (fd >= watched_size) {
+        int size = watched_size ? watched_size : 64;
+        while (size <= fd) {
+            size *= 2;
+        }
+        watched = realloc(watched, size * sizeof(*watched));
+        memset(watched + watched_size, 0, (size - watched_size) * sizeof(*watched));
+        watched_size = size;
+    }
+    watched[fd] |= events;
+}
+
+/* h2.c, tls.c or proxy.c is about to close fd: forget it, including any
+ * report of it left in this round.
+ */
+static void coroUnwatch(int fd, void *arg) {
+    (void) arg;
+    if (fd < watched_size) {
+        watched[fd] = 0;
+    }
+}
+
+/* The TLS handshake of cs is done (see tls.c): serve its request. */
+static void tlsDone(struct clientstate *cs, void *arg) {
+    (void) arg;
+    startTask(cs);
+}
+
+/* Append fd with events to the poll set, growing it as needed. */
+static void pollAdd(struct pollfd **pfds, int *cap, int *n, int fd, int events) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *pfds = realloc(*pfds, *cap * sizeof(**pfds));
+    }
+    (*pfds)[*n].fd = fd;
+    (*pfds)[*n].events = events;
+    (*pfds)[*n].revents = 0;
+    (*n)++;
+}
+
+/* Run the server on listenfd with a coroutine per connection until it has
+ * handed over to a newer wserver, which upgrade_fd (-1 if upgrades are not
+ * possible) announces.  compress_fd is the helper thread descriptor from
+ * compressInit, or -1.  Return 0.
+ */
+int runCoroLoop(int listenfd, int upgrade_fd, int compress_fd,
+        struct clientstate *client, int size) {
+    clients = client;
+    tasks = calloc(size, sizeof(*tasks));
+    h2SetLoop(coroWatch, coroUnwatch, NULL);
+    tlsSetLoop(coroWatch, coroUnwatch, tlsDone, NULL);
+    proxySetLoop(coroWatch, coroUnwatch, NULL);
+
+    struct pollfd *pfds = NULL;
+    int pfds_cap = 0;
+    int accepting = 1; // cleared once a newer wserver took over
+    int ready_fd = -1; // readiness of that newer wserver while it starts
+    upgradeServing();
+
+    for (;;) {
+        affinityCheck();
+        runDeadlines(coroTimeout, NULL);
+        if (upgradeDrained(countClients(client, size) + tlsConnections())) {
+            break;
+        }
+        struct clientstate *cs;
+        while ((cs = resumedClient()) != NULL) {
+            runTask(taskOf(cs));
+        }
+
+        // The loop's own descriptors come first, then the waiting
+        // coroutines, then what the modules watch
+        int n = 0;
+        pollAdd(&pfds, &pfds_cap, &n, accepting ? listenfd : -1, POLLIN);
+        pollAdd(&pfds, &pfds_cap, &n, compress_fd, POLLIN);
+        pollAdd(&pfds, &pfds_cap, &n, upgrade_fd, POLLIN);
+        pollAdd(&pfds, &pfds_cap, &n, ready_fd, POLLIN);
+        int first_task = n;
+        for (int i = 0; i < size; i++) {
+            struct task *t = &tasks[i];
+            int waiting = t->co != NULL && t->wait == WAIT_FD;
+            t->polled = waiting;
+            // Keep two entries per client so that entries first_task + 2 * i
+            // and the next are tasks[i]; poll ignores negative descriptors
+            pollAdd(&pfds, &pfds_cap, &n, waiting ? t->fd : -1, t->events);
+            pollAdd(&pfds, &pfds_cap, &n, waiting ? t->fd2 : -1, t->events2);
+        }
+        int first_watched = n;
+        for (int fd = 0; fd < watched_size; fd++) {
+            if (watched[fd] != 0) {
+                pollAdd(&pfds, &pfds_cap, &n, fd, watched[fd]);
+            }
+        }
+
+        if (ioPoll(pfds, n, upgradeDrainWait(nextDeadline())) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != ESHUTDOWN) {
+                // ESHUTDOWN: a simulation is over (see loopback.c)
+                perror("poll");
+            }
+            break;
+        }
+
+        if (pfds[1].revents) {
+            // Compressed bodies are back from the helper thread
+            while ((cs = compressedClient()) != NULL) {
+                runTask(taskOf(cs));
+            }
+        }
+        if (pfds[2].revents) {
+            // SIGUSR2: start the new binary, keep serving until it is ready
+            int fd = upgradeStart(listenfd);
+            if (fd != -1) {
+                ready_fd = fd;
+            }
+        }
+        if (pfds[3].revents) {
+            if (upgradeReady(ready_fd)) {
+                // The new process accepts from here on; finish what we have
+                accepting = 0;
+            }
+            ready_fd = -1;
+        }
+        if (pfds[0].revents) {
+            // Drain the accept queue, up to a budget so that a connection
+            // storm cannot starve the connections we already have
+            for (int k = 0; k < ACCEPT_BUDGET; k++) {
+                struct sockaddr_in peer;
+                socklen_t peer_len = sizeof(peer);
+                int newfd = acceptConnection(listenfd, (struct sockaddr *) &peer, &peer_len);
+                if (newfd == -1) {
+                    break;
+                }
+                int j = acceptClient(client, size, newfd, &peer);
+                if (j != -1 && !tlsStart(&client[j])) {
+                    startTask(&client[j]);
+                }
+            }
+        }
+        for (int i = 0; i < size; i++) {
+            // Only a coroutine still in the wait that was polled
+            struct task *t = &tasks[i];
+            struct pollfd *p = &pfds[first_task + 2 * i];
+            if ((p[0].revents || p[1].revents) && t->polled) {
+                t->ready = (p[0].revents ? 1 : 0) | (p[1].revents ? 2 : 0);
+                runTask(t);
+            }
+        }
+        for (int i = first_watched; i < n; i++) {
+            int fd = pfds[i].fd;
+            int revents = pfds[i].revents;
+            int events = 0;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                events |= POLLIN;
+            }
+            if (revents & (POLLOUT | POLLHUP | POLLERR)) {
+                events |= POLLOUT;
+            }
+            // Reported once, unless it was unwatched on the way
+            events &= watched[fd];
+            if (events == 0) {
+                continue;
+            }
+            watched[fd] &= ~events;
+            if (h2Event(fd, events) == -1 && tlsEvent(fd, events) == -1) {
+                proxyEvent(fd, events);
+            }
+        }
+    }
+    free(pfds);
+    free(tasks);
+    return 0;
+}
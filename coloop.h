@@ -0,0 +1,3 @@
+/* Coroutine event loop; see coloop.c */
+int runCoroLoop(int listenfd, int upgrade_fd, int compress_fd,
+        struct clientstate *client, int size);
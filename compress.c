@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "log.h"
+#include "stats.h"
+#include "mem.h"
+#include "affinity.h"
+
+/* Response compression.
+ *
+ * The coding is negotiated from Accept-Encoding (acceptedEncodings) and
+ * applied to the body of a CGI response once the CGI program is done,
+ * leaving the CGI header block alone.  gzip and deflate come from zlib;
+ * br and zstd are used when the Makefile finds their headers.
+ *
+ * Compressed bodies ("variants") are kept in a small LRU cache keyed by
+ * the coding and the uncompressed body, so a hot page is compressed once
+ * no matter how many times its CGI program runs.  Lookups go through a
+ * hash table on the coding and a hash of the body; the LRU list only
+ * orders evictions.  The key is kept in full and compared byte for byte:
+ * CGI output can echo the query string, so a hash alone could be made to
+ * collide.  Bodies that do not get smaller
+ * are cached too, as variants without data, so they are not retried.
+ *
+ * Compression can run on a helper thread (compressSubmit); finished jobs
+ * are handed back through a pipe the event loop watches.  The cache is
+ * only ever touched by the event loop thread.
+ */
+
+struct zvariant {
+    struct zvariant *next, *prev;   /* LRU list while cached */
+    struct zvariant *chain;         /* next in its bucket while cached */
+    int cached;
+    int refs;
+    int enc;
+    uint64_t hash;                  /* of key */
+    char *key;                      /* the uncompressed body */
+    int key_len;
+    char *data;                     /* NULL if compression did not pay */
+    int len;
+};
+
+static int level;
+static int min_size;
+
+static struct zvariant lru = {&lru, &lru, NULL, 0, 0, 0, 0, NULL, 0, NULL, 0};
+static struct zvariant *buckets[ZCACHE_BUCKETS];
+static size_t cache_bytes;
+
+static const char *enc_names[NUM_ENCODINGS] = {
+    "identity", "br", "zstd", "gzip", "deflate"
+};
+
+static int encodingEnabled(int enc) {
+    switch (enc) {
+#ifdef HAVE_BROTLI
+    case ENC_BR: return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case ENC_ZSTD: return 1;
+#endif
+    case ENC_GZIP: return 1;
+    case ENC_DEFLATE: return 1;
+    default: return 0;
+    }
+}
+
+const char *encodingName(int enc) {
+    return enc_names[enc];
+}
+
+/* Return a pointer to the value of header name (lower case, without the
+ * colon) in the header block that starts at headers and ends at end, or
+ * NULL.  Lines may end in CRLF or LF.
+ */
+static const char *findHeader(const char *headers, const char *end,
+        const char *name) {
+    size_t name_len = strlen(name);
+    const char *line = headers;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if ((size_t) (eol - line) > name_len && line[name_len] == ':' &&
+                strncasecmp(line, name, name_len) == 0) {
+            const char *v = line + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            return v;
+        }
+        line = eol + 1;
+    }
+    return NULL;
+}
+
+/* Return the codings the request accepts as a bit mask (1 << enc).  q
+ * values only matter as far as q=0 refuses a coding; among the accepted
+ * ones chooseEncoding goes by our own preference.
+ */
+int acceptedEncodings(const char *request) {
+    const char *end = strstr(request, "\r\n\r\n");
+    const char *first = strstr(request, "\r\n");
+    if (end == NULL || first == NULL || first >= end) {
+        return 0;
+    }
+    const char *p = findHeader(first + 2, end, "accept-encoding");
+    if (p == NULL) {
+        return 0;
+    }
+    int listed = 0, accepted = 0, star = 0;
+    while (p < end && *p != '\r' && *p != '\n') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        int n = strcspn(p, " \t;,\r\n");
+        const char *name = p;
+        p += n;
+        int q_zero = 0;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == ';') {
+            p++;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                q_zero = strtod(p + 2, NULL) <= 0.0;
+            }
+            p += strcspn(p, ",\r\n");
+        }
+        if (n == 0) {
+            if (*p == ',') {
+                continue;
+            }
+            break;
+        }
+        int enc = -1;
+        if (n == 1 && name[0] == '*') {
+            star = !q_zero;
+            continue;
+        } else if ((n == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+                (n == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+            enc = ENC_GZIP;
+        } else if (n == 7 && strncasecmp(name, "deflate", 7) == 0) {
+            enc = ENC_DEFLATE;
+        } else if (n == 2 && strncasecmp(name, "br", 2) == 0) {
+            enc = ENC_BR;
+        } else if (n == 4 && strncasecmp(name, "zstd", 4) == 0) {
+            enc = ENC_ZSTD;
+        }
+        if (enc != -1) {
+            listed |= 1 << enc;
+            if (!q_zero) {
+                accepted |= 1 << enc;
+            }
+        }
+    }
+    if (star) {
+        accepted |= ~listed & (((1 << NUM_ENCODINGS) - 1) & ~(1 << ENC_IDENTITY));
+    }
+    return accepted;
+}
+
+/* Is a response with this CGI header block worth compressing: a textual
+ * Content-Type and no Content-Encoding of its own.
+ */
+static int compressible(const char *headers, int headers_len) {
+    const char *end = headers + headers_len;
+    if (findHeader(headers, end, "content-encoding") != NULL) {
+        return 0;
+    }
+    const char *type = findHeader(headers, end, "content-type");
+    if (type == NULL) {
+        return 0;
+    }
+    int n = strcspn(type, ";\r\n");
+    if (n >= 5 && strncasecmp(type, "text/", 5) == 0) {
+        return 1;
+    }
+    static const char *const textual[] = {"json", "javascript", "xml"};
+    for (size_t i = 0; i < sizeof(textual) / sizeof(textual[0]); i++) {
+        size_t len = strlen(textual[i]);
+        for (const char *t = type; t + len <= type + n; t++) {
+            if (strncasecmp(t, textual[i], len) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Pick the coding for a response whose CGI header block is headers and
+ * whose body has body_len bytes, given the accepted mask from
+ * acceptedEncodings.  Return ENC_IDENTITY to send it as is.
+ */
+int chooseEncoding(int accepted, const char *headers, int headers_len,
+        int body_len) {
+    if (level == 0 || accepted == 0 || body_len < min_size ||
+            !compressible(headers, headers_len)) {
+        return ENC_IDENTITY;
+    }
+    for (int enc = ENC_IDENTITY + 1; enc < NUM_ENCODINGS; enc++) {
+        if ((accepted & (1 << enc)) && encodingEnabled(enc)) {
+            return enc;
+        }
+    }
+    return ENC_IDENTITY;
+}
+
+static uint64_t hashBody(const char *body, int len) {
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a */
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char) body[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Compress len bytes at body with enc into a new buffer.  Return it and
+ * set *out_len, or return NULL if that fails or does not save anything.
+ */
+static char *compressBody(int enc, const char *body, int len, int *out_len) {
+    char *out = NULL;
+    size_t n = 0;
+    if (enc == ENC_GZIP || enc == ENC_DEFLATE) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        int bits = enc == ENC_GZIP ? 15 + 16 : 15;
+        if (deflateInit2(&zs, level > 9 ? 9 : level, Z_DEFLATED, bits, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+            return NULL;
+        }
+        n = deflateBound(&zs, len);
+        out = malloc(n);
+        zs.next_in = (Bytef *) body;
+        zs.avail_in = len;
+        zs.next_out = (Bytef *) out;
+        zs.avail_out = n;
+        int rc = deflate(&zs, Z_FINISH);
+        n = zs.total_out;
+        deflateEnd(&zs);
+        if (rc != Z_STREAM_END) {
+            free(out);
+            return NULL;
+        }
+#ifdef HAVE_BROTLI
+    } else if (enc == ENC_BR) {
+        n = BrotliEncoderMaxCompressedSize(len);
+        out = malloc(n ? n : 1);
+        if (n == 0 || !BrotliEncoderCompress(level > 11 ? 11 : level,
+                    BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len,
+                    (const uint8_t *) body, &n, (uint8_t *) out)) {
+            free(out);
+            return NULL;
+        }
+#endif
+#ifdef HAVE_ZSTD
+    } else if (enc == ENC_ZSTD) {
+        n = ZSTD_compressBound(len);
+        out = malloc(n);
+        n = ZSTD_compress(out, n, body, len, level);
+        if (ZSTD_isError(n)) {
+            free(out);
+            return NULL;
+        }
+#endif
+    } else {
+        return NULL;
+    }
+    if (n >= (size_t) len) {
+        free(out);
+        return NULL;
+    }
+    *out_len = n;
+    return out;
+}
+
+static struct zvariant *newVariant(int enc, const char *body, int len,
+        uint64_t hash) {
+    struct zvariant *v = calloc(1, sizeof(*v));
+    v->refs = 1;
+    v->enc = enc;
+    v->hash = hash;
+    v->key = malloc(len);
+    memcpy(v->key, body, len);
+    v->key_len = len;
+    v->data = compressBody(enc, body, len, &v->len);
+    return v;
+}
+
+static size_t variantBytes(const struct zvariant *v) {
+    return sizeof(*v) + v->key_len + (v->data != NULL ? v->len : 0);
+}
+
+static void lruUnlink(struct zvariant *v) {
+    v->prev->next = v->next;
+    v->next->prev = v->prev;
+}
+
+static void lruPushFront(struct zvariant *v) {
+    v->next = lru.next;
+    v->prev = &lru;
+    lru.next->prev = v;
+    lru.next = v;
+}
+
+/* The bucket of the cache index for body hash in coding enc. */
+static struct zvariant **bucketOf(int enc, uint64_t hash) {
+    return &buckets[(hash ^ (hash >> 32) ^ (uint64_t) enc) & (ZCACHE_BUCKETS - 1)];
+}
+
+static void bucketUnlink(struct zvariant *v) {
+    struct zvariant **p = bucketOf(v->enc, v->hash);
+    while (*p != v) {
+        p = &(*p)->chain;
+    }
+    *p = v->chain;
+}
+
+/* Add v to the cache, which takes its own reference, and evict the least
+ * recently used variants until the cache fits ZCACHE_BYTES.
+ */
+static void cacheInsert(struct zvariant *v) {
+    if (variantBytes(v) > ZCACHE_BYTES / 4) {
+        return;
+    }
+    v->refs++;
+    v->cached = 1;
+    lruPushFront(v);
+    struct zvariant **bucket = bucketOf(v->enc, v->hash);
+    v->chain = *bucket;
+    *bucket = v;
+    cache_bytes += variantBytes(v);
+    memAdd(MEM_COMPRESS, variantBytes(v));
+    while (cache_bytes > ZCACHE_BYTES) {
+        struct zvariant *old = lru.prev;
+        lruUnlink(old);
+        bucketUnlink(old);
+        old->cached = 0;
+        cache_bytes -= variantBytes(old);
+        memAdd(MEM_COMPRESS, -(int64_t) variantBytes(old));
+        variantRelease(old);
+    }
+}
+
+/* Return a reference to the cached variant of body in coding enc, or NULL
+ * if there is none.
+ */
+struct zvariant *variantLookup(int enc, const char *body, int len) {
+    uint64_t hash = hashBody(body, len);
+    for (struct zvariant *v = *bucketOf(enc, hash); v != NULL; v = v->chain) {
+        if (v->enc == enc && v->hash == hash && v->key_len == len &&
+                memcmp(v->key, body, len) == 0) {
+            lruUnlink(v);
+            lruPushFront(v);
+            v->refs++;
+            statsAdd(STAT_ZCACHE_HITS, 1);
+            return v;
+        }
+    }
+    return NULL;
+}
+
+/* Compress body with enc on the calling thread and cache the result.
+ * Return a reference to the variant.
+ */
+struct zvariant *variantCompress(int enc, const char *body, int len) {
+    struct zvariant *v = newVariant(enc, body, len, hashBody(body, len));
+    cacheInsert(v);
+    return v;
+}
+
+/* Return the compressed body of v and set *len, or return NULL if the
+ * body is to be sent uncompressed.
+ */
+const char *variantData(const struct zvariant *v, int *len) {
+    *len = v->len;
+    return v->data;
+}
+
+int variantEncoding(const struct zvariant *v) {
+    return v->enc;
+}
+
+void variantRelease(struct zvariant *v) {
+    if (v != NULL && --v->refs == 0) {
+        free(v->key);
+        free(v->data);
+        free(v);
+    }
+}
+
+/* Helper thread.  Jobs go from the event loop to the worker through
+ * job_ring and come back through done_ring, both guarded by lock; each
+ * finished job is also announced with a byte on done_pipe.  At most
+ * ZJOBS jobs are outstanding, so neither ring can overflow.
+ */
+#define ZJOBS 64
+
+struct zjob {
+    int enc;
+    const char *body;
+    int len;
+    uint64_t hash;
+    void *owner;
+    struct zvariant *result;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static struct zjob job_ring[ZJOBS], done_ring[ZJOBS];
+static unsigned job_head, job_tail, done_head, done_tail;
+static int outstanding;     /* event loop only */
+static int done_pipe[2] = {-1, -1};
+
+static void *compressWorker(void *arg) {
+    (void) arg;
+    // Not on the CPU of a pinned event loop
+    affinityNode();
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (job_head == job_tail) {
+            pthread_cond_wait(&job_ready, &lock);
+        }
+        struct zjob job = job_ring[job_head++ % ZJOBS];
+        pthread_mutex_unlock(&lock);
+
+        job.result = newVariant(job.enc, job.body, job.len, job.hash);
+
+        pthread_mutex_lock(&lock);
+        done_ring[done_tail++ % ZJOBS] = job;
+        pthread_mutex_unlock(&lock);
+        if (write(done_pipe[1], "z", 1) < 0) {
+            /* the pipe is full of wakeups already */
+        }
+    }
+    return NULL;
+}
+
+/* Configure compression: level 0 turns it off, bodies shorter than
+ * min_size are never compressed.  With threaded, start the helper thread
+ * and return the descriptor the event loop must watch, calling
+ * compressCollect when it is readable; otherwise return -1.
+ */
+int compressInit(int compress_level, int compress_min_size, int threaded) {
+    level = compress_level;
+    min_size = compress_min_size;
+    if (!threaded || level == 0) {
+        return -1;
+    }
+    pthread_t worker;
+    if (pipe2(done_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    if (pthread_create(&worker, NULL, compressWorker, NULL) != 0) {
+        fprintf(stderr, "could not start compression thread\n");
+        close(done_pipe[0]);
+        close(done_pipe[1]);
+        done_pipe[0] = done_pipe[1] = -1;
+        return -1;
+    }
+    pthread_detach(worker);
+    return done_pipe[0];
+}
+
+/* Hand the compression of body with enc to the helper thread, unless the
+ * thread is not running or busy.  body must stay valid until the job comes
+ * back from compressCollect with owner.  Return 0 if the job was queued,
+ * -1 if the caller should compress it itself.
+ */
+int compressSubmit(int enc, const char *body, int len, void *owner) {
+    if (done_pipe[0] == -1 || outstanding == ZJOBS) {
+        return -1;
+    }
+    struct zjob job = {enc, body, len, hashBody(body, len), owner, NULL};
+    pthread_mutex_lock(&lock);
+    job_ring[job_tail++ % ZJOBS] = job;
+    pthread_cond_signal(&job_ready);
+    pthread_mutex_unlock(&lock);
+    outstanding++;
+    return 0;
+}
+
+/* Return the owner of a finished job and set *v to a reference to its
+ * variant (now cached), or return NULL if no job has finished.
+ */
+void *compressCollect(struct zvariant **v) {
+    char buf[ZJOBS];
+    while (read(done_pipe[0], buf, sizeof(buf)) > 0) {
+        /* drain the wakeups; done_ring says what is finished */
+    }
+    pthread_mutex_lock(&lock);
+    if (done_head == done_tail) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    struct zjob job = done_ring[done_head++ % ZJOBS];
+    pthread_mutex_unlock(&lock);
+    outstanding--;
+    cacheInsert(job.result);
+    *v = job.result;
+    return job.owner;
+}
@@ -0,0 +1,34 @@
+/* Response compression; see compress.c */
+#define COMPRESS_LEVEL 6        /* default -z */
+#define COMPRESS_MIN_SIZE 1024  /* default -m: smaller bodies are sent as is */
+#define ZCACHE_BYTES (8 << 20)  /* budget for cached variants and their keys */
+#define ZCACHE_BUCKETS 4096     /* hash chains indexing the cache, a power of two */
+
+/* Content codings, in order of preference when a client accepts several
+ * with the same q-value.
+ */
+enum encoding {
+    ENC_IDENTITY,
+    ENC_BR,
+    ENC_ZSTD,
+    ENC_GZIP,
+    ENC_DEFLATE,
+    NUM_ENCODINGS
+};
+
+struct zvariant;
+
+int compressInit(int level, int min_size, int threaded);
+int acceptedEncodings(const char *request);
+int chooseEncoding(int accepted, const char *headers, int headers_len,
+        int body_len);
+const char *encodingName(int enc);
+
+struct zvariant *variantLookup(int enc, const char *body, int len);
+struct zvariant *variantCompress(int enc, const char *body, int len);
+const char *variantData(const struct zvariant *v, int *len);
+int variantEncoding(const struct zvariant *v);
+void variantRelease(struct zvariant *v);
+
+int compressSubmit(int enc, const char *body, int len, void *owner);
+void *compressCollect(struct zvariant **v);
@@ -0,0 +1,10 @@
+/* Stackful coroutines for the coroutine event loop; see coro.c */
+#define CORO_STACK_SIZE (64 * 1024)  /* usable bytes per stack */
+#define CORO_POOL_MAX 64             /* stacks kept for reuse */
+
+struct coro;
+
+struct coro *coroNew(void (*fn)(void *arg), void *arg);
+int coroResume(struct coro *co);
+void coroYield(void);
+struct coro *coroSelf(void);
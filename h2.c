@@ -0,0 +1,1280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "wrapsock.h"
+#include "ws_helpers.h"
+#include "hpack.h"
+#include "h2.h"
+#include "log.h"
+#include "stats.h"
+#include "ratelimit.h"
+#include "mem.h"
+#include "probes.h"
+
+/* HTTP/2 over cleartext TCP (h2c, RFC 7540/9113).
+ *
+ * A connection becomes HTTP/2 either with prior knowledge, when its first
+ * bytes are the client connection preface, or by an HTTP/1.1 request with
+ * "Upgrade: h2c", which becomes stream 1 once we answer 101.  From then
+ * on h2.c owns the socket: the event loop hands every readiness event on
+ * it, and on the CGI pipes of its streams, to h2Event.  It learns which
+ * descriptors to watch through the hooks set with h2SetLoop; interest is
+ * one-shot, like a poll in io_uring, and is renewed by h2.c as needed.
+ *
+ * Every stream runs its own CGI program with its own pipe and output
+ * buffer.  As for HTTP/1.1 the status depends on the exit status, so a
+ * response starts once the pipe reached EOF.  Responses are then framed
+ * into DATA frames one at a time, only while less than OUT_LOW_WATER
+ * bytes are waiting for the socket, so the choice of stream is made as
+ * late as possible:
+ *
+ *   - lowest urgency first (the RFC 9218 "priority" header, u=0..7)
+ *   - within an urgency, non-incremental streams one after the other in
+ *     stream order, then incremental ones in weighted fair shares (start
+ *     time fair queuing on the RFC 7540 weight)
+ *
+ * A stream without any priority signal is incremental with weight 16, so
+ * concurrent responses share the connection evenly.  RFC 7540 dependencies
+ * are not kept: PRIORITY frames only set the weight, which RFC 9113 allows.
+ *
+ * Flow control is honoured for the connection and each stream.  Request
+ * bodies are not used (only GET is served), so received DATA is credited
+ * back at once.  There is no server push, and responses are not compressed.
+ */
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN ((int) sizeof(PREFACE) - 1)
+#define FRAME_HEAD 9
+#define MAX_FRAME 16384         /* SETTINGS_MAX_FRAME_SIZE, ours and the least a peer may set */
+#define MAX_HEADER_BLOCK 16384  /* HEADERS + CONTINUATION we buffer */
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define OUT_LOW_WATER 16384     /* frame more DATA only below this */
+#define READ_BUDGET 65536       /* socket bytes read per event */
+#define STATS_PAGE_MAX 65536
+#define DEFAULT_URGENCY 3
+#define DEFAULT_WEIGHT 16
+
+enum frame_type {
+    FRAME_DATA, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM,
+    FRAME_SETTINGS, FRAME_PUSH_PROMISE, FRAME_PING, FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE, FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum h2_error {
+    NO_ERROR, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR,
+    SETTINGS_TIMEOUT, STREAM_CLOSED, FRAME_SIZE_ERROR, REFUSED_STREAM,
+    CANCEL, COMPRESSION_ERROR, CONNECT_ERROR, ENHANCE_YOUR_CALM
+};
+
+enum h2_setting {
+    SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH,
+    SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_INITIAL_WINDOW_SIZE,
+    SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+struct buffer {
+    char *data;
+    int len, cap;
+};
+
+struct h2_stream {
+    uint32_t id;                /* 0 while the slot is free */
+    int pipe;                   /* CGI output, -1 if none or at EOF */
+    pid_t pid;                  /* CGI program, -1 once reaped */
+    int timed_out;              /* the CGI was killed by its deadline */
+    uint64_t cgi_deadline;      /* ms */
+    char path[ACCESS_PATH_LEN]; /* for the access log */
+    char *output;               /* CGI output, or the metrics page */
+    int out_len, out_cap;       /* out_cap is charged to MEM_H2 */
+    int paused;                 /* output full and the budget spent */
+    int status;                 /* of the response, once started */
+    const char *body;           /* part of the body not yet framed */
+    int body_len;
+    int64_t window;             /* bytes the client lets us send */
+    int urgency;                /* RFC 9218, 0 is the most urgent */
+    int incremental;
+    int weight;                 /* RFC 7540, 1..256 */
+    uint64_t vtime;             /* virtual time of the next frame */
+    int sent;                   /* DATA bytes sent */
+    uint64_t t_start, t_first_byte, t_cgi_done;
+};
+
+struct h2_conn {
+    struct clientstate *cs;
+    struct buffer in, out;
+    int preface;                /* bytes of the client preface seen */
+    struct hpack_table hpack;
+    struct buffer block;        /* header block being assembled */
+    uint32_t block_stream;      /* its stream while CONTINUATION is due */
+    int block_weight;           /* from its HEADERS frame, 0 if none */
+    int64_t send_window;        /* connection level */
+    int64_t initial_window;     /* peer's SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t last_stream;       /* highest stream the client opened */
+    struct h2_stream stream[H2_MAX_STREAMS];
+    int active;                 /* streams in use */
+    uint64_t vclock;            /* virtual time of the last frame sent */
+    int goaway_sent;            /* connection error: flush and close */
+    int goaway_received;        /* finish the open streams and close */
+    int dead;                   /* the socket failed or reached EOF */
+    uint64_t last_io;           /* ms */
+};
+
+/* The request in a header block */
+struct request {
+    int get;
+    char path[MAXLINE];
+    int path_len;               /* -1 if there was no :path */
+    int urgency;
+    int incremental;
+};
+
+/* Owner of every descriptor h2.c watches, indexed by descriptor */
+struct fd_owner {
+    struct h2_conn *conn;
+    int stream;                 /* index in conn->stream, -1 for the socket */
+    int armed;                  /* events asked for and not yet reported */
+};
+
+static struct fd_owner *owners;
+static int owners_size;
+
+static struct {
+    void (*watch)(int fd, int events, void *arg);
+    void (*unwatch)(int fd, void *arg);
+    void *arg;
+} loop;
+
+static uint64_t nowMsec(void) {
+    return nowUsec() / 1000;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void bufAppend(struct buffer *b, const void *data, int len) {
+    if (b->len + len > b->cap) {
+        int cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        b->data = realloc(b->data, cap);
+        memAdd(MEM_H2, cap - b->cap);
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void bufConsume(struct buffer *b, int len) {
+    memmove(b->data, b->data + len, b->len - len);
+    b->len -= len;
+}
+
+/* Set the event loop hooks: watch(fd, events, arg) asks for one report of
+ * events (POLLIN and/or POLLOUT) on fd through h2Event, and
+ * unwatch(fd, arg) cancels everything asked for on fd, which is about to
+ * be closed.
+ */
+void h2SetLoop(void (*watch)(int fd, int events, void *arg),
+        void (*unwatch)(int fd, void *arg), void *arg) {
+    loop.watch = watch;
+    loop.unwatch = unwatch;
+    loop.arg = arg;
+}
+
+static void watchFd(struct h2_conn *c, int fd, int stream, int events) {
+    if (fd >= owners_size) {
+        int size = owners_size ? owners_size : 64;
+        while (size <= fd) {
+            size *= 2;
+        }
+        owners = realloc(owners, size * sizeof(*owners));
+        memset(owners + owners_size, 0, (size - owners_size) * sizeof(*owners));
+        owners_size = size;
+    }
+    struct fd_owner *o = &owners[fd];
+    if (o->conn != c || o->stream != stream) {
+        o->conn = c;
+        o->stream = stream;
+        o->armed = 0;
+    }
+    int add = events & ~o->armed;
+    if (add) {
+        o->armed |= add;
+        loop.watch(fd, add, loop.arg);
+    }
+}
+
+static void unwatchFd(int fd) {
+    if (fd < owners_size && owners[fd].conn != NULL) {
+        owners[fd].conn = NULL;
+        owners[fd].armed = 0;
+        loop.unwatch(fd, loop.arg);
+    }
+}
+
+static void putFrame(struct h2_conn *c, int type, int flags, uint32_t id,
+        const void *payload, int len) {
+    uint8_t head[FRAME_HEAD] = {len >> 16, len >> 8, len, type, flags};
+    put32(head + 5, id);
+    bufAppend(&c->out, head, FRAME_HEAD);
+    if (len > 0) {
+        bufAppend(&c->out, payload, len);
+    }
+}
+
+/* Connection error: tell the client and stop reading; the connection is
+ * closed once the GOAWAY is out.
+ */
+static void goAway(struct h2_conn *c, int code) {
+    uint8_t payload[8];
+    if (c->goaway_sent) {
+        return;
+    }
+    LOG_DEBUG("h2: GOAWAY %d on socket %d\n", code, c->cs->sock);
+    put32(payload, c->last_stream);
+    put32(payload + 4, code);
+    putFrame(c, FRAME_GOAWAY, 0, 0, payload, 8);
+    c->goaway_sent = 1;
+}
+
+static void rstStream(struct h2_conn *c, uint32_t id, int code) {
+    uint8_t payload[4];
+    put32(payload, code);
+    putFrame(c, FRAME_RST_STREAM, 0, id, payload, 4);
+}
+
+static void windowUpdate(struct h2_conn *c, uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    putFrame(c, FRAME_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+static struct h2_stream *findStream(struct h2_conn *c, uint32_t id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->stream[i].id == id) {
+            return &c->stream[i];
+        }
+    }
+    return NULL;
+}
+
+/* Release stream s, killing its CGI program if it is still running. */
+static void streamFree(struct h2_conn *c, struct h2_stream *s) {
+    if (s->pipe != -1) {
+        unwatchFd(s->pipe);
+        Close(s->pipe);
+        s->pipe = -1;
+    }
+    if (s->pid != -1) {
+        stopProgram(s->pid);
+        reapLater(s->pid);
+        s->pid = -1;
+        statsAdd(STAT_CGI_INFLIGHT, -1);
+    }
+    free(s->output);
+    s->output = NULL;
+    memAdd(MEM_H2, -s->out_cap);
+    s->out_cap = 0;
+    s->id = 0;
+    c->active--;
+}
+
+/* Stream s is over, answered with s->status or cut short (status 0):
+ * account for it as requestDone does for a connection, and free it.
+ */
+static void streamDone(struct h2_conn *c, struct h2_stream *s) {
+    struct clientstate *cs = c->cs;
+    struct access_record rec;
+    uint64_t now = nowUsec();
+    uint64_t ready = s->t_cgi_done ? s->t_cgi_done : s->t_start;
+
+    statsRecord(STAGE_SEND, ready, now);
+    statsResponse(s->status);
+    statsAdd(STAT_BYTES_SENT, s->sent);
+    WS_PROBE4(request_done, cs->sock, cs->req_id, s->status, s->sent);
+
+    rec.time_us = wallUsec();
+    rec.client_addr = cs->client_addr;
+    rec.client_port = cs->client_port;
+    rec.status = s->status;
+    rec.bytes = s->sent;
+    rec.header_us = 0;
+    rec.cgi_us = s->t_cgi_done ? (uint32_t) (s->t_cgi_done - s->t_start) : 0;
+    rec.send_us = (uint32_t) (now - ready);
+    strncpy(rec.path, s->path, ACCESS_PATH_LEN);
+    accessLogPush(&rec);
+    streamFree(c, s);
+}
+
+/* Start the response of s: a HEADERS frame built from the CGI style
+ * header lines in headers, then body as DATA frames when pump gets to it.
+ */
+static void startResponse(struct h2_conn *c, struct h2_stream *s, int status,
+        const char *headers, int headers_len, const char *body, int body_len) {
+    // A header block never needs CONTINUATION: a peer must accept frames
+    // of MAX_FRAME bytes, and fields that do not fit are dropped
+    uint8_t block[MAX_FRAME];
+    int n = hpackStatus(block, status);
+    const char *line = headers;
+    const char *end = headers + headers_len;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *next = eol != NULL ? eol + 1 : end;
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char *colon = memchr(line, ':', eol - line);
+        int name_len = colon != NULL ? colon - line : 0;
+        char name[64];
+        if (name_len == 0 || name_len >= (int) sizeof(name)) {
+            line = next;
+            continue;
+        }
+        for (int i = 0; i < name_len; i++) {
+            name[i] = tolower((unsigned char) line[i]);
+        }
+        name[name_len] = '\0';
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        const char *value_end = eol;
+        while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ')) {
+            value_end--;
+        }
+        line = next;
+        // Connection-specific fields are not allowed in HTTP/2
+        if (strcmp(name, "connection") == 0 || strcmp(name, "keep-alive") == 0 ||
+                strcmp(name, "proxy-connection") == 0 ||
+                strcmp(name, "transfer-encoding") == 0 ||
+                strcmp(name, "upgrade") == 0 || strcmp(name, "content-length") == 0 ||
+                strcmp(name, "status") == 0) {
+            continue;
+        }
+        int m = hpackField(block + n, sizeof(block) - n, name, name_len,
+                value, value_end - value);
+        if (m < 0) {
+            LOG_WARN("h2: response header block of %s too large\n", s->path);
+            break;
+        }
+        n += m;
+    }
+    char length[16];
+    int m = hpackField(block + n, sizeof(block) - n, "content-length", 14,
+            length, snprintf(length, sizeof(length), "%d", body_len));
+    if (m > 0) {
+        n += m;
+    }
+    putFrame(c, FRAME_HEADERS, FLAG_END_HEADERS | (body_len == 0 ? FLAG_END_STREAM : 0),
+            s->id, block, n);
+    s->status = status;
+    s->body = body;
+    s->body_len = body_len;
+    if (body_len == 0) {
+        streamDone(c, s);
+    }
+}
+
+/* Answer s with one of the canned error responses. */
+static void respondCanned(struct h2_conn *c, struct h2_stream *s, int status) {
+    static const char headers[] = "Content-Type: text/html\r\n";
+    int which;
+    switch (status) {
+    case 400: which = RESP_BAD_REQUEST; break;
+    case 404: which = RESP_NOT_FOUND; break;
+    case 429: which = RESP_TOO_MANY_REQUESTS; break;
+    case 502: which = RESP_BAD_GATEWAY; break;
+    case 503: which = RESP_SERVICE_UNAVAILABLE; break;
+    case 504: which = RESP_GATEWAY_TIMEOUT; break;
+    default: which = RESP_SERVER_ERROR; break;
+    }
+    int len;
+    const char *body = responseBody(which, &len);
+    startResponse(c, s, status, headers, sizeof(headers) - 1, body, len);
+}
+
+/* Answer s with the CGI output (or metrics page) in s->output, with the
+ * status of its Status header if it has one.
+ */
+static void respondOK(struct h2_conn *c, struct h2_stream *s) {
+    int status;
+    cgiStatus(s->output, s->out_len, &status);
+    int body_offset = cgiBodyOffset(s->output, s->out_len);
+    if (body_offset < 0) {
+        // No header block: it is all body
+        body_offset = 0;
+    }
+    startResponse(c, s, status, s->output, body_offset,
+            s->output + body_offset, s->out_len - body_offset);
+}
+
+/* The CGI pipe of s reached EOF or failed: reap the program and respond.
+ * A program that has not exited yet keeps s->pid, and h2Expired tries
+ * again after MEM_RETRY_MS.
+ */
+static void cgiFinished(struct h2_conn *c, struct h2_stream *s) {
+    if (s->pipe != -1) {
+        unwatchFd(s->pipe);
+        Close(s->pipe);
+        s->pipe = -1;
+    }
+    int rc = reapProgram(s->pid);
+    if (rc == REAP_PENDING) {
+        return;
+    }
+    s->pid = -1;
+    s->t_cgi_done = nowUsec();
+    statsAdd(STAT_CGI_INFLIGHT, -1);
+    statsRecord(STAGE_FIRST_BYTE, s->t_start, s->t_first_byte);
+    statsRecord(STAGE_CGI_EXIT, s->t_start, s->t_cgi_done);
+    if (s->timed_out) {
+        respondCanned(c, s, 504);
+    } else if (rc != 0) {
+        respondCanned(c, s, rc);
+    } else {
+        respondOK(c, s);
+    }
+}
+
+/* Read the CGI pipe of s.  If its output is full and the memory budget
+ * has nothing left to grow it with, s is paused instead: the pipe is not
+ * watched and h2Expired tries again after MEM_RETRY_MS.  The output of a
+ * program killed by its deadline is not wanted, so its pipe is read to
+ * EOF without growing anything.
+ */
+static void cgiReadable(struct h2_conn *c, struct h2_stream *s) {
+    if (s->out_len == s->out_cap && !s->timed_out) {
+        int cap = s->out_cap * 2 < MAXPAGE ? s->out_cap * 2 : MAXPAGE;
+        if (s->out_cap == MAXPAGE) {
+            // Over the limit: the read below sees EOF once it is dead
+            LOG_WARN("h2: output of %s exceeds %d bytes\n", s->path, MAXPAGE);
+            stopProgram(s->pid);
+        } else if (memTry(MEM_H2, cap - s->out_cap) == -1) {
+            if (!s->paused) {
+                s->paused = 1;
+                statsAdd(STAT_MEM_PAUSED, 1);
+                shedIdleClient();
+            }
+            return;
+        } else {
+            s->out_cap = cap;
+            s->output = realloc(s->output, s->out_cap);
+            s->paused = 0;
+        }
+    }
+    ssize_t n = read(s->pipe, s->output + s->out_len, s->out_cap - s->out_len);
+    if (n > 0) {
+        if (s->t_first_byte == 0) {
+            s->t_first_byte = nowUsec();
+        }
+        s->out_len += n;
+        WS_PROBE3(pipe_read, c->cs->sock, c->cs->req_id, (int) n);
+    }
+    if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR))) {
+        watchFd(c, s->pipe, s - c->stream, POLLIN);
+        return;
+    }
+    cgiFinished(c, s);
+}
+
+/* Start stream id for the request req, whose HEADERS frame asked for
+ * weight (0 if it did not).
+ */
+static void openStream(struct h2_conn *c, uint32_t id, struct request *req,
+        int weight) {
+    struct h2_stream *s = findStream(c, 0);
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->pipe = -1;
+    s->pid = -1;
+    s->window = c->initial_window;
+    s->urgency = req->urgency;
+    s->incremental = req->incremental || weight != 0;
+    s->weight = weight != 0 ? weight : DEFAULT_WEIGHT;
+    s->vtime = c->vclock;
+    s->t_start = nowUsec();
+    c->active++;
+    statsAdd(STAT_H2_STREAMS, 1);
+
+    // Stream 1 is the request the connection was admitted with
+    if (id > 1 && rateTake(c->cs->client_addr) != 0) {
+        statsAdd(STAT_RATE_LIMITED, 1);
+        respondCanned(c, s, 429);
+        return;
+    }
+    if (!req->get || req->path_len < 2 || req->path[0] != '/') {
+        respondCanned(c, s, 400);
+        return;
+    }
+    char *name = req->path + 1;
+    char *query = strchr(name, '?');
+    if (query != NULL) {
+        *query++ = '\0';
+    }
+    snprintf(s->path, sizeof(s->path), "%s", name);
+    if (strcmp(req->path, STATS_REQUEST + 4) == 0) {
+        // Metrics page, rendered as if a CGI program had printed it
+        s->output = malloc(STATS_PAGE_MAX);
+        s->out_cap = STATS_PAGE_MAX;
+        memAdd(MEM_H2, STATS_PAGE_MAX);
+        s->out_len = statsPage(s->output, STATS_PAGE_MAX);
+        respondOK(c, s);
+        return;
+    }
+    if (validResource(name) == 0) {
+        respondCanned(c, s, 400);
+        return;
+    }
+    if (strcmp("favicon.ico", name) == 0) {
+        respondCanned(c, s, 404);
+        return;
+    }
+    // Leave what memory is left to the programs already running
+    if (memShort(CGI_CHUNK)) {
+        statsAdd(STAT_MEM_REFUSED, 1);
+        shedIdleClient();
+        respondCanned(c, s, 503);
+        return;
+    }
+    s->pid = startProgram(name, query, c->cs->client_addr, NULL, &s->pipe, NULL);
+    if (s->pid == -1) {
+        respondCanned(c, s, 500);
+        return;
+    }
+    fcntl(s->pipe, F_SETFL, O_NONBLOCK);
+    s->output = malloc(CGI_CHUNK);
+    s->out_cap = CGI_CHUNK;
+    memAdd(MEM_H2, CGI_CHUNK);
+    s->cgi_deadline = s->t_start / 1000 + CGI_TIMEOUT_MS;
+    statsAdd(STAT_CGI_STARTED, 1);
+    statsAdd(STAT_CGI_INFLIGHT, 1);
+    WS_PROBE3(cgi_spawn, c->cs->sock, c->cs->req_id, s->pid);
+    watchFd(c, s->pipe, s - c->stream, POLLIN);
+}
+
+/* Parse an RFC 9218 priority field value such as "u=1, i". */
+static void parsePriority(struct request *req, const char *v, int len) {
+    const char *end = v + len;
+    req->incremental = 0;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == ',')) {
+            v++;
+        }
+        if (end - v >= 3 && v[0] == 'u' && v[1] == '=' && v[2] >= '0' && v[2] <= '7') {
+            req->urgency = v[2] - '0';
+        } else if (v < end && v[0] == 'i') {
+            req->incremental = !(end - v >= 4 && memcmp(v + 1, "=?0", 3) == 0);
+        }
+        while (v < end && *v != ',') {
+            v++;
+        }
+    }
+}
+
+static int requestField(const char *name, int name_len, const char *value,
+        int value_len, void *arg) {
+    struct request *req = arg;
+    if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+        req->get = value_len == 3 && memcmp(value, "GET", 3) == 0;
+    } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+        if (value_len < (int) sizeof(req->path)) {
+            memcpy(req->path, value, value_len);
+            req->path[value_len] = '\0';
+            req->path_len = value_len;
+        }
+    } else if (name_len == 8 && memcmp(name, "priority", 8) == 0) {
+        parsePriority(req, value, value_len);
+    }
+    return 0;
+}
+
+static void requestInit(struct request *req) {
+    req->get = 0;
+    req->path_len = -1;
+    req->urgency = DEFAULT_URGENCY;
+    req->incremental = 1;
+}
+
+/* The header block of stream id is complete. */
+static void headersDone(struct h2_conn *c, uint32_t id) {
+    struct request req;
+    requestInit(&req);
+    // Decode even if the stream is refused: the HPACK state is shared
+    if (hpackDecode(&c->hpack, (uint8_t *) c->block.data, c->block.len,
+                requestField, &req) != 0) {
+        goAway(c, COMPRESSION_ERROR);
+        return;
+    }
+    if (id <= c->last_stream) {
+        // Trailers, or a stream that is already closed
+        return;
+    }
+    c->last_stream = id;
+    if (c->active == H2_MAX_STREAMS || c->goaway_received) {
+        rstStream(c, id, REFUSED_STREAM);
+        return;
+    }
+    openStream(c, id, &req, c->block_weight);
+}
+
+static void onHeaders(struct h2_conn *c, int flags, uint32_t id,
+        const uint8_t *p, int len) {
+    int pad = 0;
+    if (id == 0 || id % 2 == 0) {
+        goAway(c, PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & FLAG_PADDED) {
+        if (len < 1) {
+            goAway(c, FRAME_SIZE_ERROR);
+            return;
+        }
+        pad = p[0];
+        p++;
+        len--;
+    }
+    c->block_weight = 0;
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5) {
+            goAway(c, FRAME_SIZE_ERROR);
+            return;
+        }
+        c->block_weight = p[4] + 1;
+        p += 5;
+        len -= 5;
+    }
+    if (pad > len) {
+        goAway(c, PROTOCOL_ERROR);
+        return;
+    }
+    c->block.len = 0;
+    bufAppend(&c->block, p, len - pad);
+    if (flags & FLAG_END_HEADERS) {
+        headersDone(c, id);
+    } else {
+        c->block_stream = id;
+    }
+}
+
+static void onContinuation(struct h2_conn *c, int flags, uint32_t id,
+        const uint8_t *p, int len) {
+    if (c->block_stream == 0 || id != c->block_stream) {
+        goAway(c, PROTOCOL_ERROR);
+        return;
+    }
+    if (c->block.len + len > MAX_HEADER_BLOCK) {
+        goAway(c, ENHANCE_YOUR_CALM);
+        return;
+    }
+    bufAppend(&c->block, p, len);
+    if (flags & FLAG_END_HEADERS) {
+        c->block_stream = 0;
+        headersDone(c, id);
+    }
+}
+
+static void onData(struct h2_conn *c, int flags, uint32_t id,
+        const uint8_t *p, int len) {
+    if (id == 0 || ((flags & FLAG_PADDED) && (len < 1 || p[0] >= len))) {
+        goAway(c, PROTOCOL_ERROR);
+        return;
+    }
+    if (id > c->last_stream) {
+        goAway(c, PROTOCOL_ERROR);
+        return;
+    }
+    // Request bodies are discarded; credit the windows right away
+    if (len > 0) {
+        windowUpdate(c, 0, len);
+        if (findStream(c, id) != NULL && !(flags & FLAG_END_STREAM)) {
+            windowUpdate(c, id, len);
+        }
+    }
+}
+
+/* Apply the len bytes of settings at p.  Return 0 or an error code. */
+static int applySettings(struct h2_conn *c, const uint8_t *p, int len) {
+    for (; len >= 6; p += 6, len -= 6) {
+        uint32_t value = get32(p + 2);
+        switch (p[0] << 8 | p[1]) {
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return PROTOCOL_ERROR;
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > MAX_WINDOW) {
+                return FLOW_CONTROL_ERROR;
+            }
+            for (int i = 0; i < H2_MAX_STREAMS; i++) {
+                c->stream[i].window += (int64_t) value - c->initial_window;
+            }
+            c->initial_window = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < MAX_FRAME || value > 0xffffff) {
+                return PROTOCOL_ERROR;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+static void onSettings(struct h2_conn *c, int flags, uint32_t id,
+        const uint8_t *p, int len) {
+    if (id != 0) {
+        goAway(c, PROTOCOL_ERROR);
+    } else if (flags & FLAG_ACK) {
+        if (len != 0) {
+            goAway(c, FRAME_SIZE_ERROR);
+        }
+    } else if (len % 6 != 0) {
+        goAway(c, FRAME_SIZE_ERROR);
+    } else {
+        int error = applySettings(c, p, len);
+        if (error != 0) {
+            goAway(c, error);
+        } else {
+            putFrame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        }
+    }
+}
+
+static void onWindowUpdate(struct h2_conn *c, uint32_t id, const uint8_t *p,
+        int len) {
+    if (len != 4) {
+        goAway(c, FRAME_SIZE_ERROR);
+        return;
+    }
+    uint32_t increment = get32(p) & 0x7fffffff;
+    if (id == 0) {
+        c->send_window += increment;
+        if (increment == 0) {
+            goAway(c, PROTOCOL_ERROR);
+        } else if (c->send_window > MAX_WINDOW) {
+            goAway(c, FLOW_CONTROL_ERROR);
+        }
+        return;
+    }
+    struct h2_stream *s = findStream(c, id);
+    if (s == NULL) {
+        if (id > c->last_stream) {
+            goAway(c, PROTOCOL_ERROR);
+        }
+        return;
+    }
+    s->window += increment;
+    if (increment == 0 || s->window > MAX_WINDOW) {
+        rstStream(c, id, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        s->status = 0;
+        streamDone(c, s);
+    }
+}
+
+static void onRstStream(struct h2_conn *c, uint32_t id, int len) {
+    if (len != 4) {
+        goAway(c, FRAME_SIZE_ERROR);
+        return;
+    }
+    if (id == 0 || id > c->last_stream) {
+        goAway(c, PROTOCOL_ERROR);
+        return;
+    }
+    struct h2_stream *s = findStream(c, id);
+    if (s != NULL) {
+        s->status = 0;
+        streamDone(c, s);
+    }
+}
+
+static void handleFrame(struct h2_conn *c, int type, int flags, uint32_t id,
+        const uint8_t *p, int len) {
+    if (c->block_stream != 0 && type != FRAME_CONTINUATION) {
+        goAway(c, PROTOCOL_ERROR);
+        return;
+    }
+    struct h2_stream *s;
+    switch (type) {
+    case FRAME_DATA:
+        onData(c, flags, id, p, len);
+        break;
+    case FRAME_HEADERS:
+        onHeaders(c, flags, id, p, len);
+        break;
+    case FRAME_CONTINUATION:
+        onContinuation(c, flags, id, p, len);
+        break;
+    case FRAME_PRIORITY:
+        if (id == 0) {
+            goAway(c, PROTOCOL_ERROR);
+        } else if (len == 5 && (s = findStream(c, id)) != NULL) {
+            s->weight = p[4] + 1;
+            s->incremental = 1;
+        }
+        break;
+    case FRAME_RST_STREAM:
+        onRstStream(c, id, len);
+        break;
+    case FRAME_SETTINGS:
+        onSettings(c, flags, id, p, len);
+        break;
+    case FRAME_PUSH_PROMISE:
+        goAway(c, PROTOCOL_ERROR);
+        break;
+    case FRAME_PING:
+        if (len != 8) {
+            goAway(c, FRAME_SIZE_ERROR);
+        } else if (id != 0) {
+            goAway(c, PROTOCOL_ERROR);
+        } else if (!(flags & FLAG_ACK)) {
+            putFrame(c, FRAME_PING, FLAG_ACK, 0, p, 8);
+        }
+        break;
+    case FRAME_GOAWAY:
+        c->goaway_received = 1;
+        break;
+    case FRAME_WINDOW_UPDATE:
+        onWindowUpdate(c, id, p, len);
+        break;
+    default:
+        // Unknown frame types are ignored
+        break;
+    }
+}
+
+/* Handle every complete frame in c->in. */
+static void processInput(struct h2_conn *c) {
+    const uint8_t *in = (const uint8_t *) c->in.data;
+    int pos = 0;
+    if (c->preface < PREFACE_LEN) {
+        int n = c->in.len < PREFACE_LEN - c->preface ? c->in.len : PREFACE_LEN - c->preface;
+        if (memcmp(in, PREFACE + c->preface, n) != 0) {
+            goAway(c, PROTOCOL_ERROR);
+        }
+        c->preface += n;
+        pos = n;
+    }
+    while (!c->goaway_sent && c->in.len - pos >= FRAME_HEAD) {
+        uint32_t len = in[pos] << 16 | in[pos + 1] << 8 | in[pos + 2];
+        if (len > MAX_FRAME) {
+            goAway(c, FRAME_SIZE_ERROR);
+            break;
+        }
+        if (c->in.len - pos < FRAME_HEAD + (int) len) {
+            break;
+        }
+        handleFrame(c, in[pos + 3], in[pos + 4], get32(in + pos + 5) & 0x7fffffff,
+                in + pos + FRAME_HEAD, len);
+        pos += FRAME_HEAD + len;
+    }
+    bufConsume(&c->in, c->goaway_sent ? c->in.len : pos);
+}
+
+static void sockReadable(struct h2_conn *c) {
+    char buf[16384];
+    int total = 0;
+    while (total < READ_BUDGET) {
+        ssize_t n = read(c->cs->sock, buf, sizeof(buf));
+        if (n > 0) {
+            bufAppend(&c->in, buf, n);
+            total += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n == 0 || errno != EAGAIN) {
+                c->dead = 1;
+            }
+            break;
+        }
+    }
+    if (total > 0) {
+        c->last_io = nowMsec();
+        if (!c->dead) {
+            processInput(c);
+        }
+    }
+}
+
+/* Write as much of c->out as the socket takes. */
+static void flushOut(struct h2_conn *c) {
+    while (c->out.len > 0) {
+        ssize_t n = send(c->cs->sock, c->out.data, c->out.len, MSG_NOSIGNAL);
+        if (n > 0) {
+            bufConsume(&c->out, n);
+            c->last_io = nowMsec();
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n == 0 || errno != EAGAIN) {
+                c->dead = 1;
+            }
+            return;
+        }
+    }
+}
+
+/* Return the stream whose DATA goes next, or NULL if none can send. */
+static struct h2_stream *nextStream(struct h2_conn *c) {
+    struct h2_stream *best = NULL;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        struct h2_stream *s = &c->stream[i];
+        if (s->id == 0 || s->body_len == 0 || s->window <= 0) {
+            continue;
+        }
+        if (best == NULL || s->urgency < best->urgency) {
+            best = s;
+        } else if (s->urgency == best->urgency) {
+            if (s->incremental != best->incremental) {
+                if (!s->incremental) {
+                    best = s;
+                }
+            } else if (s->incremental ? s->vtime < best->vtime : s->id < best->id) {
+                best = s;
+            }
+        }
+    }
+    return best;
+}
+
+/* Frame DATA of the streams whose turn it is until enough is waiting
+ * for the socket or the flow control windows are used up.
+ */
+static void pump(struct h2_conn *c) {
+    while (c->out.len < OUT_LOW_WATER && c->send_window > 0 && !c->goaway_sent) {
+        struct h2_stream *s = nextStream(c);
+        if (s == NULL) {
+            break;
+        }
+        int n = s->body_len;
+        if (n > MAX_FRAME) {
+            n = MAX_FRAME;
+        }
+        if (n > s->window) {
+            n = s->window;
+        }
+        if (n > c->send_window) {
+            n = c->send_window;
+        }
+        int end = n == s->body_len;
+        putFrame(c, FRAME_DATA, end ? FLAG_END_STREAM : 0, s->id, s->body, n);
+        s->body += n;
+        s->body_len -= n;
+        s->window -= n;
+        s->sent += n;
+        c->send_window -= n;
+        c->vclock = s->vtime;
+        s->vtime += ((uint64_t) n << 8) / s->weight;
+        if (end) {
+            streamDone(c, s);
+        }
+    }
+}
+
+/* Arm the deadline of the connection: the earliest CGI deadline, or the
+ * idle timeout if no CGI program is running, and MEM_RETRY_MS from now at
+ * the latest while a stream is paused or waits for its program to exit.
+ */
+static void armConnDeadline(struct h2_conn *c) {
+    uint64_t now = nowMsec();
+    uint64_t expires = UINT64_MAX;
+    int running = 0;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        struct h2_stream *s = &c->stream[i];
+        if (s->id != 0 && s->pid != -1) {
+            running = 1;
+            if (!s->timed_out && s->cgi_deadline < expires) {
+                expires = s->cgi_deadline;
+            }
+            if ((s->paused || s->pipe == -1) && now + MEM_RETRY_MS < expires) {
+                expires = now + MEM_RETRY_MS;
+            }
+        }
+    }
+    if (!running) {
+        expires = c->last_io + H2_IDLE_TIMEOUT_MS;
+    } else if (expires == UINT64_MAX) {
+        // Killed programs only; their pipes are about to reach EOF
+        expires = now + 1000;
+    }
+    armDeadline(c->cs, TIMER_H2, expires > now ? expires : now + 1);
+}
+
+/* Bring c up to date after an event: send what can be sent, then close
+ * it or ask for the next events.
+ */
+static void connUpdate(struct h2_conn *c) {
+    while (!c->dead) {
+        pump(c);
+        if (c->out.len == 0) {
+            break;
+        }
+        flushOut(c);
+        if (c->out.len > 0) {
+            break;
+        }
+    }
+    if (c->dead || (c->goaway_sent && c->out.len == 0) ||
+            (c->goaway_received && c->active == 0 && c->out.len == 0)) {
+        h2Close(c->cs);
+        return;
+    }
+    int sock = c->cs->sock;
+    if (!c->goaway_sent) {
+        watchFd(c, sock, -1, POLLIN);
+    }
+    if (c->out.len > 0) {
+        watchFd(c, sock, -1, POLLOUT);
+    }
+    armConnDeadline(c);
+}
+
+static struct h2_conn *connNew(struct clientstate *cs) {
+    struct h2_conn *c = calloc(1, sizeof(*c));
+    memAdd(MEM_H2, sizeof(*c));
+    c->cs = cs;
+    hpackInit(&c->hpack);
+    c->send_window = DEFAULT_WINDOW;
+    c->initial_window = DEFAULT_WINDOW;
+    c->last_io = nowMsec();
+    cs->h2 = c;
+    statsAdd(STAT_H2_CONNS, 1);
+    return c;
+}
+
+/* Queue our SETTINGS, the server connection preface. */
+static void sendSettings(struct h2_conn *c) {
+    uint8_t settings[6] = {0, SETTINGS_MAX_CONCURRENT_STREAMS};
+    put32(settings + 2, H2_MAX_STREAMS);
+    putFrame(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+/* Return 1 if the n bytes at data, the first a client sent, are the start
+ * of the HTTP/2 connection preface.
+ */
+int h2Preface(const char *data, int n) {
+    return n >= 3 && memcmp(data, PREFACE, n < PREFACE_LEN ? n : PREFACE_LEN) == 0;
+}
+
+/* Return the value of header name in the header block of the HTTP/1.1
+ * request, and its length in *len, or NULL.
+ */
+static const char *requestHeader(const char *request, const char *name, int *len) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(request, "\r\n");
+    while (line != NULL && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            v += strspn(v, " \t");
+            *len = strcspn(v, "\r\n");
+            return v;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+/* Return 1 if the HTTP/1.1 request asks to be upgraded to h2c.  Only a
+ * GET is: stream 1 carries no body, so the body of a POST or PUT would be
+ * taken for the client preface; those are served over HTTP/1.1, ignoring
+ * Upgrade as RFC 7230 6.7 allows.
+ */
+int h2WantsUpgrade(const char *request) {
+    int len, settings_len;
+    if (strncmp(request, "GET ", 4) != 0) {
+        return 0;
+    }
+    const char *v = requestHeader(request, "upgrade", &len);
+    if (v == NULL || requestHeader(request, "http2-settings", &settings_len) == NULL) {
+        return 0;
+    }
+    for (const char *end = v + len; v < end; v++) {
+        if (strncasecmp(v, "h2c", 3) == 0 && (v + 3 == end ||
+                    v[3] == ',' || v[3] == ' ')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Decode the base64url text at in into out, which must have room for
+ * len * 3 / 4 bytes.  Return the length, or -1 if in is not base64url.
+ */
+static int base64urlDecode(const char *in, int len, uint8_t *out) {
+    uint32_t acc = 0;
+    int bits = 0, n = 0;
+    for (int i = 0; i < len && in[i] != '='; i++) {
+        const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        const char *d = in[i] != '\0' ? strchr(digits, in[i]) : NULL;
+        if (d == NULL) {
+            return -1;
+        }
+        acc = acc << 6 | (d - digits);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+/* The first n bytes the client on cs sent start the connection preface:
+ * speak HTTP/2 from now on.  Return CLIENT_H2.
+ */
+int h2Start(struct clientstate *cs, const char *data, int n) {
+    struct h2_conn *c = connNew(cs);
+    LOG_DEBUG("h2: socket %d, prior knowledge\n", cs->sock);
+    sendSettings(c);
+    bufAppend(&c->in, data, n);
+    processInput(c);
+    connUpdate(c);
+    return CLIENT_H2;
+}
+
+/* The complete HTTP/1.1 request in cs asks for h2c (see h2WantsUpgrade):
+ * switch protocols and answer it as stream 1.  Return CLIENT_H2.
+ */
+int h2Upgrade(struct clientstate *cs) {
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+            "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    struct h2_conn *c = connNew(cs);
+    LOG_DEBUG("h2: socket %d, upgrade\n", cs->sock);
+    bufAppend(&c->out, switching, sizeof(switching) - 1);
+    sendSettings(c);
+
+    int len;
+    const char *v = requestHeader(cs->request, "http2-settings", &len);
+    uint8_t settings[MAXLINE];
+    int settings_len = len < MAXLINE ? base64urlDecode(v, len, settings) : -1;
+    if (settings_len > 0 && settings_len % 6 == 0) {
+        // Acknowledged implicitly by the 101 (RFC 7540 3.2.1)
+        applySettings(c, settings, settings_len);
+    }
+
+    struct request req;
+    requestInit(&req);
+    req.get = 1;
+    req.path_len = strcspn(cs->request + 4, " \r\n");
+    if (req.path_len >= (int) sizeof(req.path)) {
+        req.path_len = sizeof(req.path) - 1;
+    }
+    memcpy(req.path, cs->request + 4, req.path_len);
+    req.path[req.path_len] = '\0';
+    c->last_stream = 1;
+    openStream(c, 1, &req, 0);
+    connUpdate(c);
+    return CLIENT_H2;
+}
+
+/* Handle events (POLLIN and/or POLLOUT) on fd, which h2.c asked the event
+ * loop to watch.  Return 0, or -1 if fd is not one of ours.
+ */
+int h2Event(int fd, int events) {
+    if (fd < 0 || fd >= owners_size || owners[fd].conn == NULL) {
+        return -1;
+    }
+    struct fd_owner *o = &owners[fd];
+    struct h2_conn *c = o->conn;
+    o->armed &= ~events;
+    if (o->stream >= 0) {
+        cgiReadable(c, &c->stream[o->stream]);
+    } else if (events & POLLIN) {
+        sockReadable(c);
+    }
+    // Whatever happened, connUpdate writes what it can
+    connUpdate(c);
+    return 0;
+}
+
+/* The deadline of the HTTP/2 connection cs expired: kill the CGI programs
+ * that ran out of time (their streams get a 504), read the pipes of paused
+ * streams again, reap the programs of streams at EOF, or close the
+ * connection if it was idle for H2_IDLE_TIMEOUT_MS.
+ */
+void h2Expired(struct clientstate *cs) {
+    struct h2_conn *c = cs->h2;
+    uint64_t now = nowMsec();
+    int running = 0, reaped = 0;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        struct h2_stream *s = &c->stream[i];
+        if (s->id == 0 || s->pid == -1) {
+            continue;
+        }
+        running = 1;
+        if (!s->timed_out && s->cgi_deadline <= now) {
+            LOG_DEBUG("h2: CGI %d of stream %u timed out\n", s->pid, s->id);
+            stopProgram(s->pid);
+            s->timed_out = 1;
+        }
+        if (s->pipe == -1) {
+            // At EOF, waiting for the program to exit
+            cgiFinished(c, s);
+            reaped |= s->pid == -1;
+        } else if (s->paused) {
+            // cgiReadable pauses it again if memory is still short
+            watchFd(c, s->pipe, i, POLLIN);
+        }
+    }
+    if (!running && c->last_io + H2_IDLE_TIMEOUT_MS <= now) {
+        LOG_DEBUG("h2: socket %d idle\n", cs->sock);
+        goAway(c, NO_ERROR);
+        flushOut(c);
+        h2Close(cs);
+        return;
+    }
+    if (reaped) {
+        // Responses to send
+        connUpdate(c);
+        return;
+    }
+    armConnDeadline(c);
+}
+
+/* Close the HTTP/2 connection cs, ending its open streams, and reset cs. */
+void h2Close(struct clientstate *cs) {
+    struct h2_conn *c = cs->h2;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->stream[i].id != 0) {
+            c->stream[i].status = 0;
+            streamDone(c, &c->stream[i]);
+        }
+    }
+    unwatchFd(cs->sock);
+    hpackFree(&c->hpack);
+    free(c->in.data);
+    free(c->out.data);
+    free(c->block.data);
+    memAdd(MEM_H2, -(int64_t) (sizeof(*c) + c->in.cap + c->out.cap + c->block.cap));
+    free(c);
+    cs->h2 = NULL;
+    statsAdd(STAT_ACTIVE_CONNS, -1);
+    rateRelease(cs->client_addr);
+    Close(cs->sock);
+    resetClient(cs);
+}
@@ -0,0 +1,16 @@
+/* HTTP/2 over cleartext TCP (h2c); see h2.c */
+#define H2_MAX_STREAMS 8           /* SETTINGS_MAX_CONCURRENT_STREAMS */
+#define H2_IDLE_TIMEOUT_MS 30000   /* no CGI running and no I/O -> closed */
+
+struct clientstate;
+struct h2_conn;
+
+void h2SetLoop(void (*watch)(int fd, int events, void *arg),
+        void (*unwatch)(int fd, void *arg), void *arg);
+int h2Preface(const char *data, int n);
+int h2WantsUpgrade(const char *request);
+int h2Start(struct clientstate *cs, const char *data, int n);
+int h2Upgrade(struct clientstate *cs);
+int h2Event(int fd, int events);
+void h2Expired(struct clientstate *cs);
+void h2Close(struct clientstate *cs);
@@ -0,0 +1,463 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+/* HPACK (RFC 7541), the header compression of HTTP/2.
+ *
+ * Decoding supports everything a client may send: the static and dynamic
+ * tables, table size updates and Huffman coded strings.  Our responses
+ * only use literals without indexing and plain strings, so the encoder
+ * keeps no state and a client's table is never touched by us.
+ */
+
+struct static_field {
+    const char *name;
+    const char *value;
+};
+
+/* RFC 7541 Appendix A; index 0 is unused */
+static const struct static_field static_table[] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_ENTRIES ((int) (sizeof(static_table) / sizeof(static_table[0])) - 1)
+
+/* Code length of every symbol of the Huffman code of RFC 7541 Appendix B;
+ * 256 is EOS.  The code is canonical, so the codes follow from the lengths
+ * (see huffmanInit).
+ */
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_MAX_BITS 30
+static const uint8_t huffman_bits[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/* Canonical decoding tables: the codes of length n are the count[n]
+ * values from first_code[n] on, and belong to the symbols sorted[first[n]]
+ * onwards.
+ */
+static struct {
+    int ready;
+    uint32_t first_code[HUFFMAN_MAX_BITS + 1];
+    int first[HUFFMAN_MAX_BITS + 1];
+    int count[HUFFMAN_MAX_BITS + 1];
+    uint16_t sorted[HUFFMAN_SYMBOLS];
+} huffman;
+
+static void huffmanInit(void) {
+    int n = 0;
+    uint32_t code = 0;
+    for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
+        huffman.first_code[bits] = code;
+        huffman.first[bits] = n;
+        for (int sym = 0; sym < HUFFMAN_SYMBOLS; sym++) {
+            if (huffman_bits[sym] == bits) {
+                huffman.sorted[n++] = sym;
+                code++;
+            }
+        }
+        huffman.count[bits] = n - huffman.first[bits];
+        code <<= 1;
+    }
+    huffman.ready = 1;
+}
+
+/* Decode the len Huffman coded bytes at in into out, which must have room
+ * for len * 8 / 5 bytes.  Return the decoded length, or -1 if the input
+ * is not valid (RFC 7541 5.2: EOS or padding that is too long or not all
+ * ones).
+ */
+static int huffmanDecode(const uint8_t *in, int len, char *out) {
+    if (!huffman.ready) {
+        huffmanInit();
+    }
+    int n = 0;
+    uint32_t code = 0;
+    int bits = 0;
+    for (int i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((in[i] >> b) & 1);
+            bits++;
+            if (code - huffman.first_code[bits] < (uint32_t) huffman.count[bits]) {
+                int sym = huffman.sorted[huffman.first[bits] + code - huffman.first_code[bits]];
+                if (sym == 256) {
+                    return -1;
+                }
+                out[n++] = sym;
+                code = 0;
+                bits = 0;
+            } else if (bits == HUFFMAN_MAX_BITS) {
+                return -1;
+            }
+        }
+    }
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+    return n;
+}
+
+void hpackInit(struct hpack_table *t) {
+    t->head = 0;
+    t->count = 0;
+    t->size = 0;
+    t->max_size = HPACK_TABLE_SIZE;
+}
+
+static void evictOldest(struct hpack_table *t) {
+    struct hpack_entry *e = &t->entry[(t->head + t->count - 1) % HPACK_MAX_FIELDS];
+    t->size -= e->name_len + e->value_len + 32;
+    free(e->name);
+    t->count--;
+}
+
+void hpackFree(struct hpack_table *t) {
+    while (t->count > 0) {
+        evictOldest(t);
+    }
+}
+
+static void shrinkTo(struct hpack_table *t, int max_size) {
+    while (t->size > max_size) {
+        evictOldest(t);
+    }
+}
+
+/* Add a field to the dynamic table, evicting as needed (RFC 7541 4.4). */
+static void addField(struct hpack_table *t, const char *name, int name_len,
+        const char *value, int value_len) {
+    int size = name_len + value_len + 32;
+    if (size > t->max_size) {
+        shrinkTo(t, 0);
+        return;
+    }
+    // Copy before evicting, name may belong to the oldest entry
+    char *mem = malloc(name_len + value_len + 2);
+    memcpy(mem, name, name_len);
+    mem[name_len] = '\0';
+    memcpy(mem + name_len + 1, value, value_len);
+    mem[name_len + 1 + value_len] = '\0';
+    shrinkTo(t, t->max_size - size);
+    t->head = (t->head + HPACK_MAX_FIELDS - 1) % HPACK_MAX_FIELDS;
+    struct hpack_entry *e = &t->entry[t->head];
+    e->name = mem;
+    e->name_len = name_len;
+    e->value = mem + name_len + 1;
+    e->value_len = value_len;
+    t->count++;
+    t->size += size;
+}
+
+/* Look up index (1-based, static table first).  Return 0, or -1 if there
+ * is no such entry.
+ */
+static int lookup(struct hpack_table *t, uint32_t index, const char **name,
+        int *name_len, const char **value, int *value_len) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= STATIC_ENTRIES) {
+        *name = static_table[index].name;
+        *name_len = strlen(*name);
+        *value = static_table[index].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_ENTRIES + 1;
+    if (index >= (uint32_t) t->count) {
+        return -1;
+    }
+    struct hpack_entry *e = &t->entry[(t->head + index) % HPACK_MAX_FIELDS];
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+/* Decode an integer with a prefix of prefix_bits bits (RFC 7541 5.1)
+ * starting at in[*pos].  Return -1 if it is truncated or too large.
+ */
+static int64_t decodeInt(const uint8_t *in, int len, int *pos, int prefix_bits) {
+    uint32_t mask = (1u << prefix_bits) - 1;
+    if (*pos >= len) {
+        return -1;
+    }
+    int64_t value = in[(*pos)++] & mask;
+    if (value < mask) {
+        return value;
+    }
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (*pos >= len) {
+            return -1;
+        }
+        uint8_t b = in[(*pos)++];
+        value += (int64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return value;
+        }
+    }
+    return -1;
+}
+
+/* Decode a string literal (RFC 7541 5.2) starting at in[*pos] into *out,
+ * advancing *out past it.  Return its length, or -1 on error.
+ */
+static int decodeString(const uint8_t *in, int len, int *pos, char **out,
+        const char **str) {
+    if (*pos >= len) {
+        return -1;
+    }
+    int huffman_coded = in[*pos] & 0x80;
+    int64_t n = decodeInt(in, len, pos, 7);
+    if (n < 0 || n > len - *pos) {
+        return -1;
+    }
+    *str = *out;
+    int out_len = n;
+    if (huffman_coded) {
+        out_len = huffmanDecode(in + *pos, n, *out);
+        if (out_len < 0) {
+            return -1;
+        }
+    } else {
+        memcpy(*out, in + *pos, n);
+    }
+    *pos += n;
+    *out += out_len;
+    return out_len;
+}
+
+/* Decode the header block of len bytes at in with the dynamic table t,
+ * calling field for every header field in order.  Strings passed to field
+ * are not null-terminated and only valid during the call.  Return 0, the
+ * first non-zero value returned by field, or -1 if the block could not be
+ * decoded, which is a connection error (COMPRESSION_ERROR).
+ */
+int hpackDecode(struct hpack_table *t, const uint8_t *in, int len,
+        int (*field)(const char *name, int name_len,
+                const char *value, int value_len, void *arg),
+        void *arg) {
+    // Decoded strings are at most 8/5 of their coded length
+    char *scratch = malloc(len * 8 / 5 + 1);
+    int pos = 0;
+    int rc = 0;
+    int fields = 0;
+    while (pos < len && rc == 0) {
+        char *out = scratch;
+        const char *name, *value;
+        int name_len, value_len;
+        int indexing = 0;
+        uint8_t b = in[pos];
+        if (b & 0x80) {
+            // Indexed header field
+            int64_t index = decodeInt(in, len, &pos, 7);
+            if (index < 0 || lookup(t, index, &name, &name_len, &value, &value_len) == -1) {
+                rc = -1;
+                break;
+            }
+        } else if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed before any field
+            int64_t size = decodeInt(in, len, &pos, 5);
+            if (size < 0 || size > HPACK_TABLE_SIZE || fields > 0) {
+                rc = -1;
+                break;
+            }
+            t->max_size = size;
+            shrinkTo(t, size);
+            continue;
+        } else {
+            // Literal; with incremental indexing (01), without (0000) or
+            // never indexed (0001)
+            indexing = (b & 0xc0) == 0x40;
+            int64_t index = decodeInt(in, len, &pos, indexing ? 6 : 4);
+            if (index < 0) {
+                rc = -1;
+                break;
+            }
+            if (index == 0) {
+                name_len = decodeString(in, len, &pos, &out, &name);
+            } else if (lookup(t, index, &name, &name_len, &value, &value_len) == -1) {
+                name_len = -1;
+            }
+            value_len = name_len < 0 ? -1 : decodeString(in, len, &pos, &out, &value);
+            if (value_len < 0) {
+                rc = -1;
+                break;
+            }
+        }
+        fields++;
+        rc = field(name, name_len, value, value_len, arg);
+        if (indexing) {
+            // Last: adding may evict the entry that name points into
+            addField(t, name, name_len, value, value_len);
+        }
+    }
+    free(scratch);
+    return rc;
+}
+
+/* Encode an integer with a prefix of prefix_bits bits into out, or'ing
+ * flags into the first byte.  Return the length, or -1 if out is full.
+ */
+static int encodeInt(uint8_t *out, int room, uint8_t flags, int prefix_bits,
+        uint32_t value) {
+    uint32_t mask = (1u << prefix_bits) - 1;
+    int n = 0;
+    if (room < 1) {
+        return -1;
+    }
+    if (value < mask) {
+        out[n++] = flags | value;
+        return n;
+    }
+    out[n++] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        if (n == room) {
+            return -1;
+        }
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n == room) {
+        return -1;
+    }
+    out[n++] = value;
+    return n;
+}
+
+static int encodeString(uint8_t *out, int room, const char *s, int len) {
+    int n = encodeInt(out, room, 0, 7, len);
+    if (n < 0 || len > room - n) {
+        return -1;
+    }
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+/* Encode the :status pseudo-header for status into out, which must have
+ * room for 5 bytes.  Return the length.
+ */
+int hpackStatus(uint8_t *out, int status) {
+    for (int i = 8; i <= 14; i++) {
+        if (atoi(static_table[i].value) == status) {
+            out[0] = 0x80 | i;
+            return 1;
+        }
+    }
+    // Literal without indexing, name from the static table
+    out[0] = 8;
+    out[1] = 3;
+    out[2] = '0' + status / 100 % 10;
+    out[3] = '0' + status / 10 % 10;
+    out[4] = '0' + status % 10;
+    return 5;
+}
+
+/* Encode a header field, whose name must be lower case, as a literal
+ * without indexing into the room bytes at out.  Return the length, or -1
+ * if it does not fit.
+ */
+int hpackField(uint8_t *out, int room, const char *name, int name_len,
+        const char *value, int value_len) {
+    int index = 0;
+    for (int i = 15; i <= STATIC_ENTRIES; i++) {
+        if ((int) strlen(static_table[i].name) == name_len &&
+                memcmp(static_table[i].name, name, name_len) == 0) {
+            index = i;
+            break;
+        }
+    }
+    int n = encodeInt(out, room, 0, 4, index);
+    if (n < 0) {
+        return -1;
+    }
+    if (index == 0) {
+        int m = encodeString(out + n, room - n, name, name_len);
+        if (m < 0) {
+            return -1;
+        }
+        n += m;
+    }
+    int m = encodeString(out + n, room - n, value, value_len);
+    return m < 0 ? -1 : n + m;
+}
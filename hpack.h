@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+/* HPACK header compression for HTTP/2 (RFC 7541); see hpack.c */
+#define HPACK_TABLE_SIZE 4096   /* SETTINGS_HEADER_TABLE_SIZE we accept */
+#define HPACK_MAX_FIELDS 128    /* dynamic table entries: 4096 / 32 */
+
+struct hpack_entry {
+    char *name;                 /* name and value in one allocation */
+    char *value;
+    int name_len, value_len;
+};
+
+/* Decoder state of one connection */
+struct hpack_table {
+    struct hpack_entry entry[HPACK_MAX_FIELDS];  /* ring, newest at head */
+    int head, count;
+    int size;                   /* RFC 7541 4.1 size of the entries */
+    int max_size;               /* current limit, set by the encoder */
+};
+
+void hpackInit(struct hpack_table *t);
+void hpackFree(struct hpack_table *t);
+int hpackDecode(struct hpack_table *t, const uint8_t *in, int len,
+        int (*field)(const char *name, int name_len,
+                const char *value, int value_len, void *arg),
+        void *arg);
+int hpackStatus(uint8_t *out, int status);
+int hpackField(uint8_t *out, int room, const char *name, int name_len,
+        const char *value, int value_len);
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+
+static const char *level_names[] = {"debug", "info", "warn", "error"};
+
+/* Write a diagnostic message to stderr.  Only reached for levels at or
+ * above LOG_LEVEL; see the LOG_* macros in log.h.
+ */
+void logMessage(int level, const char *fmt, ...) {
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "[%s] ", level_names[level]);
+    va_list ap;
+    va_start(ap, fmt);
+    n += vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+    va_end(ap);
+    if (n >= (int) sizeof(buf)) {
+        n = sizeof(buf) - 1;
+        buf[n - 1] = '\n';
+    }
+    /* One write per message so lines from the CGI children don't interleave */
+    if (write(STDERR_FILENO, buf, n) < 0) {
+        /* nothing sensible to do */
+    }
+}
+
+/* Where nowUsec gets the time, if not from the monotonic clock */
+static uint64_t (*clock_source)(void);
+
+/* Take the time from source from now on, or from the monotonic clock if
+ * source is NULL (see transportUse).
+ */
+void setClock(uint64_t (*source)(void)) {
+    clock_source = source;
+}
+
+/* Monotonic time in microseconds, for measuring durations and deadlines.
+ */
+uint64_t nowUsec(void) {
+    if (clock_source != NULL) {
+        return clock_source();
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Wall-clock time in microseconds since the epoch, for timestamps.
+ */
+uint64_t wallUsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Access log.
+ *
+ * The event loop pushes records into a single-producer/single-consumer ring
+ * and never blocks: if the ring is full the record is dropped and counted.
+ * A background thread drains the ring in batches, formats the records as
+ * one logfmt line each and writes a whole batch with a single write().
+ * There is one ring per event loop; the server currently runs one loop.
+ */
+#define RING_SIZE 4096          /* must be a power of two */
+#define DRAIN_INTERVAL_NS 50000000  /* 50ms between drains when idle */
+#define LINE_MAX_LEN 256
+
+struct access_ring {
+    _Atomic uint32_t head;      /* next slot the producer writes */
+    char pad1[60];              /* keep producer and consumer indices on */
+    _Atomic uint32_t tail;      /* different cache lines */
+    char pad2[60];
+    _Atomic uint32_t dropped;
+    struct access_record slot[RING_SIZE];
+};
+
+static struct access_ring ring;
+static int log_fd = -1;
+static pthread_t writer;
+static atomic_int stopping;
+
+void accessLogPush(const struct access_record *rec) {
+    if (log_fd == -1) {
+        return;
+    }
+    uint32_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+    if (head - tail == RING_SIZE) {
+        atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring.slot[head & (RING_SIZE - 1)] = *rec;
+    atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+}
+
+static int formatRecord(char *buf, size_t size, const struct access_record *r) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &r->client_addr, addr, sizeof(addr));
+    return snprintf(buf, size, "ts=%llu.%06llu client=%s:%u path=/%.*s "
+            "status=%u bytes=%u header_us=%u cgi_us=%u send_us=%u\n",
+            (unsigned long long) (r->time_us / 1000000),
+            (unsigned long long) (r->time_us % 1000000),
+            addr, r->client_port, ACCESS_PATH_LEN, r->path,
+            r->status, r->bytes, r->header_us, r->cgi_us, r->send_us);
+}
+
+/* Format and write everything currently in the ring.  Return the number of
+ * records written.
+ */
+static int drainRing(void) {
+    static char batch[64 * LINE_MAX_LEN];
+    int total = 0;
+    for (;;) {
+        uint32_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+        if (tail == head) {
+            break;
+        }
+        int len = 0;
+        while (tail != head && len + LINE_MAX_LEN <= (int) sizeof(batch)) {
+            int n = formatRecord(batch + len, LINE_MAX_LEN,
+                    &ring.slot[tail & (RING_SIZE - 1)]);
+            len += n < LINE_MAX_LEN ? n : LINE_MAX_LEN - 1;
+            tail++;
+            total++;
+        }
+        atomic_store_explicit(&ring.tail, tail, memory_order_release);
+        if (write(log_fd, batch, len) < 0) {
+            perror("write access log");
+        }
+    }
+    uint32_t dropped = atomic_exchange_explicit(&ring.dropped, 0,
+            memory_order_relaxed);
+    if (dropped > 0) {
+        char msg[64];
+        int n = snprintf(msg, sizeof(msg), "dropped=%u\n", dropped);
+        if (write(log_fd, msg, n) < 0) {
+            perror("write access log");
+        }
+    }
+    return total;
+}
+
+static void *writerMain(void *arg) {
+    struct timespec idle = {0, DRAIN_INTERVAL_NS};
+    while (!atomic_load(&stopping)) {
+        if (drainRing() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    drainRing();
+    return NULL;
+}
+
+/* Open (append to) the access log in filename and start the writer thread.
+ * "-" means standard output.  Return 0 on success and -1 on error.
+ */
+int accessLogOpen(const char *filename) {
+    if (strcmp(filename, "-") == 0) {
+        log_fd = STDOUT_FILENO;
+    } else {
+        log_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd == -1) {
+            perror(filename);
+            return -1;
+        }
+    }
+    if (pthread_create(&writer, NULL, writerMain, NULL) != 0) {
+        fprintf(stderr, "could not start access log writer\n");
+        log_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* Flush outstanding records and stop the writer thread.
+ */
+void accessLogClose(void) {
+    if (log_fd == -1) {
+        return;
+    }
+    atomic_store(&stopping, 1);
+    pthread_join(writer, NULL);
+    if (log_fd != STDOUT_FILENO) {
+        close(log_fd);
+    }
+    log_fd = -1;
+}
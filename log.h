@@ -0,0 +1,53 @@
+#include <stdint.h>
+
+/* Log levels.  Messages below LOG_LEVEL are compiled out entirely, so debug
+ * logging on the request path costs nothing in a normal build.  Build with
+ * e.g. CFLAGS="-g -Wall -DLOG_LEVEL=LOG_LVL_DEBUG" to turn it back on.
+ */
+#define LOG_LVL_DEBUG 0
+#define LOG_LVL_INFO  1
+#define LOG_LVL_WARN  2
+#define LOG_LVL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LVL_WARN
+#endif
+
+#define LOG_AT(lvl, ...) do { \
+        if ((lvl) >= LOG_LEVEL) logMessage((lvl), __VA_ARGS__); \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LVL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LVL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LVL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LVL_ERROR, __VA_ARGS__)
+
+#define ACCESS_PATH_LEN 32
+
+/* One access log entry.  Records are fixed-size so they can be copied into
+ * the ring without allocating; the background writer formats them.
+ * Durations are in microseconds and are 0 for stages the request never
+ * reached.
+ */
+struct access_record {
+    uint64_t time_us;       /* wall-clock time the response was finished */
+    uint32_t client_addr;   /* IPv4 address, network byte order */
+    uint16_t client_port;   /* host byte order */
+    uint16_t status;        /* 0 if the client went away without a response */
+    uint32_t bytes;         /* bytes written to the client */
+    uint32_t header_us;     /* accept -> complete request header */
+    uint32_t cgi_us;        /* request header -> CGI output complete */
+    uint32_t send_us;       /* CGI output complete -> last byte written */
+    char path[ACCESS_PATH_LEN];
+};
+
+void logMessage(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+uint64_t nowUsec(void);
+void setClock(uint64_t (*source)(void));
+uint64_t wallUsec(void);
+
+int accessLogOpen(const char *filename);
+void accessLogPush(const struct access_record *rec);
+void accessLogClose(void);
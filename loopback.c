@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "transport.h"
+#include "loopback.h"
+
+/* The in-memory loopback: a transport (see transport.c) whose clients,
+ * CGI programs and clock are simulated, for benchmarks that neither the
+ * noise of real sockets nor the number of descriptors of one host limit.
+ *
+ * Every client follows the script: it connects at its time, writes its
+ * request in fragments, reads its response at its rate, and is done once
+ * the server closes the connection and it has read everything.  A CGI
+ * program writes its output all at once after its time; the server reads
+ * it LOOP_PIPE_BUF bytes at a time, as from a pipe.  Descriptors start at
+ * LOOP_FD_BASE so that they are never mistaken for real ones.
+ *
+ * Time is virtual and only moves in poll: when nothing the server polls
+ * for is ready, the clock jumps to the next thing a client or program
+ * does, or to the timeout, whichever comes first.  It moves in ticks of
+ * the script, so that what happens within one tick is handled in one
+ * round of the event loop, as a busy server would.  Handling events
+ * takes no virtual time, so the same script always gives the same run,
+ * however loaded the host is.  Once every client is done, poll fails with
+ * ESHUTDOWN and the coroutine loop returns.
+ */
+
+enum end_kind { END_FREE, END_LISTEN, END_CONN, END_PIPE };
+
+/* What a descriptor is */
+struct end {
+    int kind;
+    int index;              /* of the client or program */
+};
+
+enum client_state { SIM_WAITING, SIM_QUEUED, SIM_OPEN, SIM_DONE };
+
+struct sim_client {
+    int state;
+    int stall;              /* stops writing after its first fragment */
+    uint64_t connect_at;
+    uint64_t next_write;    /* of the next fragment */
+    uint64_t next_read;     /* while the server's writes are in flight */
+    int sent;               /* request bytes written */
+    int consumed;           /* request bytes the server read */
+    int in_flight;          /* response bytes not read yet */
+    int closed;             /* by the server */
+    int active;             /* position in active */
+    char head[256];         /* start of the response, for its header */
+    struct loopback_client result;
+};
+
+struct sim_program {
+    uint64_t ready_at;      /* when its output is there */
+    int total;
+    int consumed;
+    int killed;
+};
+
+static struct loopback_script script;
+static int request_len;
+static uint64_t now = LOOP_CLOCK_START;
+static uint64_t polls;
+static uint32_t rng;
+
+static struct end *ends;
+static int num_ends;
+static int *free_ends;      /* stack of released descriptors */
+static int num_free;
+
+static struct sim_client *clients;
+static int arrived;         /* clients that have connected */
+static int accepted;        /* clients the server accepted */
+static int done;
+static int *active;         /* clients that are connected and not done */
+static int num_active;
+
+static struct sim_program *programs;
+static int num_programs, cap_programs;
+static int *pending;        /* programs whose output is not there yet */
+static int num_pending;
+
+static const char cgi_head[] = "Content-Type: text/html\r\n\r\n";
+
+static uint32_t nextRandom(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* Between mean / 2 and mean * 3 / 2. */
+static uint64_t jitter(uint64_t mean) {
+    return mean / 2 + (mean ? nextRandom() % (mean + 1) : 0);
+}
+
+static int newEnd(int kind, int index) {
+    int i;
+    if (num_free > 0) {
+        i = free_ends[--num_free];
+    } else {
+        i = num_ends++;
+        ends = realloc(ends, num_ends * sizeof(*ends));
+        free_ends = realloc(free_ends, num_ends * sizeof(*free_ends));
+    }
+    ends[i].kind = kind;
+    ends[i].index = index;
+    return LOOP_FD_BASE + i;
+}
+
+/* Return the end fd is, or NULL if it is none of ours. */
+static struct end *endOf(int fd) {
+    int i = fd - LOOP_FD_BASE;
+    if (fd < LOOP_FD_BASE || i >= num_ends || ends[i].kind == END_FREE) {
+        return NULL;
+    }
+    return &ends[i];
+}
+
+/* Set up the clients of s.  Return 0, or -1 if s makes no sense. */
+int loopbackInit(const struct loopback_script *s) {
+    if (s->clients <= 0 || s->request == NULL || s->window <= 0) {
+        return -1;
+    }
+    script = *s;
+    if (script.addresses <= 0) {
+        script.addresses = script.clients;
+    }
+    request_len = strlen(script.request);
+    rng = script.seed ? script.seed : 1;
+    clients = calloc(script.clients, sizeof(*clients));
+    active = calloc(script.clients, sizeof(*active));
+    uint64_t t = now;
+    for (int i = 0; i < script.clients; i++) {
+        clients[i].connect_at = t + nextRandom() % (script.arrival_us + 1);
+        clients[i].stall = (int) (nextRandom() % 100) < script.stall_percent;
+        t += script.arrival_us;
+    }
+    return 0;
+}
+
+/* The descriptor the server accepts the clients on. */
+int loopbackListen(void) {
+    return newEnd(END_LISTEN, 0);
+}
+
+const struct loopback_client *loopbackResult(int i) {
+    return &clients[i].result;
+}
+
+/* Calls to poll, each one round of the event loop. */
+uint64_t loopbackPolls(void) {
+    return polls;
+}
+
+/* Virtual time since the start, in us. */
+uint64_t loopbackElapsed(void) {
+    return now - LOOP_CLOCK_START;
+}
+
+static void clientDone(struct sim_client *c) {
+    c->state = SIM_DONE;
+    c->result.latency_us = now - c->connect_at;
+    int len = c->result.received < (int) sizeof(c->head) ? c->result.received : (int) sizeof(c->head) - 1;
+    c->head[len] = '\0';
+    if (len >= 12 && strncmp(c->head, "HTTP/1.", 7) == 0) {
+        c->result.status = atoi(c->head + 9);
+    }
+    // A response cut short, e.g. by shedIdleClient, still has its status
+    char *length = strstr(c->head, "Content-Length: ");
+    char *end = strstr(c->head, "\r\n\r\n");
+    if (length != NULL && end != NULL) {
+        c->result.complete = c->result.received >= end + 4 - c->head + atoi(length + 16);
+    }
+    int last = active[--num_active];
+    active[c->active] = last;
+    clients[last].active = c->active;
+    done++;
+}
+
+/* Write the next fragment of the request of c. */
+static void clientWrite(struct sim_client *c) {
+    int n = script.fragment > 0 ? script.fragment : request_len;
+    c->sent = c->sent + n < request_len ? c->sent + n : request_len;
+    c->next_write = now + (uint64_t) script.gap_ms * 1000;
+}
+
+/* Let every client and program do what is due by now. */
+static void advance(void) {
+    while (arrived < script.clients && clients[arrived].connect_at <= now) {
+        struct sim_client *c = &clients[arrived];
+        c->state = SIM_QUEUED;
+        c->active = num_active;
+        active[num_active++] = arrived;
+        arrived++;
+        clientWrite(c);
+    }
+    for (int k = 0; k < num_active; k++) {
+        struct sim_client *c = &clients[active[k]];
+        if (!c->stall && c->sent < request_len && c->next_write <= now) {
+            clientWrite(c);
+        }
+        if (c->in_flight > 0 && c->next_read <= now) {
+            uint64_t ms = (now - c->next_read) / 1000 + 1;
+            uint64_t n = ms * script.read_rate;
+            c->in_flight -= n < (uint64_t) c->in_flight ? (int) n : c->in_flight;
+            c->next_read = now + 1000;
+        }
+        if (c->closed && c->in_flight == 0) {
+            clientDone(c);
+            k--;        // the last one took its place
+        }
+    }
+    for (int k = 0; k < num_pending; k++) {
+        if (programs[pending[k]].ready_at <= now) {
+            pending[k--] = pending[--num_pending];
+        }
+    }
+}
+
+/* When the next thing happens, or UINT64_MAX if nothing will. */
+static uint64_t nextEvent(void) {
+    uint64_t next = UINT64_MAX;
+    if (arrived < script.clients) {
+        next = clients[arrived].connect_at;
+    }
+    for (int k = 0; k < num_active; k++) {
+        struct sim_client *c = &clients[active[k]];
+        if (!c->stall && c->sent < request_len && c->next_write < next) {
+            next = c->next_write;
+        }
+        if (c->in_flight > 0 && c->next_read < next) {
+            next = c->next_read;
+        }
+    }
+    for (int k = 0; k < num_pending; k++) {
+        if (programs[pending[k]].ready_at < next) {
+            next = programs[pending[k]].ready_at;
+        }
+    }
+    return next;
+}
+
+static int readyEvents(int fd) {
+    struct end *e = endOf(fd);
+    if (e == NULL) {
+        return 0;
+    }
+    switch (e->kind) {
+    case END_LISTEN:
+        return accepted < arrived ? POLLIN : 0;
+    case END_CONN: {
+        struct sim_client *c = &clients[e->index];
+        return (c->sent > c->consumed ? POLLIN : 0) |
+            (c->in_flight < script.window ? POLLOUT : 0);
+    }
+    case END_PIPE: {
+        struct sim_program *p = &programs[e->index];
+        return p->killed || p->ready_at <= now ? POLLIN : 0;
+    }
+    }
+    return 0;
+}
+
+static int countReady(struct pollfd *fds, nfds_t nfds) {
+    int n = 0;
+    for (nfds_t i = 0; i < nfds; i++) {
+        fds[i].revents = fds[i].fd < 0 ? 0 : readyEvents(fds[i].fd) & fds[i].events;
+        n += fds[i].revents != 0;
+    }
+    return n;
+}
+
+static uint64_t loopClock(void) {
+    return now;
+}
+
+static int loopPoll(struct pollfd *fds, nfds_t nfds, int timeout_ms) {
+    polls++;
+    uint64_t until = timeout_ms < 0 ? UINT64_MAX : now + (uint64_t) timeout_ms * 1000;
+    for (;;) {
+        advance();
+        int n = countReady(fds, nfds);
+        if (n > 0 || now >= until) {
+            return n;
+        }
+        if (done == script.clients) {
+            errno = ESHUTDOWN;
+            return -1;
+        }
+        uint64_t next = nextEvent();
+        if (next == UINT64_MAX && until == UINT64_MAX) {
+            fprintf(stderr, "loopback: stalled with %d clients left\n",
+                    script.clients - done);
+            errno = ESHUTDOWN;
+            return -1;
+        }
+        if (next < until) {
+            // Round up to the next tick
+            uint64_t tick = script.tick_us > 0 ? script.tick_us : 1;
+            now = (next + tick - 1) / tick * tick;
+        } else {
+            now = until;
+        }
+    }
+}
+
+static int loopAccept(int listenfd, struct sockaddr *sa, socklen_t *len) {
+    (void) listenfd;
+    if (accepted == arrived) {
+        errno = EAGAIN;
+        return -1;
+    }
+    int i = accepted++;
+    clients[i].state = SIM_OPEN;
+    if (sa != NULL && *len >= sizeof(struct sockaddr_in)) {
+        // 10.0.0.0/8, and the addresses repeat when the script says so
+        struct sockaddr_in *peer = (struct sockaddr_in *) sa;
+        memset(peer, 0, sizeof(*peer));
+        peer->sin_family = AF_INET;
+        peer->sin_addr.s_addr = htonl(0x0a000000 + 1 + i % script.addresses);
+        peer->sin_port = htons(1024 + i % 60000);
+        *len = sizeof(*peer);
+    }
+    return newEnd(END_CONN, i);
+}
+
+static ssize_t loopRead(int fd, void *buf, size_t len) {
+    struct end *e = endOf(fd);
+    if (e == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    if (e->kind == END_CONN) {
+        struct sim_client *c = &clients[e->index];
+        size_t n = c->sent - c->consumed;
+        if (n == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        n = n < len ? n : len;
+        memcpy(buf, script.request + c->consumed, n);
+        c->consumed += n;
+        return n;
+    }
+    if (e->kind == END_PIPE) {
+        struct sim_program *p = &programs[e->index];
+        if (p->killed) {
+            return 0;
+        }
+        if (p->ready_at > now) {
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t n = p->total - p->consumed;
+        n = n < len ? n : len;
+        n = n < LOOP_PIPE_BUF ? n : LOOP_PIPE_BUF;
+        // The head of a CGI response, then filler
+        char *out = buf;
+        size_t head = sizeof(cgi_head) - 1;
+        size_t k = 0;
+        for (; k < n && p->consumed + k < head; k++) {
+            out[k] = cgi_head[p->consumed + k];
+        }
+        memset(out + k, 'x', n - k);
+        p->consumed += n;
+        return n;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static ssize_t loopWritev(int fd, const struct iovec *iov, int iovcnt) {
+    struct end *e = endOf(fd);
+    if (e == NULL || e->kind != END_CONN) {
+        errno = EBADF;
+        return -1;
+    }
+    struct sim_client *c = &clients[e->index];
+    size_t room = script.window - c->in_flight;
+    if (room == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = 0;
+    for (int i = 0; i < iovcnt && n < room; i++) {
+        size_t len = iov[i].iov_len < room - n ? iov[i].iov_len : room - n;
+        // Keep the header, or what fits of it
+        for (size_t k = 0; k < len && c->result.received + n + k < sizeof(c->head) - 1; k++) {
+            c->head[c->result.received + n + k] = ((char *) iov[i].iov_base)[k];
+        }
+        n += len;
+    }
+    c->result.received += n;
+    if (script.read_rate > 0) {
+        if (c->in_flight == 0) {
+            c->next_read = now + 1000;
+        }
+        c->in_flight += n;
+    }
+    return n;
+}
+
+static ssize_t loopSend(int fd, const struct iovec *iov, int iovcnt, int flags) {
+    (void) flags;
+    return loopWritev(fd, iov, iovcnt);
+}
+
+/* The file is a real one (a spill file of CGI output); what is read from
+ * it goes to the client as by loopWritev.  The buffer is static because
+ * the caller may be on a small coroutine stack.
+ */
+static ssize_t loopSendfile(int fd, int file_fd, off_t *offset, size_t count) {
+    static char buf[LOOP_PIPE_BUF];
+    ssize_t n = pread(file_fd, buf, count < sizeof(buf) ? count : sizeof(buf), *offset);
+    if (n <= 0) {
+        return n;
+    }
+    struct iovec iov = {buf, n};
+    n = loopWritev(fd, &iov, 1);
+    if (n > 0) {
+        *offset += n;
+    }
+    return n;
+}
+
+static int loopClose(int fd) {
+    struct end *e = endOf(fd);
+    if (e == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    if (e->kind == END_CONN) {
+        clients[e->index].closed = 1;
+    }
+    e->kind = END_FREE;
+    free_ends[num_free++] = fd - LOOP_FD_BASE;
+    return 0;
+}
+
+static int loopSetsockopt(int fd, int level, int name, const void *val, socklen_t len) {
+    (void) level;
+    (void) name;
+    (void) val;
+    (void) len;
+    if (endOf(fd) == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+/* Start a program that writes the head of a CGI response and the body of
+ * the script.  Every path is the same program, and it takes no input:
+ * scripted clients send no request bodies.
+ */
+static int loopSpawn(const char *path, char *const env[], int *fd, int *in_fd) {
+    (void) path;
+    (void) env;
+    if (in_fd != NULL) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (num_programs == cap_programs) {
+        cap_programs = cap_programs ? cap_programs * 2 : 64;
+        programs = realloc(programs, cap_programs * sizeof(*programs));
+        pending = realloc(pending, cap_programs * sizeof(*pending));
+    }
+    int i = num_programs++;
+    struct sim_program *p = &programs[i];
+    p->ready_at = now + jitter((uint64_t) script.cgi_ms * 1000);
+    p->total = sizeof(cgi_head) - 1 + script.body;
+    p->consumed = 0;
+    p->killed = 0;
+    pending[num_pending++] = i;
+    *fd = newEnd(END_PIPE, i);
+    return i + 1;
+}
+
+static int loopStop(int pid) {
+    programs[pid - 1].killed = 1;
+    return 0;
+}
+
+static int loopReap(int pid, int *status) {
+    *status = programs[pid - 1].killed ? SIGKILL : 0;
+    return pid;
+}
+
+const struct transport loopback_transport = {
+    "loopback",
+    loopClock,
+    loopAccept,
+    loopRead,
+    loopWritev,
+    loopSend,
+    loopSendfile,
+    loopClose,
+    loopPoll,
+    loopSetsockopt,
+    loopSpawn,
+    loopStop,
+    loopReap
+};
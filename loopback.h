@@ -0,0 +1,41 @@
+#include <stdint.h>
+
+/* In-memory transport with scripted clients and a virtual clock; see
+ * loopback.c
+ */
+#define LOOP_FD_BASE (1 << 20)  /* first descriptor, above any real one */
+#define LOOP_PIPE_BUF 65536     /* CGI output readable at once, as a pipe */
+#define LOOP_CLOCK_START 1000000 /* us; nowUsec is never 0 */
+
+/* What every simulated client does */
+struct loopback_script {
+    int clients;            /* connections, one request each */
+    int arrival_us;         /* between two connections, on average */
+    const char *request;    /* what each client sends */
+    int fragment;           /* bytes per write of the request, 0 for one */
+    int gap_ms;             /* between two writes */
+    int stall_percent;      /* clients that stop after their first write */
+    int read_rate;          /* bytes per ms a client reads, 0 for no limit */
+    int window;             /* response bytes in flight before writes block */
+    int body;               /* bytes of output of a CGI program */
+    int cgi_ms;             /* time before a program writes, on average */
+    int addresses;          /* distinct client addresses */
+    int tick_us;            /* resolution of the clock, 0 for 1us */
+    uint32_t seed;          /* of the jitter of arrivals and programs */
+};
+
+/* The outcome of a client */
+struct loopback_client {
+    int status;             /* of its response, 0 if it got none */
+    int received;           /* response bytes */
+    int complete;           /* all of Content-Length arrived */
+    uint64_t latency_us;    /* connect -> response read and closed */
+};
+
+extern const struct transport loopback_transport;
+
+int loopbackInit(const struct loopback_script *script);
+int loopbackListen(void);
+const struct loopback_client *loopbackResult(int i);
+uint64_t loopbackPolls(void);
+uint64_t loopbackElapsed(void);
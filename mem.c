@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "mem.h"
+
+/* Accounting of the memory held for connections against one budget
+ * (wserver -M).
+ *
+ * Every buffer whose size a client can influence is charged to the
+ * subsystem that holds it when it is allocated or grown, and released
+ * when it is freed.  Allocations that can wait ask first with memTry,
+ * which refuses to go over the budget; those that cannot (a connection
+ * that is already accepted needs its state) are charged with memAdd,
+ * which always succeeds.  What the server does when memTry says no is up
+ * to the caller:
+ *
+ *   - CGI output buffers stop growing: the pipe is not read until memory
+ *     is released, and the program blocks on its next write
+ *     (resumedClient, and h2.c for its streams).
+ *   - no new CGI program starts above MEM_REFUSE_PERCENT of the budget;
+ *     the request gets a 503 (memShort).  The rest is headroom for the
+ *     output of those already running.
+ *   - the largest connection that is idle, still sending its request or
+ *     not reading its response, is ended (shedIdleClient).
+ *
+ * Current and peak use per subsystem are on the metrics page.
+ */
+
+static int64_t budget = MEM_BUDGET_DEFAULT;
+static _Atomic int64_t used[NUM_MEM];
+static _Atomic int64_t peak[NUM_MEM];
+static _Atomic int64_t total;
+static _Atomic int64_t total_peak;
+
+static const char *names[NUM_MEM] = {
+    "request", "cgi", "h2", "tls", "proxy", "compress"
+};
+
+/* Set the budget, in bytes. */
+void memInit(int64_t bytes) {
+    budget = bytes;
+}
+
+static void raisePeak(_Atomic int64_t *p, int64_t v) {
+    int64_t old = atomic_load_explicit(p, memory_order_relaxed);
+    while (v > old && !atomic_compare_exchange_weak_explicit(p, &old, v,
+                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/* Charge bytes (negative to release them) to sub, budget or not. */
+void memAdd(int sub, int64_t bytes) {
+    int64_t now = atomic_fetch_add_explicit(&used[sub], bytes, memory_order_relaxed) + bytes;
+    int64_t sum = atomic_fetch_add_explicit(&total, bytes, memory_order_relaxed) + bytes;
+    if (bytes > 0) {
+        raisePeak(&peak[sub], now);
+        raisePeak(&total_peak, sum);
+    }
+}
+
+/* Charge bytes to sub if that stays within the budget.  Return 0, or -1
+ * if nothing was charged.
+ */
+int memTry(int sub, int64_t bytes) {
+    if (atomic_load_explicit(&total, memory_order_relaxed) + bytes > budget) {
+        return -1;
+    }
+    memAdd(sub, bytes);
+    return 0;
+}
+
+/* Return 1 if bytes more would take us past MEM_REFUSE_PERCENT of the
+ * budget, so that nothing new should be started.
+ */
+int memShort(int64_t bytes) {
+    return (atomic_load_explicit(&total, memory_order_relaxed) + bytes) * 100 >
+            budget * MEM_REFUSE_PERCENT;
+}
+
+#define APPEND(...) do { \
+        if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+/* Render the budget and the use of each subsystem into buf, in the format
+ * of statsRender.  Return the length of the text, truncated to size - 1.
+ */
+int memRender(char *buf, int size) {
+    int len = 0;
+    APPEND("# TYPE wserver_memory_budget_bytes gauge\n"
+            "wserver_memory_budget_bytes %lld\n", (long long) budget);
+    APPEND("# TYPE wserver_memory_bytes gauge\n");
+    for (int i = 0; i < NUM_MEM; i++) {
+        APPEND("wserver_memory_bytes{subsystem=\"%s\"} %lld\n", names[i],
+                (long long) atomic_load(&used[i]));
+    }
+    APPEND("wserver_memory_bytes{subsystem=\"total\"} %lld\n",
+            (long long) atomic_load(&total));
+    APPEND("# TYPE wserver_memory_peak_bytes gauge\n");
+    for (int i = 0; i < NUM_MEM; i++) {
+        APPEND("wserver_memory_peak_bytes{subsystem=\"%s\"} %lld\n", names[i],
+                (long long) atomic_load(&peak[i]));
+    }
+    APPEND("wserver_memory_peak_bytes{subsystem=\"total\"} %lld\n",
+            (long long) atomic_load(&total_peak));
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,23 @@
+#include <stdint.h>
+
+/* Global memory budget for connection buffers; see mem.c */
+#define MEM_BUDGET_DEFAULT (256 << 20)  /* default -M, in bytes */
+#define MEM_REFUSE_PERCENT 90           /* of the budget: no new CGI above this */
+#define MEM_RETRY_MS 10                 /* paused HTTP/2 streams look again */
+
+/* What the memory is used for */
+enum mem_subsystem {
+    MEM_REQUEST,        /* HTTP/1 request headers being read */
+    MEM_CGI,            /* CGI output of HTTP/1 requests */
+    MEM_H2,             /* HTTP/2 connections and their streams' output */
+    MEM_TLS,            /* TLS handshakes and relays */
+    MEM_PROXY,          /* requests to upstreams */
+    MEM_COMPRESS,       /* cached compressed bodies */
+    NUM_MEM
+};
+
+void memInit(int64_t budget);
+int memTry(int sub, int64_t bytes);
+void memAdd(int sub, int64_t bytes);
+int memShort(int64_t bytes);
+int memRender(char *buf, int size);
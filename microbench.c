@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ws_helpers.h"
+#include "cgi.h"
+#include "ratelimit.h"
+#include "coro.h"
+
+/* Microbenchmarks for the functions that run on every request.
+ *
+ * Usage: microbench [-f filter] [-w baseline] [-c baseline] [-t percent]
+ *   -f  only run benchmarks whose name contains filter
+ *   -w  write the results to baseline
+ *   -c  compare against baseline and exit with status 1 if any benchmark
+ *       is more than percent (default 10) slower
+ *
+ * Each benchmark is timed over several rounds and the fastest round is
+ * reported, which filters out most scheduler noise.  Allocations are
+ * counted by wrapping malloc/calloc/realloc at link time (see Makefile).
+ */
+
+#define ROUNDS 7
+#define ROUND_NS 50000000       /* aim for 50ms per round */
+
+/* Allocation counting, via -Wl,--wrap=malloc etc. */
+static uint64_t n_allocs;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    n_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    n_allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    n_allocs++;
+    return __real_realloc(p, size);
+}
+
+static uint64_t nowNsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Request corpus.  Requests are split into the chunks a read() on the
+ * socket might return; chunk 0 means "all at once".
+ */
+struct sample {
+    const char *name;
+    const char *text;
+    int chunk;
+};
+
+static char long_query[1200];
+static char many_headers[4096];
+
+static struct sample corpus[] = {
+    {"minimal", "GET /simple HTTP/1.1\r\n\r\n", 0},
+    {"curl", "GET /simple?name=bench&x=1 HTTP/1.1\r\nHost: localhost:8080\r\n"
+        "User-Agent: curl/8.4.0\r\nAccept: */*\r\n\r\n", 0},
+    {"browser", "GET /large?id=42&lang=en HTTP/1.1\r\nHost: example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 "
+        "Firefox/120.0\r\nAccept: text/html,application/xhtml+xml,application/"
+        "xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\nAccept-Language: en-US,"
+        "en;q=0.5\r\nAccept-Encoding: gzip, deflate, br\r\nConnection: "
+        "keep-alive\r\nUpgrade-Insecure-Requests: 1\r\nSec-Fetch-Dest: "
+        "document\r\nSec-Fetch-Mode: navigate\r\nSec-Fetch-Site: none\r\n\r\n", 0},
+    {"browser-frag16", NULL, 16},       /* text filled from "browser" */
+    {"curl-frag1", NULL, 1},            /* text filled from "curl" */
+    {"long-query", long_query, 0},
+    {"many-headers", many_headers, 0},
+    {"many-headers-frag512", many_headers, 512},
+    {"bad-method", "POST /simple HTTP/1.1\r\nContent-Length: 0\r\n\r\n", 0},
+    {"bad-resource", "GET /../../etc/passwd HTTP/1.1\r\n\r\n", 0},
+};
+#define CORPUS_SIZE ((int) (sizeof(corpus) / sizeof(corpus[0])))
+
+static void buildCorpus(void) {
+    corpus[3].text = corpus[2].text;
+    corpus[4].text = corpus[1].text;
+
+    int n = snprintf(long_query, sizeof(long_query), "GET /simple?");
+    for (int i = 0; n < 900; i++) {
+        n += snprintf(long_query + n, sizeof(long_query) - n,
+                "%sfield%d=value%d", i ? "&" : "", i, i * 7);
+    }
+    snprintf(long_query + n, sizeof(long_query) - n,
+            " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+
+    n = snprintf(many_headers, sizeof(many_headers),
+            "GET /simple?a=1 HTTP/1.1\r\nHost: localhost\r\n");
+    for (int i = 0; i < 64; i++) {
+        n += snprintf(many_headers + n, sizeof(many_headers) - n,
+                "X-Custom-Header-%d: some-moderately-long-value-%d\r\n", i, i);
+    }
+    snprintf(many_headers + n, sizeof(many_headers) - n, "\r\n");
+}
+
+/* A benchmark runs `iters` operations on one corpus entry and returns the
+ * number of input bytes it processed.
+ */
+typedef size_t (*bench_fn)(const struct sample *s, int iters);
+
+static size_t benchHandleClient(const struct sample *s, int iters) {
+    struct clientstate cs;
+    char line[MAXLINE + 1];
+    size_t len = strlen(s->text);
+    int chunk = s->chunk ? s->chunk : MAXLINE;
+    initClients(&cs, 1);
+    for (int i = 0; i < iters; i++) {
+        cs.sock = 0;
+        for (size_t off = 0; off < len; off += chunk) {
+            size_t n = len - off < (size_t) chunk ? len - off : (size_t) chunk;
+            memcpy(line, s->text + off, n);
+            line[n] = '\0';
+            if (handleClient(&cs, line) != 0) {
+                break;
+            }
+        }
+        resetClient(&cs);
+    }
+    return len * iters;
+}
+
+static size_t benchParse(const struct sample *s, int iters) {
+    struct clientstate cs;
+    initClients(&cs, 1);
+    for (int i = 0; i < iters; i++) {
+        cs.request = (char *) s->text;
+        parse_http_request(&cs);
+        cs.request = NULL;          /* not ours to free */
+        resetClient(&cs);
+    }
+    return strlen(s->text) * iters;
+}
+
+static size_t benchGetPathQuery(const struct sample *s, int iters) {
+    char first[MAXLINE];
+    size_t n = strcspn(s->text, "\r");
+    if (n >= sizeof(first)) {
+        n = sizeof(first) - 1;
+    }
+    memcpy(first, s->text, n);
+    first[n] = '\0';
+    for (int i = 0; i < iters; i++) {
+        char *path = getPath(first);
+        char *query = getQuery(first);
+        free(path);
+        free(query);
+    }
+    return n * iters;
+}
+
+static size_t benchValidResource(const struct sample *s, int iters) {
+    static char *paths[] = {"simple", "large", "slowcgi", "term", "notvalid",
+        "simplex", "", "../simple"};
+    int npaths = sizeof(paths) / sizeof(paths[0]);
+    size_t bytes = 0;
+    for (int i = 0; i < iters; i++) {
+        char *p = paths[i % npaths];
+        validResource(p);
+        bytes += strlen(p);
+    }
+    return bytes;
+}
+
+/* What acceptClient and requestDone add to every connection with limits
+ * on: a client that is admitted, then released.  Clients come from a
+ * /22 so most lookups hit an entry that is already there.
+ */
+static size_t benchRateLimit(const struct sample *s, int iters) {
+    static int initialized;
+    if (!initialized) {
+        rateInit(1000000, 1000000, 64);
+        initialized = 1;
+    }
+    for (int i = 0; i < iters; i++) {
+        uint32_t addr = htonl(0x0a000000 | (i & 1023));
+        rateAdmit(addr);
+        rateRelease(addr);
+    }
+    return sizeof(uint32_t) * iters;
+}
+
+static void yieldForever(void *arg) {
+    (void) arg;
+    for (;;) {
+        coroYield();
+    }
+}
+
+/* A switch into a coroutine and back, as the coroutine loop does for
+ * every wait of a connection.  The stack comes from the pool, so there is
+ * no allocation.
+ */
+static size_t benchCoroSwitch(const struct sample *s, int iters) {
+    static struct coro *co;
+    (void) s;
+    if (co == NULL) {
+        co = coroNew(yieldForever, NULL);
+    }
+    for (int i = 0; i < iters; i++) {
+        coroResume(co);
+    }
+    return 0;
+}
+
+/* Query strings for the cgi.c benchmarks; only entries with a query. */
+static const char *sampleQuery(const struct sample *s) {
+    const char *q = strchr(s->text, '?');
+    return q != NULL && q < strchr(s->text, '\r') ? q + 1 : NULL;
+}
+
+static size_t benchParseQuery(const struct sample *s, int iters) {
+    const char *q = sampleQuery(s);
+    char buf[MAXLINE];
+    size_t n = strcspn(q, " ");
+    memcpy(buf, q, n);
+    buf[n] = '\0';
+    char copy[MAXLINE];
+    for (int i = 0; i < iters; i++) {
+        memcpy(copy, buf, n + 1);
+        Fdata *f = parse_query(copy);
+        fdata_free(f);
+    }
+    return n * iters;
+}
+
+static size_t benchFdata2html(const struct sample *s, int iters) {
+    const char *q = sampleQuery(s);
+    char buf[MAXLINE];
+    size_t n = strcspn(q, " ");
+    memcpy(buf, q, n);
+    buf[n] = '\0';
+    Fdata *f = parse_query(buf);
+    for (int i = 0; i < iters; i++) {
+        free(fdata2html(f));
+    }
+    fdata_free(f);
+    return n * iters;
+}
+
+struct bench {
+    const char *name;
+    bench_fn fn;
+    int needs_query;
+    int whole_only;         /* fragmentation does not apply */
+};
+
+static struct bench benches[] = {
+    {"handleClient", benchHandleClient, 0, 0},
+    {"parse_http_request", benchParse, 0, 1},
+    {"getPath+getQuery", benchGetPathQuery, 0, 1},
+    {"validResource", benchValidResource, 0, 1},
+    {"rateAdmit+rateRelease", benchRateLimit, 0, 1},
+    {"coroResume+coroYield", benchCoroSwitch, 0, 1},
+    {"parse_query", benchParseQuery, 1, 1},
+    {"fdata2html", benchFdata2html, 1, 1},
+};
+#define NUM_BENCHES ((int) (sizeof(benches) / sizeof(benches[0])))
+
+struct result {
+    char name[96];
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_cycle;
+};
+
+static struct result results[NUM_BENCHES * CORPUS_SIZE];
+static int num_results;
+
+static void run(const struct bench *b, const struct sample *s) {
+    struct result *r = &results[num_results++];
+    snprintf(r->name, sizeof(r->name), "%s/%s", b->name, s->name);
+
+    /* calibrate */
+    int iters = 1;
+    for (;;) {
+        uint64_t t = nowNsec();
+        b->fn(s, iters);
+        t = nowNsec() - t;
+        if (t > ROUND_NS / 10 || iters > (1 << 26)) {
+            iters = (int) ((double) iters * ROUND_NS / (t ? t : 1)) + 1;
+            break;
+        }
+        iters *= 4;
+    }
+
+    double best_ns = 1e300, best_cyc = 0;
+    uint64_t allocs = 0;
+    size_t bytes = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        uint64_t a = n_allocs;
+        uint64_t c = cycles();
+        uint64_t t = nowNsec();
+        bytes = b->fn(s, iters);
+        t = nowNsec() - t;
+        c = cycles() - c;
+        allocs = n_allocs - a;
+        if (t < best_ns) {
+            best_ns = t;
+            best_cyc = c;
+        }
+    }
+    r->ns_per_op = best_ns / iters;
+    r->allocs_per_op = (double) allocs / iters;
+    r->bytes_per_cycle = best_cyc > 0 ? bytes / best_cyc : 0;
+    printf("%-44s %10.1f ns/op %6.2f allocs/op %7.3f bytes/cycle\n",
+            r->name, r->ns_per_op, r->allocs_per_op, r->bytes_per_cycle);
+}
+
+static int writeBaseline(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    for (int i = 0; i < num_results; i++) {
+        fprintf(f, "%s %.2f\n", results[i].name, results[i].ns_per_op);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Return the number of benchmarks more than threshold percent slower than
+ * the baseline in filename, or -1 if it cannot be read.
+ */
+static int checkBaseline(const char *filename, double threshold) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    char name[96];
+    double base;
+    int regressions = 0;
+    while (fscanf(f, "%95s %lf", name, &base) == 2) {
+        for (int i = 0; i < num_results; i++) {
+            if (strcmp(results[i].name, name) != 0) {
+                continue;
+            }
+            double change = (results[i].ns_per_op - base) / base * 100;
+            if (change > threshold) {
+                printf("REGRESSION %s: %.1f -> %.1f ns/op (%+.1f%%)\n",
+                        name, base, results[i].ns_per_op, change);
+                regressions++;
+            }
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    const char *filter = NULL, *write_file = NULL, *check_file = NULL;
+    double threshold = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:w:c:t:")) != -1) {
+        switch (opt) {
+        case 'f': filter = optarg; break;
+        case 'w': write_file = optarg; break;
+        case 'c': check_file = optarg; break;
+        case 't': threshold = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: microbench [-f filter] [-w baseline] "
+                    "[-c baseline] [-t percent]\n");
+            exit(1);
+        }
+    }
+    buildCorpus();
+
+    for (int b = 0; b < NUM_BENCHES; b++) {
+        for (int s = 0; s < CORPUS_SIZE; s++) {
+            const struct sample *sm = &corpus[s];
+            char name[96];
+            snprintf(name, sizeof(name), "%s/%s", benches[b].name, sm->name);
+            if (filter != NULL && strstr(name, filter) == NULL) {
+                continue;
+            }
+            if (benches[b].whole_only && sm->chunk != 0) {
+                continue;
+            }
+            if (benches[b].needs_query && sampleQuery(sm) == NULL) {
+                continue;
+            }
+            /* validResource, the rate limiter and the coroutine switch do
+             * not depend on the request */
+            if (benches[b].fn == benchValidResource || benches[b].fn == benchRateLimit ||
+                    benches[b].fn == benchCoroSwitch) {
+                static const struct sample mixed = {"mixed", "", 0};
+                if (s == 0) {
+                    run(&benches[b], &mixed);
+                }
+                continue;
+            }
+            run(&benches[b], sm);
+        }
+    }
+
+    if (write_file != NULL && writeBaseline(write_file) == -1) {
+        return 1;
+    }
+    if (check_file != NULL) {
+        int regressions = checkBaseline(check_file, threshold);
+        if (regressions != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "pack.h"
+
+/* mkpack: build a content pack for wserver -p (see pack.c).
+ *
+ * Each spec is target=source, split at the last '=': the request target
+ * (path and query string) the entry answers, and either a file, whose
+ * Content-Type goes by its extension, or !program, a CGI program that is
+ * run here once, with the query string of the target, and whose output
+ * is stored as the server would send it.  The pack is written next to
+ * output and renamed over it once complete, so a server can be told to
+ * reload (SIGHUP) at any time.
+ */
+
+#define MAX_HEAD 4096           /* headers of one response */
+#define DATA_ALIGN 8
+
+struct spec {
+    char *key;
+    const char *source;
+};
+
+static int fd;
+static uint64_t data_end;       /* where the next piece of data goes */
+static char tmp[PATH_MAX];      /* the pack being written */
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mkpack [-z level] output target=file|target=!program...\n"
+            "  e.g. mkpack site.pack /index.html=index.html '/simple?filenum=2=!simple'\n"
+            "  -z  gzip level of the compressed variants (default 9, 0 for none)\n");
+    exit(1);
+}
+
+static void die(const char *what, const char *detail) {
+    fprintf(stderr, "mkpack: %s: %s\n", what, detail);
+    if (tmp[0] != '\0') {
+        unlink(tmp);
+    }
+    exit(1);
+}
+
+/* Append len bytes to the data of the pack.  Return their offset. */
+static uint64_t putData(const void *data, size_t len) {
+    uint64_t off = data_end;
+    const char *p = data;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, p + done, len - done, off + done);
+        if (n < 0) {
+            die("write", strerror(errno));
+        }
+        done += n;
+    }
+    data_end = (off + len + DATA_ALIGN - 1) & ~(uint64_t) (DATA_ALIGN - 1);
+    return off;
+}
+
+static char *readAll(int in, size_t *len) {
+    size_t cap = 65536;
+    char *buf = malloc(cap);
+    *len = 0;
+    for (;;) {
+        if (*len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        ssize_t n = read(in, buf + *len, cap - *len);
+        if (n < 0) {
+            die("read", strerror(errno));
+        }
+        if (n == 0) {
+            return buf;
+        }
+        *len += n;
+    }
+}
+
+static const char *contentType(const char *file) {
+    static const char *types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"},
+        {".js", "text/javascript"}, {".json", "application/json"},
+        {".txt", "text/plain"}, {".xml", "application/xml"},
+        {".svg", "image/svg+xml"}, {".png", "image/png"},
+        {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"}, {".gif", "image/gif"},
+        {".ico", "image/x-icon"}, {".webp", "image/webp"}, {".wasm", "application/wasm"},
+    };
+    const char *ext = strrchr(file, '.');
+    for (size_t i = 0; ext != NULL && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcasecmp(ext, types[i][0]) == 0) {
+            return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* Run the CGI program with the query string of key, as wserver would, and
+ * return its output.
+ */
+static char *runProgram(const char *program, const char *key, size_t *len) {
+    int out[2];
+    if (pipe(out) == -1) {
+        die("pipe", strerror(errno));
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        die("fork", strerror(errno));
+    }
+    if (pid == 0) {
+        const char *query = strchr(key, '?');
+        setenv("QUERY_STRING", query != NULL ? query + 1 : "", 1);
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", strchr(program, '/') ? "" : "./", program);
+        execl(path, program, (char *) NULL);
+        perror(path);
+        _exit(100);
+    }
+    close(out[1]);
+    char *output = readAll(out[0], len);
+    close(out[0]);
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || status != 0) {
+        die(program, "failed");
+    }
+    return output;
+}
+
+/* Turn the CGI header block at the start of output into the header lines
+ * of a response in head, less Content-Length, and its Status header, if
+ * there is one, into the status line in status_line (64 bytes).  Return
+ * the offset of the body.
+ */
+static size_t cgiHeaders(const char *output, size_t len, const char *program,
+        char *head, int *head_len, char *status_line) {
+    *head_len = 0;
+    const char *line = output;
+    const char *end = output + len;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        int n = eol - line;
+        if (n > 0 && line[n - 1] == '\r') {
+            n--;
+        }
+        if (n == 0) {
+            return eol + 1 - output;
+        }
+        if (strncasecmp(line, "Status:", 7) == 0) {
+            const char *text = line + 7;
+            while (text < line + n && *text == ' ') {
+                text++;
+            }
+            snprintf(status_line, 64, "HTTP/1.1 %.*s", (int) (line + n - text), text);
+        } else if (strncasecmp(line, "Content-Length:", 15) != 0) {
+            if (*head_len + n + 2 > MAX_HEAD / 2) {
+                die(program, "headers too long");
+            }
+            memcpy(head + *head_len, line, n);
+            memcpy(head + *head_len + n, "\r\n", 2);
+            *head_len += n + 2;
+        }
+        line = eol + 1;
+    }
+    die(program, "no CGI header block in its output");
+    return 0;
+}
+
+/* Return the gzip of the len bytes at body in *zlen, or NULL if it is
+ * not smaller.
+ */
+static char *gzip(const char *body, size_t len, int level, size_t *zlen) {
+    if (level == 0 || len == 0) {
+        return NULL;
+    }
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        die("zlib", "deflateInit2 failed");
+    }
+    size_t cap = deflateBound(&z, len);
+    char *out = malloc(cap);
+    z.next_in = (Bytef *) body;
+    z.avail_in = len;
+    z.next_out = (Bytef *) out;
+    z.avail_out = cap;
+    int rc = deflate(&z, Z_FINISH);
+    *zlen = z.total_out;
+    deflateEnd(&z);
+    if (rc != Z_STREAM_END || *zlen >= len) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static void putVariant(struct pack_body *b, const char *status_line,
+        const char *headers, int headers_len, const char *extra,
+        const char *etag, const char *body, size_t len) {
+    char head[MAX_HEAD];
+    int n = snprintf(head, sizeof(head), "%s\r\n%.*s%sContent-Length: %zu\r\n"
+            "ETag: %s\r\nConnection: close\r\n\r\n",
+            status_line, headers_len, headers, extra, len, etag);
+    b->head_off = putData(head, n);
+    b->head_len = n;
+    b->body_off = putData(body, len);
+    b->body_len = len;
+}
+
+/* Add the entry for spec to the pack as entry e. */
+static void addEntry(const struct spec *spec, int level, struct pack_entry *e) {
+    size_t len;
+    char *output;
+    if (spec->source[0] == '!') {
+        output = runProgram(spec->source + 1, spec->key, &len);
+    } else {
+        int in = open(spec->source, O_RDONLY);
+        if (in == -1) {
+            die(spec->source, strerror(errno));
+        }
+        output = readAll(in, &len);
+        close(in);
+    }
+
+    char headers[MAX_HEAD];
+    int headers_len;
+    char status_line[64] = "HTTP/1.1 200 OK";
+    size_t body_off = 0;
+    if (spec->source[0] == '!') {
+        body_off = cgiHeaders(output, len, spec->source + 1, headers, &headers_len,
+                status_line);
+    } else {
+        headers_len = snprintf(headers, sizeof(headers), "Content-Type: %s\r\n",
+                contentType(spec->source));
+    }
+    const char *body = output + body_off;
+    size_t body_len = len - body_off;
+    if (body_len > INT32_MAX) {
+        die(spec->source, "over 2GB");
+    }
+
+    uint64_t hash = PACK_HASH_INIT;
+    for (size_t i = 0; i < body_len; i++) {
+        hash = PACK_HASH_STEP(hash, body[i]);
+    }
+    char etag[24];
+    int etag_len = snprintf(etag, sizeof(etag), "W/\"%016llx\"", (unsigned long long) hash);
+
+    memset(e, 0, sizeof(*e));
+    e->key_len = strlen(spec->key);
+    e->key_off = putData(spec->key, e->key_len);
+    e->etag_len = etag_len;
+    e->etag_off = putData(etag, etag_len);
+    e->status = atoi(status_line + 9);
+    size_t zlen;
+    char *zbody = gzip(body, body_len, level, &zlen);
+    putVariant(&e->var[PACK_IDENTITY], status_line, headers, headers_len,
+            zbody != NULL ? "Vary: Accept-Encoding\r\n" : "", etag, body, body_len);
+    if (zbody != NULL) {
+        putVariant(&e->var[PACK_GZIP], status_line, headers, headers_len,
+                "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n", etag, zbody, zlen);
+    } else {
+        zlen = 0;
+    }
+    free(zbody);
+    printf("%-32s %10zu %10zu  %s\n", spec->key, body_len, zlen,
+            spec->source);
+    free(output);
+}
+
+int main(int argc, char **argv) {
+    int level = 9;
+    int opt;
+    while ((opt = getopt(argc, argv, "z:")) != -1) {
+        switch (opt) {
+        case 'z': level = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (argc - optind < 2 || level < 0 || level > 9) {
+        usage();
+    }
+    const char *output = argv[optind++];
+    int num = argc - optind;
+    struct spec *specs = calloc(num, sizeof(*specs));
+    for (int i = 0; i < num; i++) {
+        char *eq = strrchr(argv[optind + i], '=');
+        if (argv[optind + i][0] != '/' || eq == NULL || eq[1] == '\0') {
+            usage();
+        }
+        *eq = '\0';
+        specs[i].key = argv[optind + i];
+        specs[i].source = eq + 1;
+    }
+
+    struct pack_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PACK_MAGIC, sizeof(h.magic));
+    h.entries = num;
+    h.slots = 1;
+    while (h.slots < 2 * (uint32_t) num) {
+        h.slots *= 2;
+    }
+    h.slot_off = sizeof(h);
+    h.entry_off = h.slot_off + (uint64_t) h.slots * sizeof(struct pack_slot);
+    data_end = h.entry_off + (uint64_t) num * sizeof(struct pack_entry);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d", output, (int) getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        die(tmp, strerror(errno));
+    }
+    struct pack_slot *slots = calloc(h.slots, sizeof(*slots));
+    struct pack_entry *entries = calloc(num, sizeof(*entries));
+    printf("%-32s %10s %10s  %s\n", "target", "bytes", "gzip", "source");
+    for (int i = 0; i < num; i++) {
+        uint64_t hash = PACK_HASH_INIT;
+        for (const char *k = specs[i].key; *k != '\0'; k++) {
+            hash = PACK_HASH_STEP(hash, *k);
+        }
+        uint32_t s = hash & (h.slots - 1);
+        while (slots[s].entry != 0) {
+            if (strcmp(specs[slots[s].entry - 1].key, specs[i].key) == 0) {
+                die(specs[i].key, "listed twice");
+            }
+            s = (s + 1) & (h.slots - 1);
+        }
+        slots[s].hash = hash;
+        slots[s].entry = i + 1;
+        addEntry(&specs[i], level, &entries[i]);
+    }
+    off_t end = lseek(fd, 0, SEEK_END);
+    data_end = 0;
+    putData(&h, sizeof(h));
+    data_end = h.slot_off;
+    putData(slots, (size_t) h.slots * sizeof(*slots));
+    data_end = h.entry_off;
+    putData(entries, (size_t) num * sizeof(*entries));
+    if (fsync(fd) == -1 || close(fd) == -1) {
+        die(tmp, strerror(errno));
+    }
+    if (rename(tmp, output) == -1) {
+        die(output, strerror(errno));
+    }
+    printf("%d entries, %llu bytes in %s\n", num, (unsigned long long) end, output);
+    return 0;
+}
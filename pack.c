@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ws_helpers.h"
+#include "pack.h"
+#include "log.h"
+#include "stats.h"
+
+/* Content pack (wserver -p).
+ *
+ * Pages that only change at deploy time, files and prerendered CGI output
+ * alike, are packed by mkpack into one file: a hash table keyed by the
+ * request target, then for each entry its complete response headers (with
+ * Content-Length and ETag) and body, and a gzip variant when that is
+ * smaller.  The server maps the file and answers a request for an entry
+ * with one writev straight from the mapping: no open, stat or fork, and
+ * no copy of the body.
+ *
+ * Opening a pack only checks its header, so it costs the same whatever
+ * its size; the kernel pages in the index and the bodies as they are
+ * used and can drop them again under memory pressure, since they are
+ * clean pages of the file.
+ *
+ * On SIGHUP the file is mapped again and the new pack replaces the old
+ * one for the requests that follow.  Responses already laid out keep a
+ * reference to their pack, and the old mapping goes once the last of
+ * them is done.  Deploy with mkpack, which renames a complete pack into
+ * place, then send the signal.
+ */
+
+struct pack {
+    int refs;                   /* current, plus each client using it */
+    const char *base;
+    size_t size;
+    const struct pack_header *h;
+};
+
+static const char *pack_file;
+static struct pack *current;
+static volatile sig_atomic_t reload_wanted;
+
+static void onReloadSignal(int sig) {
+    (void) sig;
+    reload_wanted = 1;
+}
+
+/* Return 1 if the len bytes at off are in p. */
+static int inPack(const struct pack *p, uint64_t off, uint64_t len) {
+    return off <= p->size && len <= p->size - off;
+}
+
+/* Have the kernel start reading the len bytes at off of p. */
+static void prefetch(const struct pack *p, uint64_t off, uint64_t len) {
+    uint64_t start = off & ~(uint64_t) (sysconf(_SC_PAGESIZE) - 1);
+    madvise((char *) p->base + start, off + len - start, MADV_WILLNEED);
+}
+
+/* Map the pack in filename.  Return it with one reference, or NULL. */
+static struct pack *packMap(const char *filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(filename);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    if ((size_t) st.st_size < sizeof(struct pack_header)) {
+        fprintf(stderr, "%s: not a content pack\n", filename);
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    struct pack *p = malloc(sizeof(*p));
+    p->refs = 1;
+    p->base = base;
+    p->size = st.st_size;
+    p->h = base;
+    const struct pack_header *h = p->h;
+    if (memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) != 0 ||
+            h->slots == 0 || (h->slots & (h->slots - 1)) != 0 ||
+            h->slot_off % 8 != 0 || h->entry_off % 8 != 0 ||
+            !inPack(p, h->slot_off, (uint64_t) h->slots * sizeof(struct pack_slot)) ||
+            !inPack(p, h->entry_off, (uint64_t) h->entries * sizeof(struct pack_entry))) {
+        fprintf(stderr, "%s: not a content pack\n", filename);
+        packRelease(p);
+        return NULL;
+    }
+    // Only the index is read ahead; bodies come in as they are sent
+    prefetch(p, h->slot_off, (uint64_t) h->slots * sizeof(struct pack_slot));
+    prefetch(p, h->entry_off, (uint64_t) h->entries * sizeof(struct pack_entry));
+    return p;
+}
+
+void packRelease(struct pack *p) {
+    if (p == NULL || --p->refs > 0) {
+        return;
+    }
+    munmap((void *) p->base, p->size);
+    free(p);
+}
+
+/* Serve the pack in filename from now on, and map it again on SIGHUP.
+ * Return 0 on success and -1 on error.
+ */
+int packOpen(const char *filename) {
+    current = packMap(filename);
+    if (current == NULL) {
+        return -1;
+    }
+    pack_file = filename;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onReloadSignal;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+}
+
+/* Swap in the pack file as it is now, if it is a valid one. */
+static void packReload(void) {
+    reload_wanted = 0;
+    struct pack *p = packMap(pack_file);
+    if (p == NULL) {
+        LOG_WARN("keeping the content pack already loaded\n");
+        return;
+    }
+    packRelease(current);
+    current = p;
+    LOG_INFO("reloaded %s, %u entries\n", pack_file, p->h->entries);
+}
+
+static int entryValid(const struct pack *p, const struct pack_entry *e) {
+    if (!inPack(p, e->key_off, e->key_len) || !inPack(p, e->etag_off, e->etag_len)) {
+        return 0;
+    }
+    for (int v = 0; v < PACK_VARIANTS; v++) {
+        const struct pack_body *b = &e->var[v];
+        if (!inPack(p, b->head_off, b->head_len) || !inPack(p, b->body_off, b->body_len) ||
+                b->body_len > INT32_MAX) {
+            return 0;
+        }
+    }
+    return e->var[PACK_IDENTITY].head_len > 0;
+}
+
+/* Return the entry of p for the request target key, or NULL. */
+static const struct pack_entry *packFind(const struct pack *p, const char *key, int len) {
+    uint64_t hash = PACK_HASH_INIT;
+    for (int i = 0; i < len; i++) {
+        hash = PACK_HASH_STEP(hash, key[i]);
+    }
+    const struct pack_slot *slots = (const void *) (p->base + p->h->slot_off);
+    const struct pack_entry *entries = (const void *) (p->base + p->h->entry_off);
+    uint32_t mask = p->h->slots - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t probes = 0; probes < p->h->slots; probes++, i = (i + 1) & mask) {
+        const struct pack_slot *s = &slots[i];
+        if (s->entry == 0) {
+            return NULL;
+        }
+        if (s->hash != hash || s->entry > p->h->entries) {
+            continue;
+        }
+        const struct pack_entry *e = &entries[s->entry - 1];
+        if (entryValid(p, e) && e->key_len == (uint32_t) len &&
+                memcmp(p->base + e->key_off, key, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Return 1 if the If-None-Match header of request lists etag (or is *). */
+static int notModified(const char *request, const char *etag, int etag_len) {
+    const char *v = strcasestr(request, "\r\nIf-None-Match:");
+    if (v == NULL) {
+        return 0;
+    }
+    v += sizeof("\r\nIf-None-Match:") - 1;
+    int len = strcspn(v, "\r");
+    while (len > 0 && (*v == ' ' || *v == '\t')) {
+        v++;
+        len--;
+    }
+    if (len == 1 && *v == '*') {
+        return 1;
+    }
+    return memmem(v, len, etag, etag_len) != NULL;
+}
+
+/* If the complete request in cs (see handleClient) is a GET for an entry
+ * of the content pack, lay out its response in cs->out_iov as startOK
+ * would, set cs->path for the access log and return 1.  The body is the
+ * gzip variant if the client takes it, and the response is a 304 if the
+ * client has the entry already.  Return 0 if the pack has no such entry.
+ */
+int packRespond(struct clientstate *cs) {
+    if (reload_wanted) {
+        packReload();
+    }
+    if (current == NULL || strncmp(cs->request, "GET /", 5) != 0) {
+        return 0;
+    }
+    const char *key = cs->request + 4;
+    int key_len = strcspn(key, " \r");
+    const struct pack_entry *e = packFind(current, key, key_len);
+    if (e == NULL) {
+        return 0;
+    }
+    cs->pack = current;
+    current->refs++;
+    cs->path = strndup(key + 1, strcspn(key + 1, "? \r"));
+
+    const char *etag = current->base + e->etag_off;
+    if (e->etag_len > 0 && e->etag_len <= PACK_ETAG_MAX &&
+            notModified(cs->request, etag, e->etag_len)) {
+        int n = snprintf(cs->out_head, OK_HEAD_MAX, "HTTP/1.1 304 Not Modified\r\n"
+                "ETag: %.*s\r\nConnection: close\r\n\r\n", (int) e->etag_len, etag);
+        cs->out_iov[0].iov_base = cs->out_head;
+        cs->out_iov[0].iov_len = n;
+        cs->out_iovcnt = 1;
+        cs->out_status = 304;
+    } else {
+        int v = PACK_IDENTITY;
+        if ((acceptedEncodings(cs->request) & 1 << ENC_GZIP) &&
+                e->var[PACK_GZIP].head_len > 0) {
+            v = PACK_GZIP;
+            statsAdd(STAT_COMPRESSED, 1);
+        }
+        const struct pack_body *b = &e->var[v];
+        cs->out_iov[0].iov_base = (void *) (current->base + b->head_off);
+        cs->out_iov[0].iov_len = b->head_len;
+        cs->out_iov[1].iov_base = (void *) (current->base + b->body_off);
+        cs->out_iov[1].iov_len = b->body_len;
+        cs->out_iovcnt = 2;
+        cs->out_status = e->status;
+    }
+    cs->out_next = cs->out_iov;
+    cs->out_sent = 0;
+    statsAdd(STAT_PACK_HITS, 1);
+    return 1;
+}
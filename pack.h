@@ -0,0 +1,61 @@
+#include <stdint.h>
+
+/* Content pack (wserver -p): prerendered responses in one file, built by
+ * mkpack and served from memory; see pack.c
+ */
+#define PACK_MAGIC "WSPACK01"   /* first 8 bytes of the file */
+#define PACK_ETAG_MAX 64        /* longest ETag we answer 304 for */
+
+/* FNV-1a, over the request target of an entry */
+#define PACK_HASH_INIT 14695981039346656037ULL
+#define PACK_HASH_STEP(h, c) (((h) ^ (uint8_t) (c)) * 1099511628211ULL)
+
+/* The file starts with this.  Offsets are from the start of the file and
+ * everything is in host byte order.
+ */
+struct pack_header {
+    char magic[8];
+    uint32_t entries;
+    uint32_t slots;             /* size of the hash table, a power of two */
+    uint64_t slot_off;          /* struct pack_slot[slots] */
+    uint64_t entry_off;         /* struct pack_entry[entries] */
+};
+
+/* Open addressing with linear probing, from hash & (slots - 1) */
+struct pack_slot {
+    uint64_t hash;
+    uint32_t entry;             /* index + 1, or 0 if the slot is empty */
+    uint32_t reserved;
+};
+
+enum pack_variant {
+    PACK_IDENTITY,
+    PACK_GZIP,                  /* head_len is 0 if there is none */
+    PACK_VARIANTS
+};
+
+/* One response, ready to go out as head then body */
+struct pack_body {
+    uint64_t head_off;          /* status line and headers, up to the blank line */
+    uint64_t body_off;
+    uint64_t body_len;
+    uint32_t head_len;
+    uint32_t reserved;
+};
+
+struct pack_entry {
+    uint64_t key_off;           /* request target: path and query string */
+    uint64_t etag_off;          /* quoted, as in the ETag header */
+    uint32_t key_len;
+    uint32_t etag_len;
+    uint32_t status;
+    uint32_t reserved;
+    struct pack_body var[PACK_VARIANTS];
+};
+
+struct clientstate;
+struct pack;
+
+int packOpen(const char *filename);
+int packRespond(struct clientstate *cs);
+void packRelease(struct pack *p);
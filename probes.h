@@ -0,0 +1,34 @@
+/* USDT static tracepoints for the request lifecycle.
+ *
+ * When <sys/sdt.h> (systemtap-sdt-dev) is available each probe compiles to a
+ * single nop plus an ELF note, so probes cost nothing until a tracer such as
+ * bpftrace attaches to them.  Without the header they compile away.
+ *
+ * All probes live in the "wserver" provider and take the client socket and
+ * the request id as their first two arguments; see bpftrace/ for examples.
+ *
+ *   accept(fd, req_id)
+ *   request_read(fd, req_id, handle_code, bytes)  handleClient returned
+ *   parse(fd, req_id, result)                     parse_http_request returned
+ *   cgi_spawn(fd, req_id, pid)                    do_pipe forked the child
+ *   pipe_read(fd, req_id, bytes)                  each handle_pipe_data read
+ *   ok_sent(fd, req_id, bytes)                    200 response finished
+ *   timeout(fd, req_id, kind)                     a deadline expired
+ *   request_done(fd, req_id, status, bytes)       any response finished
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(WS_NO_PROBES)
+#include <sys/sdt.h>
+#define WS_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef WS_HAVE_SDT
+#define WS_PROBE2(name, a, b) DTRACE_PROBE2(wserver, name, a, b)
+#define WS_PROBE3(name, a, b, c) DTRACE_PROBE3(wserver, name, a, b, c)
+#define WS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(wserver, name, a, b, c, d)
+#else
+#define WS_PROBE2(name, a, b) do { } while (0)
+#define WS_PROBE3(name, a, b, c) do { } while (0)
+#define WS_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
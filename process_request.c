@@ -5,6 +5,7 @@
 
 #include "ws_helpers.h"
 #include "wrapsock.h"
+#include "log.h"
 
 void startCGI(struct clientstate *cs);
 char *getPath(char *str);
@@ -25,7 +26,7 @@ int processRequest(struct clientstate *cs) {
         return(-1);
     }
     int result;
-    fprintf(stderr, "Setting up pipe and creating child process\n");
+    LOG_DEBUG("Setting up pipe and creating child process\n");
     if(pipe(cs->fd) == -1) {
         perror("pipe"); 
 
@@ -38,7 +39,7 @@ int processRequest(struct clientstate *cs) {
 
     result = fork();
     if(result == -1) {
-        fprintf(stderr, "Fork failed\n");
+        LOG_ERROR("Fork failed\n");
 
         // printServerError(cs->sock);
         // Close(cs->sock);
@@ -61,7 +62,7 @@ int processRequest(struct clientstate *cs) {
  * and calling exec
   */
 void startCGI(struct clientstate *cs) {
-    fprintf(stdout, "Child query_string = %s\n", cs->query_string);
+    LOG_DEBUG("Child query_string = %s\n", cs->query_string);
 
     /* set env in the child so that we don't have to 
      * worry about cleaning it up in the parent 
@@ -82,7 +83,7 @@ void startCGI(struct clientstate *cs) {
     
     char path[MAXLINE] = "./";
     strncat(path, cs->path, MAXLINE - strlen(path) - 1);
-    fprintf(stderr, "Program to execute = %s\n", path);
+    LOG_DEBUG("Program to execute = %s\n", path);
 
     execl(path, cs->path, NULL);
     perror("execl");
@@ -97,7 +98,8 @@ char * getPath(char *str) {
     char *path = malloc(MAXLINE);
     int num;
     if(strncmp(str, "GET", 3) != 0) {
-        fprintf(stderr, "Invalid request type: %s\n", str);
+        LOG_DEBUG("Invalid request type: %s\n", str);
+        free(path);
         return NULL;
     }
     
@@ -105,6 +107,7 @@ char * getPath(char *str) {
      * going to worry about handling badly formatted requests.
      */
     if((num = sscanf(str, "GET /%s HTTP/1.1", path)) != 1) {
+        free(path);
         return NULL;
     } else {
         char *ptr = strchr(path, '?');
@@ -132,6 +135,7 @@ char *getQuery(char *resource) {
         // locate the next space to null-terminate the query string
         ptr = strchr(query, ' ');
         if(ptr == NULL) {
+            free(query);
             return NULL;
         } else {
             *ptr = '\0';
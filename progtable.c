@@ -10,6 +10,39 @@
 
 char *progs[MAXPROGS] = {"slowcgi", "term", "simple", "large"};
 
+/* Programs served by an upstream HTTP service instead of an executable,
+ * added with wserver -u (see proxy.c).  The index of a program in this
+ * array is its route number.
+ */
+#define MAXUPSTREAMPROGS 8
+
+static char *upstream_progs[MAXUPSTREAMPROGS];
+static int num_upstream_progs;
+
+/* Add name to the programs served by an upstream.  name must stay valid.
+ * Return its route number, or -1 if there are too many.
+ */
+int addUpstreamProgram(char *name) {
+    if(num_upstream_progs == MAXUPSTREAMPROGS) {
+        return -1;
+    }
+    upstream_progs[num_upstream_progs] = name;
+    return num_upstream_progs++;
+}
+
+/* Return the route number of str if an upstream serves it, or -1. */
+int upstreamProgram(char *str) {
+    if(str == NULL) {
+        return -1;
+    }
+    for(int i = 0; i < num_upstream_progs; i++) {
+        if(strcmp(str, upstream_progs[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /* Return 0 if str is NULL or if str is not in the list of valid programs to
  * run. Note that str does not begin with '/', nor does it contain the 
  * optional '?' or the arguments that follow.
@@ -30,6 +63,9 @@ int validResource(char *str) {
             return 1;
         }
     }
+    if(upstreamProgram(str) != -1) {
+        return 1;
+    }
     /* str did not match any of the valid programs */
     return 0;
 }
@@ -0,0 +1,946 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "wrapsock.h"
+#include "ws_helpers.h"
+#include "proxy.h"
+#include "log.h"
+#include "stats.h"
+#include "mem.h"
+
+/* Reverse proxy to upstream HTTP/1.1 services.
+ *
+ * A program in the program table can be served by HTTP services instead
+ * of an executable: wserver -u name=host:port[,host:port...] sends the
+ * requests for /name to those upstreams.  To the rest of the server such
+ * a request is a CGI program like any other (see startProgram): its
+ * output is read from a descriptor until EOF, stopProgram and
+ * reapProgram stand in for kill and waitpid, and the output is what a CGI
+ * program would print, with the upstream's status in a Status header
+ * (see cgiStatus).  Deadlines, compression, HTTP/2 and both event loops
+ * therefore need nothing new.  The descriptor is one end of a socketpair
+ * rather than a pipe, so that writing to it never raises SIGPIPE.
+ *
+ * proxy.c drives the upstream side itself, watching descriptors through
+ * the hooks set with proxySetLoop in the same one-shot way as h2.c:
+ *
+ *   - each upstream keeps a pool of up to UPSTREAM_MAX_IDLE idle
+ *     keep-alive connections.  A request takes the most recently used one
+ *     or connects anew, and the connection goes back to the pool once the
+ *     response is complete, unless the upstream asked to close.  Idle
+ *     connections are watched so one the upstream closes is dropped, and
+ *     a request whose pooled connection turns out to be closed before a
+ *     byte of response arrived is retried once on a new connection.
+ *   - a request goes to the healthy upstream with the fewest requests
+ *     outstanding; ties go round robin.
+ *   - every UPSTREAM_CHECK_MS each upstream gets a health check, GET / on
+ *     a new connection, which any status below 500 passes.
+ *     UPSTREAM_MAX_FAILS failed requests or checks in a row take an
+ *     upstream out of rotation and a passed check puts it back.  With no
+ *     upstream in rotation requests fail at once with 502.
+ *   - each request has a deadline: UPSTREAM_CONNECT_TIMEOUT_MS to
+ *     connect, then the upstream's own timeout (/ms after its address,
+ *     UPSTREAM_TIMEOUT_MS by default) for the complete response.  A late
+ *     upstream gets the client a 504, a broken one a 502.
+ *   - the response is relayed as it arrives: hop-by-hop headers dropped,
+ *     chunked bodies decoded.  While the event loop has not taken what
+ *     was written, the upstream is not read, so a request holds at most
+ *     UPSTREAM_BUF bytes in each direction plus the socket buffers.
+ *
+ * The request line and Host are the only parts of the client's request
+ * passed on, plus X-Forwarded-For; like a CGI program an upstream gets
+ * only GET requests.
+ */
+
+#define MAX_ROUTES 8            /* as MAXUPSTREAMPROGS in progtable.c */
+#define MAX_EXCHANGES 256       /* requests in flight */
+#define HEALTH_PATH "/"
+
+struct upstream {
+    struct sockaddr_in addr;
+    char host[64];              /* as given, for Host and the stats page */
+    int timeout_ms;             /* connected -> response complete */
+    int healthy;                /* in rotation */
+    int fails;                  /* failed requests or checks in a row */
+    int outstanding;            /* requests sent to it and not finished */
+    uint64_t requests;          /* all requests sent to it */
+    int idle[UPSTREAM_MAX_IDLE];    /* pooled connections, oldest first */
+    uint64_t idle_since[UPSTREAM_MAX_IDLE];
+    int nidle;
+    int checking;               /* a health check is in flight */
+    struct timer check;         /* when the next one is due */
+};
+
+struct route {
+    char *name;
+    struct upstream up[UPSTREAM_MAX];
+    int n;
+    int next;                   /* first upstream to look at, round robin */
+};
+
+enum exchange_state {
+    X_CONNECTING,
+    X_SENDING,
+    X_HEAD,                     /* reading the response header */
+    X_BODY,
+    X_FLUSH,                    /* response complete, writing what is left */
+    X_FINISHED                  /* result is final; waiting for proxyReap */
+};
+
+enum body_framing { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_CLOSE };
+enum chunk_state { CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER };
+
+/* One request to an upstream, or a health check */
+struct exchange {
+    struct upstream *up;        /* NULL if none was in rotation */
+    int slot;                   /* in exchanges[], -1 for a health check */
+    int check;                  /* a health check: no output, no slot */
+    int sock;                   /* connection to the upstream, or -1 */
+    int out_fd;                 /* our end of the output socketpair, or -1 */
+    int state;
+    int result;                 /* once X_FINISHED: as proxyReap */
+    int reused;                 /* sock came from the pool */
+    int retried;
+    int got_bytes;              /* any of the response arrived */
+    int keepalive;              /* sock may go back to the pool */
+    int framing;
+    int chunk;
+    int64_t left;               /* bytes of the body or chunk to come */
+    struct timer timer;
+    char req[MAXLINE + 256];
+    int req_len, req_sent;
+    char in[UPSTREAM_BUF];      /* received, not yet parsed */
+    int in_len;
+    char out[UPSTREAM_BUF];     /* CGI output not yet written to out_fd */
+    int out_off, out_len;
+};
+
+/* Owner of every descriptor proxy.c watches, indexed by descriptor */
+enum owner_kind { OWN_NONE, OWN_SOCK, OWN_OUT, OWN_IDLE };
+
+struct fd_owner {
+    int kind;
+    void *ptr;                  /* struct exchange, or struct upstream for OWN_IDLE */
+    int armed;                  /* events asked for and not yet reported */
+};
+
+static struct route routes[MAX_ROUTES];
+static int num_routes;
+static struct exchange *exchanges[MAX_EXCHANGES];
+static struct fd_owner *owners;
+static int owners_size;
+
+static struct {
+    void (*watch)(int fd, int events, void *arg);
+    void (*unwatch)(int fd, void *arg);
+    void *arg;
+} loop;
+
+static uint64_t nowMsec(void) {
+    return nowUsec() / 1000;
+}
+
+/* Parse "host:port[/timeout_ms]" into up.  Return 0, or -1 if it is not
+ * an address we can use.
+ */
+static int parseUpstream(struct upstream *up, const char *spec, int len) {
+    char buf[sizeof(up->host)];
+    if (len <= 0 || len >= (int) sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, spec, len);
+    buf[len] = '\0';
+    up->timeout_ms = UPSTREAM_TIMEOUT_MS;
+    char *slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        up->timeout_ms = atoi(slash + 1);
+        if (up->timeout_ms <= 0) {
+            return -1;
+        }
+    }
+    snprintf(up->host, sizeof(up->host), "%s", buf);
+    char *colon = strrchr(buf, ':');
+    if (colon == NULL || colon == buf) {
+        return -1;
+    }
+    *colon = '\0';
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    // Resolved once, at startup
+    if (getaddrinfo(buf, colon + 1, &hints, &res) != 0) {
+        return -1;
+    }
+    memcpy(&up->addr, res->ai_addr, sizeof(up->addr));
+    freeaddrinfo(res);
+    up->healthy = 1;
+    timerInit(&up->check);
+    return 0;
+}
+
+/* Add the route in spec, "name=host:port[/timeout_ms][,host:port...]":
+ * the program name is served by those upstreams from now on.  Return 0,
+ * or -1 if spec is not valid.
+ */
+int proxyAddRoute(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL || eq == spec || num_routes == MAX_ROUTES) {
+        LOG_ERROR("bad upstream route %s\n", spec);
+        return -1;
+    }
+    struct route *r = &routes[num_routes];
+    r->name = strndup(spec, eq - spec);
+    const char *p = eq + 1;
+    while (*p != '\0') {
+        int len = strcspn(p, ",");
+        if (r->n == UPSTREAM_MAX || parseUpstream(&r->up[r->n], p, len) == -1) {
+            LOG_ERROR("bad upstream %.*s for /%s\n", len, p, r->name);
+            return -1;
+        }
+        r->n++;
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    if (r->n == 0 || addUpstreamProgram(r->name) != num_routes) {
+        LOG_ERROR("bad upstream route %s\n", spec);
+        return -1;
+    }
+    num_routes++;
+    return 0;
+}
+
+/* Set the event loop hooks, as for h2SetLoop; events are reported
+ * through proxyEvent.  Health checks start from here.
+ */
+void proxySetLoop(void (*watch)(int fd, int events, void *arg),
+        void (*unwatch)(int fd, void *arg), void *arg) {
+    loop.watch = watch;
+    loop.unwatch = unwatch;
+    loop.arg = arg;
+    for (int i = 0; i < num_routes; i++) {
+        for (int j = 0; j < routes[i].n; j++) {
+            armTimer(&routes[i].up[j].check, TIMER_HEALTH, nowMsec() + UPSTREAM_CHECK_MS);
+        }
+    }
+}
+
+/* Make kind/ptr the owner of fd, keeping whatever is armed on it. */
+static void own(int fd, int kind, void *ptr) {
+    if (fd >= owners_size) {
+        int size = owners_size ? owners_size : 64;
+        while (size <= fd) {
+            size *= 2;
+        }
+        owners = realloc(owners, size * sizeof(*owners));
+        memset(owners + owners_size, 0, (size - owners_size) * sizeof(*owners));
+        owners_size = size;
+    }
+    owners[fd].kind = kind;
+    owners[fd].ptr = ptr;
+}
+
+static void watchFd(int fd, int events) {
+    struct fd_owner *o = &owners[fd];
+    int add = events & ~o->armed;
+    if (add) {
+        o->armed |= add;
+        loop.watch(fd, add, loop.arg);
+    }
+}
+
+/* Forget fd, cancelling whatever is still asked for on it. */
+static void unwatchFd(int fd) {
+    if (fd < owners_size && owners[fd].kind != OWN_NONE) {
+        if (owners[fd].armed) {
+            loop.unwatch(fd, loop.arg);
+        }
+        owners[fd].kind = OWN_NONE;
+        owners[fd].ptr = NULL;
+        owners[fd].armed = 0;
+    }
+}
+
+static void closeFd(int *fd) {
+    if (*fd != -1) {
+        unwatchFd(*fd);
+        Close(*fd);
+        *fd = -1;
+    }
+}
+
+/* Drop the pooled connections of up idle since before cutoff (all of
+ * them for a cutoff of UINT64_MAX).
+ */
+static void dropIdle(struct upstream *up, uint64_t cutoff) {
+    int keep = 0;
+    for (int i = 0; i < up->nidle; i++) {
+        if (up->idle_since[i] < cutoff) {
+            closeFd(&up->idle[i]);
+        } else {
+            up->idle[keep] = up->idle[i];
+            up->idle_since[keep] = up->idle_since[i];
+            keep++;
+        }
+    }
+    up->nidle = keep;
+}
+
+/* Give the connection fd, idle and in a clean state, back to the pool. */
+static void poolPut(struct upstream *up, int fd) {
+    if (up->nidle == UPSTREAM_MAX_IDLE || !up->healthy) {
+        closeFd(&fd);
+        return;
+    }
+    up->idle[up->nidle] = fd;
+    up->idle_since[up->nidle] = nowMsec();
+    up->nidle++;
+    // Whatever it says now is the upstream closing it
+    own(fd, OWN_IDLE, up);
+    watchFd(fd, POLLIN);
+}
+
+static void upstreamOk(struct upstream *up) {
+    up->fails = 0;
+    if (!up->healthy) {
+        LOG_WARN("upstream %s is back\n", up->host);
+        up->healthy = 1;
+    }
+}
+
+static void upstreamFailed(struct upstream *up) {
+    up->fails++;
+    if (up->healthy && up->fails >= UPSTREAM_MAX_FAILS) {
+        LOG_WARN("upstream %s is down\n", up->host);
+        up->healthy = 0;
+        dropIdle(up, UINT64_MAX);
+    }
+}
+
+/* x is over with result (0 or a status for the client): close what it
+ * still has open, which is EOF for the event loop.  Health checks are
+ * freed here, requests by proxyReap.
+ */
+static void finish(struct exchange *x, int result) {
+    disarmTimer(&x->timer);
+    closeFd(&x->sock);
+    closeFd(&x->out_fd);
+    x->state = X_FINISHED;
+    x->result = result;
+    if (x->check) {
+        x->up->checking = 0;
+        if (result == 0) {
+            upstreamOk(x->up);
+        } else {
+            upstreamFailed(x->up);
+        }
+        memAdd(MEM_PROXY, -(int64_t) sizeof(*x));
+        free(x);
+        return;
+    }
+    if (x->up != NULL) {
+        x->up->outstanding--;
+    }
+}
+
+/* Give x a connection to its upstream, from the pool unless x is a health
+ * check or a retry.  Return 0, or -1 if no connection could be started.
+ */
+static int connectUpstream(struct exchange *x) {
+    struct upstream *up = x->up;
+    x->in_len = 0;
+    x->req_sent = 0;
+    x->got_bytes = 0;
+    x->state = X_SENDING;
+    armTimer(&x->timer, TIMER_UPSTREAM, nowMsec() + up->timeout_ms);
+    if (!x->check && !x->retried && up->nidle > 0) {
+        up->nidle--;
+        x->sock = up->idle[up->nidle];
+        x->reused = 1;
+        own(x->sock, OWN_SOCK, x);
+        statsAdd(STAT_UPSTREAM_REUSED, 1);
+        return 0;
+    }
+    x->reused = 0;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    statsAdd(STAT_UPSTREAM_CONNECTS, 1);
+    if (connect(fd, (struct sockaddr *) &up->addr, sizeof(up->addr)) == -1) {
+        if (errno != EINPROGRESS) {
+            LOG_DEBUG("connect to %s: %s\n", up->host, strerror(errno));
+            Close(fd);
+            return -1;
+        }
+        x->state = X_CONNECTING;
+        armTimer(&x->timer, TIMER_UPSTREAM, nowMsec() + UPSTREAM_CONNECT_TIMEOUT_MS);
+    }
+    x->sock = fd;
+    own(fd, OWN_SOCK, x);
+    if (x->state == X_CONNECTING) {
+        watchFd(fd, POLLOUT);
+    }
+    return 0;
+}
+
+static void pump(struct exchange *x);
+
+/* The upstream connection of x broke, the response is not valid, or its
+ * deadline passed (status 504).  Retry once if a pooled connection went
+ * stale under us; otherwise the client gets status.
+ */
+static void failed(struct exchange *x, int status) {
+    LOG_DEBUG("upstream %s failed a request (%d)\n", x->up->host, status);
+    closeFd(&x->sock);
+    if (status == 502 && x->reused && !x->got_bytes && !x->retried) {
+        x->retried = 1;
+        statsAdd(STAT_UPSTREAM_RETRIES, 1);
+        if (connectUpstream(x) == 0) {
+            pump(x);
+            return;
+        }
+    }
+    if (!x->check) {
+        statsAdd(STAT_UPSTREAM_ERRORS, 1);
+        upstreamFailed(x->up);
+    }
+    finish(x, status);
+}
+
+static void consume(struct exchange *x, int n) {
+    memmove(x->in, x->in + n, x->in_len - n);
+    x->in_len -= n;
+}
+
+/* Append the n bytes at data to the output of x. */
+static void emit(struct exchange *x, const char *data, int n) {
+    memcpy(x->out + x->out_off + x->out_len, data, n);
+    x->out_len += n;
+}
+
+static int outRoom(struct exchange *x) {
+    return sizeof(x->out) - x->out_off - x->out_len;
+}
+
+static int fieldIs(const char *line, int name_len, const char *name) {
+    return name_len == (int) strlen(name) && strncasecmp(line, name, name_len) == 0;
+}
+
+/* Return 1 if the value of length len at v has token in it. */
+static int valueHas(const char *v, int len, const char *token) {
+    int n = strlen(token);
+    for (int i = 0; i + n <= len; i++) {
+        if (strncasecmp(v + i, token, n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Turn the response header in x->in into a CGI header block in x->out.
+ * Return as parse.
+ */
+static int parseHead(struct exchange *x) {
+    char *end = memmem(x->in, x->in_len, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return x->in_len == (int) sizeof(x->in) ? -1 : 0;
+    }
+    int head_len = end + 4 - x->in;
+    char *eol = memchr(x->in, '\r', head_len);
+    char *code = x->in + 9;
+    if (eol - x->in < 12 || memcmp(x->in, "HTTP/1.", 7) != 0 || x->in[8] != ' ') {
+        return -1;
+    }
+    int status = atoi(code);
+    if (status < 100 || status > 599) {
+        return -1;
+    }
+    if (status < 200) {
+        // 100 Continue and friends: the real response follows
+        consume(x, head_len);
+        return 1;
+    }
+    if (x->check) {
+        x->keepalive = 0;
+        x->result = status < 500 ? 0 : 502;
+        x->state = X_FLUSH;
+        return 1;
+    }
+    x->keepalive = x->in[7] != '0';
+    x->framing = BODY_CLOSE;
+    emit(x, "Status: ", 8);
+    emit(x, code, eol - code);
+    emit(x, "\r\n", 2);
+    char *line = eol + 2;
+    while (line < end) {
+        char *next = memmem(line, end + 2 - line, "\r\n", 2);
+        char *colon = memchr(line, ':', next - line);
+        int name_len = colon != NULL ? colon - line : 0;
+        char *value = colon != NULL ? colon + 1 : next;
+        int value_len = next - value;
+        if (fieldIs(line, name_len, "content-length")) {
+            char *digits_end;
+            x->left = strtoll(value, &digits_end, 10);
+            if (digits_end == value || x->left < 0) {
+                return -1;
+            }
+            if (x->framing != BODY_CHUNKED) {
+                x->framing = BODY_LENGTH;
+            }
+        } else if (fieldIs(line, name_len, "transfer-encoding")) {
+            if (valueHas(value, value_len, "chunked")) {
+                x->framing = BODY_CHUNKED;
+                x->chunk = CHUNK_SIZE;
+            }
+        } else if (fieldIs(line, name_len, "connection")) {
+            if (valueHas(value, value_len, "close")) {
+                x->keepalive = 0;
+            } else if (valueHas(value, value_len, "keep-alive")) {
+                x->keepalive = 1;
+            }
+        } else if (name_len > 0 && !fieldIs(line, name_len, "keep-alive") &&
+                !fieldIs(line, name_len, "proxy-connection") &&
+                !fieldIs(line, name_len, "upgrade") &&
+                !fieldIs(line, name_len, "trailer")) {
+            emit(x, line, next + 2 - line);
+        }
+        line = next + 2;
+    }
+    emit(x, "\r\n", 2);
+    consume(x, head_len);
+    if (status == 204 || status == 304 || (x->framing == BODY_LENGTH && x->left == 0)) {
+        x->framing = BODY_NONE;
+    }
+    if (x->framing == BODY_CLOSE) {
+        x->keepalive = 0;
+    }
+    x->state = x->framing == BODY_NONE ? X_FLUSH : X_BODY;
+    return 1;
+}
+
+/* Move up to max body bytes from x->in to x->out. */
+static int moveBody(struct exchange *x, int64_t max) {
+    int n = x->in_len;
+    if (n > outRoom(x)) {
+        n = outRoom(x);
+    }
+    if (n > max) {
+        n = max;
+    }
+    emit(x, x->in, n);
+    consume(x, n);
+    return n;
+}
+
+/* Decode the chunked body in x->in into x->out.  Return as parse. */
+static int parseChunked(struct exchange *x) {
+    int progress = 0;
+    for (;;) {
+        if (x->chunk == CHUNK_DATA) {
+            int n = moveBody(x, x->left);
+            x->left -= n;
+            if (x->left > 0) {
+                return progress || n > 0;
+            }
+            x->chunk = CHUNK_DATA_END;
+            progress = 1;
+            continue;
+        }
+        if (x->chunk == CHUNK_DATA_END) {
+            if (x->in_len < 2) {
+                return progress;
+            }
+            if (x->in[0] != '\r' || x->in[1] != '\n') {
+                return -1;
+            }
+            consume(x, 2);
+            x->chunk = CHUNK_SIZE;
+            progress = 1;
+            continue;
+        }
+        char *eol = memmem(x->in, x->in_len, "\r\n", 2);
+        if (eol == NULL) {
+            return x->in_len == (int) sizeof(x->in) ? -1 : progress;
+        }
+        int line_len = eol + 2 - x->in;
+        if (x->chunk == CHUNK_SIZE) {
+            char *digits_end;
+            x->left = strtoll(x->in, &digits_end, 16);
+            if (digits_end == x->in || x->left < 0) {
+                return -1;
+            }
+            x->chunk = x->left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        } else if (line_len == 2) {
+            // The empty line after the trailer fields ends the body
+            x->state = X_FLUSH;
+            consume(x, line_len);
+            return 1;
+        }
+        // Chunk extensions and trailer fields are dropped
+        consume(x, line_len);
+        progress = 1;
+    }
+}
+
+/* Turn what has been received into CGI output in x->out.  Return 1 if
+ * anything was done, 0 if more input is needed, or -1 if the response is
+ * not valid HTTP.
+ */
+static int parse(struct exchange *x) {
+    if (x->state == X_HEAD) {
+        return parseHead(x);
+    }
+    switch (x->framing) {
+    case BODY_LENGTH: {
+        int n = moveBody(x, x->left);
+        x->left -= n;
+        if (x->left == 0) {
+            x->state = X_FLUSH;
+            return 1;
+        }
+        return n > 0;
+    }
+    case BODY_CHUNKED:
+        return parseChunked(x);
+    default:
+        return moveBody(x, x->in_len) > 0;
+    }
+}
+
+/* The response of x is complete and written out. */
+static void complete(struct exchange *x) {
+    if (x->in_len > 0) {
+        // More than the response: nothing we can reuse
+        x->keepalive = 0;
+    }
+    if (x->check) {
+        finish(x, x->result);
+        return;
+    }
+    upstreamOk(x->up);
+    if (x->keepalive) {
+        poolPut(x->up, x->sock);
+        x->sock = -1;
+    }
+    finish(x, 0);
+}
+
+/* Move x along as far as its descriptors allow. */
+static void pump(struct exchange *x) {
+    for (;;) {
+        if (x->state == X_CONNECTING) {
+            return;
+        }
+        if (x->state == X_SENDING) {
+            ssize_t n = send(x->sock, x->req + x->req_sent,
+                    x->req_len - x->req_sent, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                watchFd(x->sock, POLLOUT);
+                return;
+            }
+            if (n < 0) {
+                failed(x, 502);
+                return;
+            }
+            x->req_sent += n;
+            if (x->req_sent == x->req_len) {
+                x->state = X_HEAD;
+            }
+            continue;
+        }
+        // Write out what we have before taking more from the upstream
+        if (x->out_len > 0) {
+            ssize_t n = send(x->out_fd, x->out + x->out_off, x->out_len, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                watchFd(x->out_fd, POLLOUT);
+                return;
+            }
+            if (n < 0) {
+                // The event loop stopped reading; proxyReap will be along
+                finish(x, 502);
+                return;
+            }
+            x->out_off += n;
+            x->out_len -= n;
+            if (x->out_len > 0) {
+                continue;
+            }
+            x->out_off = 0;
+        }
+        if (x->state == X_FLUSH) {
+            complete(x);
+            return;
+        }
+        int rc = parse(x);
+        if (rc == -1) {
+            LOG_WARN("upstream %s sent an invalid response\n", x->up->host);
+            x->got_bytes = 1;
+            failed(x, 502);
+            return;
+        }
+        if (rc == 1) {
+            continue;
+        }
+        ssize_t n = recv(x->sock, x->in + x->in_len, sizeof(x->in) - x->in_len, 0);
+        if (n > 0) {
+            x->got_bytes = 1;
+            x->in_len += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            watchFd(x->sock, POLLIN);
+            return;
+        }
+        if (n == 0 && x->state == X_BODY && x->framing == BODY_CLOSE) {
+            x->state = X_FLUSH;
+            continue;
+        }
+        failed(x, 502);
+        return;
+    }
+}
+
+/* Return the upstream of r to send a request to, or NULL if none is in
+ * rotation.
+ */
+static struct upstream *pick(struct route *r) {
+    struct upstream *best = NULL;
+    for (int k = 0; k < r->n; k++) {
+        struct upstream *up = &r->up[(r->next + k) % r->n];
+        if (up->healthy && (best == NULL || up->outstanding < best->outstanding)) {
+            best = up;
+        }
+    }
+    r->next = (r->next + 1) % r->n;
+    return best;
+}
+
+static struct exchange *newExchange(struct upstream *up) {
+    struct exchange *x = calloc(1, sizeof(*x));
+    memAdd(MEM_PROXY, sizeof(*x));
+    x->up = up;
+    x->slot = -1;
+    x->sock = -1;
+    x->out_fd = -1;
+    timerInit(&x->timer);
+    return x;
+}
+
+/* Forward the request for the program name with the query string query
+ * (NULL if none) from client_addr to an upstream of route.  Put the read
+ * end of the output in *fd and return a handle for proxyStop and
+ * proxyReap, or -1 if the request cannot even be started.
+ */
+int proxyStart(int route, const char *name, const char *query,
+        uint32_t client_addr, int *fd) {
+    int slot = 0;
+    while (slot < MAX_EXCHANGES && exchanges[slot] != NULL) {
+        slot++;
+    }
+    int sv[2];
+    if (slot == MAX_EXCHANGES) {
+        LOG_WARN("too many upstream requests in flight\n");
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    struct route *r = &routes[route];
+    struct exchange *x = newExchange(pick(r));
+    x->slot = slot;
+    x->out_fd = sv[1];
+    own(x->out_fd, OWN_OUT, x);
+    exchanges[slot] = x;
+    *fd = sv[0];
+    statsAdd(STAT_UPSTREAM_REQUESTS, 1);
+    if (x->up == NULL) {
+        LOG_DEBUG("no upstream of /%s in rotation\n", name);
+        finish(x, 502);
+        return -2 - slot;
+    }
+    x->up->outstanding++;
+    x->up->requests++;
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr, addr, sizeof(addr));
+    int has_query = query != NULL && *query != '\0';
+    x->req_len = snprintf(x->req, sizeof(x->req),
+            "GET /%s%s%s HTTP/1.1\r\nHost: %s\r\nX-Forwarded-For: %s\r\n\r\n",
+            name, has_query ? "?" : "", has_query ? query : "", x->up->host, addr);
+    if (connectUpstream(x) == -1) {
+        failed(x, 502);
+    } else {
+        pump(x);
+    }
+    return -2 - slot;
+}
+
+static struct exchange *handleExchange(int handle) {
+    int slot = -2 - handle;
+    return slot >= 0 && slot < MAX_EXCHANGES ? exchanges[slot] : NULL;
+}
+
+/* Abandon the request handle, as kill does a CGI program. */
+void proxyStop(int handle) {
+    struct exchange *x = handleExchange(handle);
+    if (x != NULL && x->state != X_FINISHED) {
+        finish(x, 500);
+    }
+}
+
+/* Free the request handle, whose output reached EOF, and return as
+ * reapProgram.  If the event loop stopped reading early, the request is
+ * abandoned and fails with 502.
+ */
+int proxyReap(int handle) {
+    struct exchange *x = handleExchange(handle);
+    if (x == NULL) {
+        return 500;
+    }
+    if (x->state != X_FINISHED) {
+        finish(x, 502);
+    }
+    int result = x->result;
+    exchanges[x->slot] = NULL;
+    memAdd(MEM_PROXY, -(int64_t) sizeof(*x));
+    free(x);
+    return result;
+}
+
+/* A pooled connection of up became readable: the upstream closed it (or
+ * sent something unasked for, which is as bad).
+ */
+static void idleEvent(struct upstream *up, int fd) {
+    char c;
+    if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && errno == EAGAIN) {
+        watchFd(fd, POLLIN);
+        return;
+    }
+    for (int i = 0; i < up->nidle; i++) {
+        if (up->idle[i] == fd) {
+            closeFd(&up->idle[i]);
+            up->nidle--;
+            memmove(&up->idle[i], &up->idle[i + 1], (up->nidle - i) * sizeof(int));
+            memmove(&up->idle_since[i], &up->idle_since[i + 1],
+                    (up->nidle - i) * sizeof(uint64_t));
+            return;
+        }
+    }
+}
+
+/* Handle events (POLLIN and/or POLLOUT) on fd, which proxy.c asked the
+ * event loop to watch.  Return 0, or -1 if fd is not one of ours.
+ */
+int proxyEvent(int fd, int events) {
+    if (fd < 0 || fd >= owners_size || owners[fd].kind == OWN_NONE) {
+        return -1;
+    }
+    struct fd_owner *o = &owners[fd];
+    o->armed &= ~events;
+    if (o->kind == OWN_IDLE) {
+        idleEvent(o->ptr, fd);
+        return 0;
+    }
+    struct exchange *x = o->ptr;
+    if (x->state == X_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(x->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            LOG_DEBUG("connect to %s: %s\n", x->up->host, strerror(err));
+            failed(x, 502);
+            return 0;
+        }
+        x->state = X_SENDING;
+        armTimer(&x->timer, TIMER_UPSTREAM, nowMsec() + x->up->timeout_ms);
+    }
+    pump(x);
+    return 0;
+}
+
+/* Start a health check of up on a new connection. */
+static void startCheck(struct upstream *up) {
+    struct exchange *x = newExchange(up);
+    x->check = 1;
+    x->req_len = snprintf(x->req, sizeof(x->req),
+            "GET " HEALTH_PATH " HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+            up->host);
+    up->checking = 1;
+    if (connectUpstream(x) == -1) {
+        finish(x, 502);
+    } else {
+        pump(x);
+    }
+}
+
+/* The deadline t of a request or health check, or the time for the next
+ * health check of an upstream, has come.
+ */
+void proxyExpired(struct timer *t) {
+    if (t->kind == TIMER_HEALTH) {
+        struct upstream *up = (struct upstream *)
+                ((char *) t - offsetof(struct upstream, check));
+        uint64_t now = nowMsec();
+        dropIdle(up, now - UPSTREAM_IDLE_TIMEOUT_MS);
+        if (!up->checking) {
+            startCheck(up);
+        }
+        armTimer(&up->check, TIMER_HEALTH, now + UPSTREAM_CHECK_MS);
+        return;
+    }
+    struct exchange *x = (struct exchange *)
+            ((char *) t - offsetof(struct exchange, timer));
+    LOG_DEBUG("upstream %s timed out\n", x->up->host);
+    failed(x, 504);
+}
+
+/* Render the state of every upstream into buf, in the format of
+ * statsRender.  Return the length of the text, truncated to size - 1.
+ */
+int proxyStats(char *buf, int size) {
+    static const char *names[] = {
+        "wserver_upstream_healthy", "wserver_upstream_outstanding",
+        "wserver_upstream_idle_connections", "wserver_upstream_requests_total"
+    };
+    int len = 0;
+    for (int m = 0; m < 4 && num_routes > 0; m++) {
+        if (len < size) {
+            len += snprintf(buf + len, size - len, "# TYPE %s %s\n", names[m],
+                    m == 3 ? "counter" : "gauge");
+        }
+        for (int i = 0; i < num_routes; i++) {
+            for (int j = 0; j < routes[i].n; j++) {
+                struct upstream *up = &routes[i].up[j];
+                long long v = m == 0 ? up->healthy : m == 1 ? up->outstanding :
+                        m == 2 ? up->nidle : (long long) up->requests;
+                if (len < size) {
+                    len += snprintf(buf + len, size - len,
+                            "%s{program=\"%s\",upstream=\"%s\"} %lld\n",
+                            names[m], routes[i].name, up->host, v);
+                }
+            }
+        }
+    }
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,25 @@
+/* Reverse proxy to upstream HTTP/1.1 services; see proxy.c */
+#define UPSTREAM_MAX 8                  /* upstreams per program */
+#define UPSTREAM_MAX_IDLE 16            /* pooled connections per upstream */
+#define UPSTREAM_IDLE_TIMEOUT_MS 30000  /* pooled connection unused -> closed */
+#define UPSTREAM_CONNECT_TIMEOUT_MS 1000
+#define UPSTREAM_TIMEOUT_MS 10000       /* connected -> response complete */
+#define UPSTREAM_CHECK_MS 2000          /* between health checks */
+#define UPSTREAM_MAX_FAILS 2            /* failures in a row -> out of rotation */
+#define UPSTREAM_BUF 16384              /* response bytes buffered per request */
+
+/* startProgram handles of proxied requests are below -1, pids above */
+#define PROXY_HANDLE_P(pid) ((pid) < -1)
+
+struct timer;
+
+int proxyAddRoute(const char *spec);
+void proxySetLoop(void (*watch)(int fd, int events, void *arg),
+        void (*unwatch)(int fd, void *arg), void *arg);
+int proxyStart(int route, const char *name, const char *query,
+        uint32_t client_addr, int *fd);
+void proxyStop(int handle);
+int proxyReap(int handle);
+int proxyEvent(int fd, int events);
+void proxyExpired(struct timer *t);
+int proxyStats(char *buf, int size);
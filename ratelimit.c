@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ratelimit.h"
+#include "log.h"
+
+/* Per-client limits, keyed by IPv4 address:
+ *
+ *   - a token bucket of burst requests, refilled at rate requests per
+ *     second.  A connection takes a token when it is accepted (HTTP/1
+ *     connections carry one request each) and an HTTP/2 stream when it is
+ *     opened.
+ *   - at most max_conns connections open at once.
+ *
+ * Clients are kept in a fixed open-addressing table with linear probing
+ * that is never rehashed or swept.  An entry whose client has no
+ * connections left and whose bucket would be full again is no different
+ * from no entry at all, so it expires lazily: any lookup passing it may
+ * take it over.  Entries are never emptied, which keeps probe chains
+ * intact.  A lookup looks at RATE_MAX_PROBE entries at most; a client
+ * that finds no room there is let through untracked rather than refused.
+ *
+ * Buckets count thousandths of a request, so refilling after ms
+ * milliseconds adds ms * rate and no division is needed.  Everything runs
+ * on the event loop thread.
+ */
+
+#define TABLE_SIZE (1 << RATE_TABLE_BITS)
+#define TOKEN 1000                          /* one request */
+
+struct rate_entry {
+    uint32_t addr;          /* network byte order; 0 if never used */
+    uint32_t last_ms;       /* when tokens was last brought up to date */
+    int32_t tokens;         /* thousandths of a request */
+    uint32_t conns;         /* connections open */
+};
+
+static struct rate_entry table[TABLE_SIZE];
+static int rate;            /* requests per second, 0 for no limit */
+static int32_t full;        /* burst, in thousandths */
+static uint32_t max_conns;  /* 0 for no limit */
+
+/* Limit every client to rate requests per second with bursts of burst
+ * (0 for rate), and max_conns connections at once.  A limit of 0 is no
+ * limit.
+ */
+void rateInit(int rate_per_sec, int burst, int max_conns_per_client) {
+    rate = rate_per_sec > 0 ? rate_per_sec : 0;
+    if (burst <= 0) {
+        burst = rate;
+    }
+    full = (int32_t) burst * TOKEN;
+    max_conns = max_conns_per_client > 0 ? max_conns_per_client : 0;
+    if (rate > 0 || max_conns > 0) {
+        LOG_INFO("limiting clients to %d requests/s (burst %d), %u connections\n",
+                rate, burst, max_conns);
+    }
+}
+
+static uint32_t nowMsec32(void) {
+    return (uint32_t) (nowUsec() / 1000);
+}
+
+/* Bring the bucket of e up to now. */
+static void refill(struct rate_entry *e, uint32_t now) {
+    uint32_t elapsed = now - e->last_ms;
+    e->last_ms = now;
+    if (rate == 0) {
+        return;
+    }
+    uint64_t tokens = e->tokens + (uint64_t) elapsed * rate;
+    e->tokens = tokens < (uint64_t) full ? (int32_t) tokens : full;
+}
+
+/* Return 1 if e tells nothing that a fresh entry would not. */
+static int stale(const struct rate_entry *e, uint32_t now) {
+    return e->conns == 0 &&
+            (rate == 0 || e->tokens + (uint64_t) (now - e->last_ms) * rate >= (uint64_t) full);
+}
+
+/* Return the entry of addr, taking over an empty or stale one for it if
+ * create is set, or NULL if there is none.
+ */
+static struct rate_entry *lookup(uint32_t addr, uint32_t now, int create) {
+    // Fibonacci hashing spreads the addresses of a subnet over the table
+    uint32_t i = (addr * 2654435761u) >> (32 - RATE_TABLE_BITS);
+    struct rate_entry *free_entry = NULL;
+    for (int k = 0; k < RATE_MAX_PROBE; k++, i = (i + 1) & (TABLE_SIZE - 1)) {
+        struct rate_entry *e = &table[i];
+        if (e->addr == addr) {
+            return e;
+        }
+        if (e->addr == 0) {
+            // addr cannot be further along
+            if (free_entry == NULL) {
+                free_entry = e;
+            }
+            break;
+        }
+        if (free_entry == NULL && stale(e, now)) {
+            free_entry = e;
+        }
+    }
+    if (!create || free_entry == NULL) {
+        return NULL;
+    }
+    free_entry->addr = addr;
+    free_entry->last_ms = now;
+    free_entry->tokens = full;
+    free_entry->conns = 0;
+    return free_entry;
+}
+
+/* Take a token from the bucket of e. */
+static int take(struct rate_entry *e) {
+    if (rate == 0) {
+        return 0;
+    }
+    if (e->tokens < TOKEN) {
+        return -1;
+    }
+    e->tokens -= TOKEN;
+    return 0;
+}
+
+/* A connection from addr was accepted.  Return 0 if it may go ahead, in
+ * which case rateRelease must be called when it ends, or 429 if the
+ * client is over one of its limits.
+ */
+int rateAdmit(uint32_t addr) {
+    if (rate == 0 && max_conns == 0) {
+        return 0;
+    }
+    uint32_t now = nowMsec32();
+    struct rate_entry *e = lookup(addr, now, 1);
+    if (e == NULL) {
+        return 0;
+    }
+    refill(e, now);
+    if ((max_conns > 0 && e->conns >= max_conns) || take(e) == -1) {
+        return 429;
+    }
+    e->conns++;
+    return 0;
+}
+
+/* A connection from addr asked for one more request (an HTTP/2 stream).
+ * Return 0 if it may go ahead, or 429 if the client is over its rate.
+ */
+int rateTake(uint32_t addr) {
+    if (rate == 0) {
+        return 0;
+    }
+    uint32_t now = nowMsec32();
+    struct rate_entry *e = lookup(addr, now, 1);
+    if (e == NULL) {
+        return 0;
+    }
+    refill(e, now);
+    return take(e) == -1 ? 429 : 0;
+}
+
+/* A connection from addr that rateAdmit let through has ended. */
+void rateRelease(uint32_t addr) {
+    if (rate == 0 && max_conns == 0) {
+        return;
+    }
+    struct rate_entry *e = lookup(addr, 0, 0);
+    if (e != NULL && e->conns > 0) {
+        e->conns--;
+    }
+}
@@ -0,0 +1,10 @@
+#include <stdint.h>
+
+/* Per-client request rate and connection limits; see ratelimit.c */
+#define RATE_TABLE_BITS 12      /* 4096 clients tracked at once */
+#define RATE_MAX_PROBE 16       /* entries looked at per lookup */
+
+void rateInit(int rate, int burst, int max_conns);
+int rateAdmit(uint32_t addr);
+int rateTake(uint32_t addr);
+void rateRelease(uint32_t addr);
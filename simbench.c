@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ws_helpers.h"
+#include "coloop.h"
+#include "transport.h"
+#include "loopback.h"
+#include "ratelimit.h"
+#include "mem.h"
+
+/* simbench: the coroutine event loop of wserver against simulated clients.
+ *
+ * The server code is the real one; only its transport is the in-memory
+ * loopback of loopback.c.  Clients follow a script (how many, how fast
+ * they come, how they fragment their request, how fast they read, how
+ * long the CGI programs take), and time is virtual, so a run is exactly
+ * reproducible and can have far more connections than one host can open.
+ * Latencies are in virtual time; the wall clock time and the number of
+ * rounds of the event loop measure what the server code costs.
+ */
+
+#define MAX_STATUS 600
+
+static void usage(void) {
+    fprintf(stderr, "Usage: simbench [-n clients] [-a arrival_us] [-f fragment] [-g gap_ms]\n"
+            "                [-x stall_percent] [-r read_rate] [-w window]\n"
+            "                [-s body] [-d cgi_ms] [-A addresses] [-t tick_us]\n"
+            "                [-l max_conns] [-M megabytes] [-S seed] [-j] [path]\n"
+            "  -f  write the request in fragments of this many bytes\n"
+            "  -x  clients that stop after their first fragment\n"
+            "  -r  bytes per ms a client reads its response (default: no limit)\n"
+            "  -w  response bytes in flight before the server's writes block\n"
+            "  -t  resolution of the virtual clock (default 1000us)\n"
+            "  -j  print one JSON object instead of a text report\n");
+    exit(1);
+}
+
+static int compareLatency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double wallSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    struct loopback_script script = {
+        .clients = 10000,
+        .arrival_us = 100,
+        .fragment = 0,
+        .gap_ms = 1,
+        .read_rate = 0,
+        .window = 65536,
+        .body = 1024,
+        .cgi_ms = 5,
+        .tick_us = 1000,
+        .seed = 1
+    };
+    int max_conns = 0;
+    int64_t mem_budget = MEM_BUDGET_DEFAULT;
+    int json = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:a:f:g:x:r:w:s:d:A:t:l:M:S:j")) != -1) {
+        switch (opt) {
+        case 'n': script.clients = atoi(optarg); break;
+        case 'a': script.arrival_us = atoi(optarg); break;
+        case 'f': script.fragment = atoi(optarg); break;
+        case 'g': script.gap_ms = atoi(optarg); break;
+        case 'x': script.stall_percent = atoi(optarg); break;
+        case 'r': script.read_rate = atoi(optarg); break;
+        case 'w': script.window = atoi(optarg); break;
+        case 's': script.body = atoi(optarg); break;
+        case 'd': script.cgi_ms = atoi(optarg); break;
+        case 'A': script.addresses = atoi(optarg); break;
+        case 't': script.tick_us = atoi(optarg); break;
+        case 'l': max_conns = atoi(optarg); break;
+        case 'M': mem_budget = (int64_t) atoi(optarg) << 20; break;
+        case 'S': script.seed = strtoul(optarg, NULL, 10); break;
+        case 'j': json = 1; break;
+        default: usage();
+        }
+    }
+    if (argc - optind > 1) {
+        usage();
+    }
+    const char *path = optind < argc ? argv[optind] : "/simple";
+    char request[MAXLINE];
+    snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: sim\r\n\r\n", path);
+    script.request = request;
+    if (loopbackInit(&script) == -1) {
+        usage();
+    }
+
+    // The clock comes first: every deadline is armed on it
+    transportUse(&loopback_transport);
+    rateInit(0, 0, max_conns);
+    memInit(mem_budget);
+    initResponses();
+    struct clientstate *client = calloc(script.clients, sizeof(*client));
+    initClients(client, script.clients);
+
+    double wall = wallSeconds();
+    runCoroLoop(loopbackListen(), -1, -1, client, script.clients);
+    wall = wallSeconds() - wall;
+
+    int status[MAX_STATUS] = {0};
+    uint64_t *latency = malloc(script.clients * sizeof(*latency));
+    uint64_t bytes = 0;
+    int incomplete = 0;
+    for (int i = 0; i < script.clients; i++) {
+        const struct loopback_client *r = loopbackResult(i);
+        status[r->status < MAX_STATUS ? r->status : 0]++;
+        latency[i] = r->latency_us;
+        bytes += r->received;
+        incomplete += r->status != 0 && !r->complete;
+    }
+    qsort(latency, script.clients, sizeof(*latency), compareLatency);
+    double p50 = latency[script.clients / 2] / 1e3;
+    double p99 = latency[(int) (script.clients * 0.99)] / 1e3;
+    double max = latency[script.clients - 1] / 1e3;
+    double elapsed = loopbackElapsed() / 1e3;
+    unsigned long long rounds = loopbackPolls();
+
+    if (json) {
+        printf("{\"path\":\"%s\",\"clients\":%d,\"arrival_us\":%d,\"fragment\":%d,"
+                "\"stall_percent\":%d,\"read_rate\":%d,\"body\":%d,\"cgi_ms\":%d,"
+                "\"virtual_ms\":%.1f,\"rounds\":%llu,\"wall_s\":%.3f,\"incomplete\":%d,",
+                path, script.clients, script.arrival_us, script.fragment,
+                script.stall_percent, script.read_rate, script.body, script.cgi_ms,
+                elapsed, rounds, wall, incomplete);
+        for (int s = 0; s < MAX_STATUS; s++) {
+            if (status[s] > 0) {
+                printf("\"status_%d\":%d,", s, status[s]);
+            }
+        }
+        printf("\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}\n", p50, p99, max);
+    } else {
+        printf("%s: %d clients, one every %dus, %s, %d%% stalled, reading %s\n",
+                path, script.clients, script.arrival_us,
+                script.fragment > 0 ? "fragmented requests" : "whole requests",
+                script.stall_percent, script.read_rate > 0 ? "slowly" : "at once");
+        printf("  %.1f virtual ms, %llu bytes received, statuses:", elapsed,
+                (unsigned long long) bytes);
+        for (int s = 0; s < MAX_STATUS; s++) {
+            if (status[s] > 0) {
+                printf(" %d x%d", s, status[s]);
+            }
+        }
+        printf(", %d incomplete\n  latency p50 %.3fms  p99 %.3fms  max %.3fms (virtual)\n", incomplete, p50, p99, max);
+        printf("  %llu loop rounds in %.3fs, %.0f clients/s wall\n", rounds, wall,
+                script.clients / wall);
+    }
+    free(latency);
+    free(client);
+    return 0;
+}
@@ -5,7 +5,8 @@
 #include "cgi.h"
 
 /* A simple CGI program.  It grabs the form data from the environment variable
- * QUERY_STRING and prints it as an html list if QUERY_STRING is not empty
+ * QUERY_STRING and prints it as an html list if QUERY_STRING is not empty,
+ * and does the same with a form POSTed to it on standard input
  *
  * It first prints a header line to indicate the content type.  Note that
  * header lines are terminated with crlf (carriage return, line feed)
@@ -13,6 +14,12 @@
  * headers and the beginning of the body of the http message 
  */
 
+/* Print one posted form field as an item of an html list. */
+void print_field(char *name, char *value, void *arg) {
+    (void) arg;
+    printf("<li>%s = %s</li>\n", name, value);
+}
+
 int main() {
     char *name, *qstr = NULL;
     Fdata *f = NULL;
@@ -35,6 +42,14 @@ int main() {
             printf("%s", fdata2html(f));
         }
     }
+    char *method = getenv("REQUEST_METHOD");
+    if(method != NULL && strcmp(method, "POST") == 0) {
+        printf("<p>Posted:</p>\n<ul>\n");
+        if(read_form(stdin, print_field, NULL) == -1) {
+            printf("<li>(field too long)</li>\n");
+        }
+        printf("</ul>\n");
+    }
     printf("</body></html>\n");
     fflush(stdout);
 
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "stats.h"
+
+/* Latency histograms in the style of HdrHistogram: values (microseconds)
+ * fall into power-of-two octaves, each split into SUB_BUCKETS linear
+ * sub-buckets, which keeps the relative error under 1/SUB_BUCKETS at any
+ * magnitude with a fixed, small number of counters.  Recording is a
+ * couple of shifts and one relaxed atomic increment, so it stays on in
+ * production.
+ */
+#define SUB_BITS 2
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define OCTAVES 32
+#define NUM_BUCKETS ((OCTAVES + 1) * SUB_BUCKETS)
+
+/* Octaves reported as Prometheus buckets: 1us .. 2^26us (about 67s). */
+#define EXPORT_OCTAVES 27
+
+struct histogram {
+    _Atomic uint64_t bucket[NUM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_us;
+};
+
+static struct histogram hist[NUM_STAGES];
+static _Atomic int64_t counter[NUM_COUNTERS];
+
+#define NUM_STATUS 10
+static const int status_codes[NUM_STATUS] = {0, 200, 400, 404, 408, 429, 500, 502, 503, 504};
+static _Atomic uint64_t responses[NUM_STATUS + 1];    /* last is "other" */
+
+static const char *stage_names[NUM_STAGES] = {
+    "header", "parse", "cgi_spawn", "cgi_first_byte", "cgi_exit", "send"
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "wserver_connections_accepted_total",
+    "wserver_connections_active",
+    "wserver_cgi_started_total",
+    "wserver_cgi_inflight",
+    "wserver_bytes_sent_total",
+    "wserver_timeouts_total",
+    "wserver_responses_compressed_total",
+    "wserver_compress_cache_hits_total",
+    "wserver_h2_connections_total",
+    "wserver_h2_streams_total",
+    "wserver_tls_handshakes_total",
+    "wserver_tls_resumed_total",
+    "wserver_ktls_connections_total",
+    "wserver_proxy_requests_total",
+    "wserver_proxy_connects_total",
+    "wserver_proxy_reused_total",
+    "wserver_proxy_retries_total",
+    "wserver_proxy_errors_total",
+    "wserver_rate_limited_total",
+    "wserver_memory_paused_total",
+    "wserver_memory_refused_total",
+    "wserver_memory_shed_total",
+    "wserver_cpu_migrations_total",
+    "wserver_node_migrations_total",
+    "wserver_connections_other_cpu_total",
+    "wserver_connections_cross_node_total",
+    "wserver_pack_hits_total",
+    "wserver_cgi_spilled_total",
+    "wserver_request_body_bytes_total",
+};
+
+static int bucketIndex(uint64_t v) {
+    if (v < SUB_BUCKETS) {
+        return (int) v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= OCTAVES + SUB_BITS - 1) {
+        return NUM_BUCKETS - 1;
+    }
+    int sub = (int) (v >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/* Smallest value that does not fit in bucket i. */
+static uint64_t bucketLimit(int i) {
+    if (i < SUB_BUCKETS) {
+        return i + 1;
+    }
+    int octave = i / SUB_BUCKETS;
+    int sub = i % SUB_BUCKETS;
+    return (uint64_t) (SUB_BUCKETS + sub + 1) << (octave - 1);
+}
+
+/* Record the duration between two nowUsec() timestamps for stage.
+ * Stages that were never reached (either timestamp 0) are ignored.
+ */
+void statsRecord(int stage, uint64_t from_us, uint64_t to_us) {
+    if (from_us == 0 || to_us < from_us) {
+        return;
+    }
+    uint64_t v = to_us - from_us;
+    struct histogram *h = &hist[stage];
+    atomic_fetch_add_explicit(&h->bucket[bucketIndex(v)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_us, v, memory_order_relaxed);
+}
+
+void statsAdd(int c, int64_t delta) {
+    atomic_fetch_add_explicit(&counter[c], delta, memory_order_relaxed);
+}
+
+/* Count a finished request by status code; 0 means no response was sent.
+ */
+void statsResponse(int status) {
+    int i = 0;
+    while (i < NUM_STATUS && status_codes[i] != status) {
+        i++;
+    }
+    atomic_fetch_add_explicit(&responses[i], 1, memory_order_relaxed);
+}
+
+/* Return the upper bound of the bucket holding quantile q of h. */
+static uint64_t quantile(uint64_t *snap, uint64_t total, double q) {
+    uint64_t rank = (uint64_t) (q * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += snap[i];
+        if (seen > rank) {
+            return bucketLimit(i);
+        }
+    }
+    return bucketLimit(NUM_BUCKETS - 1);
+}
+
+#define APPEND(...) do { \
+        if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+/* Render all metrics into buf in the Prometheus text exposition format.
+ * Return the length of the text, truncated to size - 1.
+ */
+int statsRender(char *buf, int size) {
+    int len = 0;
+
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        const char *name = counter_names[c];
+        int gauge = (c == STAT_ACTIVE_CONNS || c == STAT_CGI_INFLIGHT);
+        APPEND("# TYPE %s %s\n%s %lld\n", name, gauge ? "gauge" : "counter",
+                name, (long long) atomic_load(&counter[c]));
+    }
+
+    APPEND("# TYPE wserver_responses_total counter\n");
+    for (int i = 0; i <= NUM_STATUS; i++) {
+        uint64_t n = atomic_load(&responses[i]);
+        if (i == NUM_STATUS) {
+            APPEND("wserver_responses_total{code=\"other\"} %llu\n",
+                    (unsigned long long) n);
+        } else if (status_codes[i] == 0) {
+            APPEND("wserver_responses_total{code=\"none\"} %llu\n",
+                    (unsigned long long) n);
+        } else {
+            APPEND("wserver_responses_total{code=\"%d\"} %llu\n",
+                    status_codes[i], (unsigned long long) n);
+        }
+    }
+
+    APPEND("# TYPE wserver_stage_seconds histogram\n");
+    for (int s = 0; s < NUM_STAGES; s++) {
+        uint64_t snap[NUM_BUCKETS];
+        uint64_t total = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            snap[i] = atomic_load_explicit(&hist[s].bucket[i], memory_order_relaxed);
+            total += snap[i];
+        }
+        /* Export octave boundaries only; sub-buckets never straddle them */
+        uint64_t cumulative = 0;
+        int i = 0;
+        for (int oct = 0; oct < EXPORT_OCTAVES; oct++) {
+            uint64_t le = (uint64_t) 1 << oct;
+            while (i < NUM_BUCKETS && bucketLimit(i) <= le) {
+                cumulative += snap[i++];
+            }
+            APPEND("wserver_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    stage_names[s], le / 1e6, (unsigned long long) cumulative);
+        }
+        APPEND("wserver_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                stage_names[s], (unsigned long long) total);
+        APPEND("wserver_stage_seconds_sum{stage=\"%s\"} %g\n", stage_names[s],
+                atomic_load(&hist[s].sum_us) / 1e6);
+        APPEND("wserver_stage_seconds_count{stage=\"%s\"} %llu\n",
+                stage_names[s], (unsigned long long) total);
+    }
+
+    /* Quantiles from the full-resolution buckets */
+    static const double qs[] = {0.5, 0.9, 0.99, 0.999};
+    APPEND("# TYPE wserver_stage_quantile_seconds gauge\n");
+    for (int s = 0; s < NUM_STAGES; s++) {
+        uint64_t snap[NUM_BUCKETS];
+        uint64_t total = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            snap[i] = atomic_load_explicit(&hist[s].bucket[i], memory_order_relaxed);
+            total += snap[i];
+        }
+        if (total == 0) {
+            continue;
+        }
+        for (int q = 0; q < (int) (sizeof(qs) / sizeof(qs[0])); q++) {
+            APPEND("wserver_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %g\n",
+                    stage_names[s], qs[q], quantile(snap, total, qs[q]) / 1e6);
+        }
+    }
+
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+/* Request lifecycle stages with a latency histogram each. */
+enum stat_stage {
+    STAGE_HEADER,       /* accept -> request header complete */
+    STAGE_PARSE,        /* parsing and validating the request */
+    STAGE_SPAWN,        /* pipe + fork of the CGI program */
+    STAGE_FIRST_BYTE,   /* fork -> first byte of CGI output */
+    STAGE_CGI_EXIT,     /* fork -> CGI output complete and child reaped */
+    STAGE_SEND,         /* response ready -> last byte written */
+    NUM_STAGES
+};
+
+/* Gauges and counters other than the per-status response counts. */
+enum stat_counter {
+    STAT_ACCEPTED,          /* connections accepted */
+    STAT_ACTIVE_CONNS,      /* gauge: connections currently open */
+    STAT_CGI_STARTED,       /* CGI programs forked */
+    STAT_CGI_INFLIGHT,      /* gauge: CGI programs not yet reaped */
+    STAT_BYTES_SENT,        /* response bytes written */
+    STAT_TIMEOUTS,          /* connections ended by a deadline */
+    STAT_COMPRESSED,        /* responses sent with a content coding */
+    STAT_ZCACHE_HITS,       /* compressed variants found in the cache */
+    STAT_H2_CONNS,          /* connections that switched to HTTP/2 */
+    STAT_H2_STREAMS,        /* HTTP/2 streams opened */
+    STAT_TLS_HANDSHAKES,    /* TLS handshakes completed */
+    STAT_TLS_RESUMED,       /* of those, resumed sessions */
+    STAT_KTLS,              /* of those, handed to kernel TLS */
+    STAT_UPSTREAM_REQUESTS, /* requests for proxied programs */
+    STAT_UPSTREAM_CONNECTS, /* connections opened to upstreams */
+    STAT_UPSTREAM_REUSED,   /* requests sent on a pooled connection */
+    STAT_UPSTREAM_RETRIES,  /* requests retried after a stale connection */
+    STAT_UPSTREAM_ERRORS,   /* requests failed with 502 or 504 */
+    STAT_RATE_LIMITED,      /* requests refused with 429, see ratelimit.c */
+    STAT_MEM_PAUSED,        /* CGI pipes paused for memory, see mem.c */
+    STAT_MEM_REFUSED,       /* requests refused with 503 for memory */
+    STAT_MEM_SHED,          /* connections ended to free memory */
+    STAT_CPU_MIGRATIONS,    /* event loop moved to another CPU, see affinity.c */
+    STAT_NODE_MIGRATIONS,   /* ... and NUMA node */
+    STAT_CONN_OTHER_CPU,    /* connections received on another CPU */
+    STAT_CONN_CROSS_NODE,   /* ... on another NUMA node */
+    STAT_PACK_HITS,         /* responses from the content pack, see pack.c */
+    STAT_CGI_SPILLED,       /* CGI outputs spilled to a file */
+    STAT_BODY_BYTES,        /* request body bytes passed to CGI programs */
+    NUM_COUNTERS
+};
+
+void statsRecord(int stage, uint64_t from_us, uint64_t to_us);
+void statsAdd(int counter, int64_t delta);
+void statsResponse(int status);
+int statsRender(char *buf, int size);
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* stubserver: a keep-alive HTTP/1.1 backend for trying out and
+ * benchmarking wserver -u.
+ *
+ * Every request gets a 200 with a small HTML body, after delay_ms (-d).
+ * The query string can ask for something else: status=N answers with
+ * status N, size=N with a body of N bytes.  With -c bodies are sent
+ * chunked; with -k n a connection is closed after n requests, as servers
+ * with a keep-alive limit do.  One thread per connection.
+ */
+
+#define USAGE "Usage: stubserver [-d delay_ms] [-c] [-k max_requests] <port>\n"
+#define REQ_MAX 8192
+#define CHUNK 4096
+
+static int delay_ms;
+static int chunked;
+static int max_requests;
+static int port;
+
+/* Return the value of the query parameter name in the request line req,
+ * or def if it is not there.
+ */
+static long param(const char *req, const char *name, long def) {
+    const char *q = strchr(req, '?');
+    const char *end = strchr(req, ' ');
+    end = end != NULL ? strchr(end + 1, ' ') : NULL;
+    int len = strlen(name);
+    while (q != NULL && (end == NULL || q < end)) {
+        q++;
+        if (strncmp(q, name, len) == 0 && q[len] == '=') {
+            return atol(q + len + 1);
+        }
+        q = strchr(q, '&');
+    }
+    return def;
+}
+
+static int sendAll(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Answer the request line in req on fd; last says we close afterwards. */
+static int respond(int fd, const char *req, int last) {
+    int status = param(req, "status", 200);
+    long size = param(req, "size", -1);
+    char body[CHUNK];
+    int body_len;
+    if (size < 0) {
+        body_len = snprintf(body, sizeof(body),
+                "<html><body><p>stubserver on port %d</p></body></html>\n", port);
+        size = body_len;
+    } else {
+        memset(body, 'x', sizeof(body));
+        body_len = sizeof(body);
+    }
+    if (delay_ms > 0) {
+        usleep(delay_ms * 1000);
+    }
+    char framing[64];
+    if (chunked) {
+        snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n");
+    } else {
+        snprintf(framing, sizeof(framing), "Content-Length: %ld\r\n", size);
+    }
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+            "HTTP/1.1 %d Stub\r\nContent-Type: text/html\r\n%s%s\r\n",
+            status, framing, last ? "Connection: close\r\n" : "");
+    if (sendAll(fd, head, n) == -1) {
+        return -1;
+    }
+    while (size > 0) {
+        int len = size < body_len ? size : body_len;
+        if (chunked) {
+            char line[32];
+            if (sendAll(fd, line, snprintf(line, sizeof(line), "%x\r\n", len)) == -1 ||
+                    sendAll(fd, body, len) == -1 || sendAll(fd, "\r\n", 2) == -1) {
+                return -1;
+            }
+        } else if (sendAll(fd, body, len) == -1) {
+            return -1;
+        }
+        size -= len;
+    }
+    if (chunked && sendAll(fd, "0\r\n\r\n", 5) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static void *serve(void *arg) {
+    int fd = (int) (long) arg;
+    char buf[REQ_MAX + 1];
+    int len = 0;
+    int count = 0;
+    for (;;) {
+        char *end = memmem(buf, len, "\r\n\r\n", 4);
+        if (end == NULL) {
+            if (len == REQ_MAX) {
+                break;
+            }
+            ssize_t n = recv(fd, buf + len, REQ_MAX - len, 0);
+            if (n <= 0) {
+                break;
+            }
+            len += n;
+            continue;
+        }
+        buf[len] = '\0';
+        count++;
+        int last = (max_requests > 0 && count == max_requests) ||
+                strcasestr(buf, "\r\nConnection: close") != NULL;
+        if (respond(fd, buf, last) == -1 || last) {
+            break;
+        }
+        int used = end + 4 - buf;
+        memmove(buf, buf + used, len - used);
+        len -= used;
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:ck:")) != -1) {
+        switch (opt) {
+        case 'd':
+            delay_ms = atoi(optarg);
+            break;
+        case 'c':
+            chunked = 1;
+            break;
+        case 'k':
+            max_requests = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    port = atoi(argv[optind]);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+            listen(listenfd, 128) == -1) {
+        perror("stubserver");
+        exit(1);
+    }
+    for (;;) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, serve, (void *) (long) fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
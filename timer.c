@@ -0,0 +1,153 @@
+#include <stddef.h>
+
+#include "timer.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define LEVEL_SPAN(l) ((uint64_t) 1 << (WHEEL_BITS * ((l) + 1)))
+
+static void listInit(struct timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+void timerWheelInit(struct timer_wheel *w, uint64_t now_ms) {
+    w->current = now_ms;
+    w->count = 0;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            listInit(&w->slot[l][i]);
+        }
+    }
+}
+
+void timerInit(struct timer *t) {
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+int timerPending(const struct timer *t) {
+    return t->next != NULL;
+}
+
+/* Link t into the slot its expiry falls in, relative to w->current. */
+static void place(struct timer_wheel *w, struct timer *t) {
+    uint64_t expires = t->expires;
+    struct timer *head;
+    if (expires < w->current) {
+        /* already due: fire on the next tick */
+        expires = w->current;
+    }
+    uint64_t delta = expires - w->current;
+    if (delta >= LEVEL_SPAN(WHEEL_LEVELS - 1)) {
+        expires = w->current + LEVEL_SPAN(WHEEL_LEVELS - 1) - 1;
+        delta = expires - w->current;
+    }
+    int level = 0;
+    while (delta >= LEVEL_SPAN(level)) {
+        level++;
+    }
+    head = &w->slot[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void unlink(struct timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/* Arm t to expire at expires_ms, re-arming it if it is already pending. */
+void timerAdd(struct timer_wheel *w, struct timer *t, uint64_t expires_ms) {
+    if (timerPending(t)) {
+        unlink(t);
+        w->count--;
+    }
+    t->expires = expires_ms;
+    place(w, t);
+    w->count++;
+}
+
+void timerDel(struct timer_wheel *w, struct timer *t) {
+    if (timerPending(t)) {
+        unlink(t);
+        w->count--;
+    }
+}
+
+/* Move every timer in slot (level, index) down to where it now belongs.
+ * Return index so the caller knows whether the next level wrapped too.
+ */
+static int cascade(struct timer_wheel *w, int level, int index) {
+    struct timer *head = &w->slot[level][index];
+    struct timer *t = head->next;
+    listInit(head);
+    while (t != head) {
+        struct timer *next = t->next;
+        place(w, t);
+        t = next;
+    }
+    return index;
+}
+
+/* Expire every timer due at or before now_ms, calling expire(t, arg) for
+ * each after it has been disarmed.  expire may re-arm or delete any timer.
+ */
+void timerRun(struct timer_wheel *w, uint64_t now_ms,
+        void (*expire)(struct timer *t, void *arg), void *arg) {
+    if (w->count == 0) {
+        /* nothing to cascade; jump straight to the present */
+        if (now_ms >= w->current) {
+            w->current = now_ms + 1;
+        }
+        return;
+    }
+    while (w->current <= now_ms) {
+        int index = w->current & WHEEL_MASK;
+        if (index == 0) {
+            int level = 1;
+            while (level < WHEEL_LEVELS &&
+                    cascade(w, level,
+                        (w->current >> (WHEEL_BITS * level)) & WHEEL_MASK) == 0) {
+                level++;
+            }
+        }
+        struct timer *head = &w->slot[0][index];
+        while (head->next != head) {
+            struct timer *t = head->next;
+            unlink(t);
+            w->count--;
+            expire(t, arg);
+        }
+        w->current++;
+        if (w->count == 0 && w->current <= now_ms) {
+            w->current = now_ms + 1;
+        }
+    }
+}
+
+/* Return how many ms the event loop may sleep before the next timer can
+ * expire, or -1 if no timer is armed.  The answer may be early (when the
+ * next timer sits in an upper level) but never late.
+ */
+int64_t timerNextTimeout(struct timer_wheel *w, uint64_t now_ms) {
+    if (w->count == 0) {
+        return -1;
+    }
+    if (w->current > now_ms + 1) {
+        now_ms = w->current - 1;
+    }
+    int start = w->current & WHEEL_MASK;
+    for (int i = 0; i < WHEEL_SIZE - start; i++) {
+        if (w->slot[0][start + i].next != &w->slot[0][start + i]) {
+            uint64_t due = w->current + i;
+            return due > now_ms ? (int64_t) (due - now_ms) : 0;
+        }
+    }
+    /* nothing more in level 0 before it wraps and cascades */
+    uint64_t wrap = (w->current | WHEEL_MASK) + 1;
+    return wrap > now_ms ? (int64_t) (wrap - now_ms) : 0;
+}
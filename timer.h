@@ -0,0 +1,34 @@
+#include <stdint.h>
+
+/* Hierarchical timer wheel with 1ms ticks.
+ *
+ * Four levels of 64 slots cover 1ms..64ms, ..4s, ..4.4min and ..4.7h;
+ * later deadlines are clamped to the last level.  Adding and removing a
+ * timer is O(1); timers in the upper levels are cascaded down as the wheel
+ * turns.  Timers are embedded in the structure they belong to, so the wheel
+ * never allocates.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct timer {
+    struct timer *next, *prev;  /* slot list; next == NULL when not armed */
+    uint64_t expires;           /* ms, same clock as the wheel */
+    int kind;                   /* for the owner's use */
+};
+
+struct timer_wheel {
+    uint64_t current;           /* next tick to process */
+    int count;                  /* armed timers */
+    struct timer slot[WHEEL_LEVELS][WHEEL_SIZE];    /* list heads */
+};
+
+void timerWheelInit(struct timer_wheel *w, uint64_t now_ms);
+void timerInit(struct timer *t);
+void timerAdd(struct timer_wheel *w, struct timer *t, uint64_t expires_ms);
+void timerDel(struct timer_wheel *w, struct timer *t);
+int timerPending(const struct timer *t);
+int64_t timerNextTimeout(struct timer_wheel *w, uint64_t now_ms);
+void timerRun(struct timer_wheel *w, uint64_t now_ms,
+        void (*expire)(struct timer *t, void *arg), void *arg);
@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "wrapsock.h"
+#include "ws_helpers.h"
+#include "tls.h"
+#include "log.h"
+#include "stats.h"
+#include "mem.h"
+
+/* TLS termination.
+ *
+ * With a certificate (wserver -c), every accepted connection first goes
+ * through a TLS handshake driven by tls.c, before the event loop sees a
+ * single request byte.  The handshake is non-blocking: tls.c watches the
+ * socket through the hooks set with tlsSetLoop, in the same one-shot way
+ * as h2.c, and has its own deadline (TLS_HANDSHAKE_TIMEOUT_MS).  Sessions
+ * are resumed from tickets, or from a server-side cache of
+ * TLS_SESSION_CACHE sessions for TLS 1.2 clients that do not do tickets;
+ * ALPN offers h2 and http/1.1.
+ *
+ * Once the handshake is done OpenSSL tries to hand the record layer to
+ * the kernel (kTLS, setsockopt TCP_ULP "tls"), which needs kernel
+ * support and a cipher the kernel implements.  If it took for both
+ * directions, the socket goes back to the event loop as is: reads and
+ * writes on it carry plaintext, writev, sendfile and splice included, and
+ * the kernel does the crypto without an extra copy.
+ *
+ * Otherwise the connection falls back to a relay in user space: the event
+ * loop gets one end of a socketpair in place of the socket, and tls.c
+ * moves data between the other end and SSL_read/SSL_write, one record at
+ * a time in each direction.  Nothing else in the server needs to know.
+ * The relay outlives the client state: once the event loop closes its
+ * end, the rest of the response is flushed and the relay closes the
+ * socket, after a close_notify.  A client that stops reading gets
+ * SEND_TIMEOUT_MS per record.
+ */
+
+#ifdef HAVE_OPENSSL
+
+struct tls_conn {
+    SSL *ssl;
+    struct clientstate *cs;     /* while handshaking, NULL after */
+    int sock;                   /* the client's TCP socket */
+    int inner;                  /* our end of the relay socketpair, or -1 */
+    struct timer timer;         /* handshake or relay deadline */
+    char in[TLS_RECORD];        /* from the client, not yet relayed */
+    int in_off, in_len;
+    char out[TLS_RECORD];       /* to the client, not yet taken by SSL_write */
+    int out_len;
+    int read_wants;             /* events a blocked SSL_read waits for */
+    int write_wants;            /* events a blocked SSL_write waits for */
+    int client_eof;             /* the client is done sending */
+    int server_eof;             /* the event loop closed its end */
+    int failed;                 /* the client is unreachable; drain inner */
+};
+
+/* Owner of every descriptor tls.c watches, indexed by descriptor */
+struct fd_owner {
+    struct tls_conn *conn;
+    int armed;                  /* events asked for and not yet reported */
+};
+
+static SSL_CTX *ctx;
+static struct fd_owner *owners;
+static int owners_size;
+static int live;                /* struct tls_conn allocated */
+
+static struct {
+    void (*watch)(int fd, int events, void *arg);
+    void (*unwatch)(int fd, void *arg);
+    void (*resume)(struct clientstate *cs, void *arg);
+    void *arg;
+} loop;
+
+static uint64_t nowMsec(void) {
+    return nowUsec() / 1000;
+}
+
+static void logSslError(const char *what) {
+    unsigned long e = ERR_get_error();
+    char msg[256];
+    if (e != 0) {
+        ERR_error_string_n(e, msg, sizeof(msg));
+        LOG_ERROR("%s: %s\n", what, msg);
+    } else {
+        LOG_ERROR("%s: %s\n", what, strerror(errno));
+    }
+    ERR_clear_error();
+}
+
+/* Prefer h2 when the client offers it; h2.c picks it up by its preface */
+static int alpnSelect(SSL *ssl, const unsigned char **out,
+        unsigned char *outlen, const unsigned char *in, unsigned int inlen,
+        void *arg) {
+    static const unsigned char ours[] = "\x02h2\x08http/1.1";
+    (void) ssl;
+    (void) arg;
+    if (SSL_select_next_proto((unsigned char **) out, outlen, ours,
+            sizeof(ours) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/* Serve TLS with the certificate chain in cert_file and the private key in
+ * key_file (both PEM), using kernel TLS when ktls is set and the kernel
+ * allows.  Return 0, or -1 if the certificate or key cannot be used.
+ */
+int tlsInit(const char *cert_file, const char *key_file, int ktls) {
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        logSslError("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1) {
+        logSslError(cert_file);
+        goto fail;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(ctx) != 1) {
+        logSslError(key_file);
+        goto fail;
+    }
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "wserver", 7);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+    // One ticket is enough for a client that reconnects one at a time
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_alpn_select_cb(ctx, alpnSelect, NULL);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // A client that closes without close_notify is done, not broken
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    if (ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        LOG_WARN("OpenSSL has no kTLS support, relaying in user space\n");
+#endif
+    }
+    // The socket BIO writes with write(), not send(MSG_NOSIGNAL); main
+    // ignores the SIGPIPE of a client that resets mid-response
+    return 0;
+
+fail:
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return -1;
+}
+
+/* Set the event loop hooks: watch and unwatch as for h2SetLoop, with
+ * events reported through tlsEvent, and resume(cs, arg), which hands the
+ * connection cs back to the event loop to read its request from
+ * cs->sock.
+ */
+void tlsSetLoop(void (*watch)(int fd, int events, void *arg),
+        void (*unwatch)(int fd, void *arg),
+        void (*resume)(struct clientstate *cs, void *arg), void *arg) {
+    loop.watch = watch;
+    loop.unwatch = unwatch;
+    loop.resume = resume;
+    loop.arg = arg;
+}
+
+static void watchFd(struct tls_conn *c, int fd, int events) {
+    if (fd >= owners_size) {
+        int size = owners_size ? owners_size : 64;
+        while (size <= fd) {
+            size *= 2;
+        }
+        owners = realloc(owners, size * sizeof(*owners));
+        memset(owners + owners_size, 0, (size - owners_size) * sizeof(*owners));
+        owners_size = size;
+    }
+    struct fd_owner *o = &owners[fd];
+    if (o->conn != c) {
+        o->conn = c;
+        o->armed = 0;
+    }
+    int add = events & ~o->armed;
+    if (add) {
+        o->armed |= add;
+        loop.watch(fd, add, loop.arg);
+    }
+}
+
+/* Forget fd, cancelling whatever is still asked for on it. */
+static void unwatchFd(int fd) {
+    if (fd < owners_size && owners[fd].conn != NULL) {
+        if (owners[fd].armed) {
+            loop.unwatch(fd, loop.arg);
+        }
+        owners[fd].conn = NULL;
+        owners[fd].armed = 0;
+    }
+}
+
+/* Free c; its descriptors are closed, or someone else's, by now. */
+static void connFree(struct tls_conn *c) {
+    disarmTimer(&c->timer);
+    SSL_free(c->ssl);
+    free(c);
+    memAdd(MEM_TLS, -(int64_t) sizeof(*c));
+    live--;
+}
+
+/* The handshake of c failed or timed out: drop the client. */
+static void handshakeFailed(struct tls_conn *c) {
+    struct clientstate *cs = c->cs;
+    ERR_clear_error();
+    unwatchFd(c->sock);
+    connFree(c);
+    clientGone(cs);
+}
+
+/* The client is done sending: pass the EOF on to the event loop. */
+static void clientEof(struct tls_conn *c) {
+    c->client_eof = 1;
+    shutdown(c->inner, SHUT_WR);
+}
+
+/* The client cannot be written to any more.  Stop using SSL and throw
+ * away whatever the event loop still sends until it closes its end.
+ */
+static void relayFailed(struct tls_conn *c) {
+    ERR_clear_error();
+    c->failed = 1;
+    c->in_len = 0;
+    c->out_len = 0;
+    if (!c->client_eof) {
+        clientEof(c);
+    }
+}
+
+static void relayDone(struct tls_conn *c) {
+    if (!c->failed) {
+        // Best effort: the socket is non-blocking and we do not wait
+        SSL_shutdown(c->ssl);
+    }
+    unwatchFd(c->sock);
+    unwatchFd(c->inner);
+    Close(c->sock);
+    Close(c->inner);
+    connFree(c);
+}
+
+/* Move what can be moved between the client and the event loop's end of
+ * the relay, then ask for the events that unblock the rest.
+ */
+static void relay(struct tls_conn *c) {
+    int progress = 0;
+
+    // Client to server
+    while (!c->client_eof) {
+        if (c->in_len == 0) {
+            int n = SSL_read(c->ssl, c->in, TLS_RECORD);
+            if (n <= 0) {
+                int err = SSL_get_error(c->ssl, n);
+                if (err == SSL_ERROR_WANT_READ) {
+                    c->read_wants = POLLIN;
+                } else if (err == SSL_ERROR_WANT_WRITE) {
+                    c->read_wants = POLLOUT;
+                } else if (err == SSL_ERROR_ZERO_RETURN
+                        || (err == SSL_ERROR_SYSCALL && errno == 0)) {
+                    // close_notify, or EOF without one
+                    clientEof(c);
+                } else {
+                    relayFailed(c);
+                }
+                break;
+            }
+            c->read_wants = 0;
+            c->in_off = 0;
+            c->in_len = n;
+        }
+        ssize_t n = send(c->inner, c->in + c->in_off, c->in_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                // The event loop closed its end; nobody wants the rest
+                c->in_len = 0;
+                c->client_eof = 1;
+            }
+            break;
+        }
+        c->in_off += n;
+        c->in_len -= n;
+    }
+
+    // Server to client
+    while (!c->server_eof) {
+        if (c->out_len == 0) {
+            ssize_t n = recv(c->inner, c->out, TLS_RECORD, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN) {
+                break;
+            }
+            if (n <= 0) {
+                c->server_eof = 1;
+                break;
+            }
+            if (c->failed) {
+                continue;
+            }
+            c->out_len = n;
+        }
+        int n = SSL_write(c->ssl, c->out, c->out_len);
+        if (n <= 0) {
+            int err = SSL_get_error(c->ssl, n);
+            if (err == SSL_ERROR_WANT_WRITE) {
+                c->write_wants = POLLOUT;
+                break;
+            }
+            if (err == SSL_ERROR_WANT_READ) {
+                c->write_wants = POLLIN;
+                break;
+            }
+            relayFailed(c);
+            continue;
+        }
+        c->write_wants = 0;
+        c->out_len = 0;
+        progress = 1;
+    }
+
+    if (c->server_eof) {
+        relayDone(c);
+        return;
+    }
+    // Only a client that does not read holds the relay up
+    if (c->out_len > 0) {
+        if (progress || !timerPending(&c->timer)) {
+            armTimer(&c->timer, TIMER_TLS, nowMsec() + SEND_TIMEOUT_MS);
+        }
+    } else {
+        disarmTimer(&c->timer);
+    }
+
+    int sock_events = 0;
+    int inner_events = 0;
+    if (!c->client_eof && c->in_len == 0) {
+        sock_events |= c->read_wants;
+    }
+    if (c->in_len > 0) {
+        inner_events |= POLLOUT;
+    }
+    if (c->out_len > 0) {
+        sock_events |= c->write_wants;
+    } else {
+        inner_events |= POLLIN;
+    }
+    watchFd(c, c->sock, sock_events);
+    watchFd(c, c->inner, inner_events);
+}
+
+/* The handshake of c is complete.  Hand the socket back to the event
+ * loop if the kernel took over the record layer, or set up the relay.
+ */
+static void handshakeDone(struct tls_conn *c) {
+    struct clientstate *cs = c->cs;
+    statsAdd(STAT_TLS_HANDSHAKES, 1);
+    if (SSL_session_reused(c->ssl)) {
+        statsAdd(STAT_TLS_RESUMED, 1);
+    }
+    unwatchFd(c->sock);
+    disarmTimer(&c->timer);
+
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl))
+            && BIO_get_ktls_recv(SSL_get_rbio(c->ssl))) {
+        LOG_DEBUG("kTLS on socket %d\n", c->sock);
+        statsAdd(STAT_KTLS, 1);
+        connFree(c);
+        armDeadline(cs, TIMER_IDLE, nowMsec() + IDLE_TIMEOUT_MS);
+        loop.resume(cs, loop.arg);
+        return;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        handshakeFailed(c);
+        return;
+    }
+    cs->sock = sv[0];
+    c->inner = sv[1];
+    c->cs = NULL;
+    armDeadline(cs, TIMER_IDLE, nowMsec() + IDLE_TIMEOUT_MS);
+    loop.resume(cs, loop.arg);
+    // The request may have come in with the last handshake flight
+    relay(c);
+}
+
+static void handshake(struct tls_conn *c) {
+    int rc = SSL_accept(c->ssl);
+    if (rc == 1) {
+        handshakeDone(c);
+        return;
+    }
+    int err = SSL_get_error(c->ssl, rc);
+    if (err == SSL_ERROR_WANT_READ) {
+        watchFd(c, c->sock, POLLIN);
+    } else if (err == SSL_ERROR_WANT_WRITE) {
+        watchFd(c, c->sock, POLLOUT);
+    } else {
+        LOG_DEBUG("TLS handshake on socket %d failed\n", c->sock);
+        handshakeFailed(c);
+    }
+}
+
+/* Start the TLS handshake on the newly accepted connection cs.
+ * Return 0 if TLS is off, so the event loop reads cs->sock itself, or 1
+ * if tls.c took the connection over; it comes back through the resume
+ * hook once the handshake is done, or is ended with clientGone.
+ */
+int tlsStart(struct clientstate *cs) {
+    if (ctx == NULL) {
+        return 0;
+    }
+    struct tls_conn *c = calloc(1, sizeof(*c));
+    memAdd(MEM_TLS, sizeof(*c));
+    live++;
+    c->cs = cs;
+    c->sock = cs->sock;
+    c->inner = -1;
+    timerInit(&c->timer);
+    c->ssl = SSL_new(ctx);
+    if (c->ssl == NULL || SSL_set_fd(c->ssl, cs->sock) != 1) {
+        logSslError("SSL_new");
+        handshakeFailed(c);
+        return 1;
+    }
+    // The handshake has a deadline of its own
+    disarmTimer(&cs->deadline);
+    armTimer(&c->timer, TIMER_TLS, cs->t_accept / 1000 + TLS_HANDSHAKE_TIMEOUT_MS);
+    handshake(c);
+    return 1;
+}
+
+/* Handle events (POLLIN and/or POLLOUT) on fd, which tls.c asked the
+ * event loop to watch.  Return 0, or -1 if fd is not one of ours.
+ */
+int tlsEvent(int fd, int events) {
+    if (fd < 0 || fd >= owners_size || owners[fd].conn == NULL) {
+        return -1;
+    }
+    struct fd_owner *o = &owners[fd];
+    struct tls_conn *c = o->conn;
+    o->armed &= ~events;
+    if (c->cs != NULL) {
+        handshake(c);
+    } else {
+        relay(c);
+    }
+    return 0;
+}
+
+/* The deadline t of a handshake or a relay expired. */
+void tlsExpired(struct timer *t) {
+    struct tls_conn *c = (struct tls_conn *)
+            ((char *) t - offsetof(struct tls_conn, timer));
+    statsAdd(STAT_TIMEOUTS, 1);
+    if (c->cs != NULL) {
+        LOG_DEBUG("TLS handshake on socket %d timed out\n", c->sock);
+        handshakeFailed(c);
+        return;
+    }
+    LOG_DEBUG("TLS client on socket %d stopped reading\n", c->sock);
+    relayFailed(c);
+    relay(c);
+}
+
+/* Return the number of handshakes and relays in progress; a draining
+ * server must wait for the relays, which outlive their client state.
+ */
+int tlsConnections(void) {
+    return live;
+}
+
+/* Return 1 if connections start with a TLS handshake. */
+int tlsEnabled(void) {
+    return ctx != NULL;
+}
+
+#else /* !HAVE_OPENSSL */
+
+int tlsInit(const char *cert_file, const char *key_file, int ktls) {
+    (void) cert_file;
+    (void) key_file;
+    (void) ktls;
+    LOG_ERROR("wserver was built without OpenSSL, TLS is not available\n");
+    return -1;
+}
+
+void tlsSetLoop(void (*watch)(int fd, int events, void *arg),
+        void (*unwatch)(int fd, void *arg),
+        void (*resume)(struct clientstate *cs, void *arg), void *arg) {
+    (void) watch;
+    (void) unwatch;
+    (void) resume;
+    (void) arg;
+}
+
+int tlsStart(struct clientstate *cs) {
+    (void) cs;
+    return 0;
+}
+
+int tlsEvent(int fd, int events) {
+    (void) fd;
+    (void) events;
+    return -1;
+}
+
+void tlsExpired(struct timer *t) {
+    (void) t;
+}
+
+int tlsConnections(void) {
+    return 0;
+}
+
+int tlsEnabled(void) {
+    return 0;
+}
+
+#endif /* HAVE_OPENSSL */
@@ -0,0 +1,17 @@
+/* TLS termination with kernel TLS offload; see tls.c */
+#define TLS_HANDSHAKE_TIMEOUT_MS 5000  /* accept -> handshake complete */
+#define TLS_SESSION_CACHE 20480        /* sessions kept for resumption */
+#define TLS_RECORD 16384               /* relay buffers, one record each */
+
+struct clientstate;
+struct timer;
+
+int tlsInit(const char *cert_file, const char *key_file, int ktls);
+void tlsSetLoop(void (*watch)(int fd, int events, void *arg),
+        void (*unwatch)(int fd, void *arg),
+        void (*resume)(struct clientstate *cs, void *arg), void *arg);
+int tlsStart(struct clientstate *cs);
+int tlsEvent(int fd, int events);
+void tlsExpired(struct timer *t);
+int tlsConnections(void);
+int tlsEnabled(void);
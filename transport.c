@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+
+#include "transport.h"
+#include "log.h"
+#include "affinity.h"
+
+/* The transport: everything the HTTP/1 path does to the outside world.
+ *
+ * Client sockets (accept, read, write, close and socket options), the
+ * pipes and processes of CGI programs, poll(2) in the coroutine loop and
+ * the clock behind nowUsec all go through the io* functions below, which
+ * hand them to the transport in use.  That is the kernel unless a
+ * simulation installs the in-memory loopback of loopback.c, whose clients
+ * are scripted and whose clock is virtual (see simbench).
+ *
+ * The select loop itself, io_uring, HTTP/2, TLS and upstream connections
+ * always talk to the kernel: a simulation runs the coroutine loop with
+ * HTTP/1 clients.
+ */
+
+static int kernelAccept(int listenfd, struct sockaddr *sa, socklen_t *len) {
+    return accept4(listenfd, sa, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+static ssize_t kernelSend(int fd, const struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr msg = {0};
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(fd, &msg, flags);
+}
+
+/* Return our environment with the "NAME=value" strings of env in place
+ * of the variables they name, in a new array.
+ */
+static char **mergeEnv(char *const env[]) {
+    extern char **environ;
+    int n = 0, extra = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    while (env[extra] != NULL) {
+        extra++;
+    }
+    char **merged = malloc((n + extra + 1) * sizeof(char *));
+    int m = 0;
+    for (int i = 0; i < extra; i++) {
+        merged[m++] = env[i];
+    }
+    for (int i = 0; i < n; i++) {
+        int name_len = strcspn(environ[i], "=");
+        int replaced = 0;
+        for (int k = 0; k < extra && !replaced; k++) {
+            replaced = strncmp(env[k], environ[i], name_len + 1) == 0;
+        }
+        if (!replaced) {
+            merged[m++] = environ[i];
+        }
+    }
+    merged[m] = NULL;
+    return merged;
+}
+
+/* Run the CGI program path, with the variables of env (see mergeEnv) and
+ * its standard output on a new pipe.  If in_fd is not NULL, its standard
+ * input is another pipe, whose non-blocking write end goes in *in_fd.
+ * Return its pid and put the read end of the output pipe in *fd, or
+ * return -1.  A program that cannot be executed exits with status 100.
+ */
+static int kernelSpawn(const char *path, char *const env[], int *fd, int *in_fd) {
+    int pipe_fd[2];
+    int in_pipe[2] = {-1, -1};
+    if (pipe(pipe_fd) == -1) {
+        LOG_ERROR("pipe failed\n");
+        return -1;
+    }
+    // Close-on-exec, or another program could hold the write end open and
+    // this one would never see EOF
+    if (in_fd != NULL && pipe2(in_pipe, O_CLOEXEC) == -1) {
+        LOG_ERROR("pipe failed\n");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return -1;
+    }
+    char **merged = mergeEnv(env);
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG_ERROR("fork failed\n");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        if (in_fd != NULL) {
+            close(in_pipe[0]);
+            close(in_pipe[1]);
+        }
+        free(merged);
+        return -1;
+    }
+    if (pid == 0) {
+        // Child
+        signal(SIGPIPE, SIG_DFL);
+        affinityNode();
+        close(pipe_fd[0]);
+        dup2(pipe_fd[1], STDOUT_FILENO);
+        close(pipe_fd[1]);
+        if (in_fd != NULL) {
+            dup2(in_pipe[0], STDIN_FILENO);
+        }
+        char *argv[] = {(char *) path, NULL};
+        execve(path, argv, merged);
+        LOG_ERROR("Exec failed\n");
+        exit(100);
+    }
+    // Parent
+    free(merged);
+    close(pipe_fd[1]);
+    *fd = pipe_fd[0];
+    if (in_fd != NULL) {
+        close(in_pipe[0]);
+        fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
+        *in_fd = in_pipe[1];
+    }
+    return pid;
+}
+
+static int kernelStop(int pid) {
+    return kill(pid, SIGKILL);
+}
+
+static int kernelReap(int pid, int *status) {
+    return waitpid(pid, status, WNOHANG);
+}
+
+const struct transport kernel_transport = {
+    "kernel",
+    NULL,               // the monotonic clock, see nowUsec
+    kernelAccept,
+    read,
+    writev,
+    kernelSend,
+    sendfile,
+    close,
+    poll,
+    setsockopt,
+    kernelSpawn,
+    kernelStop,
+    kernelReap
+};
+
+static const struct transport *current = &kernel_transport;
+
+/* Send all I/O to t from now on.  Called before anything is set up, as
+ * the clock of t is the time of every deadline.
+ */
+void transportUse(const struct transport *t) {
+    current = t;
+    setClock(t->clock);
+}
+
+const char *transportName(void) {
+    return current->name;
+}
+
+/* Accept a connection on the non-blocking listenfd, as accept4 with
+ * SOCK_NONBLOCK and SOCK_CLOEXEC.
+ */
+int ioAccept(int listenfd, struct sockaddr *sa, socklen_t *len) {
+    return current->accept(listenfd, sa, len);
+}
+
+ssize_t ioRead(int fd, void *buf, size_t len) {
+    return current->read(fd, buf, len);
+}
+
+ssize_t ioWritev(int fd, const struct iovec *iov, int iovcnt) {
+    return current->writev(fd, iov, iovcnt);
+}
+
+/* As writev on the socket fd, with the flags of send(2). */
+ssize_t ioSend(int fd, const struct iovec *iov, int iovcnt, int flags) {
+    return current->send(fd, iov, iovcnt, flags);
+}
+
+/* As sendfile(2) from the regular file file_fd to the socket fd. */
+ssize_t ioSendfile(int fd, int file_fd, off_t *offset, size_t count) {
+    return current->sendfile(fd, file_fd, offset, count);
+}
+
+int ioClose(int fd) {
+    return current->close(fd);
+}
+
+int ioPoll(struct pollfd *fds, nfds_t nfds, int timeout_ms) {
+    return current->poll(fds, nfds, timeout_ms);
+}
+
+int ioSetsockopt(int fd, int level, int name, const void *val, socklen_t len) {
+    return current->setsockopt(fd, level, name, val, len);
+}
+
+/* Start the CGI program path as kernelSpawn does. */
+int ioSpawn(const char *path, char *const env[], int *fd, int *in_fd) {
+    return current->spawn(path, env, fd, in_fd);
+}
+
+/* Kill the program pid from ioSpawn; its pipe then reaches EOF. */
+int ioStop(int pid) {
+    return current->stop(pid);
+}
+
+/* Wait for the program pid from ioSpawn to end, as waitpid. */
+int ioReap(int pid, int *status) {
+    return current->reap(pid, status);
+}
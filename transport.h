@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Where the server's I/O goes: the kernel, or an in-memory loopback
+ * (see loopback.c); see transport.c
+ */
+struct transport {
+    const char *name;
+    uint64_t (*clock)(void);    /* monotonic time in us, for nowUsec */
+    int (*accept)(int listenfd, struct sockaddr *sa, socklen_t *len);
+    ssize_t (*read)(int fd, void *buf, size_t len);
+    ssize_t (*writev)(int fd, const struct iovec *iov, int iovcnt);
+    ssize_t (*send)(int fd, const struct iovec *iov, int iovcnt, int flags);
+    ssize_t (*sendfile)(int fd, int file_fd, off_t *offset, size_t count);
+    int (*close)(int fd);
+    int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout_ms);
+    int (*setsockopt)(int fd, int level, int name, const void *val, socklen_t len);
+    int (*spawn)(const char *path, char *const env[], int *fd, int *in_fd); /* a CGI program */
+    int (*stop)(int pid);
+    int (*reap)(int pid, int *status);  /* without waiting: 0 while it runs */
+};
+
+extern const struct transport kernel_transport;
+
+void transportUse(const struct transport *t);
+const char *transportName(void);
+
+int ioAccept(int listenfd, struct sockaddr *sa, socklen_t *len);
+ssize_t ioRead(int fd, void *buf, size_t len);
+ssize_t ioWritev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t ioSend(int fd, const struct iovec *iov, int iovcnt, int flags);
+ssize_t ioSendfile(int fd, int file_fd, off_t *offset, size_t count);
+int ioClose(int fd);
+int ioPoll(struct pollfd *fds, nfds_t nfds, int timeout_ms);
+int ioSetsockopt(int fd, int level, int name, const void *val, socklen_t len);
+int ioSpawn(const char *path, char *const env[], int *fd, int *in_fd);
+int ioStop(int pid);
+int ioReap(int pid, int *status);
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "upgrade.h"
+
+/* Zero-downtime binary upgrade.
+ *
+ * On SIGUSR2 the running server forks and execs its own binary again (so
+ * a freshly installed wserver replaces it), handing over the listening
+ * socket as an inherited descriptor:
+ *
+ *   WSERVER_LISTEN_FD  the listening socket; the new process uses it
+ *                      instead of binding the port
+ *   WSERVER_READY_FD   write end of a pipe; the new process writes a byte
+ *                      to it once its event loop is about to run
+ *
+ * Until that byte arrives the old process keeps accepting, so there is
+ * always someone taking connections off the shared accept queue.  Then
+ * it stops accepting and drains: it finishes the requests it has and
+ * exits when none are left or after DRAIN_TIMEOUT_MS.  If the new process
+ * dies before it is ready, the pipe reaches EOF and the old one carries on
+ * as if nothing happened.
+ *
+ * The event loops watch the descriptor returned by upgradeInit (readable
+ * after a SIGUSR2) and the one returned by upgradeStart.
+ */
+
+#define LISTEN_ENV "WSERVER_LISTEN_FD"
+#define READY_ENV "WSERVER_READY_FD"
+
+static char **saved_argv;
+static char exe_path[PATH_MAX];    /* absolute path of our binary */
+static int signal_pipe[2] = {-1, -1};
+static int ready_out = -1;          /* new process: tell the old one */
+static pid_t upgrade_pid = -1;      /* old process: the new one, while starting */
+static uint64_t drain_until;        /* old process: nowUsec() deadline, 0 if serving */
+
+static void onUpgradeSignal(int sig) {
+    (void) sig;
+    int saved_errno = errno;
+    if (write(signal_pipe[1], "u", 1) < 0) {
+        /* already pending */
+    }
+    errno = saved_errno;
+}
+
+/* Remember how we were started and catch SIGUSR2.  Return a descriptor
+ * that becomes readable when an upgrade is requested, or -1 on error.
+ *
+ * argv[0] is no use to execve when we were found through PATH, so resolve
+ * the binary's absolute path now.  It is the path, not /proc/self/exe, that
+ * gets exec'd later: that way a binary installed over ours is picked up.
+ */
+int upgradeInit(char **argv) {
+    saved_argv = argv;
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (len > 0) {
+        exe_path[len] = '\0';
+    } else if (realpath(argv[0], exe_path) == NULL) {
+        snprintf(exe_path, sizeof(exe_path), "%s", argv[0]);
+    }
+    if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onUpgradeSignal;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    return signal_pipe[0];
+}
+
+static int envFd(const char *name) {
+    char *value = getenv(name);
+    if (value == NULL) {
+        return -1;
+    }
+    int fd = atoi(value);
+    if (fcntl(fd, F_GETFD) == -1) {
+        LOG_WARN("%s=%s is not an open descriptor\n", name, value);
+        fd = -1;
+    }
+    unsetenv(name);     /* keep it away from CGI programs */
+    if (fd == -1) {
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/* Return the listening socket handed over by the process we are replacing,
+ * or -1 if we were started normally.
+ */
+int upgradeListenFd(void) {
+    int fd = envFd(LISTEN_ENV);
+    if (fd != -1) {
+        ready_out = envFd(READY_ENV);
+        /* already bound and listening; the accept path needs it non-blocking */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        LOG_INFO("took over listening socket %d\n", fd);
+    }
+    return fd;
+}
+
+/* Called by the event loop right before it starts waiting: if we replace
+ * an older process, tell it that it can stop accepting.
+ */
+void upgradeServing(void) {
+    if (ready_out != -1) {
+        if (write(ready_out, "r", 1) < 0) {
+            perror("write ready");
+        }
+        close(ready_out);
+        ready_out = -1;
+    }
+}
+
+/* The descriptor from upgradeInit is readable: start the new binary with
+ * listenfd.  Return a descriptor that becomes readable when the new
+ * process is serving or has failed (see upgradeReady), or -1 if no
+ * upgrade was started.
+ */
+int upgradeStart(int listenfd) {
+    char buf[16];
+    while (read(signal_pipe[0], buf, sizeof(buf)) > 0) {
+        /* coalesce repeated signals */
+    }
+    if (upgrade_pid != -1 || drain_until != 0) {
+        LOG_WARN("upgrade already in progress\n");
+        return -1;
+    }
+
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    // Build the environment before forking: the child of a threaded
+    // process may only make async-signal-safe calls until it execs
+    extern char **environ;
+    int n = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    char **envp = malloc((n + 3) * sizeof(char *));
+    char listen_var[32], ready_var[32];
+    snprintf(listen_var, sizeof(listen_var), LISTEN_ENV "=%d", listenfd);
+    snprintf(ready_var, sizeof(ready_var), READY_ENV "=%d", ready[1]);
+    memcpy(envp, environ, n * sizeof(char *));
+    envp[n] = listen_var;
+    envp[n + 1] = ready_var;
+    envp[n + 2] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child: nothing but the two handed-over descriptors survives exec
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+        fcntl(listenfd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        signal(SIGPIPE, SIG_DFL);
+        execve(exe_path, saved_argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(ready[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(ready[0]);
+        return -1;
+    }
+    upgrade_pid = pid;
+    LOG_WARN("upgrade: started %s as pid %d\n", exe_path, (int) pid);
+    return ready[0];
+}
+
+/* The descriptor from upgradeStart is readable; it is closed here.
+ * Return 1 if the new process is serving, so the caller must stop
+ * accepting and start draining, or 0 if it failed to start.
+ */
+int upgradeReady(int ready_fd) {
+    char c;
+    ssize_t n = read(ready_fd, &c, 1);
+    close(ready_fd);
+    if (n == 1) {
+        LOG_WARN("upgrade: pid %d is serving, draining\n", (int) upgrade_pid);
+        upgrade_pid = -1;
+        drain_until = nowUsec() + (uint64_t) DRAIN_TIMEOUT_MS * 1000;
+        return 1;
+    }
+    LOG_WARN("upgrade: pid %d failed to start, still serving\n", (int) upgrade_pid);
+    waitpid(upgrade_pid, NULL, 0);
+    upgrade_pid = -1;
+    return 0;
+}
+
+/* Shorten wait_ms, the time the event loop would block for (-1 for no
+ * limit), so it wakes up for the drain deadline.
+ */
+int upgradeDrainWait(int wait_ms) {
+    if (drain_until == 0) {
+        return wait_ms;
+    }
+    uint64_t now = nowUsec();
+    int left = now >= drain_until ? 0 : (int) ((drain_until - now + 999) / 1000);
+    return (wait_ms < 0 || left < wait_ms) ? left : wait_ms;
+}
+
+/* Return 1 if the event loop should exit: we are draining and none of the
+ * active connections are left, or the drain deadline passed.
+ */
+int upgradeDrained(int active) {
+    if (drain_until == 0) {
+        return 0;
+    }
+    if (active == 0) {
+        return 1;
+    }
+    if (nowUsec() >= drain_until) {
+        LOG_WARN("upgrade: drain deadline passed with %d connections\n", active);
+        return 1;
+    }
+    return 0;
+}
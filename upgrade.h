@@ -0,0 +1,10 @@
+/* Zero-downtime binary upgrade; see upgrade.c */
+#define DRAIN_TIMEOUT_MS 60000  /* old process: max time to finish requests */
+
+int upgradeInit(char **argv);
+int upgradeListenFd(void);
+void upgradeServing(void);
+int upgradeStart(int listenfd);
+int upgradeReady(int ready_fd);
+int upgradeDrainWait(int wait_ms);
+int upgradeDrained(int active);
@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#include "wrapsock.h"
+#include "ws_helpers.h"
+#include "log.h"
+#include "probes.h"
+#include "uring.h"
+#include "upgrade.h"
+#include "h2.h"
+#include "tls.h"
+#include "proxy.h"
+#include "affinity.h"
+#include "body.h"
+
+/* io_uring event loop.
+ *
+ * This is an alternative to the select loop in wserver.c built directly on
+ * the io_uring system calls (no liburing).  Per loop iteration every
+ * completion is handled and all new requests go to the kernel with a single
+ * io_uring_enter, which also waits for the next completion.
+ *
+ *   - one multishot accept on the listening socket
+ *   - receives on client sockets pick a buffer from a provided-buffer ring,
+ *     so no memory is pinned to idle connections
+ *   - CGI output is read from the pipe straight into cs->output; the
+ *     status line depends on the exit status, so the response is sent once
+ *     the pipe reaches EOF, as a send linked to the close of the socket
+ *   - the wait for completions times out at the next connection deadline;
+ *     an expired deadline cancels the receive or send it is guarding
+ *   - bodies compressed on the helper thread come back through a pipe
+ *     that is watched with a poll
+ *   - so are the upgrade descriptors (see upgrade.c); once a newer
+ *     wserver is serving, the accept is cancelled and the loop returns
+ *     when the remaining connections are done
+ *   - HTTP/2 connections (see h2.c), TLS handshakes and relays (see
+ *     tls.c) and connections to upstreams (see proxy.c) do their own
+ *     reads and writes; the descriptors they ask for are watched with one
+ *     poll per direction
+ *
+ * Requests are identified by user_data: the client index (the descriptor
+ * for the h2.c, tls.c and proxy.c polls) shifted left by 8 bits, or'ed with the
+ * operation.
+ */
+
+#define RING_ENTRIES 256
+#define RECV_BUFS 64            /* provided receive buffers, power of two */
+#define RECV_BGID 1             /* buffer group id */
+
+enum uring_op {
+    OP_ACCEPT, OP_RECV, OP_PIPE_READ, OP_SEND, OP_CLOSE, OP_CANCEL,
+    OP_UPGRADE, OP_UPGRADE_READY, OP_COMPRESSED, OP_WATCH_IN, OP_WATCH_OUT, OP_BODY
+};
+
+#define UDATA(op, idx) (((uint64_t) (idx) << 8) | (op))
+#define UDATA_OP(u) ((int) ((u) & 0xff))
+#define UDATA_IDX(u) ((int) ((u) >> 8))
+
+struct uring {
+    int fd;
+    unsigned entries;
+    /* submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;         /* tail not yet published to the kernel */
+    unsigned to_submit;
+    /* completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqe_map_len;
+    /* provided receive buffers */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *bufs;
+    unsigned short buf_tail;
+};
+
+/* Per-client state for a response that is being sent asynchronously;
+ * the response itself is laid out in cs->out_iov by startOK.
+ */
+struct pending_send {
+    struct msghdr msg;
+    int sent;
+    int body_poll;      /* an OP_BODY poll is outstanding */
+};
+
+static int uringSetup(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        /* no way to wait with a timeout for the deadlines */
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    r->entries = p.sq_entries;
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len) {
+            r->sq_map_len = r->cq_map_len;
+        }
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            munmap(r->sq_map, r->sq_map_len);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqe_map_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqe_map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_map != r->sq_map) {
+            munmap(r->cq_map, r->cq_map_len);
+        }
+        munmap(r->sq_map, r->sq_map_len);
+        close(r->fd);
+        return -1;
+    }
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r->sq_local_tail = *r->sq_tail;
+    r->to_submit = 0;
+    return 0;
+}
+
+static void uringTeardown(struct uring *r) {
+    if (r->buf_ring != NULL) {
+        munmap(r->buf_ring, r->buf_ring_len);
+        free(r->bufs);
+    }
+    munmap(r->sqes, r->sqe_map_len);
+    if (r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_len);
+    }
+    munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+}
+
+/* Hand everything queued so far to the kernel and wait for at least
+ * wait_nr completions, but no longer than timeout_ms unless that is -1.
+ */
+static int uringEnter(struct uring *r, unsigned wait_nr, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+        arg.ts = (unsigned long) &ts;
+    }
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        int n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr,
+                flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (n >= 0) {
+            r->to_submit -= n;
+            return n;
+        }
+        if (errno == ETIME) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+static struct io_uring_sqe *getSqe(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head == r->entries) {
+        /* full: submit what we have without waiting */
+        uringEnter(r, 0, -1);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head == r->entries) {
+            return NULL;
+        }
+    }
+    unsigned idx = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    r->to_submit++;
+    return sqe;
+}
+
+/* Register RECV_BUFS buffers of MAXLINE bytes as buffer group RECV_BGID. */
+static int setupBufRing(struct uring *r) {
+    r->buf_ring_len = RECV_BUFS * sizeof(struct io_uring_buf);
+    r->buf_ring = mmap(NULL, r->buf_ring_len, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (r->buf_ring == MAP_FAILED) {
+        r->buf_ring = NULL;
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) r->buf_ring;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_BGID;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        munmap(r->buf_ring, r->buf_ring_len);
+        r->buf_ring = NULL;
+        return -1;
+    }
+    r->bufs = malloc(RECV_BUFS * MAXLINE);
+    r->buf_tail = 0;
+    for (int i = 0; i < RECV_BUFS; i++) {
+        struct io_uring_buf *b = &r->buf_ring->bufs[r->buf_tail++ & (RECV_BUFS - 1)];
+        b->addr = (unsigned long) (r->bufs + i * MAXLINE);
+        b->len = MAXLINE;
+        b->bid = i;
+    }
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Give receive buffer bid back to the kernel. */
+static void recycleBuf(struct uring *r, int bid) {
+    struct io_uring_buf *b = &r->buf_ring->bufs[r->buf_tail & (RECV_BUFS - 1)];
+    b->addr = (unsigned long) (r->bufs + bid * MAXLINE);
+    b->len = MAXLINE;
+    b->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void queueAccept(struct uring *r, int listenfd, int multishot) {
+    struct io_uring_sqe *sqe = getSqe(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = UDATA(OP_ACCEPT, 0);
+}
+
+static void queueRecv(struct uring *r, struct clientstate *cs, int idx) {
+    struct io_uring_sqe *sqe = getSqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = cs->sock;
+    sqe->len = MAXLINE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BGID;
+    sqe->user_data = UDATA(OP_RECV, idx);
+}
+
+/* Read the CGI output of cs, unless there is no memory to read it into;
+ * cs then comes back from resumedClient.
+ */
+static void queuePipeRead(struct uring *r, struct clientstate *cs, int idx) {
+    int room = cgiRoom(cs);
+    if (room == -1) {
+        return;
+    }
+    struct io_uring_sqe *sqe = getSqe(r);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = cs->fd[0];
+    sqe->addr = (unsigned long) cs->optr;
+    sqe->len = room;
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = UDATA(OP_PIPE_READ, idx);
+}
+
+/* Send the 200 response of cs (see startOK), or what sendOK left of an
+ * error page, and close the socket, as one linked chain.  Spilled CGI
+ * output is mapped and goes in the same sendmsg.
+ */
+static void queueSendOK(struct uring *r, struct clientstate *cs,
+        struct pending_send *ps, int idx) {
+    spillMap(cs);
+    size_t total = 0;
+    for (int i = 0; i < cs->out_iovcnt; i++) {
+        total += cs->out_next[i].iov_len;
+    }
+    memset(&ps->msg, 0, sizeof(ps->msg));
+    ps->msg.msg_iov = cs->out_next;
+    ps->msg.msg_iovlen = cs->out_iovcnt;
+    ps->sent = 0;
+
+    struct io_uring_sqe *sqe = getSqe(r);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = cs->sock;
+    sqe->addr = (unsigned long) &ps->msg;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = UDATA(OP_SEND, idx);
+
+    sqe = getSqe(r);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = cs->sock;
+    sqe->user_data = UDATA(OP_CLOSE, idx);
+    armSendDeadline(cs, total);
+}
+
+/* Wait for events on fd; completes with user_data. */
+static void queuePoll(struct uring *r, int fd, int events, uint64_t user_data) {
+    struct io_uring_sqe *sqe = getSqe(r);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+/* Cancel the request with user_data target, if it is still in flight. */
+static void queueCancel(struct uring *r, uint64_t target, int idx) {
+    struct io_uring_sqe *sqe = getSqe(r);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = target;
+    sqe->user_data = UDATA(OP_CANCEL, idx);
+}
+
+struct uring_loop {
+    struct uring *ring;
+    struct clientstate *client;
+};
+
+/* A deadline of cs expired.  Cancel the receive or send it guards; its
+ * completion then ends the connection.
+ */
+static void uringTimeout(struct clientstate *cs, void *arg) {
+    struct uring_loop *loop = arg;
+    int idx = cs - loop->client;
+    int op = cs->timed_out == TIMER_SEND ? OP_SEND : OP_RECV;
+    queueCancel(loop->ring, UDATA(op, idx), idx);
+}
+
+/* h2.c, tls.c or proxy.c wants to hear about events on fd. */
+static void uringWatch(int fd, int events, void *arg) {
+    struct uring_loop *loop = arg;
+    if (events & POLLIN) {
+        queuePoll(loop->ring, fd, POLLIN, UDATA(OP_WATCH_IN, fd));
+    }
+    if (events & POLLOUT) {
+        queuePoll(loop->ring, fd, POLLOUT, UDATA(OP_WATCH_OUT, fd));
+    }
+}
+
+/* h2.c, tls.c or proxy.c is about to close fd (or tls.c hands it back).
+ * The polls keep their own reference to the file, so cancelling them
+ * later in this batch is fine; a completion that raced with the cancel is
+ * ignored by h2Event, tlsEvent and proxyEvent.
+ */
+static void uringUnwatch(int fd, void *arg) {
+    struct uring_loop *loop = arg;
+    queueCancel(loop->ring, UDATA(OP_WATCH_IN, fd), 0);
+    queueCancel(loop->ring, UDATA(OP_WATCH_OUT, fd), 0);
+}
+
+/* The TLS handshake of cs is done (see tls.c): receive its request. */
+static void uringResume(struct clientstate *cs, void *arg) {
+    struct uring_loop *loop = arg;
+    queueRecv(loop->ring, cs, cs - loop->client);
+}
+
+/* Move the request body of cs on (see bodyPump) and poll the descriptor
+ * it waits for.
+ */
+static void queueBody(struct uring *r, struct clientstate *cs,
+        struct pending_send *ps, int idx) {
+    int events;
+    int fd = bodyWait(cs, bodyPump(cs), &events);
+    if (fd != -1) {
+        ps->body_poll = 1;
+        queuePoll(r, fd, events, UDATA(OP_BODY, idx));
+    }
+}
+
+/* Run the server on listenfd with io_uring until an unrecoverable error or
+ * until it has handed over to a newer wserver, which upgrade_fd (-1 if
+ * upgrades are not possible) announces.  compress_fd is the helper thread
+ * descriptor from compressInit, or -1.
+ * Return -1 without serving anything if io_uring (or a feature we need)
+ * is not available, so the caller can fall back to the select loop.
+ */
+int runUringLoop(int listenfd, int upgrade_fd, int compress_fd,
+        struct clientstate *client, int size) {
+    struct uring ring;
+    memset(&ring, 0, sizeof(ring));
+    if (uringSetup(&ring, RING_ENTRIES) == -1) {
+        LOG_WARN("io_uring unavailable: %s\n", strerror(errno));
+        return -1;
+    }
+    if (setupBufRing(&ring) == -1) {
+        LOG_WARN("io_uring provided buffers unavailable: %s\n", strerror(errno));
+        uringTeardown(&ring);
+        return -1;
+    }
+    struct pending_send *pending = calloc(size, sizeof(struct pending_send));
+    struct io_uring_cqe *cqe;
+
+    struct uring_loop loop = {&ring, client};
+    h2SetLoop(uringWatch, uringUnwatch, &loop);
+    tlsSetLoop(uringWatch, uringUnwatch, uringResume, &loop);
+    proxySetLoop(uringWatch, uringUnwatch, &loop);
+
+    int multishot = 1;
+    int accepting = 1;
+    int ready_fd = -1;
+    queueAccept(&ring, listenfd, multishot);
+    if (upgrade_fd != -1) {
+        queuePoll(&ring, upgrade_fd, POLLIN, UDATA(OP_UPGRADE, 0));
+    }
+    if (compress_fd != -1) {
+        queuePoll(&ring, compress_fd, POLLIN, UDATA(OP_COMPRESSED, 0));
+    }
+    upgradeServing();
+
+    for (;;) {
+        affinityCheck();
+        runDeadlines(uringTimeout, &loop);
+        struct clientstate *resumed;
+        while ((resumed = resumedClient()) != NULL) {
+            queuePipeRead(&ring, resumed, resumed - client);
+        }
+        if (upgradeDrained(countClients(client, size) + tlsConnections())) {
+            break;
+        }
+        if (uringEnter(&ring, 1, upgradeDrainWait(nextDeadline())) < 0) {
+            break;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            int op = UDATA_OP(cqe->user_data);
+            int idx = UDATA_IDX(cqe->user_data);
+            int res = cqe->res;
+
+            if (op == OP_WATCH_IN || op == OP_WATCH_OUT) {
+                /* idx is the descriptor; cancelled polls are done with */
+                int events = op == OP_WATCH_IN ? POLLIN : POLLOUT;
+                if (res >= 0 && h2Event(idx, events) == -1 &&
+                        tlsEvent(idx, events) == -1) {
+                    proxyEvent(idx, events);
+                }
+                continue;
+            }
+            struct clientstate *cs = &client[idx];
+
+            if (op == OP_ACCEPT) {
+                if (res >= 0) {
+                    struct sockaddr_in peer;
+                    socklen_t peer_len = sizeof(peer);
+                    memset(&peer, 0, sizeof(peer));
+                    getpeername(res, (struct sockaddr *) &peer, &peer_len);
+                    int j = acceptClient(client, size, res, &peer);
+                    if (j != -1 && !tlsStart(&client[j])) {
+                        queueRecv(&ring, &client[j], j);
+                    }
+                } else if (res == -EMFILE || res == -ENFILE) {
+                    dropPendingConnection(listenfd);
+                } else if (res == -EINVAL && multishot) {
+                    /* kernel without multishot accept */
+                    multishot = 0;
+                } else if (res != -EAGAIN && res != -ECONNABORTED && res != -ECANCELED) {
+                    LOG_WARN("accept: %s\n", strerror(-res));
+                }
+                if (accepting && !(cqe->flags & IORING_CQE_F_MORE)) {
+                    queueAccept(&ring, listenfd, multishot);
+                }
+            } else if (op == OP_COMPRESSED) {
+                struct clientstate *done;
+                while ((done = compressedClient()) != NULL) {
+                    int j = done - client;
+                    queueSendOK(&ring, done, &pending[j], j);
+                }
+                queuePoll(&ring, compress_fd, POLLIN, UDATA(OP_COMPRESSED, 0));
+            } else if (op == OP_UPGRADE) {
+                /* SIGUSR2: start the new binary, keep serving until it is ready */
+                int fd = upgradeStart(listenfd);
+                if (fd != -1) {
+                    ready_fd = fd;
+                    queuePoll(&ring, ready_fd, POLLIN, UDATA(OP_UPGRADE_READY, 0));
+                }
+                queuePoll(&ring, upgrade_fd, POLLIN, UDATA(OP_UPGRADE, 0));
+            } else if (op == OP_UPGRADE_READY) {
+                if (upgradeReady(ready_fd)) {
+                    /* the new process accepts from here on */
+                    accepting = 0;
+                    queueCancel(&ring, UDATA(OP_ACCEPT, 0), 0);
+                }
+                ready_fd = -1;
+            } else if (op == OP_RECV) {
+                if (cs->timed_out != TIMER_NONE) {
+                    /* cancelled by its deadline, or raced with it */
+                    if (res > 0) {
+                        recycleBuf(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                    }
+                    if (clientTimedOut(cs) == CLIENT_SEND) {
+                        queueSendOK(&ring, cs, &pending[idx], idx);
+                    }
+                } else if (res == -ENOBUFS) {
+                    queueRecv(&ring, cs, idx);
+                } else if (res <= 0) {
+                    clientGone(cs);
+                } else {
+                    char line[MAXLINE + 1];
+                    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    memcpy(line, ring.bufs + bid * MAXLINE, res);
+                    line[res] = '\0';
+                    recycleBuf(&ring, bid);
+                    int result = clientInput(cs, line, res);
+                    if (result == CLIENT_MORE) {
+                        queueRecv(&ring, cs, idx);
+                    } else if (result == CLIENT_STATIC || result == CLIENT_SEND) {
+                        queueSendOK(&ring, cs, &pending[idx], idx);
+                    } else if (result == CLIENT_CGI) {
+                        queuePipeRead(&ring, cs, idx);
+                        queueBody(&ring, cs, &pending[idx], idx);
+                    }
+                }
+            } else if (op == OP_PIPE_READ) {
+                int ret_code = pipe_data_read(cs, res);
+                if (ret_code == 1) {
+                    queuePipeRead(&ring, cs, idx);
+                } else if (ret_code == 2) {
+                    /* at EOF before the program exited, see resumedClient */
+                } else {
+                    if (pending[idx].body_poll) {
+                        /* done before its request body */
+                        pending[idx].body_poll = 0;
+                        queueCancel(&ring, UDATA(OP_BODY, idx), idx);
+                    }
+                    cgiDone(cs);
+                    if (ret_code == 0) {
+                        if (startOK(cs)) {
+                            queueSendOK(&ring, cs, &pending[idx], idx);
+                        }
+                    } else if (cgiRespond(cs, ret_code) == CLIENT_SEND) {
+                        queueSendOK(&ring, cs, &pending[idx], idx);
+                    }
+                }
+            } else if (op == OP_BODY) {
+                /* a poll cancelled at the program's end is done with */
+                if (pending[idx].body_poll) {
+                    pending[idx].body_poll = 0;
+                    queueBody(&ring, cs, &pending[idx], idx);
+                }
+            } else if (op == OP_SEND) {
+                pending[idx].sent = res > 0 ? res : 0;
+                if (res < 0) {
+                    LOG_WARN("send: %s\n", strerror(-res));
+                }
+                WS_PROBE3(ok_sent, cs->sock, cs->req_id, pending[idx].sent);
+            } else if (op == OP_CLOSE) {
+                if (res == -ECANCELED) {
+                    /* the send failed or timed out and broke the link */
+                    Close(cs->sock);
+                }
+                requestDone(cs, cs->out_status, cs->out_sent + pending[idx].sent);
+                resetClient(cs);
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    free(pending);
+    uringTeardown(&ring);
+    return 0;
+}
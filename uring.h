@@ -0,0 +1,3 @@
+/* io_uring event loop; see uring.c */
+int runUringLoop(int listenfd, int upgrade_fd, int compress_fd,
+        struct clientstate *client, int size);
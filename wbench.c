@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/* wbench: an HTTP/1.1 load generator for wserver.
+ *
+ * Each thread runs its own epoll loop over its share of the connections.
+ *
+ * Closed loop (default): every connection keeps `depth` requests in flight
+ * and sends the next one as soon as a response arrives.
+ *
+ * Open loop (-r rps): requests are scheduled at fixed intervals whether or
+ * not the server keeps up.  Latency is measured from the time a request
+ * was *scheduled*, not from when a free connection finally sent it, so a
+ * stalled server shows up in the percentiles instead of silently lowering
+ * the request rate (no coordinated omission).
+ *
+ * Without -k every request uses a fresh connection (wserver closes after
+ * each response).  With -k the connection is reused when the server
+ * allows it, and -p sends up to depth requests back to back (pipelining).
+ *
+ * With -s the connections speak TLS (certificates are not checked).  Each
+ * connection resumes the session of the one before it, as a returning
+ * browser would; -S makes every handshake a full one.
+ */
+
+#define MAX_DEPTH 64
+#define RECV_BUF 65536
+#define MAX_EVENTS 256
+
+/* Latency histogram in nanoseconds; log-linear with 2^SUB_BITS sub-buckets
+ * per octave (<1% error), merged across threads at the end.
+ */
+#define SUB_BITS 7
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define OCTAVES 40
+#define NUM_BUCKETS ((OCTAVES + 1) * SUB_BUCKETS)
+
+struct histogram {
+    uint64_t bucket[NUM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+static int bucketIndex(uint64_t v) {
+    if (v < SUB_BUCKETS) {
+        return (int) v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= OCTAVES + SUB_BITS - 1) {
+        return NUM_BUCKETS - 1;
+    }
+    int sub = (int) (v >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static uint64_t bucketValue(int i) {
+    if (i < SUB_BUCKETS) {
+        return i;
+    }
+    int octave = i / SUB_BUCKETS;
+    int sub = i % SUB_BUCKETS;
+    /* midpoint of the bucket */
+    uint64_t lo = (uint64_t) (SUB_BUCKETS + sub) << (octave - 1);
+    return lo + (((uint64_t) 1 << (octave - 1)) >> 1);
+}
+
+static void histRecord(struct histogram *h, uint64_t v) {
+    h->bucket[bucketIndex(v)]++;
+    h->count++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static uint64_t histQuantile(const struct histogram *h, double q) {
+    uint64_t rank = (uint64_t) (q * h->count);
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen > rank) {
+            uint64_t v = bucketValue(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static uint64_t nowNsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Options shared by all threads */
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static char request[2048];
+static int request_len;
+static int keepalive;
+static int depth = 1;
+static double rate;             /* total requests/s, 0 = closed loop */
+static uint64_t duration_ns;
+static uint64_t start_ns;
+static int tls;                 /* 0, 1 with resumption, 2 full handshakes */
+#ifdef HAVE_OPENSSL
+static SSL_CTX *tls_ctx;
+#endif
+
+enum conn_state { CONN_IDLE, CONN_CONNECTING, CONN_HANDSHAKE, CONN_OPEN };
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    int sent_off;               /* bytes of the current request written */
+    int unsent;                 /* requests queued on this conn, not written */
+    uint64_t start[MAX_DEPTH];  /* latency start time of each outstanding */
+    int head, count;            /* ring of outstanding requests */
+    char buf[RECV_BUF];
+    int len;                    /* bytes in buf */
+    long body_left;             /* -1 while reading headers */
+    int status;                 /* status of the response being read */
+    int until_close;            /* response ends at EOF */
+    int server_closes;          /* response said Connection: close */
+#ifdef HAVE_OPENSSL
+    SSL *ssl;
+    SSL_SESSION *session;       /* to resume on the next connection */
+#endif
+};
+
+struct worker {
+    pthread_t tid;
+    int epfd;
+    struct conn *conns;
+    int nconns;
+    double rate;                /* this thread's share, 0 = closed loop */
+    uint64_t next_send;         /* open loop: next scheduled time */
+    uint64_t *backlog;          /* open loop: scheduled but not yet sent */
+    int backlog_head, backlog_count, backlog_cap;
+    struct histogram hist;
+    uint64_t completed, errors, non2xx, bytes;
+};
+
+static void connClose(struct worker *w, struct conn *c) {
+#ifdef HAVE_OPENSSL
+    if (c->ssl != NULL) {
+        /* Without a close_notify OpenSSL takes the session for a broken
+         * one and will not resume it */
+        if (SSL_is_init_finished(c->ssl)) {
+            SSL_shutdown(c->ssl);
+        }
+        SSL_SESSION *session = SSL_get0_session(c->ssl);
+        if (tls == 1 && session != NULL && SSL_SESSION_is_resumable(session)) {
+            SSL_SESSION_free(c->session);
+            c->session = SSL_get1_session(c->ssl);
+        }
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+#endif
+    if (c->fd != -1) {
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = CONN_IDLE;
+    c->len = 0;
+    c->body_left = -1;
+    c->until_close = 0;
+    c->server_closes = 0;
+    c->sent_off = 0;
+}
+
+static int connOpen(struct worker *w, struct conn *c) {
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(c->fd, (struct sockaddr *) &server_addr, server_addr_len) == -1
+            && errno != EINPROGRESS) {
+        w->errors++;
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->state = CONN_CONNECTING;
+    struct epoll_event ev = {EPOLLIN | EPOLLOUT, {.ptr = c}};
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+/* read and write on c, through TLS with -s.  As for the system calls,
+ * -1 with errno EAGAIN means the socket is not ready.
+ */
+static int connRead(struct conn *c, char *buf, int len) {
+#ifdef HAVE_OPENSSL
+    if (c->ssl != NULL) {
+        int n = SSL_read(c->ssl, buf, len);
+        if (n > 0) {
+            return n;
+        }
+        int err = SSL_get_error(c->ssl, n);
+        ERR_clear_error();
+        if (err == SSL_ERROR_ZERO_RETURN) {
+            return 0;
+        }
+        errno = (err == SSL_ERROR_WANT_READ) ? EAGAIN : EIO;
+        return -1;
+    }
+#endif
+    return read(c->fd, buf, len);
+}
+
+static int connWrite(struct conn *c, const char *buf, int len) {
+#ifdef HAVE_OPENSSL
+    if (c->ssl != NULL) {
+        int n = SSL_write(c->ssl, buf, len);
+        if (n > 0) {
+            return n;
+        }
+        int err = SSL_get_error(c->ssl, n);
+        ERR_clear_error();
+        errno = (err == SSL_ERROR_WANT_WRITE) ? EAGAIN : EIO;
+        return -1;
+    }
+#endif
+    return write(c->fd, buf, len);
+}
+
+/* Drive the TLS handshake of c.  Return 1 once it is done, 0 while it
+ * waits for the socket, or -1 if it failed.
+ */
+static int connHandshake(struct worker *w, struct conn *c) {
+#ifdef HAVE_OPENSSL
+    if (c->ssl == NULL) {
+        c->ssl = SSL_new(tls_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        SSL_set_connect_state(c->ssl);
+        if (c->session != NULL) {
+            SSL_set_session(c->ssl, c->session);
+        }
+    }
+    int rc = SSL_do_handshake(c->ssl);
+    if (rc == 1) {
+        return 1;
+    }
+    int err = SSL_get_error(c->ssl, rc);
+    ERR_clear_error();
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        struct epoll_event ev = {err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT, {.ptr = c}};
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return 0;
+    }
+    return -1;
+#else
+    (void) w;
+    (void) c;
+    return 1;
+#endif
+}
+
+/* Queue one request with latency start time t on c. */
+static void connEnqueue(struct worker *w, struct conn *c, uint64_t t) {
+    c->start[(c->head + c->count) % MAX_DEPTH] = t;
+    c->count++;
+    c->unsent++;
+    if (c->state == CONN_IDLE) {
+        connOpen(w, c);
+    }
+}
+
+/* Write as much of the queued requests as the socket takes. */
+static void connFlush(struct worker *w, struct conn *c) {
+    while (c->unsent > 0) {
+        int n = connWrite(c, request + c->sent_off, request_len - c->sent_off);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                struct epoll_event ev = {EPOLLIN | EPOLLOUT, {.ptr = c}};
+                epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+            }
+            return;
+        }
+        c->sent_off += n;
+        if (c->sent_off == request_len) {
+            c->sent_off = 0;
+            c->unsent--;
+            if (rate == 0) {
+                /* closed loop: latency runs from the actual send */
+                int slot = (c->head + c->count - c->unsent - 1) % MAX_DEPTH;
+                c->start[slot] = nowNsec();
+            }
+        }
+    }
+    struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void responseDone(struct worker *w, struct conn *c, int status) {
+    uint64_t t = c->start[c->head];
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->count--;
+    histRecord(&w->hist, nowNsec() - t);
+    w->completed++;
+    if (status < 200 || status > 299) {
+        w->non2xx++;
+    }
+}
+
+/* Return the value of header name in the header block hdr, or NULL. */
+static const char *findHeader(const char *hdr, const char *end, const char *name) {
+    size_t nlen = strlen(name);
+    for (const char *p = hdr; p && p < end; p = memchr(p, '\n', end - p)) {
+        if (*p == '\n') {
+            p++;
+        }
+        if (end - p > (long) nlen && strncasecmp(p, name, nlen) == 0) {
+            p += nlen;
+            while (*p == ' ') {
+                p++;
+            }
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Consume complete responses from c->buf.  eof says the server closed the
+ * connection, which ends a response that has no Content-Length.
+ */
+static void parseResponses(struct worker *w, struct conn *c, int eof) {
+    for (;;) {
+        if (c->body_left < 0 && !c->until_close) {
+            char *end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+            if (end == NULL) {
+                return;
+            }
+            end += 4;
+            c->status = 0;
+            sscanf(c->buf, "HTTP/1.%*d %d", &c->status);
+            const char *cl = findHeader(c->buf, end, "Content-Length:");
+            const char *conn = findHeader(c->buf, end, "Connection:");
+            c->server_closes = !keepalive ||
+                (conn != NULL && strncasecmp(conn, "close", 5) == 0);
+            if (cl != NULL) {
+                c->body_left = strtol(cl, NULL, 10);
+            } else {
+                c->until_close = 1;
+            }
+            int hlen = end - c->buf;
+            memmove(c->buf, end, c->len - hlen);
+            c->len -= hlen;
+        }
+        if (c->until_close) {
+            w->bytes += c->len;
+            c->len = 0;
+            if (!eof) {
+                return;
+            }
+            c->until_close = 0;
+            responseDone(w, c, c->status);
+            return;
+        }
+        long take = c->len < c->body_left ? c->len : c->body_left;
+        w->bytes += take;
+        memmove(c->buf, c->buf + take, c->len - take);
+        c->len -= take;
+        c->body_left -= take;
+        if (c->body_left > 0) {
+            return;
+        }
+        c->body_left = -1;
+        responseDone(w, c, c->status);
+        if (c->count == 0) {
+            return;
+        }
+    }
+}
+
+/* Send scheduled requests (open loop) to connections with spare depth. */
+static void dispatchBacklog(struct worker *w) {
+    for (int i = 0; i < w->nconns && w->backlog_count > 0; i++) {
+        struct conn *c = &w->conns[i];
+        int room = keepalive ? depth : 1;
+        while (c->count < room && w->backlog_count > 0) {
+            uint64_t t = w->backlog[w->backlog_head];
+            w->backlog_head = (w->backlog_head + 1) % w->backlog_cap;
+            w->backlog_count--;
+            connEnqueue(w, c, t);
+        }
+        if (c->state == CONN_OPEN && c->unsent > 0) {
+            connFlush(w, c);
+        }
+    }
+}
+
+static void scheduleOpenLoop(struct worker *w, uint64_t now) {
+    uint64_t interval = (uint64_t) (1e9 / w->rate);
+    while (w->next_send <= now) {
+        if (w->backlog_count == w->backlog_cap) {
+            /* Server hopelessly behind; count the drop rather than grow */
+            w->errors++;
+        } else {
+            int tail = (w->backlog_head + w->backlog_count) % w->backlog_cap;
+            w->backlog[tail] = w->next_send;
+            w->backlog_count++;
+        }
+        w->next_send += interval;
+    }
+    dispatchBacklog(w);
+}
+
+/* After a connection finished (or lost) its responses, requeue what it
+ * still owes and start the next round.
+ */
+static void connRecycle(struct worker *w, struct conn *c, int closed) {
+    if (closed) {
+        /* Requests that never got an answer are errors.  In the open loop
+         * they are also retried with their original start times so the
+         * time already spent waiting is still counted. */
+        while (c->count > 0) {
+            uint64_t t = c->start[c->head];
+            c->head = (c->head + 1) % MAX_DEPTH;
+            c->count--;
+            w->errors++;
+            if (rate > 0 && w->backlog_count < w->backlog_cap) {
+                int tail = (w->backlog_head + w->backlog_count) % w->backlog_cap;
+                w->backlog[tail] = t;
+                w->backlog_count++;
+            }
+        }
+        c->unsent = 0;
+        connClose(w, c);
+    }
+    if (rate == 0 && nowNsec() - start_ns < duration_ns) {
+        while (c->count < (keepalive ? depth : 1)) {
+            connEnqueue(w, c, 0);
+        }
+        if (c->state == CONN_OPEN) {
+            connFlush(w, c);
+        }
+    }
+}
+
+static void handleEvent(struct worker *w, struct conn *c, uint32_t events) {
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            connRecycle(w, c, 1);
+            return;
+        }
+        if (!tls) {
+            c->state = CONN_OPEN;
+            connFlush(w, c);
+            return;
+        }
+        c->state = CONN_HANDSHAKE;
+    }
+    if (c->state == CONN_HANDSHAKE) {
+        int rc = connHandshake(w, c);
+        if (rc == -1) {
+            connRecycle(w, c, 1);
+        } else if (rc == 1) {
+            c->state = CONN_OPEN;
+            connFlush(w, c);
+        }
+        return;
+    }
+    if (events & EPOLLOUT) {
+        connFlush(w, c);
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    int eof = 0;
+    for (;;) {
+        int n = connRead(c, c->buf + c->len, RECV_BUF - c->len);
+        if (n > 0) {
+            c->len += n;
+            parseResponses(w, c, 0);
+            if (c->len == RECV_BUF) {
+                /* only possible while reading an oversized header */
+                eof = 1;
+                break;
+            }
+            continue;
+        }
+        if (n == 0 || errno != EAGAIN) {
+            eof = 1;
+        }
+        break;
+    }
+    if (eof) {
+        parseResponses(w, c, 1);
+        /* a response that ended with the connection is not an error */
+        connRecycle(w, c, 1);
+        return;
+    }
+    if (c->count == 0 && c->server_closes) {
+        connClose(w, c);
+        connRecycle(w, c, 0);
+    } else if (c->count < (keepalive ? depth : 1)) {
+        connRecycle(w, c, 0);
+    }
+}
+
+static void *workerMain(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    w->next_send = start_ns;
+
+    if (w->rate == 0) {
+        for (int i = 0; i < w->nconns; i++) {
+            connRecycle(w, &w->conns[i], 0);
+        }
+    }
+    for (;;) {
+        uint64_t now = nowNsec();
+        if (now - start_ns >= duration_ns) {
+            break;
+        }
+        int timeout = 10;
+        if (w->rate > 0) {
+            scheduleOpenLoop(w, now);
+            uint64_t wait = w->next_send > now ? w->next_send - now : 0;
+            timeout = wait / 1000000;   /* sub-ms waits become a poll */
+        }
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            handleEvent(w, events[i].data.ptr, events[i].events);
+        }
+        if (w->rate > 0) {
+            dispatchBacklog(w);
+        }
+    }
+    /* Requests scheduled but never answered count against the server:
+     * record them with the time they have waited so far. */
+    uint64_t end = nowNsec();
+    for (int i = 0; i < w->backlog_count; i++) {
+        uint64_t t = w->backlog[(w->backlog_head + i) % w->backlog_cap];
+        histRecord(&w->hist, end - t);
+    }
+    for (int i = 0; i < w->nconns; i++) {
+        struct conn *c = &w->conns[i];
+        if (w->rate > 0) {
+            for (int k = 0; k < c->count; k++) {
+                histRecord(&w->hist, end - c->start[(c->head + k) % MAX_DEPTH]);
+            }
+        }
+        connClose(w, c);
+#ifdef HAVE_OPENSSL
+        SSL_SESSION_free(c->session);
+#endif
+    }
+    close(w->epfd);
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: wbench [-t threads] [-c connections] [-d seconds]\n"
+            "              [-r requests_per_sec] [-k] [-p depth] [-j]\n"
+            "              [-s | -S] host port path\n"
+            "  -r  open loop at a fixed total rate (default: closed loop)\n"
+            "  -k  keep connections alive when the server allows it\n"
+            "  -p  pipeline up to depth requests per connection (implies -k)\n"
+            "  -j  print one JSON object instead of a text report\n"
+            "  -s  use TLS, resuming sessions; -S: full handshakes only\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int nthreads = 1, nconns = 1, json = 0;
+    double seconds = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:r:kp:jsS")) != -1) {
+        switch (opt) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'd': seconds = atof(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'k': keepalive = 1; break;
+        case 'p': depth = atoi(optarg); keepalive = 1; break;
+        case 'j': json = 1; break;
+        case 's': tls = 1; break;
+        case 'S': tls = 2; break;
+        default: usage();
+        }
+    }
+    if (argc - optind != 3 || nthreads < 1 || nconns < nthreads ||
+            depth < 1 || depth > MAX_DEPTH) {
+        usage();
+    }
+    const char *host = argv[optind], *port = argv[optind + 1];
+    const char *path = argv[optind + 2];
+    if (tls) {
+#ifdef HAVE_OPENSSL
+        /* SSL_write and SSL_shutdown may write to a closed socket */
+        signal(SIGPIPE, SIG_IGN);
+        tls_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+        SSL_CTX_set_alpn_protos(tls_ctx, (const unsigned char *) "\x08http/1.1", 9);
+        if (tls == 2) {
+            SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_OFF);
+            SSL_CTX_set_options(tls_ctx, SSL_OP_NO_TICKET);
+        }
+#else
+        fprintf(stderr, "wbench was built without OpenSSL\n");
+        exit(1);
+#endif
+    }
+
+    struct addrinfo hints = {0}, *ai;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+        exit(1);
+    }
+    memcpy(&server_addr, ai->ai_addr, ai->ai_addrlen);
+    server_addr_len = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    request_len = snprintf(request, sizeof(request),
+            "GET %s HTTP/1.1\r\nHost: %s:%s\r\nConnection: %s\r\n\r\n",
+            path, host, port, keepalive ? "keep-alive" : "close");
+    duration_ns = (uint64_t) (seconds * 1e9);
+
+    struct worker *workers = calloc(nthreads, sizeof(struct worker));
+    start_ns = nowNsec();
+    for (int i = 0; i < nthreads; i++) {
+        struct worker *w = &workers[i];
+        w->nconns = nconns / nthreads + (i < nconns % nthreads);
+        w->conns = calloc(w->nconns, sizeof(struct conn));
+        for (int k = 0; k < w->nconns; k++) {
+            w->conns[k].fd = -1;
+            w->conns[k].body_left = -1;
+        }
+        w->rate = rate / nthreads;
+        w->backlog_cap = 1 << 20;
+        w->backlog = w->rate > 0 ? malloc(w->backlog_cap * sizeof(uint64_t)) : NULL;
+        pthread_create(&w->tid, NULL, workerMain, w);
+    }
+
+    static struct histogram total;
+    uint64_t completed = 0, errors = 0, non2xx = 0, bytes = 0;
+    for (int i = 0; i < nthreads; i++) {
+        struct worker *w = &workers[i];
+        pthread_join(w->tid, NULL);
+        for (int b = 0; b < NUM_BUCKETS; b++) {
+            total.bucket[b] += w->hist.bucket[b];
+        }
+        total.count += w->hist.count;
+        if (w->hist.max > total.max) {
+            total.max = w->hist.max;
+        }
+        completed += w->completed;
+        errors += w->errors;
+        non2xx += w->non2xx;
+        bytes += w->bytes;
+        free(w->conns);
+        free(w->backlog);
+    }
+    double elapsed = (nowNsec() - start_ns) / 1e9;
+
+    double p50 = histQuantile(&total, 0.5) / 1e3;
+    double p99 = histQuantile(&total, 0.99) / 1e3;
+    double p999 = histQuantile(&total, 0.999) / 1e3;
+    if (json) {
+        printf("{\"path\":\"%s\",\"mode\":\"%s\",\"threads\":%d,"
+                "\"connections\":%d,\"depth\":%d,\"keepalive\":%d,\"tls\":%d,"
+                "\"target_rps\":%.0f,\"seconds\":%.2f,\"requests\":%llu,"
+                "\"errors\":%llu,\"non2xx\":%llu,\"rps\":%.1f,"
+                "\"body_MBps\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+                "\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+                path, rate > 0 ? "open" : "closed", nthreads, nconns, depth,
+                keepalive, tls, rate, elapsed, (unsigned long long) completed,
+                (unsigned long long) errors, (unsigned long long) non2xx,
+                completed / elapsed, bytes / elapsed / 1e6, p50, p99, p999,
+                total.max / 1e3);
+    } else {
+        printf("%s %s loop, %d threads, %d connections, depth %d%s%s\n",
+                path, rate > 0 ? "open" : "closed", nthreads, nconns, depth,
+                keepalive ? ", keep-alive" : "",
+                tls == 1 ? ", TLS" : tls == 2 ? ", TLS full handshakes" : "");
+        printf("  %llu requests in %.2fs, %llu errors, %llu non-2xx\n",
+                (unsigned long long) completed, elapsed,
+                (unsigned long long) errors, (unsigned long long) non2xx);
+        printf("  %.1f requests/s, %.2f MB/s body\n", completed / elapsed,
+                bytes / elapsed / 1e6);
+        printf("  latency p50 %.1fus  p99 %.1fus  p99.9 %.1fus  max %.1fus\n",
+                p50, p99, p999, total.max / 1e3);
+    }
+    free(workers);
+    return 0;
+}
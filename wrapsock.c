@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,10 +6,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>    /* Internet domain header */
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include "wrapsock.h"
+#include "transport.h"
 
-/* Socket function wrappers that incorporate error checking
+/* Socket function wrappers that incorporate error checking.  Close and the
+ * functions for client sockets go through the transport (see
+ * transport.c).
  */
 
 int Accept(int fd, struct sockaddr *sa, socklen_t *salenptr) {
@@ -43,10 +50,17 @@ int Select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
 
     int n;
     if ( (n = select(nfds, readfds, writefds, exceptfds, timeout)) < 0) {
+        if (errno == EINTR) {
+            /* a signal; report nothing ready so the caller looks at it */
+            if (readfds != NULL) FD_ZERO(readfds);
+            if (writefds != NULL) FD_ZERO(writefds);
+            if (exceptfds != NULL) FD_ZERO(exceptfds);
+            return 0;
+        }
         perror("select error");
         exit(1);
     }
-    return n;              /* can return 0 on timeout */
+    return n;              /* can return 0 on timeout or signal */
 }
 
 
@@ -61,7 +75,7 @@ int Socket(int family, int type, int protocol) {
 }
 
 void Close(int fd) {
-    if (close(fd) == -1) {
+    if (ioClose(fd) == -1) {
         perror("close error");
         exit(1);
     }
@@ -75,10 +89,21 @@ void Dup2(int oldfd, int newfd) {
     }
 }
 
+/* A descriptor held in reserve so that when the process runs out of
+ * descriptors we can still accept (and immediately close) a connection
+ * instead of leaving it in the queue to wake us up forever.
+ */
+static int reserve_fd = -1;
+
 /*
  * Create and set up a socket for a server to listen on.
+ * The socket is non-blocking and the kernel only hands us connections once
+ * the client has sent data (TCP_DEFER_ACCEPT).  backlog is the length of
+ * the queue of pending connections.  If reuseport is set, other processes
+ * may listen on the same port (SO_REUSEPORT) and the kernel spreads the
+ * connections among them.
  */
-int setupServerSocket(unsigned short port) {
+int setupServerSocket(unsigned short port, int backlog, int reuseport) {
     int soc = Socket(PF_INET, SOCK_STREAM, 0);
 
     // Make sure we can reuse the port immediately after the
@@ -90,6 +115,10 @@ int setupServerSocket(unsigned short port) {
         perror("setsockopt");
         exit(1);
     }
+    if (reuseport && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        exit(1);
+    }
 
     struct sockaddr_in addr;
 
@@ -109,13 +138,88 @@ int setupServerSocket(unsigned short port) {
         exit(1);
     }
 
+    // Don't wake up for connections that have not sent a request yet;
+    // after DEFER_ACCEPT_SECS the kernel passes them on anyway.
+    int defer = DEFER_ACCEPT_SECS;
+    if (setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0) {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+    }
+
+    if (fcntl(soc, F_SETFL, fcntl(soc, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(1);
+    }
+
     // Set up a queue in the kernel to hold pending connections.
-    if (listen(soc, LISTENQ) < 0) {
+    if (listen(soc, backlog) < 0) {
         // listen failed
         perror("listen");
         exit(1);
     }
 
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     return soc;
 }
 
+/*
+ * Accept one pending connection on the non-blocking socket listenfd.
+ * The new socket is non-blocking and close-on-exec.
+ * Return the new socket, or -1 if there is nothing more to accept right
+ * now.  Unlike Accept, errors never terminate the server: aborted
+ * connections are skipped and running out of descriptors drops the
+ * connection (see dropPendingConnection).
+ */
+int acceptConnection(int listenfd, struct sockaddr *sa, socklen_t *salenptr) {
+    for (;;) {
+        int fd = ioAccept(listenfd, sa, salenptr);
+        if (fd >= 0) {
+            return fd;
+        }
+        switch (errno) {
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+            continue;
+        case EMFILE:
+        case ENFILE:
+            dropPendingConnection(listenfd);
+            return -1;
+        case EAGAIN:
+            return -1;
+        default:
+            perror("accept4");
+            return -1;
+        }
+    }
+}
+
+/*
+ * We are out of descriptors: use the reserve descriptor to accept the
+ * connection at the head of the queue and close it right away, so the
+ * client gets a prompt reset instead of a hang and the listening socket
+ * stops being readable.
+ */
+void dropPendingConnection(int listenfd) {
+    if (reserve_fd == -1) {
+        return;
+    }
+    close(reserve_fd);
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd >= 0) {
+        close(fd);
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+
+/*
+ * Set per-connection socket options on an accepted socket.
+ * Responses are written with a single writev (corked when larger), so
+ * Nagle only delays the last partial segment; turn it off.
+ */
+void tuneClientSocket(int fd) {
+    int on = 1;
+    if (ioSetsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        perror("setsockopt TCP_NODELAY");
+    }
+}
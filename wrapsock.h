@@ -2,7 +2,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>    /* Internet domain header */
 
-#define LISTENQ 10
+#define LISTENQ 10  /* default listen backlog */
+#define DEFER_ACCEPT_SECS 5
 
 int Accept(int fd, struct sockaddr *sa, socklen_t *salenptr);
 void Bind(int fd, const struct sockaddr *sa, socklen_t salen);
@@ -15,6 +16,9 @@ int Socket(int family, int type, int protocol);
 void Close(int fd);
 void Dup2(int oldfd, int newfd);
 
-int setupServerSocket(unsigned short port);
+int setupServerSocket(unsigned short port, int backlog, int reuseport);
+int acceptConnection(int listenfd, struct sockaddr *sa, socklen_t *salenptr);
+void dropPendingConnection(int listenfd);
+void tuneClientSocket(int fd);
 
 
@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "capture.h"
+
+/* wreplay: re-issue the requests of a capture (wserver -C) to a server.
+ *
+ * Each request goes out on its own connection at the time it arrived in
+ * the capture, scaled by the speed: -s 1 keeps the original gaps, -s 10
+ * makes them ten times shorter and -s 0 sends requests as fast as -c
+ * connections allow, in their original order.  Requests that shared a
+ * connection are sent in order, each once the response to the one before
+ * it is in.  As with the open loop of wbench, latency is measured from
+ * the time a request was due, so a server that falls behind shows in the
+ * percentiles.
+ *
+ * The report puts the latency distribution of the replay, per path, next
+ * to that of the original run, which the capture has from the time each
+ * response went out.
+ *
+ * Requests the capture flags CAPTURE_BODY are not sent, since it has
+ * only their header: each would stall until the server's deadline.  They
+ * keep their place on their connection and are counted apart.
+ */
+
+#define MAX_EVENTS 256
+#define MAX_PATHS 16
+#define PATH_LEN 32
+#define RECV_BUF 65536
+
+enum job_state { JOB_WAITING, JOB_BLOCKED, JOB_READY, JOB_RUNNING, JOB_DONE };
+
+/* One request of the capture */
+struct job {
+    uint64_t at_us;             /* capture time it arrived */
+    uint32_t conn;
+    const char *req;
+    int req_len;
+    int path;                   /* index in paths */
+    int orig_status;            /* -1 if the capture has no response */
+    int skipped;                /* had a body the capture lacks */
+    uint64_t orig_us;           /* latency of the original response */
+    int prev, next;             /* requests on the same connection, or -1 */
+    int state;
+    int status;                 /* of the replayed response, 0 for none */
+    uint64_t latency_us;
+    /* While running */
+    int fd;
+    int sent;
+    int received;
+    uint64_t start_ns;          /* when it was due */
+    char head[16];
+};
+
+static struct job *jobs;
+static int num_jobs;
+static char paths[MAX_PATHS + 1][PATH_LEN];
+static int num_paths;
+static int dropped;
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+
+static uint64_t nowNsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Return the index in paths of the path of the request req, adding it if
+ * it is new and there is room.  The last entry takes the rest.
+ */
+static int pathOf(const char *req, int len) {
+    char path[PATH_LEN];
+    const char *p = memchr(req, ' ', len);
+    int n = 0;
+    if (p != NULL) {
+        p++;
+        while (p < req + len && *p != ' ' && *p != '?' && *p != '\r' && n < PATH_LEN - 1) {
+            path[n++] = *p++;
+        }
+    }
+    path[n] = '\0';
+    for (int i = 0; i < num_paths; i++) {
+        if (strcmp(paths[i], path) == 0) {
+            return i;
+        }
+    }
+    if (num_paths == MAX_PATHS) {
+        strcpy(paths[MAX_PATHS], "(other)");
+        return MAX_PATHS;
+    }
+    strcpy(paths[num_paths], path);
+    return num_paths++;
+}
+
+/* Open-addressing map from connection id to its last job, for pairing
+ * requests with their responses and with the requests before them.
+ */
+static int *conn_map;
+static int conn_map_size;
+
+static int *connSlot(uint32_t conn) {
+    uint32_t i = conn * 2654435761u & (conn_map_size - 1);
+    while (conn_map[i] != -1 && jobs[conn_map[i]].conn != conn) {
+        i = (i + 1) & (conn_map_size - 1);
+    }
+    return &conn_map[i];
+}
+
+static void resetConnMap(void) {
+    for (int i = 0; i < conn_map_size; i++) {
+        conn_map[i] = -1;
+    }
+}
+
+static int compareJobs(const void *a, const void *b) {
+    const struct job *x = a, *y = b;
+    if (x->at_us != y->at_us) {
+        return x->at_us < y->at_us ? -1 : 1;
+    }
+    return x->req < y->req ? -1 : x->req > y->req;
+}
+
+/* Read the capture in filename into jobs.  Exit on error. */
+static void loadCapture(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(filename);
+        exit(1);
+    }
+    char *data = malloc(st.st_size + 1);
+    size_t size = 0;
+    while (size < (size_t) st.st_size) {
+        ssize_t n = read(fd, data + size, st.st_size - size);
+        if (n <= 0) {
+            break;
+        }
+        size += n;
+    }
+    close(fd);
+    struct capture_header h;
+    if (size < sizeof(h) || memcmp(data, CAPTURE_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", filename);
+        exit(1);
+    }
+
+    // Requests first, in the order the file has them
+    int cap = 1024;
+    jobs = malloc(cap * sizeof(*jobs));
+    for (size_t off = sizeof(h); off + sizeof(struct capture_record) <= size; ) {
+        struct capture_record rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        off += sizeof(rec);
+        if (rec.type == CAPTURE_DROPPED) {
+            dropped += rec.len;
+        }
+        if (rec.type != CAPTURE_REQUEST) {
+            continue;
+        }
+        if (off + rec.len > size) {
+            break;      // cut short while being written
+        }
+        if (num_jobs == cap) {
+            cap *= 2;
+            jobs = realloc(jobs, cap * sizeof(*jobs));
+        }
+        struct job *j = &jobs[num_jobs++];
+        memset(j, 0, sizeof(*j));
+        j->at_us = rec.time_us;
+        j->conn = rec.conn;
+        j->req = data + off;
+        j->req_len = rec.len;
+        j->path = pathOf(j->req, j->req_len);
+        j->orig_status = -1;
+        j->skipped = (rec.flags & CAPTURE_BODY) != 0;
+        j->fd = -1;
+        off += rec.len;
+    }
+    if (num_jobs == 0) {
+        fprintf(stderr, "%s: no requests\n", filename);
+        exit(1);
+    }
+    qsort(jobs, num_jobs, sizeof(*jobs), compareJobs);
+
+    conn_map_size = 1;
+    while (conn_map_size < num_jobs * 2) {
+        conn_map_size *= 2;
+    }
+    conn_map = malloc(conn_map_size * sizeof(*conn_map));
+
+    // Chain the requests of each connection, in time order
+    resetConnMap();
+    for (int i = 0; i < num_jobs; i++) {
+        int *slot = connSlot(jobs[i].conn);
+        jobs[i].prev = *slot;
+        jobs[i].next = -1;
+        if (*slot != -1) {
+            jobs[*slot].next = i;
+        }
+        *slot = i;
+    }
+
+    // Each response goes with the first request of its connection that
+    // has none yet
+    resetConnMap();
+    for (int i = num_jobs - 1; i >= 0; i--) {
+        if (jobs[i].prev == -1) {
+            *connSlot(jobs[i].conn) = i;
+        }
+    }
+    for (size_t off = sizeof(h); off + sizeof(struct capture_record) <= size; ) {
+        struct capture_record rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        off += sizeof(rec) + (rec.type == CAPTURE_REQUEST ? rec.len : 0);
+        if (rec.type != CAPTURE_DONE) {
+            continue;
+        }
+        int *slot = connSlot(rec.conn);
+        if (*slot == -1) {
+            continue;
+        }
+        struct job *j = &jobs[*slot];
+        j->orig_status = rec.len;
+        j->orig_us = rec.time_us > j->at_us ? rec.time_us - j->at_us : 0;
+        *slot = j->next;
+    }
+}
+
+static int epfd;
+static int in_flight;
+static int finished;
+static int *ready;              /* jobs whose turn came while blocked */
+static int num_ready;
+
+static void finishJob(struct job *j, uint64_t now) {
+    if (j->fd != -1) {
+        close(j->fd);
+        j->fd = -1;
+        in_flight--;
+    }
+    j->state = JOB_DONE;
+    j->latency_us = (now - j->start_ns) / 1000;
+    if (j->received >= 12 && strncmp(j->head, "HTTP/1.", 7) == 0) {
+        j->status = atoi(j->head + 9);
+    }
+    finished++;
+    if (j->next != -1 && jobs[j->next].state == JOB_BLOCKED) {
+        jobs[j->next].state = JOB_READY;
+        ready[num_ready++] = j->next;
+    }
+}
+
+/* Connect for j, due at due (nowNsec() time). */
+static void startJob(struct job *j, uint64_t due) {
+    j->state = JOB_RUNNING;
+    j->start_ns = due;
+    if (j->skipped) {
+        // Only the next request on its connection waits for it
+        finishJob(j, due);
+        return;
+    }
+    j->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (j->fd == -1) {
+        perror("socket");
+        finishJob(j, nowNsec());
+        return;
+    }
+    in_flight++;
+    int on = 1;
+    setsockopt(j->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(j->fd, (struct sockaddr *) &server_addr, server_addr_len) == -1 &&
+            errno != EINPROGRESS) {
+        finishJob(j, nowNsec());
+        return;
+    }
+    struct epoll_event ev = {EPOLLOUT, {.ptr = j}};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, j->fd, &ev);
+}
+
+/* Send the request of j, then read its response until the server closes
+ * the connection.
+ */
+static void jobEvent(struct job *j, uint32_t events) {
+    if (j->sent < j->req_len) {
+        if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLOUT)) {
+            finishJob(j, nowNsec());
+            return;
+        }
+        ssize_t n = send(j->fd, j->req + j->sent, j->req_len - j->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                finishJob(j, nowNsec());
+            }
+            return;
+        }
+        j->sent += n;
+        if (j->sent == j->req_len) {
+            struct epoll_event ev = {EPOLLIN, {.ptr = j}};
+            epoll_ctl(epfd, EPOLL_CTL_MOD, j->fd, &ev);
+        }
+        return;
+    }
+    static char buf[RECV_BUF];
+    for (;;) {
+        ssize_t n = read(j->fd, buf, sizeof(buf));
+        if (n > 0) {
+            for (int k = 0; k < n && j->received + k < (int) sizeof(j->head); k++) {
+                j->head[j->received + k] = buf[k];
+            }
+            j->received += n;
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        // EOF, or reset after the response
+        finishJob(j, nowNsec());
+        return;
+    }
+}
+
+static int compareU64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double quantileMs(uint64_t *v, int n, double q) {
+    if (n == 0) {
+        return 0;
+    }
+    int i = (int) (q * (n - 1) + 0.5);
+    return v[i] / 1e3;
+}
+
+struct summary {
+    int requests, errors, mismatches, orig_count, skipped;
+    double p50, p99, max, orig_p50, orig_p99, orig_max;
+};
+
+/* Summarize the jobs on path (-1 for all of them). */
+static struct summary summarize(int path) {
+    struct summary s = {0};
+    uint64_t *replay = malloc(num_jobs * sizeof(uint64_t));
+    uint64_t *orig = malloc(num_jobs * sizeof(uint64_t));
+    for (int i = 0; i < num_jobs; i++) {
+        struct job *j = &jobs[i];
+        if (path != -1 && j->path != path) {
+            continue;
+        }
+        if (j->skipped) {
+            s.skipped++;
+            continue;
+        }
+        if (j->status == 0) {
+            s.errors++;
+        } else {
+            replay[s.requests - s.errors] = j->latency_us;
+        }
+        s.requests++;
+        if (j->orig_status != -1) {
+            orig[s.orig_count++] = j->orig_us;
+            s.mismatches += j->status != 0 && j->status != j->orig_status;
+        }
+    }
+    int ok = s.requests - s.errors;
+    qsort(replay, ok, sizeof(uint64_t), compareU64);
+    qsort(orig, s.orig_count, sizeof(uint64_t), compareU64);
+    s.p50 = quantileMs(replay, ok, 0.5);
+    s.p99 = quantileMs(replay, ok, 0.99);
+    s.max = quantileMs(replay, ok, 1);
+    s.orig_p50 = quantileMs(orig, s.orig_count, 0.5);
+    s.orig_p99 = quantileMs(orig, s.orig_count, 0.99);
+    s.orig_max = quantileMs(orig, s.orig_count, 1);
+    free(replay);
+    free(orig);
+    return s;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: wreplay [-s speed] [-c connections] [-j] host port capture\n"
+            "  -s  1 (default) keeps the original timing, N replays N times faster,\n"
+            "      0 as fast as the connections allow\n"
+            "  -c  connections open at once at most (default 1000)\n"
+            "  -j  print one JSON object per path instead of a text report\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    double speed = 1;
+    int max_conns = 1000;
+    int json = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:j")) != -1) {
+        switch (opt) {
+        case 's': speed = atof(optarg); break;
+        case 'c': max_conns = atoi(optarg); break;
+        case 'j': json = 1; break;
+        default: usage();
+        }
+    }
+    if (argc - optind != 3 || speed < 0 || max_conns < 1) {
+        usage();
+    }
+    const char *host = argv[optind], *port = argv[optind + 1];
+    struct addrinfo hints = {0}, *ai;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+        exit(1);
+    }
+    memcpy(&server_addr, ai->ai_addr, ai->ai_addrlen);
+    server_addr_len = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    loadCapture(argv[optind + 2]);
+    ready = malloc(num_jobs * sizeof(*ready));
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    uint64_t first_us = jobs[0].at_us;
+    uint64_t start = nowNsec();
+    int next = 0;               // next job in time order
+    while (finished < num_jobs) {
+        uint64_t now = nowNsec();
+        while (num_ready > 0 && in_flight < max_conns) {
+            struct job *j = &jobs[ready[--num_ready]];
+            startJob(j, j->start_ns > now ? now : j->start_ns);
+        }
+        int timeout = -1;
+        while (next < num_jobs && in_flight < max_conns) {
+            struct job *j = &jobs[next];
+            uint64_t due = speed > 0 ? start + (uint64_t) ((j->at_us - first_us) * 1000 / speed) : now;
+            if (due > now) {
+                timeout = (int) ((due - now + 999999) / 1000000);
+                break;
+            }
+            next++;
+            if (j->prev != -1 && jobs[j->prev].state != JOB_DONE) {
+                // Its connection is still busy with the one before
+                j->state = JOB_BLOCKED;
+                j->start_ns = due;
+                continue;
+            }
+            startJob(j, due);
+        }
+        if (in_flight == 0 && num_ready == 0 && timeout == -1) {
+            continue;
+        }
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            jobEvent(events[i].data.ptr, events[i].events);
+        }
+    }
+    double seconds = (nowNsec() - start) / 1e9;
+    double orig_seconds = (jobs[num_jobs - 1].at_us - first_us) / 1e6;
+
+    for (int p = -1; p < num_paths + (paths[MAX_PATHS][0] != '\0'); p++) {
+        struct summary s = summarize(p);
+        const char *name = p == -1 ? "all" : paths[p];
+        if (json) {
+            printf("{\"path\":\"%s\",\"speed\":%g,\"seconds\":%.2f,\"orig_seconds\":%.2f,"
+                    "\"requests\":%d,\"errors\":%d,\"mismatches\":%d,\"dropped\":%d,\"skipped\":%d,"
+                    "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,"
+                    "\"orig_p50_ms\":%.3f,\"orig_p99_ms\":%.3f,\"orig_max_ms\":%.3f}\n",
+                    name, speed, seconds, orig_seconds, s.requests, s.errors,
+                    s.mismatches, p == -1 ? dropped : 0, s.skipped, s.p50, s.p99, s.max,
+                    s.orig_p50, s.orig_p99, s.orig_max);
+            continue;
+        }
+        if (p == -1) {
+            printf("%d requests replayed in %.2fs (%.2fs captured)", s.requests,
+                    seconds, orig_seconds);
+            if (speed > 0) {
+                printf(" at %gx\n", speed);
+            } else {
+                printf(" as fast as possible\n");
+            }
+            printf("  %d errors, %d statuses differ from the capture, %d requests "
+                    "dropped by it\n", s.errors, s.mismatches, dropped);
+            if (s.skipped > 0) {
+                printf("  %d requests with bodies not replayed\n", s.skipped);
+            }
+            printf("  %-24s %8s  %25s  %25s\n", "path (ms)", "requests",
+                    "original p50/p99/max", "replay p50/p99/max");
+        }
+        printf("  %-24s %8d  %8.2f %8.2f %8.2f  %8.2f %8.2f %8.2f\n", name,
+                s.requests, s.orig_p50, s.orig_p99, s.orig_max, s.p50, s.p99, s.max);
+    }
+    return 0;
+}
@@ -1,24 +1,90 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <sys/wait.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #include "wrapsock.h"
 #include "ws_helpers.h"
+#include "log.h"
+#include "stats.h"
+#include "probes.h"
+#include "h2.h"
+#include "tls.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "mem.h"
+#include "affinity.h"
+#include "transport.h"
+#include "capture.h"
+#include "pack.h"
+#include "body.h"
 
+/* Deadlines of all connections, in nowMsec() time */
+static struct timer_wheel deadlines;
+
+/* The entries of initClients, for shedIdleClient and resumedClient */
+static struct clientstate *clients;
+static int num_clients;
+static int paused_clients;  /* entries with paused set */
+
+/* Killed programs nobody waits for any more, see reapLater */
+static int *orphans;
+static int num_orphans, orphans_cap;
+
+static const char *spill_dir = SPILL_DIR;
+
+#define STATS_PAGE_MAX 65536  /* room for the metrics page, see layoutStats */
+
+static uint64_t nowMsec(void) {
+    return nowUsec() / 1000;
+}
 
 void initClients(struct clientstate *client, int size) {
     // Initialize client array
     for (int i = 0; i < size; i++){
         client[i].sock = -1;	/* -1 indicates available entry */
         client[i].fd[0] = -1;
+        client[i].fd[1] = -1;
         client[i].request = NULL;
         client[i].path = NULL;
         client[i].query_string = NULL;
         client[i].output = NULL;
         client[i].optr = client[i].output;
+        client[i].out_cap = 0;
+        client[i].spill_fd = -1;
+        client[i].spill_len = 0;
+        client[i].spill_map = NULL;
+        client[i].req_bytes = 0;
+        client[i].paused = 0;
+        client[i].cgi_status = REAP_PENDING;
+        client[i].reaping = 0;
+        client[i].req_id = 0;
+        client[i].t_accept = 0;
+        client[i].t_header = 0;
+        client[i].t_parsed = 0;
+        client[i].t_spawned = 0;
+        client[i].t_first_byte = 0;
+        client[i].t_cgi_done = 0;
+        timerInit(&client[i].deadline);
+        client[i].timed_out = TIMER_NONE;
+        client[i].accept_enc = 0;
+        client[i].zbody = NULL;
+        client[i].h2 = NULL;
+        client[i].pack = NULL;
+        client[i].body = NULL;
     }
+    clients = client;
+    num_clients = size;
+    timerWheelInit(&deadlines, nowMsec());
 }
 
 
@@ -26,8 +92,42 @@ void initClients(struct clientstate *client, int size) {
  * Free the dynamically allocated fields
  */
 void resetClient(struct clientstate *cs){
+    bodyEnd(cs);
     cs->sock = -1;
     cs->fd[0] = -1;
+    cs->req_id = 0;
+    cs->t_accept = 0;
+    cs->t_header = 0;
+    cs->t_parsed = 0;
+    cs->t_spawned = 0;
+    cs->t_first_byte = 0;
+    cs->t_cgi_done = 0;
+    timerDel(&deadlines, &cs->deadline);
+    cs->timed_out = TIMER_NONE;
+    cs->accept_enc = 0;
+    variantRelease(cs->zbody);
+    cs->zbody = NULL;
+    packRelease(cs->pack);
+    cs->pack = NULL;
+    memAdd(MEM_REQUEST, -cs->req_bytes);
+    cs->req_bytes = 0;
+    memAdd(MEM_CGI, -cs->out_cap);
+    cs->out_cap = 0;
+    if (cs->spill_map != NULL) {
+        munmap(cs->spill_map, cs->spill_len);
+        cs->spill_map = NULL;
+    }
+    if (cs->spill_fd != -1) {
+        close(cs->spill_fd);
+        cs->spill_fd = -1;
+        cs->spill_len = 0;
+    }
+    if (cs->paused) {
+        cs->paused = 0;
+        paused_clients--;
+    }
+    cs->cgi_status = REAP_PENDING;
+    cs->reaping = 0;
 
     if(cs->path != NULL) {
         free(cs->path);
@@ -58,48 +158,293 @@ int reset_client_for_fd(int fd, struct clientstate *client, int size) {
 }
 
 
+/* Keep spill files in dir from now on. */
+void spillInit(const char *dir) {
+    spill_dir = dir;
+}
+
+/* Return a new anonymous file for spilled CGI output, or -1: one that is
+ * never linked in spill_dir, or a memfd if that file system cannot have
+ * such files.
+ */
+static int spillFile(void) {
+    int fd = open(spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        fd = memfd_create("wserver-cgi", MFD_CLOEXEC);
+    }
+    if (fd == -1) {
+        perror("spill file");
+    }
+    return fd;
+}
+
+/* Append the n bytes at cs->optr, the last chunk of its output buffer,
+ * to the spill file of cs.  Return 0, or -1 on error.
+ */
+static int spillWrite(struct clientstate *cs, int n) {
+    for (int done = 0; done < n; ) {
+        ssize_t w = write(cs->spill_fd, cs->optr + done, n - done);
+        if (w < 0) {
+            perror("write spill file");
+            return -1;
+        }
+        done += w;
+    }
+    cs->spill_len += n;
+    return 0;
+}
+
+/* The output buffer of cs is full and may not grow: go on in a spill
+ * file.  The last CGI_CHUNK bytes of the buffer are its first bytes, and
+ * from now on the CGI program is read into that chunk and each read is
+ * appended to the file, so the program never waits for memory or for the
+ * client.  Return 0, or -1 if there is no file to be had.
+ */
+static int spillOutput(struct clientstate *cs) {
+    if (cs->out_cap < 2 * CGI_CHUNK) {
+        // Not even the CGI header block would stay in memory
+        return -1;
+    }
+    cs->spill_fd = spillFile();
+    if (cs->spill_fd == -1) {
+        return -1;
+    }
+    cs->spill_at = cs->out_cap - CGI_CHUNK;
+    cs->optr = cs->output + cs->spill_at;
+    if (spillWrite(cs, CGI_CHUNK) == -1) {
+        close(cs->spill_fd);
+        cs->spill_fd = -1;
+        cs->optr = cs->output + cs->out_cap;
+        return -1;
+    }
+    statsAdd(STAT_CGI_SPILLED, 1);
+    LOG_DEBUG("Pipe %d spilling after %d bytes\n", cs->fd[0], cs->spill_at);
+    return 0;
+}
+
+/* Map the spill file of cs, if it has one, and add it to the response in
+ * cs->out_iov, for event loops that send the whole response at once
+ * rather than with clientWritable (io_uring).  Return 0, or -1 on error.
+ */
+int spillMap(struct clientstate *cs) {
+    if (cs->spill_fd == -1 || cs->spill_len == 0) {
+        return 0;
+    }
+    void *map = mmap(NULL, cs->spill_len, PROT_READ, MAP_SHARED, cs->spill_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap spill file");
+        return -1;
+    }
+    cs->spill_map = map;
+    cs->out_iov[cs->out_iovcnt].iov_base = map;
+    cs->out_iov[cs->out_iovcnt].iov_len = cs->spill_len;
+    cs->out_iovcnt++;
+    cs->spill_off = cs->spill_len;
+    return 0;
+}
+
+/* Read what the CGI program of client wrote.  Return as pipe_data_read,
+ * or 2 if there is no memory to read into; the pipe must not be read
+ * until client comes back from resumedClient.
+ */
 int handle_pipe_data(struct clientstate *client) {
-    int already_read = client->optr - client->output;
-    int bytes_read = read(client->fd[0], client->optr, MAXPAGE - already_read);
+    int room = cgiRoom(client);
+    if (room == -1) {
+        return 2;
+    }
+    int bytes_read = ioRead(client->fd[0], client->optr, room);
     if (bytes_read < 0) {
         perror("read");
+    }
+    return pipe_data_read(client, bytes_read);
+}
+
+/* Account for the result of one read of bytes_read bytes from the CGI pipe
+ * into client->optr; this is the part of handle_pipe_data shared with
+ * event loops that do the read themselves.  Returns as handle_pipe_data:
+ * 1 if more data is expected, 0 when the CGI program succeeded, 100 when
+ * it was not found, 502 or 504 when its upstream failed or timed out (see
+ * proxy.c) and -1 on error.  At EOF from a program that has not exited
+ * yet it returns 2, as for a pause: the pipe is read again, to the same
+ * EOF, once client comes back from resumedClient with the program reaped.
+ */
+int pipe_data_read(struct clientstate *client, int bytes_read) {
+    if (bytes_read < 0) {
         return -1;
     } else if (bytes_read == 0) { // external program closed pipe
-        int status = 33;
-        fprintf(stderr, "External CGI program closed pipe %d\n", client->fd[0]);
-        // Check that the external CGI program finished successfuly
-
-        int rc = waitpid(client->cgi_pid, &status, WNOHANG);
-        fprintf(stderr, "waitpid returned %d\n", rc);
-        fprintf(stderr, "status: %d\n", status);
-        if (rc < 0) {
-            perror("waitpid failed");
-            return -1;
-        } else if (rc == 0) {
-            // Program has not exited yet
-            return -1;
-        } else {
-            // External program has finished; inspect its status
-            if (status == 100<<8) {
-                // Success
-                fprintf(stderr, "CGI program not found\n");
-                return 100;
-            } else if (status == 0) {
-                // Success
-                fprintf(stderr, "CGI program exited successfully\n");
-                return 0;
-            } else {
-                fprintf(stderr, "External program has finished with an error. Don't send anything to client.\n");
-                return -1;
+        LOG_DEBUG("External CGI program closed pipe %d\n", client->fd[0]);
+        // Check that the external CGI program finished successfuly.
+        if (client->cgi_status == REAP_PENDING) {
+            client->cgi_status = reapProgram(client->cgi_pid);
+        }
+        int status = client->cgi_status;
+        if (status == REAP_PENDING) {
+            // It closed its output but has not exited: hold the response,
+            // paused, until resumedClient sees it gone
+            LOG_DEBUG("CGI %d closed pipe %d before exiting\n", client->cgi_pid, client->fd[0]);
+            client->reaping = 1;
+            if (!client->paused) {
+                client->paused = 1;
+                paused_clients++;
             }
+            return 2;
+        } else if (status == 0) {
+            return 0;
+        } else if (status == 404) {
+            return 100;
+        } else if (status == 502 || status == 504) {
+            return status;
         }
+        return -1;
     } else {
-        client->optr += bytes_read;
-        fprintf(stderr, "Read %d bytes from pipe %d\n", bytes_read, client->fd[0]);
+        if (client->t_first_byte == 0) {
+            client->t_first_byte = nowUsec();
+        }
+        if (client->spill_fd != -1) {
+            // Read into the last chunk of output, which goes to the file
+            if (spillWrite(client, bytes_read) == -1) {
+                return -1;
+            }
+        } else {
+            client->optr += bytes_read;
+        }
+        WS_PROBE3(pipe_read, client->sock, client->req_id, bytes_read);
+        LOG_DEBUG("Read %d bytes from pipe %d\n", bytes_read, client->fd[0]);
         return 1;
     }
 }
 
+/* Grow the output buffer of cs if it is full, up to CGI_SPILL_AT and as
+ * far as the memory budget allows.  Return 0 if it has room now, or -1.
+ */
+static int growOutput(struct clientstate *cs) {
+    int used = cs->optr - cs->output;
+    if (used < cs->out_cap) {
+        return 0;
+    }
+    if (cs->out_cap >= CGI_SPILL_AT) {
+        return -1;
+    }
+    int cap = cs->out_cap * 2 < CGI_SPILL_AT ? cs->out_cap * 2 : CGI_SPILL_AT;
+    if (memTry(MEM_CGI, cap - cs->out_cap) == -1) {
+        return -1;
+    }
+    char *output = realloc(cs->output, cap);
+    if (output == NULL) {
+        memAdd(MEM_CGI, -(cap - cs->out_cap));
+        return -1;
+    }
+    cs->output = output;
+    cs->optr = cs->output + used;
+    cs->out_cap = cap;
+    return 0;
+}
+
+/* Return how many bytes of CGI output cs has room for at cs->optr.  The
+ * buffer grows to CGI_SPILL_AT, or less if the memory budget (see mem.c)
+ * runs out, and then the output goes on in a spill file (see
+ * spillOutput).  Return -1 if neither is possible; cs is then paused:
+ * its pipe must not be read until it comes back from resumedClient.  The
+ * output of a program killed by its deadline is not wanted, so that
+ * program is never paused; its pipe is read to EOF with whatever room
+ * there is.
+ */
+int cgiRoom(struct clientstate *cs) {
+    if (cs->spill_fd == -1 && growOutput(cs) == -1 && cs->timed_out != TIMER_CGI &&
+            spillOutput(cs) == -1) {
+        if (!cs->paused) {
+            cs->paused = 1;
+            paused_clients++;
+            statsAdd(STAT_MEM_PAUSED, 1);
+            LOG_DEBUG("Pipe %d paused at %d bytes\n", cs->fd[0], cs->out_cap);
+            shedIdleClient();
+        }
+        return -1;
+    }
+    return cs->out_cap - (cs->optr - cs->output);
+}
+
+/* Reap what reapLater left, as far as it has exited. */
+static void reapOrphans(void) {
+    for (int i = 0; i < num_orphans; ) {
+        if (reapProgram(orphans[i]) == REAP_PENDING) {
+            i++;
+        } else {
+            orphans[i] = orphans[--num_orphans];
+        }
+    }
+}
+
+/* Return a paused client (see cgiRoom) whose pipe may be read again, now
+ * that memory was released, its program was killed or, for one paused at
+ * EOF (see pipe_data_read), its program exited; or NULL if there is none.
+ * The event loop calls this until it returns NULL.
+ */
+struct clientstate *resumedClient(void) {
+    reapOrphans();
+    for (int i = 0; i < num_clients && paused_clients > 0; i++) {
+        struct clientstate *cs = &clients[i];
+        if (!cs->paused) {
+            continue;
+        }
+        if (cs->reaping) {
+            cs->cgi_status = reapProgram(cs->cgi_pid);
+            if (cs->cgi_status == REAP_PENDING) {
+                continue;
+            }
+            cs->reaping = 0;
+        }
+        if (cs->timed_out == TIMER_CGI || growOutput(cs) == 0 ||
+                spillOutput(cs) == 0) {
+            cs->paused = 0;
+            paused_clients--;
+            return cs;
+        }
+    }
+    return NULL;
+}
+
+/* Memory is short: end the connection holding the most of it among those
+ * that are idle, still sending their request or not reading their
+ * response, by expiring its deadline now.  Connections holding less than
+ * MAXLINE bytes are left alone; ending them would not help.
+ */
+void shedIdleClient(void) {
+    struct clientstate *victim = NULL;
+    int most = MAXLINE;
+    for (int i = 0; i < num_clients; i++) {
+        struct clientstate *cs = &clients[i];
+        int kind = cs->deadline.kind;
+        if (cs->sock == -1 || cs->h2 != NULL || cs->timed_out != TIMER_NONE ||
+                !timerPending(&cs->deadline) ||
+                (kind != TIMER_IDLE && kind != TIMER_HEADER && kind != TIMER_SEND)) {
+            continue;
+        }
+        int bytes = cs->req_bytes + (kind == TIMER_SEND ? cs->out_cap : 0);
+        if (bytes > most) {
+            victim = cs;
+            most = bytes;
+        }
+    }
+    if (victim != NULL) {
+        LOG_DEBUG("Shedding socket %d, %d bytes\n", victim->sock, most);
+        statsAdd(STAT_MEM_SHED, 1);
+        armDeadline(victim, victim->deadline.kind, 0);
+    }
+}
+
+/* Return the index of the entry of client whose request body goes to the
+ * pipe fd (see body.c), or -1.
+ */
+int get_client_for_input_fd(int fd, struct clientstate *client, int size) {
+    for (int i = 0; i < size; i++) {
+        if (client[i].fd[1] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 int get_client_for_pipe_fd(int fd, struct clientstate *client, int size) {
     for (int i = 0; i < size; i++) {
         if (client[i].fd[0] == fd) {
@@ -118,37 +463,51 @@ int get_client_for_sock_fd(int fd, struct clientstate *client, int size) {
     return -1;
 }
 
+/* Return the number of entries of client that hold a connection. */
+int countClients(struct clientstate *client, int size) {
+    int n = 0;
+    for (int i = 0; i < size; i++) {
+        if (client[i].sock != -1) {
+            n++;
+        }
+    }
+    return n;
+}
+
 int parse_http_request(struct clientstate *client) {
-    int get = strncmp(client->request, "GET ", 4);
-    if (get != 0) {
-        fprintf(stderr, "Not a GET request\n");
+    // POST and PUT bodies go to the program, see body.c
+    int method_len = strcspn(client->request, " ");
+    if (strncmp(client->request, "GET ", 4) != 0 &&
+            strncmp(client->request, "POST ", 5) != 0 &&
+            strncmp(client->request, "PUT ", 4) != 0) {
+        LOG_DEBUG("Not a GET, POST or PUT request\n");
         return -1;
     }
     // Test for valid path
-    if (client->request[4] != '/') {
-        fprintf(stderr, "Bad request2\n");
+    if (client->request[method_len + 1] != '/') {
+        LOG_DEBUG("Bad request2\n");
         return -1;
     }
-    const int path_start = 5;
+    const int path_start = method_len + 2;
     int path_end = strcspn(client->request + path_start, "\r ?");
 
     if (path_end == 0) {
-        fprintf(stderr, "Bad request1\n");
+        LOG_DEBUG("Bad request1\n");
         return -1;
     }
 
     // Get path
-    client->path = (char*) malloc((path_end) * sizeof(char));
+    client->path = (char*) malloc((path_end + 1) * sizeof(char));
     memcpy(client->path, client->request + path_start, path_end);
     client->path[path_end] = '\0';
 
     // Test query string
     int code = validResource(client->path);
     if (code == 0) {
-        fprintf(stderr, "Wrong program to execute: %s\n", client->path);
+        LOG_DEBUG("Wrong program to execute: %s\n", client->path);
         return -1;
     }
-    fprintf(stderr, "Path: %s\n", client->path);
+    LOG_DEBUG("Path: %s\n", client->path);
     
     if (client->request[path_start + path_end] == '?') {
         
@@ -156,76 +515,293 @@ int parse_http_request(struct clientstate *client) {
         int query_start = path_start + path_end + 1;
         int query_end = strcspn(client->request + query_start, " \r");
         if (query_end == 0) {
-            fprintf(stderr, "Bad request3\n");
+            LOG_DEBUG("Bad request3\n");
             return -1;
         }
-        client->query_string = (char*) malloc((query_end) * sizeof(char));
+        client->query_string = (char*) malloc((query_end + 1) * sizeof(char));
         memcpy(client->query_string, client->request + query_start, query_end);
         client->query_string[query_end] = '\0';
-        fprintf(stderr, "Query string is: %s\n", client->query_string);
+        LOG_DEBUG("Query string is: %s\n", client->query_string);
     }
     return 0;
 }
 
-int do_pipe(struct clientstate *client) {
-    int pipe_status = pipe(client->fd);
-    if (pipe_status == -1) {
-        fprintf(stderr, "pipe failed\n");
+/* Update the client state cs with the request input in line.
+ * Intializes cs->request if this is the first read call from the socket.
+ * Note that line must be null-terminated string.
+ *
+ * Return 0 if the get request message is not complete and we need to wait for
+ *     more data
+ * Return -1 if there is an error and the socket should be closed
+ *     - Request is not a GET, POST or PUT request
+ *     - The request header is larger than MAX_REQUEST bytes
+ *     - The first line of the GET request is poorly formatted (getPath, getQuery)
+ *
+ * Return 2 if the request is for the metrics page (STATS_REQUEST); it is answered from memory
+ *
+ * Return 3 if the request is for an entry of the content pack; its response
+ *     is laid out in cs->out_iov (see packRespond)
+ *
+ * Return 1 if the get request message is complete and ready for processing
+ *     cs->request will hold the complete request
+ *     cs->path will hold the executable path for the CGI program
+ *     cs->query will hold the query string
+ *     cs->output will be allocated to hold the output of the CGI program
+ *     cs->optr will point to the beginning of cs->output
+ */
+int handleClient(struct clientstate *cs, char *line)
+{
+
+    int n = strlen(line);
+    // fprintf(stderr, "line: %s\n", line);
+    if (cs->request == NULL)
+    { // First read operation for this socket
+        cs->request = (char *)malloc((n + 1) * sizeof(char));
+        memcpy(cs->request, line, n + 1); // Copy received data, including the NULL terminator
+    }
+    else
+    {
+        // We need to append the data we just received to the older data
+        int previous_size = strlen(cs->request);
+        int new_size = previous_size + n + 1;
+        char *new_mem = (char *)malloc(new_size * sizeof(char));
+        memcpy(new_mem, cs->request, previous_size);  // Copy old data
+        memcpy(new_mem + previous_size, line, n + 1); // Append the new data, including the NULL terminator
+        free(cs->request);                            // Free the old buffer which is no longer needed
+        cs->request = new_mem;                        // Attach the new buffer to this client
+    }
+    memAdd(MEM_REQUEST, n);
+    cs->req_bytes += n;
+    // Check whether we have a full HTTP request
+    char *end_ptr = strstr(cs->request, "\r\n\r\n");
+    if (end_ptr == NULL && cs->req_bytes > MAX_REQUEST)
+    {
+        LOG_DEBUG("Request header over %d bytes\n", MAX_REQUEST);
+        return -1;
+    }
+    if (end_ptr == NULL)
+    {
+        // fprintf(stderr, "Request not received fully. Will arm this socket for the next 'select' operation\n");
+        return 0;
+    }
+    // fprintf(stderr, "server read entire HTTP request for client\n");
+    // The metrics page is not a CGI program; catch it before validResource
+    int stats_len = sizeof(STATS_REQUEST) - 1;
+    if (strncmp(cs->request, STATS_REQUEST, stats_len) == 0 &&
+        (cs->request[stats_len] == ' ' || cs->request[stats_len] == '?'))
+    {
+        return 2;
+    }
+    // Prerendered pages need no program either
+    if (packRespond(cs))
+    {
+        return 3;
+    }
+    // Parse the HTTP request and make sure it meets all acceptance criteria
+    int parsable = parse_http_request(cs);
+    WS_PROBE3(parse, cs->sock, cs->req_id, parsable);
+    if (parsable == -1)
+    {
         return -1;
     }
-    pid_t pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "fork failed\n");
+
+    // fprintf(stderr, "handleClient called with socket: %d\n", cs->sock);
+
+    // If the resource is favicon.ico we will ignore the request
+    if (strcmp("favicon.ico", cs->path) == 0)
+    {
+        // A suggestion for debugging output
+        // fprintf(stderr, "Client: sock = %d\n", cs->sock);
+        // fprintf(stderr, "        path = %s (ignoring)\n", cs->path);
+        printNotFound(cs->sock);
+        return -1;
+    }
+
+    // A suggestion for printing some information about each client.
+    // You are welcome to modify or remove these print statements
+    // fprintf(stderr, "Client: sock = %d\n", cs->sock);
+    // fprintf(stderr, "        path = %s\n", cs->path);
+    // fprintf(stderr, "        query_string = %s\n", cs->query_string);
+
+    return 1;
+}
+
+int do_pipe(struct clientstate *client) {
+    pid_t pid = startProgram(client->path, client->query_string,
+            client->client_addr, client->body, &client->fd[0], &client->fd[1]);
+    if (pid == -1) {
         return -1;
     }
-    if (pid > 0) {
-        // Parent
-        close(client->fd[1]);
-        client->output = (char*) malloc(MAXPAGE * sizeof(char));
-        client->optr = client->output;
-        client->cgi_pid = pid;
-        return client->fd[0];
-    }
-    if (pid == 0) {
-        // Child
-        close(client->fd[0]);
-        dup2(client->fd[1], STDOUT_FILENO);
-        close(client->fd[1]);
-        execl(client->path, client->path, NULL);
-        fprintf(stderr, "Exec failed\n");
-        // return 100;
-        exit(100);
+    // Grown by cgiRoom as the output arrives
+    client->output = (char*) malloc(CGI_CHUNK * sizeof(char));
+    client->optr = client->output;
+    client->out_cap = CGI_CHUNK;
+    memAdd(MEM_CGI, CGI_CHUNK);
+    client->cgi_pid = pid;
+    WS_PROBE3(cgi_spawn, client->sock, client->req_id, pid);
+    return client->fd[0];
+}
+
+#define CGI_ENV_MAX 8  /* entries of the env array cgiEnv fills */
+
+/* Put the CGI meta-variables (RFC 3875, section 4.1) of a request for
+ * query from client_addr with body (NULL for a GET) in env, as
+ * "NAME=value" strings in a new buffer.  Return the buffer, for the
+ * caller to free.
+ */
+static char *cgiEnv(char *env[CGI_ENV_MAX], const char *query,
+        uint32_t client_addr, const struct req_body *body) {
+    const char *type = body != NULL ? bodyType(body) : NULL;
+    query = query != NULL ? query : "";
+    // The values we format ourselves take less than 256 bytes
+    size_t size = 256 + strlen(query) + (type != NULL ? strlen(type) : 0);
+    char *buf = malloc(size);
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in = {client_addr};
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    int n = 0;
+    size_t used = 0;
+    env[n++] = "GATEWAY_INTERFACE=CGI/1.1";
+    env[n++] = "SERVER_PROTOCOL=HTTP/1.1";
+    env[n++] = buf + used;
+    used += snprintf(buf + used, size - used, "REQUEST_METHOD=%s",
+            body != NULL ? bodyMethod(body) : "GET") + 1;
+    env[n++] = buf + used;
+    used += snprintf(buf + used, size - used, "QUERY_STRING=%s", query) + 1;
+    env[n++] = buf + used;
+    used += snprintf(buf + used, size - used, "REMOTE_ADDR=%s", addr) + 1;
+    if (body != NULL && bodyLength(body) >= 0) {
+        env[n++] = buf + used;
+        used += snprintf(buf + used, size - used, "CONTENT_LENGTH=%lld",
+                (long long) bodyLength(body)) + 1;
+    }
+    if (type != NULL) {
+        env[n++] = buf + used;
+        snprintf(buf + used, size - used, "CONTENT_TYPE=%s", type);
     }
+    env[n] = NULL;
+    return buf;
+}
+
+/* Start the program name for a request with the query string query (NULL
+ * if there is none) from client_addr, with its output on a new pipe whose
+ * read end goes in *fd.  A POST or PUT body (see body.c) goes to its
+ * standard input, a pipe whose write end goes in *in_fd.  A program an
+ * upstream serves (see proxy.c) gets the request forwarded instead, and
+ * its response comes through the pipe as CGI output.  Return a handle for
+ * stopProgram and reapProgram, which is the pid of a CGI program, or -1.
+ */
+int startProgram(const char *name, const char *query, uint32_t client_addr,
+        struct req_body *body, int *fd, int *in_fd) {
+    int route = upstreamProgram((char *) name);
+    if (route != -1) {
+        if (body != NULL) {
+            LOG_WARN("request bodies are not forwarded to upstreams\n");
+            return -1;
+        }
+        return proxyStart(route, name, query, client_addr, fd);
+    }
+    char *env[CGI_ENV_MAX];
+    char *values = cgiEnv(env, query, client_addr, body);
+    int pid = ioSpawn(name, env, fd, body != NULL ? in_fd : NULL);
+    free(values);
+    return pid;
+}
+
+/* Kill the program pid from startProgram; its pipe then reaches EOF.  It
+ * must still be reaped.
+ */
+void stopProgram(int pid) {
+    if (PROXY_HANDLE_P(pid)) {
+        proxyStop(pid);
+    } else {
+        ioStop(pid);
+    }
+}
+
+/* Reap the program pid from startProgram, once its pipe reached EOF,
+ * without waiting for it.  Return REAP_PENDING if it has not exited yet
+ * (a program may close its output and carry on); otherwise 0 if it
+ * succeeded, or the status to answer with: 404 if it could not be run,
+ * 502 or 504 if its upstream failed or timed out, and 500 for anything
+ * else.
+ */
+int reapProgram(int pid) {
+    if (PROXY_HANDLE_P(pid)) {
+        return proxyReap(pid);
+    }
+    int status = 33;
+    int rc = ioReap(pid, &status);
+    LOG_DEBUG("waitpid returned %d, status %d\n", rc, status);
+    if (rc == 0) {
+        return REAP_PENDING;
+    } else if (rc < 0) {
+        perror("waitpid failed");
+        return 500;
+    } else if (status == 100 << 8) {
+        LOG_DEBUG("CGI program not found\n");
+        return 404;
+    } else if (status != 0) {
+        LOG_DEBUG("External program has finished with an error. Don't send anything to client.\n");
+        return 500;
+    }
+    LOG_DEBUG("CGI program exited successfully\n");
     return 0;
 }
 
-/* Write the 404 Not Found error message on the file descriptor fd
+/* Reap pid, a program killed with stopProgram whose status nobody wants,
+ * as soon as it has exited: now, or from resumedClient.  If there is no
+ * memory to remember it, wait for it here; it was killed, so that is
+ * brief.
  */
-void printNotFound(int fd) {
+void reapLater(int pid) {
+    if (reapProgram(pid) != REAP_PENDING) {
+        return;
+    }
+    if (num_orphans == orphans_cap) {
+        int cap = orphans_cap ? orphans_cap * 2 : 16;
+        int *grown = realloc(orphans, cap * sizeof(*orphans));
+        if (grown == NULL) {
+            while (reapProgram(pid) == REAP_PENDING) {
+                poll(NULL, 0, 1);
+            }
+            return;
+        }
+        orphans = grown;
+        orphans_cap = cap;
+    }
+    orphans[num_orphans++] = pid;
+}
 
-    char *error_str = "HTTP/1.1 404 Not Found\r\n"
-        "Content-Type: text/html\r\n\r\n"
-        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"
+/* Canned responses.  The bodies are string literals so their lengths are
+ * known at compile time; the header block (status line, Content-Length,
+ * Connection) is formatted once by initResponses() so that sending one of
+ * these is a single writev with no strlen or formatting on the hot path.
+ */
+#define ERROR_PREAMBLE "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n" \
         "<html><head>\n"
+
+static const char bad_request_body[] = ERROR_PREAMBLE
+        "<title>400 Bad Request</title>\n"
+        "</head><body>\n"
+        "<h1>Bad Request (CSC209) </h1>\n"
+        "Bad Request<p>\n"
+        "</body></html>\n";
+
+static const char not_found_body[] = ERROR_PREAMBLE
         "<title>404 Not Found  </title>\n"
         "</head><body>\n"
         "<h1>Not Found (CSC209)</h1>\n"
         "<hr>\n</body>The server could not satisfy the request.</html>\n";
 
-    int result = write(fd, error_str, strlen(error_str));
-    if(result != strlen(error_str)) {
-        perror("write");
-    }
-}
-
-/* Write the 500 error message on the file descriptor fd
- */
-void printServerError(int fd) {
+static const char timeout_body[] = ERROR_PREAMBLE
+        "<title>408 Request Timeout</title>\n"
+        "</head><body>\n"
+        "<h1>Request Timeout (CSC209) </h1>\n"
+        "The server timed out waiting for the request.<p>\n"
+        "</body></html>\n";
 
-    char *error_str = "HTTP/1.1 500 Internal Server Error\r\n"
-        "Content-Type: text/html\r\n\r\n"
-        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"
-        "<html><head>\n"
+static const char server_error_body[] = ERROR_PREAMBLE
         "<title>500 Internal Server Error</title>\n"
         "</head><body>\n"
         "<h1>Internal Server Error (CSC209) </h1>\n"
@@ -233,49 +809,776 @@ void printServerError(int fd) {
         "misconfiguration and was unable to complete your request.<p>\n"
         "</body></html>\n";
 
-    int result = write(fd, error_str, strlen(error_str));
-    if(result != strlen(error_str)) {
-        perror("write");
+static const char gateway_timeout_body[] = ERROR_PREAMBLE
+        "<title>504 Gateway Timeout</title>\n"
+        "</head><body>\n"
+        "<h1>Gateway Timeout (CSC209) </h1>\n"
+        "The CGI program did not finish in time.<p>\n"
+        "</body></html>\n";
+
+static const char bad_gateway_body[] = ERROR_PREAMBLE
+        "<title>502 Bad Gateway</title>\n"
+        "</head><body>\n"
+        "<h1>Bad Gateway (CSC209) </h1>\n"
+        "The upstream server could not be reached or sent an invalid response.<p>\n"
+        "</body></html>\n";
+
+static const char too_many_requests_body[] = ERROR_PREAMBLE
+        "<title>429 Too Many Requests</title>\n"
+        "</head><body>\n"
+        "<h1>Too Many Requests (CSC209) </h1>\n"
+        "Slow down.<p>\n"
+        "</body></html>\n";
+
+static const char content_too_large_body[] = ERROR_PREAMBLE
+        "<title>413 Content Too Large</title>\n"
+        "</head><body>\n"
+        "<h1>Content Too Large (CSC209) </h1>\n"
+        "The request body is larger than the server accepts.<p>\n"
+        "</body></html>\n";
+
+static const char service_unavailable_body[] = ERROR_PREAMBLE
+        "<title>503 Service Unavailable</title>\n"
+        "</head><body>\n"
+        "<h1>Service Unavailable (CSC209) </h1>\n"
+        "The server is out of memory for new requests; try again later.<p>\n"
+        "</body></html>\n";
+
+struct canned_response {
+    const char *status;         /* status line without the trailing CRLF */
+    const char *body;
+    size_t body_len;
+    char head[160];             /* filled in by initResponses */
+    struct iovec iov[2];
+};
+
+static struct canned_response canned[NUM_RESPONSES] = {
+    [RESP_BAD_REQUEST] = {"HTTP/1.1 400 Bad Request",
+        bad_request_body, sizeof(bad_request_body) - 1},
+    [RESP_NOT_FOUND] = {"HTTP/1.1 404 Not Found",
+        not_found_body, sizeof(not_found_body) - 1},
+    [RESP_TIMEOUT] = {"HTTP/1.1 408 Request Timeout",
+        timeout_body, sizeof(timeout_body) - 1},
+    [RESP_SERVER_ERROR] = {"HTTP/1.1 500 Internal Server Error",
+        server_error_body, sizeof(server_error_body) - 1},
+    [RESP_GATEWAY_TIMEOUT] = {"HTTP/1.1 504 Gateway Timeout",
+        gateway_timeout_body, sizeof(gateway_timeout_body) - 1},
+    [RESP_BAD_GATEWAY] = {"HTTP/1.1 502 Bad Gateway",
+        bad_gateway_body, sizeof(bad_gateway_body) - 1},
+    [RESP_TOO_MANY_REQUESTS] = {"HTTP/1.1 429 Too Many Requests",
+        too_many_requests_body, sizeof(too_many_requests_body) - 1},
+    [RESP_SERVICE_UNAVAILABLE] = {"HTTP/1.1 503 Service Unavailable",
+        service_unavailable_body, sizeof(service_unavailable_body) - 1},
+    [RESP_CONTENT_TOO_LARGE] = {"HTTP/1.1 413 Content Too Large",
+        content_too_large_body, sizeof(content_too_large_body) - 1},
+};
+
+/* Serialize the header block of every canned response.  Must be called
+ * once before any response is sent.
+ */
+void initResponses(void) {
+    for (int i = 0; i < NUM_RESPONSES; i++) {
+        struct canned_response *r = &canned[i];
+        int n = snprintf(r->head, sizeof(r->head),
+                "%s\r\nContent-Type: text/html\r\n"
+                "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                r->status, r->body_len);
+        r->iov[0].iov_base = r->head;
+        r->iov[0].iov_len = n;
+        r->iov[1].iov_base = (void *) r->body;
+        r->iov[1].iov_len = r->body_len;
     }
 }
 
-/* Write the 200 OK response on the file descriptor fd, and write the
- * content of the response from the string output. The string in output
- * is expected to be correctly formatted.
+/* Turn TCP_CORK on or off.  Errors are ignored: fd may not be a TCP socket.
  */
-void printOK(int fd, char *output, int length) {
-    int nbytes = strlen("HTTP/1.1 200 OK\r\n");
-    if(write(fd, "HTTP/1.1 200 OK\r\n", nbytes) != nbytes) {
-        perror("write");
+static void setCork(int fd, int on) {
+    ioSetsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/* Drop the first n written bytes from the *iovcnt iovecs at *iov. */
+static void skipIov(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/* Send one of the canned responses on fd in a single writev, as much of
+ * it as the socket takes without waiting.  Return the number of bytes
+ * written.  The event loops lay canned responses out for sendOK instead
+ * (see finishWith); this is for process_request.c.
+ */
+int printResponse(int fd, int which) {
+    ssize_t n = ioWritev(fd, canned[which].iov, 2);
+    return n > 0 ? n : 0;
+}
+
+/* Lay out canned response which, answering with status, in cs->out_iov
+ * for sendOK.
+ */
+static void layoutCanned(struct clientstate *cs, int which, int status) {
+    memcpy(cs->out_iov, canned[which].iov, sizeof(canned[which].iov));
+    cs->out_iovcnt = 2;
+    cs->out_next = cs->out_iov;
+    cs->out_sent = 0;
+    cs->out_status = status;
+}
+
+/* Return the body of canned response which, and its length in *len. */
+const char *responseBody(int which, int *len) {
+    *len = canned[which].body_len;
+    return canned[which].body;
+}
+
+/* Write the 404 Not Found error message on the file descriptor fd
+ */
+int printNotFound(int fd) {
+    return printResponse(fd, RESP_NOT_FOUND);
+}
+
+/* Return the offset of the first body byte in the CGI output, i.e. just
+ * past the blank line that ends the CGI header block, or -1 if there is
+ * no complete header block.
+ */
+int cgiBodyOffset(const char *output, int length) {
+    for (int i = 0; i + 1 < length; i++) {
+        if (output[i] != '\n') {
+            continue;
+        }
+        if (output[i + 1] == '\n') {
+            return i + 2;
+        }
+        if (i + 2 < length && output[i + 1] == '\r' && output[i + 2] == '\n') {
+            return i + 3;
+        }
+    }
+    return -1;
+}
+
+/* If the CGI output starts with a Status header (RFC 3875 6.3.3), as the
+ * responses of upstreams do (see proxy.c), put its code in *status and
+ * return the length of that line.  Otherwise set *status to 200 and
+ * return 0.
+ */
+int cgiStatus(const char *output, int length, int *status) {
+    *status = 200;
+    if (length < 12 || strncasecmp(output, "Status:", 7) != 0) {
+        return 0;
+    }
+    const char *eol = memchr(output, '\n', length);
+    const char *code = output + 7;
+    while (code < output + length && *code == ' ') {
+        code++;
+    }
+    if (eol == NULL || eol - code < 3 || code[0] < '1' || code[0] > '5' ||
+            code[1] < '0' || code[1] > '9' || code[2] < '0' || code[2] > '9') {
+        return 0;
+    }
+    *status = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+    return eol + 1 - output;
+}
+
+#define STATUS_TEXT_MAX 64  /* code and reason phrase we pass on */
+
+/* Write the status line for the CGI output into head, which must hold
+ * OK_HEAD_MAX bytes, and return its length.  The line is taken from the
+ * Status header that cgiStatus found, if there is one.
+ */
+static int formatStatusLine(char *head, const char *output, int status_len) {
+    if (status_len == 0) {
+        return snprintf(head, OK_HEAD_MAX, "HTTP/1.1 200 OK\r\n");
+    }
+    const char *text = output + 7;
+    const char *end = output + status_len;
+    while (*text == ' ') {
+        text++;
+    }
+    while (end > text && (end[-1] == '\n' || end[-1] == '\r')) {
+        end--;
     }
+    // Leave room for our headers; only the reason phrase can be cut
+    int text_len = end - text < STATUS_TEXT_MAX ? end - text : STATUS_TEXT_MAX;
+    return snprintf(head, OK_HEAD_MAX, "HTTP/1.1 %.*s\r\n", text_len, text);
+}
+
+/* Format the status line and server headers that go in front of the CGI
+ * output into head, which must hold OK_HEAD_MAX bytes.  Return the length.
+ * The caller leaves out the first *skip bytes of the output, its Status
+ * header.
+ */
+int formatOKHead(char *head, char *output, int length, int *skip) {
+    int status;
+    *skip = cgiStatus(output, length, &status);
+    int n = formatStatusLine(head, output, *skip);
+    int body_offset = cgiBodyOffset(output, length);
+    if (body_offset >= 0) {
+        n += snprintf(head + n, OK_HEAD_MAX - n,
+                "Content-Length: %d\r\nConnection: close\r\n",
+                length - body_offset);
+    }
+    return n;
+}
+
+/* Lay out the 200 response of cs in cs->out_iov: our headers, then the
+ * CGI output, with the body replaced by cs->zbody's if it is compressed.
+ * Output spilled to a file is not in cs->out_iov; it follows the rest.
+ */
+static void layoutOK(struct clientstate *cs) {
+    int length = cs->optr - cs->output;
+    int zlen;
+    const char *zdata = cs->zbody != NULL ? variantData(cs->zbody, &zlen) : NULL;
     int n;
-    while(length > MAXLINE) {
-        n = write(fd, output, MAXLINE);
-        length -= n;
-        output += n;
+    int skip;
+    if (cs->spill_fd != -1) {
+        length = cs->spill_at;
+        int body_offset = cgiBodyOffset(cs->output, length);
+        skip = cgiStatus(cs->output, length, &cs->out_status);
+        n = formatStatusLine(cs->out_head, cs->output, skip);
+        if (body_offset >= 0) {
+            n += snprintf(cs->out_head + n, OK_HEAD_MAX - n,
+                    "Content-Length: %lld\r\nConnection: close\r\n",
+                    (long long) (length - body_offset + cs->spill_len));
+        }
+        cs->out_iov[1].iov_base = cs->output + skip;
+        cs->out_iov[1].iov_len = length - skip;
+        cs->out_iovcnt = 2;
+        cs->spill_off = 0;
+    } else if (zdata != NULL) {
+        int body_offset = cgiBodyOffset(cs->output, length);
+        skip = cgiStatus(cs->output, length, &cs->out_status);
+        n = formatStatusLine(cs->out_head, cs->output, skip);
+        n += snprintf(cs->out_head + n, OK_HEAD_MAX - n,
+                "Content-Length: %d\r\nContent-Encoding: %s\r\n"
+                "Vary: Accept-Encoding\r\nConnection: close\r\n",
+                zlen, encodingName(variantEncoding(cs->zbody)));
+        cs->out_iov[1].iov_base = cs->output + skip;
+        cs->out_iov[1].iov_len = body_offset - skip;
+        cs->out_iov[2].iov_base = (void *) zdata;
+        cs->out_iov[2].iov_len = zlen;
+        cs->out_iovcnt = 3;
+        statsAdd(STAT_COMPRESSED, 1);
+    } else {
+        n = formatOKHead(cs->out_head, cs->output, length, &skip);
+        cgiStatus(cs->output, length, &cs->out_status);
+        cs->out_iov[1].iov_base = cs->output + skip;
+        cs->out_iov[1].iov_len = length - skip;
+        cs->out_iovcnt = 2;
     }
-    n = write(fd, output, length);
-    if(n != length) {
-        perror("write");
+    cs->out_iov[0].iov_base = cs->out_head;
+    cs->out_iov[0].iov_len = n;
+    cs->out_next = cs->out_iov;
+    cs->out_sent = 0;
+}
+
+/* Prepare the 200 response of cs, whose CGI program succeeded, in
+ * cs->out_iov, compressing the body if the client and the content allow
+ * (see compress.c).  Return 1 if the response is ready to send, or 0 if
+ * the body went to the helper thread; cs then comes back from
+ * compressedClient.
+ */
+int startOK(struct clientstate *cs) {
+    int length = cs->optr - cs->output;
+    int body_offset = cgiBodyOffset(cs->output, length);
+    if (body_offset >= 0 && cs->spill_fd == -1) {
+        char *body = cs->output + body_offset;
+        int body_len = length - body_offset;
+        int enc = chooseEncoding(cs->accept_enc, cs->output, body_offset, body_len);
+        if (enc != ENC_IDENTITY) {
+            cs->zbody = variantLookup(enc, body, body_len);
+            if (cs->zbody == NULL) {
+                if (compressSubmit(enc, body, body_len, cs) == 0) {
+                    return 0;
+                }
+                cs->zbody = variantCompress(enc, body, body_len);
+            }
+        }
     }
+    layoutOK(cs);
+    return 1;
 }
 
+/* Return a client whose body the helper thread has finished compressing,
+ * with its response laid out as by startOK, or NULL if there is none.
+ */
+struct clientstate *compressedClient(void) {
+    struct zvariant *v;
+    struct clientstate *cs = compressCollect(&v);
+    if (cs != NULL) {
+        cs->zbody = v;
+        layoutOK(cs);
+    }
+    return cs;
+}
 
-void printINVALID(int fd) {
-    char *error_str = "HTTP/1.1 400 Bad Request\r\n"
-        "Content-Type: text/html\r\n\r\n"
-        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"
-        "<html><head>\n"
-        "<title>400 Bad Request</title>\n"
-        "</head><body>\n"
-        "<h1>Bad Request (CSC209) </h1>\n"
-        "Bad Request<p>\n"
-        "</body></html>\n";
-    
-    fprintf(stderr, "im here\n");
+static uint32_t elapsed(uint64_t from, uint64_t to) {
+    return (from != 0 && to >= from) ? (uint32_t) (to - from) : 0;
+}
+
+/* Account for the request in cs, which has just been answered with status
+ * (0 if the client went away) after writing bytes bytes: update the stats
+ * and queue an access log record.  Must be called once per connection,
+ * before its socket is closed and resetClient is called.
+ */
+void requestDone(struct clientstate *cs, int status, int64_t bytes) {
+    struct access_record rec;
+    uint64_t now = nowUsec();
+
+    statsRecord(STAGE_HEADER, cs->t_accept, cs->t_header);
+    statsRecord(STAGE_PARSE, cs->t_header, cs->t_parsed);
+    statsRecord(STAGE_SPAWN, cs->t_parsed, cs->t_spawned);
+    statsRecord(STAGE_FIRST_BYTE, cs->t_spawned, cs->t_first_byte);
+    statsRecord(STAGE_CGI_EXIT, cs->t_spawned, cs->t_cgi_done);
+    statsRecord(STAGE_SEND, cs->t_cgi_done ? cs->t_cgi_done : cs->t_parsed, now);
+    statsResponse(status);
+    statsAdd(STAT_BYTES_SENT, bytes > 0 ? bytes : 0);
+    statsAdd(STAT_ACTIVE_CONNS, -1);
+    rateRelease(cs->client_addr);
+    WS_PROBE4(request_done, cs->sock, cs->req_id, status, bytes);
+
+    rec.time_us = wallUsec();
+    rec.client_addr = cs->client_addr;
+    rec.client_port = cs->client_port;
+    rec.status = status;
+    rec.bytes = bytes > 0 ? (bytes < UINT32_MAX ? bytes : UINT32_MAX) : 0;
+    rec.header_us = elapsed(cs->t_accept, cs->t_header);
+    rec.cgi_us = elapsed(cs->t_header, cs->t_cgi_done);
+    rec.send_us = elapsed(cs->t_cgi_done, now);
+    if (cs->path != NULL) {
+        strncpy(rec.path, cs->path, ACCESS_PATH_LEN);
+    } else {
+        rec.path[0] = '\0';
+    }
+    accessLogPush(&rec);
+    if (cs->t_header != 0) {
+        captureDone(cs->req_id, status);
+    }
+}
+
+/* Render the metrics page into the size bytes at page, formatted like
+ * the output of a CGI program.  Return its length.
+ */
+int statsPage(char *page, int size) {
+    static const char head[] = "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+    memcpy(page, head, sizeof(head) - 1);
+    int len = sizeof(head) - 1;
+    len += statsRender(page + len, size - len);
+    len += memRender(page + len, size - len);
+    return len + proxyStats(page + len, size - len);
+}
+
+/* Lay out the metrics page as the response of cs for sendOK.  It is
+ * rendered from memory, into an output buffer of cs as if a CGI program
+ * had written it, and never touches validResource or fork.
+ */
+static void layoutStats(struct clientstate *cs) {
+    cs->output = malloc(STATS_PAGE_MAX);
+    cs->out_cap = STATS_PAGE_MAX;
+    memAdd(MEM_CGI, STATS_PAGE_MAX);
+    cs->optr = cs->output + statsPage(cs->output, STATS_PAGE_MAX);
+    layoutOK(cs);
+}
+
+/* Arm the deadline of cs for the stage kind, to expire at expires_ms
+ * (nowMsec() time).  Each connection has a single deadline because it is
+ * only ever in one stage; arming it replaces the previous one.
+ */
+void armDeadline(struct clientstate *cs, int kind, uint64_t expires_ms) {
+    armTimer(&cs->deadline, kind, expires_ms);
+}
+
+/* Arm t for kind on the deadline wheel, to expire at expires_ms (nowMsec()
+ * time).  Timers of kind TIMER_TLS, TIMER_UPSTREAM and TIMER_HEALTH need
+ * not belong to a client; everything else is the deadline of a struct
+ * clientstate.
+ */
+void armTimer(struct timer *t, int kind, uint64_t expires_ms) {
+    t->kind = kind;
+    timerAdd(&deadlines, t, expires_ms);
+}
+
+void disarmTimer(struct timer *t) {
+    timerDel(&deadlines, t);
+}
+
+/* Arm the deadline for writing a response of bytes bytes to cs: the
+ * client gets SEND_TIMEOUT_MS plus the time the response takes at
+ * MIN_SEND_RATE.
+ */
+void armSendDeadline(struct clientstate *cs, uint64_t bytes) {
+    uint64_t budget = SEND_TIMEOUT_MS + bytes * 1000 / MIN_SEND_RATE;
+    armDeadline(cs, TIMER_SEND, nowMsec() + budget);
+}
 
-    int result = write(fd, error_str, strlen(error_str));
-    if(result != strlen(error_str)) {
-        perror("write");
+/* Return how many ms the event loop may block before a deadline is due,
+ * or -1 if no deadline is armed.  While a client is paused (see cgiRoom)
+ * or a killed program is left to reap (see reapLater) it is MEM_RETRY_MS
+ * at most.
+ */
+int nextDeadline(void) {
+    int64_t ms = timerNextTimeout(&deadlines, nowMsec());
+    if ((paused_clients > 0 || num_orphans > 0) && (ms == -1 || ms > MEM_RETRY_MS)) {
+        // Come back for resumedClient
+        ms = MEM_RETRY_MS;
+    }
+    return ms > INT32_MAX ? INT32_MAX : (int) ms;
+}
+
+struct expiry {
+    void (*expired)(struct clientstate *cs, void *arg);
+    void *arg;
+};
+
+static void deadlineExpired(struct timer *t, void *arg) {
+    struct expiry *e = arg;
+    if (t->kind == TIMER_TLS) {
+        tlsExpired(t);
+        return;
+    }
+    if (t->kind == TIMER_UPSTREAM || t->kind == TIMER_HEALTH) {
+        proxyExpired(t);
+        return;
+    }
+    struct clientstate *cs = (struct clientstate *)
+            ((char *) t - offsetof(struct clientstate, deadline));
+    if (t->kind == TIMER_H2) {
+        // Covers all the streams of the connection; h2.c sorts it out
+        h2Expired(cs);
+        return;
+    }
+    cs->timed_out = t->kind;
+    statsAdd(STAT_TIMEOUTS, 1);
+    WS_PROBE3(timeout, cs->sock, cs->req_id, t->kind);
+    if (t->kind == TIMER_CGI) {
+        // The pipe reaches EOF once the child is gone, and cgiRespond
+        // answers 504; the event loop needs to do nothing special
+        LOG_DEBUG("CGI %d of socket %d timed out\n", cs->cgi_pid, cs->sock);
+        stopProgram(cs->cgi_pid);
+        return;
+    }
+    e->expired(cs, e->arg);
+}
+
+/* Handle every deadline that is due.  CGI, HTTP/2, TLS and upstream
+ * deadlines are handled here; for any other kind, expired(cs, arg) is
+ * called with cs->timed_out set and must stop whatever I/O the event loop
+ * has pending on cs->sock and then call clientTimedOut, now or once that
+ * I/O has completed.
+ */
+void runDeadlines(void (*expired)(struct clientstate *cs, void *arg),
+        void *arg) {
+    struct expiry e = {expired, arg};
+    timerRun(&deadlines, nowMsec(), deadlineExpired, &e);
+}
+
+/* Answer the new connection fd with a 429 and close it, without reading
+ * its request.  The response is the canned one, sent with one
+ * non-blocking sendmsg that the send buffer of a new socket always has
+ * room for.  A TLS client cannot be answered without a handshake, so it
+ * is just closed.
+ */
+static void rejectClient(int fd) {
+    if (!tlsEnabled()) {
+        ioSend(fd, canned[RESP_TOO_MANY_REQUESTS].iov, 2, MSG_DONTWAIT | MSG_NOSIGNAL);
+        shutdown(fd, SHUT_WR);
+    }
+    Close(fd);
+    statsAdd(STAT_RATE_LIMITED, 1);
+    statsResponse(429);
+}
+
+/* Take a newly accepted socket newfd from peer and give it a free entry in
+ * client.  Return the index of the entry, or -1 if all entries are in use
+ * or the client is over its limits (see ratelimit.c), in which case newfd
+ * is closed.
+ */
+int acceptClient(struct clientstate *client, int size, int newfd,
+        struct sockaddr_in *peer) {
+    static uint64_t next_req_id = 1;
+    tuneClientSocket(newfd);
+    affinityAccepted(newfd);
+    for (int j = 0; j < size; j++) {
+        if (client[j].sock == -1) { // available entry; re-use
+            if (rateAdmit(peer->sin_addr.s_addr) != 0) {
+                rejectClient(newfd);
+                return -1;
+            }
+            client[j].sock = newfd;
+            client[j].client_addr = peer->sin_addr.s_addr;
+            client[j].client_port = ntohs(peer->sin_port);
+            client[j].t_accept = nowUsec();
+            client[j].req_id = next_req_id++;
+            armDeadline(&client[j], TIMER_IDLE, nowMsec() + IDLE_TIMEOUT_MS);
+            WS_PROBE2(accept, newfd, client[j].req_id);
+            statsAdd(STAT_ACCEPTED, 1);
+            statsAdd(STAT_ACTIVE_CONNS, 1);
+            return j;
+        }
+    }
+    // too many clients
+    Close(newfd);
+    return -1;
+}
+
+/* Answer the request in cs with one of the canned responses (or the
+ * metrics page), sent like a 200 response so that a client that does not
+ * read cannot hold up the event loop.  Return as sendOK.
+ */
+static int finishWith(struct clientstate *cs, int status) {
+    switch (status) {
+    case 200: layoutStats(cs); break;
+    case 400: layoutCanned(cs, RESP_BAD_REQUEST, 400); break;
+    case 404: layoutCanned(cs, RESP_NOT_FOUND, 404); break;
+    case 408: layoutCanned(cs, RESP_TIMEOUT, 408); break;
+    case 413: layoutCanned(cs, RESP_CONTENT_TOO_LARGE, 413); break;
+    case 429: layoutCanned(cs, RESP_TOO_MANY_REQUESTS, 429); break;
+    case 502: layoutCanned(cs, RESP_BAD_GATEWAY, 502); break;
+    case 503: layoutCanned(cs, RESP_SERVICE_UNAVAILABLE, 503); break;
+    case 504: layoutCanned(cs, RESP_GATEWAY_TIMEOUT, 504); break;
+    default: layoutCanned(cs, RESP_SERVER_ERROR, 500); break;
+    }
+    return sendOK(cs);
+}
+
+/* Feed n bytes read from the client socket (null-terminated in line) to
+ * the request in cs.
+ * Return CLIENT_MORE if the request is incomplete, CLIENT_DONE if it has
+ * been answered and the connection closed, CLIENT_SEND if that answer (an
+ * error or the metrics page) is partly written, CLIENT_CGI if the CGI program
+ * was started and its output should be read from cs->fd[0], CLIENT_STATIC
+ * if the response is laid out for sendOK, or CLIENT_H2 if the connection
+ * switched to HTTP/2 (see h2.c).
+ */
+int clientInput(struct clientstate *cs, char *line, int n) {
+    uint64_t t_read = nowUsec();
+    if (cs->request == NULL && h2Preface(line, n)) {
+        // HTTP/2 with prior knowledge
+        return h2Start(cs, line, n);
+    }
+    int had = cs->req_bytes;
+    int handle_code = handleClient(cs, line);
+    WS_PROBE4(request_read, cs->sock, cs->req_id, handle_code, n);
+    if (handle_code == 0) {
+        if (cs->deadline.kind == TIMER_IDLE) {
+            // The request has started; the whole header must arrive in time
+            armDeadline(cs, TIMER_HEADER, cs->t_accept / 1000 + HEADER_TIMEOUT_MS);
+        }
+        return CLIENT_MORE;
+    }
+    cs->t_header = t_read;
+    cs->t_parsed = nowUsec();
+    if (bodyAnnounced(cs->request)) {
+        // Only the header: the body streams past (see body.c), so wreplay
+        // could not send it again
+        int head_len = strstr(cs->request, "\r\n\r\n") + 4 - cs->request;
+        captureRequest(cs->req_id, cs->t_accept, cs->request, head_len, CAPTURE_BODY);
+    } else {
+        captureRequest(cs->req_id, cs->t_accept, cs->request, cs->req_bytes, 0);
+    }
+
+    cs->accept_enc = acceptedEncodings(cs->request);
+
+    if (handle_code == 3) {
+        // From the content pack, ready to send
+        return CLIENT_STATIC;
+    }
+    if (handle_code != -1 && h2WantsUpgrade(cs->request)) {
+        return h2Upgrade(cs);
     }
-}
\ No newline at end of file
+    if (handle_code == -1) {
+        return finishWith(cs, 400);
+    } else if (handle_code == 2) {
+        // Metrics request, answered from memory
+        return finishWith(cs, 200);
+    }
+
+    // Leave what memory is left to the programs already running
+    if (memShort(CGI_CHUNK)) {
+        statsAdd(STAT_MEM_REFUSED, 1);
+        shedIdleClient();
+        return finishWith(cs, 503);
+    }
+    // What came after the header is the start of a POST or PUT body
+    int head_len = strstr(cs->request, "\r\n\r\n") + 4 - cs->request - had;
+    int body_status = bodyStart(cs, line + head_len, n - head_len);
+    if (body_status != 0) {
+        return finishWith(cs, body_status);
+    }
+    // Open a pipe, fork/exec and allocate buffer for incoming data
+    if (do_pipe(cs) == -1) {
+        return finishWith(cs, 500);
+    }
+    cs->t_spawned = nowUsec();
+    armDeadline(cs, TIMER_CGI, cs->t_spawned / 1000 + CGI_TIMEOUT_MS);
+    statsAdd(STAT_CGI_STARTED, 1);
+    statsAdd(STAT_CGI_INFLIGHT, 1);
+    return CLIENT_CGI;
+}
+
+/* The client at the other end of cs closed its connection. */
+void clientGone(struct clientstate *cs) {
+    requestDone(cs, 0, 0);
+    Close(cs->sock);
+    resetClient(cs);
+}
+
+/* End the connection of cs, whose deadline cs->timed_out expired (see
+ * runDeadlines), once the event loop has no I/O pending on it.  A client
+ * that never sent a byte is dropped silently; one that sent part of a
+ * request gets a 408.  Return CLIENT_SEND if that 408 is partly written
+ * (finish it with clientWritable), or CLIENT_DONE.
+ */
+int clientTimedOut(struct clientstate *cs) {
+    switch (cs->timed_out) {
+    case TIMER_HEADER:
+        // The 408 is sent like any response, under a deadline of its own
+        cs->timed_out = TIMER_NONE;
+        return finishWith(cs, 408);
+    case TIMER_SEND:
+        LOG_DEBUG("Client on %d too slow, %lld bytes sent\n", cs->sock,
+                (long long) cs->out_sent);
+        requestDone(cs, cs->out_status, cs->out_sent);
+        Close(cs->sock);
+        resetClient(cs);
+        break;
+    default:
+        clientGone(cs);
+        break;
+    }
+    return CLIENT_DONE;
+}
+
+/* Record that the CGI program of cs is done (its pipe reached EOF or
+ * failed) and close the pipe.
+ */
+void cgiDone(struct clientstate *cs) {
+    bodyStop(cs);
+    cs->t_cgi_done = nowUsec();
+    timerDel(&deadlines, &cs->deadline);
+    statsAdd(STAT_CGI_INFLIGHT, -1);
+    Close(cs->fd[0]);
+    cs->fd[0] = -1;
+}
+
+/* Answer the request in cs now that its CGI program is done (see cgiDone)
+ * with the response that ret_code calls for.  Return CLIENT_DONE once the
+ * connection is closed, CLIENT_SEND if the client cannot take the whole
+ * response yet, or CLIENT_COMPRESS if the body is being compressed.
+ */
+int cgiRespond(struct clientstate *cs, int ret_code) {
+    int body_status = bodyStatus(cs);
+    if (body_status != 0) {
+        // The request body failed, and the program was stopped
+        return finishWith(cs, body_status);
+    } else if (ret_code == 0) {
+        // All data from the CGI program was received
+        if (!startOK(cs)) {
+            return CLIENT_COMPRESS;
+        }
+        return sendOK(cs);
+    } else if (cs->timed_out == TIMER_CGI) {
+        // Killed by its deadline
+        return finishWith(cs, 504);
+    } else if (ret_code == 502 || ret_code == 504) {
+        // The upstream of a proxied program failed or timed out
+        return finishWith(cs, ret_code);
+    } else if (ret_code == 100) {
+        // The CGI program has not been found
+        return finishWith(cs, 404);
+    }
+    // Server Error
+    return finishWith(cs, 500);
+}
+
+/* Start writing the response laid out by startOK (or compressedClient)
+ * without blocking, so that a slow client cannot hold up the event loop.
+ * Return as clientWritable.
+ */
+int sendOK(struct clientstate *cs) {
+    uint64_t total = 0;
+    for (int i = 0; i < cs->out_iovcnt; i++) {
+        total += cs->out_iov[i].iov_len;
+    }
+    if (cs->spill_fd != -1) {
+        total += cs->spill_len - cs->spill_off;
+    }
+    if (total > MAXLINE) {
+        setCork(cs->sock, 1);
+    }
+    armSendDeadline(cs, total);
+    return clientWritable(cs);
+}
+
+/* Copy into turn the first of the iovcnt iovecs at iov, cut to budget
+ * bytes in all.  Return how many there are.
+ */
+static int budgetIov(struct iovec *turn, const struct iovec *iov, int iovcnt,
+        size_t budget) {
+    int n = 0;
+    while (n < iovcnt && budget > 0) {
+        turn[n] = iov[n];
+        if (turn[n].iov_len > budget) {
+            turn[n].iov_len = budget;
+        }
+        budget -= turn[n].iov_len;
+        n++;
+    }
+    return n;
+}
+
+/* Write as much of the response started by sendOK as cs->sock takes, up
+ * to SEND_BUDGET bytes so that a fast client with a large response takes
+ * its turn like everyone else.  Spilled output goes last, straight from
+ * its file with sendfile.  Return CLIENT_SEND if some is left, or
+ * CLIENT_DONE once the response is complete (or failed) and the
+ * connection has been closed.
+ */
+int clientWritable(struct clientstate *cs) {
+    size_t budget = SEND_BUDGET;
+    while (cs->out_iovcnt > 0 ||
+            (cs->spill_fd != -1 && cs->spill_off < cs->spill_len)) {
+        if (budget == 0) {
+            return CLIENT_SEND;
+        }
+        ssize_t n;
+        if (cs->out_iovcnt > 0) {
+            struct iovec turn[sizeof(cs->out_iov) / sizeof(cs->out_iov[0])];
+            int turn_cnt = budgetIov(turn, cs->out_next, cs->out_iovcnt, budget);
+            n = ioWritev(cs->sock, turn, turn_cnt);
+        } else {
+            off_t left = cs->spill_len - cs->spill_off;
+            n = ioSendfile(cs->sock, cs->spill_fd, &cs->spill_off,
+                    (off_t) budget < left ? budget : (size_t) left);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return CLIENT_SEND;
+            }
+            perror(cs->out_iovcnt > 0 ? "writev" : "sendfile");
+            break;
+        }
+        if (n == 0 && cs->out_iovcnt == 0) {
+            // The spill file is shorter than it was
+            break;
+        }
+        cs->out_sent += n;
+        budget -= n;
+        if (cs->out_iovcnt > 0) {
+            skipIov(&cs->out_next, &cs->out_iovcnt, n);
+        }
+    }
+    setCork(cs->sock, 0);
+    WS_PROBE3(ok_sent, cs->sock, cs->req_id, cs->out_sent);
+    requestDone(cs, cs->out_status, cs->out_sent);
+    Close(cs->sock);
+    resetClient(cs);
+    return CLIENT_DONE;
+}
@@ -1,43 +1,182 @@
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "timer.h"
+#include "compress.h"
+
 #define MAXLINE 1024
-#define MAXPAGE 1048576  /* 1MB max page size */
+#define MAXPAGE 1048576  /* 1MB max CGI output of an HTTP/2 stream */
+#define MAX_REQUEST 8192  /* request header bytes we buffer */
+#define CGI_CHUNK 16384   /* first CGI output buffer, doubled up to CGI_SPILL_AT */
+#define CGI_SPILL_AT 262144 /* CGI output kept in memory; the rest is spilled */
+#define SPILL_DIR "/tmp"  /* default directory of spill files, see cgiRoom */
+#define OK_HEAD_MAX 192   /* room for the headers formatOKHead writes */
+#define STATS_REQUEST "GET /_stats"  /* metrics page, see handleClient */
+#define ACCEPT_BUDGET 32  /* max connections accepted per loop iteration */
+#define SEND_BUDGET 65536 /* max response bytes written per turn of a client */
+#define REAP_PENDING -1   /* from reapProgram: the program has not exited yet */
+
+/* Connection deadlines, see armDeadline */
+#define IDLE_TIMEOUT_MS 5000      /* accept -> first request byte */
+#define HEADER_TIMEOUT_MS 10000   /* accept -> complete request header */
+#define CGI_TIMEOUT_MS 30000      /* fork -> CGI output complete */
+#define SEND_TIMEOUT_MS 10000     /* grace period for writing a response */
+#define MIN_SEND_RATE 16384       /* bytes/s a client must read beyond that */
+
+/* What a connection is waiting for; the kind of cs->deadline */
+enum deadline_kind {
+    TIMER_NONE,
+    TIMER_IDLE,
+    TIMER_HEADER,
+    TIMER_CGI,
+    TIMER_SEND,
+    TIMER_H2,     /* an HTTP/2 connection, see h2Expired */
+    TIMER_TLS,    /* a TLS handshake or relay, see tlsExpired */
+    TIMER_UPSTREAM, /* a request to an upstream, see proxyExpired */
+    TIMER_HEALTH  /* the next health check of an upstream */
+};
 
 /* Assumptions you can make about the client state:
- *   request: An HTTP request will be no bigger than MAXLINE bytes
+ *   request: An HTTP request will be no bigger than MAX_REQUEST bytes
  *   resource: The resources string will be no bigger than MAXLINE bytes
  *   query_string: This string is part of the resource so can be dynamically
  *           allocated with the correct size.
- *   output: The output from the CGI program will be no bigger than
- *           MAXPAGE bytes
+ *   output: The output from the CGI program; the buffer grows from
+ *           CGI_CHUNK to CGI_SPILL_AT as memory allows, and what does not
+ *           fit goes to a spill file (see cgiRoom)
  */
 
 struct clientstate {
     int sock; /* Socket to write to */
-    int fd[2]; /* The pipe descriptors for the child to write to parent */
+    int fd[2]; /* CGI output to read, and CGI input to write the request
+                * body to (-1 once it is all written), see body.c */
     char *request; /* pointer to the beginning of a request message */
     char *path; /* program to run - not including the query string */
     char *query_string;
     char *output; /* pointer to the beginning of the response data */
     char *optr; /* pointer to the current end of the response data */
-    int cgi_pid; /* pid of the external CGI executable that is launched */
+    int out_cap; /* size of output, charged to MEM_CGI */
+    int spill_fd; /* file holding the CGI output past spill_at, or -1 */
+    int spill_at; /* bytes of output in memory once spilling */
+    off_t spill_len; /* bytes in spill_fd */
+    off_t spill_off; /* next byte of spill_fd clientWritable sends */
+    void *spill_map; /* spill_fd mapped by spillMap, or NULL */
+    int req_bytes; /* size of request, charged to MEM_REQUEST */
+    int paused; /* output is full and the budget is spent, see cgiRoom */
+    int cgi_pid; /* the CGI program or upstream request, see startProgram */
+    int cgi_status; /* from reapProgram once it is reaped, else REAP_PENDING */
+    int reaping; /* paused at EOF until the program exits, see pipe_data_read */
+    uint64_t req_id; /* unique per connection, for tracing */
+    uint32_t client_addr; /* peer IPv4 address, network byte order */
+    uint16_t client_port; /* peer port, host byte order */
+    uint64_t t_accept; /* nowUsec() timestamps of each request stage; */
+    uint64_t t_header; /* 0 until the stage is reached */
+    uint64_t t_parsed;
+    uint64_t t_spawned;
+    uint64_t t_first_byte;
+    uint64_t t_cgi_done;
+    struct timer deadline; /* armed for the stage the connection is in */
+    int timed_out; /* kind of the deadline that expired, or TIMER_NONE */
+    int accept_enc; /* codings the client accepts, see acceptedEncodings */
+    struct zvariant *zbody; /* compressed body being sent, or NULL */
+    struct iovec out_iov[3]; /* response being written by clientWritable */
+    struct iovec *out_next; /* first iovec not yet fully written */
+    int out_iovcnt;
+    int64_t out_sent;
+    int out_status; /* status of that response */
+    char out_head[OK_HEAD_MAX];
+    struct h2_conn *h2; /* set once the connection speaks HTTP/2 */
+    struct pack *pack; /* content pack out_iov points into, see pack.c */
+    struct req_body *body; /* POST or PUT body, see body.c */
 };
 
-void printNotFound(int sock);
-void printServerError(int sock);
-void printOK(int sock, char *output, int length);
-void printINVALID(int fd);
+/* Pre-serialized responses sent by printResponse */
+enum response_id {
+    RESP_BAD_REQUEST,
+    RESP_NOT_FOUND,
+    RESP_TIMEOUT,
+    RESP_SERVER_ERROR,
+    RESP_GATEWAY_TIMEOUT,
+    RESP_BAD_GATEWAY,
+    RESP_TOO_MANY_REQUESTS,
+    RESP_SERVICE_UNAVAILABLE,
+    RESP_CONTENT_TOO_LARGE,
+    NUM_RESPONSES
+};
+
+void initResponses(void);
+int printResponse(int fd, int which);
+const char *responseBody(int which, int *len);
+int printNotFound(int sock);
+int cgiBodyOffset(const char *output, int length);
+int cgiStatus(const char *output, int length, int *status);
+int formatOKHead(char *head, char *output, int length, int *skip);
+int startOK(struct clientstate *cs);
+struct clientstate *compressedClient(void);
+int sendOK(struct clientstate *cs);
+void requestDone(struct clientstate *cs, int status, int64_t bytes);
+int statsPage(char *page, int size);
 int reset_client_for_fd(int fd, struct clientstate *client, int size);
 int handle_pipe_data(struct clientstate *client);
+int cgiRoom(struct clientstate *cs);
+void spillInit(const char *dir);
+int spillMap(struct clientstate *cs);
+struct clientstate *resumedClient(void);
+void shedIdleClient(void);
+int pipe_data_read(struct clientstate *client, int bytes_read);
 int get_client_for_pipe_fd(int fd, struct clientstate *client, int size);
 int get_client_for_sock_fd(int fd, struct clientstate *client, int size);
+int get_client_for_input_fd(int fd, struct clientstate *client, int size);
+int countClients(struct clientstate *client, int size);
+int handleClient(struct clientstate *cs, char *line);
 int parse_http_request(struct clientstate *client);
 int do_pipe(struct clientstate *client);
+int startProgram(const char *name, const char *query, uint32_t client_addr,
+        struct req_body *body, int *fd, int *in_fd);
+void stopProgram(int pid);
+int reapProgram(int pid);
+void reapLater(int pid);
 
 char *getPath(char *str);
 char *getQuery(char *str);
 void initClients(struct clientstate *client, int size);
+
+/* Results of clientInput */
+#define CLIENT_MORE 0   /* request incomplete, keep reading the socket */
+#define CLIENT_DONE 1   /* answered, connection closed and reset */
+#define CLIENT_CGI 2    /* CGI started, read its output from cs->fd[0] */
+#define CLIENT_SEND 3   /* response (or error page) partly written, wait
+                         * until cs->sock is writable and call clientWritable */
+#define CLIENT_COMPRESS 4 /* body being compressed on the helper thread;
+                           * it comes back from compressedClient */
+#define CLIENT_H2 5     /* the connection speaks HTTP/2 from now on; h2.c
+                         * watches its descriptors, see h2SetLoop */
+#define CLIENT_STATIC 6 /* response laid out from the content pack, as by
+                         * startOK; send it with sendOK */
+
+int acceptClient(struct clientstate *client, int size, int newfd,
+        struct sockaddr_in *peer);
+int clientInput(struct clientstate *cs, char *line, int n);
+void clientGone(struct clientstate *cs);
+void cgiDone(struct clientstate *cs);
+int cgiRespond(struct clientstate *cs, int ret_code);
+int clientWritable(struct clientstate *cs);
+int clientTimedOut(struct clientstate *cs);
 void resetClient(struct clientstate *cs);
 
+void armDeadline(struct clientstate *cs, int kind, uint64_t expires_ms);
+void armSendDeadline(struct clientstate *cs, uint64_t bytes);
+void armTimer(struct timer *t, int kind, uint64_t expires_ms);
+void disarmTimer(struct timer *t);
+int nextDeadline(void);
+void runDeadlines(void (*expired)(struct clientstate *cs, void *arg),
+        void *arg);
+
 int validResource(char *str);
+int addUpstreamProgram(char *name);
+int upstreamProgram(char *str);
 char *getPath(char *str);
 char *getQuery(char *str);
 int processRequest(struct clientstate *cs);
@@ -1,58 +1,524 @@
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <netinet/in.h> /* Internet domain header */
 
 #include "wrapsock.h"
 #include "ws_helpers.h"
+#include "log.h"
+#include "stats.h"
+#include "probes.h"
+#include "uring.h"
+#include "coloop.h"
+#include "upgrade.h"
+#include "h2.h"
+#include "tls.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "mem.h"
+#include "affinity.h"
+#include "transport.h"
+#include "capture.h"
+#include "pack.h"
+#include "body.h"
 
 #include "sys/select.h"
 
 #define MAXCLIENTS 10
-
-int handleClient(struct clientstate *cs, char *line);
+#define USAGE "Usage: wserver [-a access_log] [-C capture] [-p pack] [-b backlog] [-e select|uring|coro]\n" \
+              "               [-z level] [-m min_size] [-t] [-s spill_dir] [-B max_body]\n" \
+              "               [-r rate[/burst]] [-l max_conns] [-M megabytes]\n" \
+              "               [-P cpu|any]\n" \
+              "               [-c cert.pem [-k key.pem] [-T]]\n" \
+              "               [-u name=host:port[,host:port...]]... <port>\n"
 
 // You may want to use this function for initial testing
 // void write_page(int fd);
 
+// Descriptors to arm for the next round of "select"
+static fd_set shadow_fds;
+static fd_set shadow_write_fds;
+// This round: what was armed and what is ready
+static fd_set read_fds, write_fds;
+static fd_set armed_fds, armed_write_fds;
+static int max_fd;
+
+/* A deadline of cs expired: stop waiting for its socket and end it. */
+static void selectTimeout(struct clientstate *cs, void *arg)
+{
+    (void)arg;
+    int sock = cs->sock;
+    FD_CLR(sock, &shadow_fds);
+    FD_CLR(sock, &shadow_write_fds);
+    if (clientTimedOut(cs) == CLIENT_SEND)
+    {
+        // The rest of its 408
+        FD_SET(sock, &shadow_write_fds);
+    }
+}
+
+/* h2.c, tls.c or proxy.c wants to hear about events on fd: arm it for the
+ * next round.
+ */
+static void selectWatch(int fd, int events, void *arg)
+{
+    (void)arg;
+    if (events & POLLIN)
+    {
+        FD_SET(fd, &shadow_fds);
+    }
+    if (events & POLLOUT)
+    {
+        FD_SET(fd, &shadow_write_fds);
+    }
+    if (fd > max_fd)
+    {
+        max_fd = fd;
+    }
+}
+
+/* h2.c, tls.c or proxy.c is about to close fd: forget it, including what
+ * is left of this round, so that neither select nor the loop below sees it
+ * again.
+ */
+static void selectUnwatch(int fd, void *arg)
+{
+    (void)arg;
+    FD_CLR(fd, &shadow_fds);
+    FD_CLR(fd, &shadow_write_fds);
+    FD_CLR(fd, &read_fds);
+    FD_CLR(fd, &write_fds);
+    FD_CLR(fd, &armed_fds);
+    FD_CLR(fd, &armed_write_fds);
+}
+
+/* The TLS handshake of cs is done (see tls.c): read its request. */
+static void selectResume(struct clientstate *cs, void *arg)
+{
+    (void)arg;
+    FD_SET(cs->sock, &shadow_fds);
+    if (cs->sock > max_fd)
+    {
+        max_fd = cs->sock;
+    }
+}
+
+/* Move the request body of cs on (see bodyPump) and arm the descriptor
+ * it waits for.
+ */
+static void pumpBody(struct clientstate *cs)
+{
+    int events;
+    int fd = bodyWait(cs, bodyPump(cs), &events);
+    if (fd != -1)
+    {
+        selectWatch(fd, events, NULL);
+    }
+}
+
+/* Ready descriptors of one round, by class, in the order they are served.
+ * Each gets one turn per round: one read of its socket or pipe, or up to
+ * SEND_BUDGET bytes of its response (see clientWritable).
+ */
+static int io_queue[FD_SETSIZE];  /* client sockets; HTTP/2, TLS, upstreams */
+static int cgi_queue[FD_SETSIZE]; /* pipes of CGI programs */
+static int rr_start;              /* where the scan for them starts */
+
+/* Drain the accept queue, up to a budget so that a connection storm
+ * cannot starve the connections we already have.
+ */
+static void acceptClients(int listenfd, struct clientstate *client)
+{
+    for (int k = 0; k < ACCEPT_BUDGET; k++)
+    {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int newfd = acceptConnection(listenfd, (struct sockaddr *)&peer, &peer_len);
+        if (newfd == -1)
+        {
+            break;
+        }
+        // fprintf(stderr, "accepted new connection on socket %d\n", newfd);
+        int j = acceptClient(client, MAXCLIENTS, newfd, &peer);
+        if (j != -1)
+        {
+            if (newfd > max_fd)
+                max_fd = newfd;
+            // Prepare for the next round of using "select",
+            // after the TLS handshake if there is one
+            if (!tlsStart(&client[j]))
+            {
+                FD_SET(newfd, &shadow_fds);
+            }
+        }
+    }
+}
+
+/* Give fd, a client socket or pipe or a descriptor of h2.c, tls.c or
+ * proxy.c, its turn for events.
+ */
+static void serveFd(int fd, int events, struct clientstate *client)
+{
+    // Sockets of HTTP/2 connections and the pipes of their streams,
+    // TLS connections that are handshaking or relayed, and
+    // connections to upstreams
+    if (h2Event(fd, events) == 0 || tlsEvent(fd, events) == 0 ||
+        proxyEvent(fd, events) == 0)
+    {
+        return;
+    }
+    if (events & POLLOUT)
+    {
+        int client_id = get_client_for_input_fd(fd, client, MAXCLIENTS);
+        if (client_id != -1)
+        {
+            // A CGI program can take more of its request body
+            pumpBody(&client[client_id]);
+            return;
+        }
+        // A client socket can take more of its response
+        client_id = get_client_for_sock_fd(fd, client, MAXCLIENTS);
+        if (client_id == -1)
+        {
+            return;
+        }
+        if (clientWritable(&client[client_id]) == CLIENT_SEND)
+        {
+            FD_SET(fd, &shadow_write_fds);
+        }
+        return;
+    }
+    // There is data to be read on file descriptor "fd"
+    // Determine the right client for this descriptor and whether it's a socket or a pipe
+    int client_id = get_client_for_sock_fd(fd, client, MAXCLIENTS);
+    if (client_id == -1)
+    {
+        // fprintf(stderr, "we are dealing with pipe fd %d\n", fd);
+        client_id = get_client_for_pipe_fd(fd, client, MAXCLIENTS);
+        if (client_id == -1)
+        {
+            // This case should only happen in case of a bug
+            // fprintf(stderr, "error getting client for pipe fd %d\n", fd);
+            exit(1);
+        }
+        struct clientstate *client_ptr = &client[client_id];
+        int ret_code = handle_pipe_data(client_ptr);
+        if (ret_code == 1)
+        {
+            // There is more data to be read from the CGI program
+            FD_SET(fd, &shadow_fds);
+        }
+        else if (ret_code == 2)
+        {
+            // Paused until it comes back from resumedClient
+        }
+        else
+        {
+            if (client_ptr->fd[1] != -1)
+            {
+                // Done before its request body: stop streaming it
+                selectUnwatch(client_ptr->fd[1], NULL);
+                selectUnwatch(client_ptr->sock, NULL);
+            }
+            cgiDone(client_ptr);
+            int sock = client_ptr->sock;
+            if (cgiRespond(client_ptr, ret_code) == CLIENT_SEND)
+            {
+                // Finish the response as the client reads it
+                FD_SET(sock, &shadow_write_fds);
+            }
+        }
+    }
+    else
+    {
+        // We have incoming data on socket fd for client_id
+        char line[MAXLINE + 1]; // Add one extra byte for null terminator
+        struct clientstate *client_ptr = &client[client_id];
+        if (client_ptr->fd[1] != -1)
+        {
+            // More of the request body its CGI program is reading
+            pumpBody(client_ptr);
+            return;
+        }
+        int n = ioRead(fd, line, MAXLINE);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            FD_SET(fd, &shadow_fds);
+        }
+        else if (n <= 0)
+        {
+            // fprintf(stderr, "client %d disconnected from socket %d\n", client_id, fd);
+            clientGone(client_ptr);
+        }
+        else
+        {
+            line[n] = '\0'; // Add NULL terminator so that we can print it as string
+            int result = clientInput(client_ptr, line, n);
+            if (result == CLIENT_MORE)
+            {
+                FD_SET(fd, &shadow_fds);
+            }
+            else if (result == CLIENT_STATIC)
+            {
+                if (sendOK(client_ptr) == CLIENT_SEND)
+                {
+                    FD_SET(fd, &shadow_write_fds);
+                }
+            }
+            else if (result == CLIENT_SEND)
+            {
+                // The rest of an error or the metrics page
+                FD_SET(fd, &shadow_write_fds);
+            }
+            else if (result == CLIENT_CGI)
+            {
+                int pipe_fd = client_ptr->fd[0];
+                if (pipe_fd > max_fd)
+                {
+                    max_fd = pipe_fd;
+                }
+                FD_SET(pipe_fd, &shadow_fds);
+                pumpBody(client_ptr);
+            }
+        }
+    } // End of handling incoming data on socket
+}
+
+/* Serve the n descriptors of queue that are still ready; a descriptor
+ * closed by an earlier turn was taken out of read_fds and write_fds.
+ */
+static void runQueue(const int *queue, int n, struct clientstate *client)
+{
+    for (int k = 0; k < n; k++)
+    {
+        int fd = queue[k];
+        int events = (FD_ISSET(fd, &read_fds) ? POLLIN : 0) |
+                     (FD_ISSET(fd, &write_fds) ? POLLOUT : 0);
+        if (events != 0)
+        {
+            serveFd(fd, events, client);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
 
-    if (argc != 2)
+    char *access_log = NULL;
+    char *capture = NULL;
+    char *pack = NULL;
+    char *engine = "select";
+    int backlog = LISTENQ;
+    int compress_level = COMPRESS_LEVEL;
+    int compress_min = COMPRESS_MIN_SIZE;
+    int compress_thread = 0;
+    char *cert_file = NULL;
+    char *key_file = NULL;
+    int ktls = 1;
+    int rate = 0;
+    int burst = 0;
+    int max_conns = 0;
+    int64_t mem_budget = MEM_BUDGET_DEFAULT;
+    int cpu = AFFINITY_NONE;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:C:p:s:B:b:e:z:m:tc:k:Tu:r:l:M:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            access_log = optarg;
+            break;
+        case 'C':
+            // Record the requests for wreplay, see capture.c
+            capture = optarg;
+            break;
+        case 'p':
+            // Prerendered pages built by mkpack, see pack.c
+            pack = optarg;
+            break;
+        case 's':
+            // Where CGI output too large to keep in memory goes
+            spillInit(optarg);
+            break;
+        case 'B':
+            // Largest POST or PUT body, see body.c
+            bodyLimit(atoll(optarg));
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'e':
+            engine = optarg;
+            break;
+        case 'z':
+            compress_level = atoi(optarg);
+            break;
+        case 'm':
+            compress_min = atoi(optarg);
+            break;
+        case 't':
+            compress_thread = 1;
+            break;
+        case 'c':
+            cert_file = optarg;
+            break;
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'T':
+            // Keep TLS in user space, e.g. to compare with kTLS
+            ktls = 0;
+            break;
+        case 'r':
+            // Requests per second per client, and how many may come at once
+            rate = atoi(optarg);
+            if (strchr(optarg, '/') != NULL)
+            {
+                burst = atoi(strchr(optarg, '/') + 1);
+            }
+            break;
+        case 'l':
+            // Connections per client
+            max_conns = atoi(optarg);
+            break;
+        case 'M':
+            // Memory budget for connection buffers, see mem.c
+            mem_budget = (int64_t)atoi(optarg) << 20;
+            break;
+        case 'P':
+            // One of several workers on the port, pinned to a CPU or not
+            cpu = strcmp(optarg, "any") == 0 ? AFFINITY_ANY : atoi(optarg);
+            break;
+        case 'u':
+            // Serve the program name from upstream HTTP services
+            if (proxyAddRoute(optarg) == -1)
+            {
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 || (strcmp(engine, "select") != 0 && strcmp(engine, "uring") != 0 &&
+                              strcmp(engine, "coro") != 0))
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    unsigned short port = (unsigned short)atoi(argv[optind]);
+    rateInit(rate, burst, max_conns);
+    memInit(mem_budget);
+    if (affinityInit(cpu) == -1)
+    {
+        exit(1);
+    }
+    if (access_log != NULL && accessLogOpen(access_log) == -1)
+    {
+        exit(1);
+    }
+    if (capture != NULL && captureOpen(capture) == -1)
+    {
+        exit(1);
+    }
+    if (pack != NULL && packOpen(pack) == -1)
+    {
+        exit(1);
+    }
+    // A client or CGI program that goes away mid-write is an EPIPE for the
+    // code doing the writing, not the end of the server; CGI programs get
+    // the default back (see kernelSpawn)
+    signal(SIGPIPE, SIG_IGN);
+    // The key may be in the certificate file
+    if (cert_file != NULL && tlsInit(cert_file, key_file != NULL ? key_file : cert_file, ktls) == -1)
     {
-        // fprintf(stderr, "Usage: wserver <port>\n");
         exit(1);
     }
-    unsigned short port = (unsigned short)atoi(argv[1]);
     int listenfd;
     struct clientstate client[MAXCLIENTS];
 
-    // Set up the socket to which the clients will connect
-    listenfd = setupServerSocket(port);
+    // Set up the socket to which the clients will connect, unless we are
+    // taking over from an older wserver (see upgrade.c)
+    int upgrade_fd = upgradeInit(argv);
+    listenfd = upgradeListenFd();
+    if (listenfd == -1)
+    {
+        listenfd = setupServerSocket(port, backlog, affinityShared());
+    }
+    affinityListen(listenfd);
+    initResponses();
+    int compress_fd = compressInit(compress_level, compress_min, compress_thread);
 
     initClients(client, MAXCLIENTS);
 
-    fd_set read_fds;
-    fd_set shadow_fds;
+    if (strcmp(engine, "uring") == 0)
+    {
+        if (runUringLoop(listenfd, upgrade_fd, compress_fd, client, MAXCLIENTS) == 0)
+        {
+            accessLogClose();
+            captureClose();
+            return 0;
+        }
+        LOG_WARN("falling back to the select loop\n");
+    }
+    if (strcmp(engine, "coro") == 0)
+    {
+        runCoroLoop(listenfd, upgrade_fd, compress_fd, client, MAXCLIENTS);
+        accessLogClose();
+        captureClose();
+        return 0;
+    }
 
     FD_ZERO(&shadow_fds);
+    FD_ZERO(&shadow_write_fds);
+    h2SetLoop(selectWatch, selectUnwatch, NULL);
+    tlsSetLoop(selectWatch, selectUnwatch, selectResume, NULL);
+    proxySetLoop(selectWatch, selectUnwatch, NULL);
 
-    int max_fd = listenfd;
+    max_fd = listenfd > upgrade_fd ? listenfd : upgrade_fd;
+    if (compress_fd > max_fd)
+    {
+        max_fd = compress_fd;
+    }
     // fprintf(stderr, "Server will listen on socket %d\n", listenfd);
 
-    int n_connections = 0;
+    int accepting = 1; // cleared once a newer wserver took over
+    int ready_fd = -1; // readiness of that newer wserver while it starts
+    upgradeServing();
+
     int exit_flag = 0;
     while (!exit_flag)
     {
+        affinityCheck();
+        // End the connections whose deadline passed before arming anything,
+        // so that select never sees a descriptor closed on the way
+        runDeadlines(selectTimeout, NULL);
+        if (upgradeDrained(countClients(client, MAXCLIENTS) + tlsConnections()))
+        {
+            break;
+        }
+        // Pipes paused for lack of memory that may be read again
+        struct clientstate *resumed;
+        while ((resumed = resumedClient()) != NULL)
+        {
+            FD_SET(resumed->fd[0], &shadow_fds);
+        }
 
         // Set-up all descriptors "select" should inspect
         // This includes both socket descriptors and pipe descriptors
         FD_ZERO(&read_fds);
-        FD_SET(listenfd, &read_fds);
+        if (accepting)
+        {
+            FD_SET(listenfd, &read_fds);
+        }
         for (int k = 0; k < max_fd + 1; k++)
         {
             if (FD_ISSET(k, &shadow_fds))
@@ -60,253 +526,127 @@ int main(int argc, char **argv)
                 FD_SET(k, &read_fds);
             }
         }
+        write_fds = shadow_write_fds;
         FD_ZERO(&shadow_fds);
+        FD_ZERO(&shadow_write_fds);
+        // Remember what we armed: descriptors that are not ready this time
+        // must be armed again for the next round
+        armed_fds = read_fds;
+        armed_write_fds = write_fds;
+        // The upgrade and compression descriptors are always armed and
+        // handled first
+        if (compress_fd != -1)
+        {
+            FD_SET(compress_fd, &read_fds);
+        }
+        if (upgrade_fd != -1)
+        {
+            FD_SET(upgrade_fd, &read_fds);
+        }
+        if (ready_fd != -1)
+        {
+            FD_SET(ready_fd, &read_fds);
+        }
 
-        struct timeval timeLimit = {300, 0};
-        int num_active = Select(max_fd + 1, &read_fds, NULL, NULL, &timeLimit);
-        if (num_active == 0)
+        // Sleep no longer than until the next deadline
+        struct timeval timeLimit;
+        struct timeval *timeout = NULL;
+        int wait_ms = upgradeDrainWait(nextDeadline());
+        if (wait_ms >= 0)
         {
-            // fprintf(stderr, "Timeout encountered. Will exit the program now\n");
-            break; // Will exit the program
+            timeLimit.tv_sec = wait_ms / 1000;
+            timeLimit.tv_usec = (wait_ms % 1000) * 1000;
+            timeout = &timeLimit;
         }
+        // On a timeout nothing is ready; the loop below then re-arms every
+        // descriptor and the due deadlines run at the top of the next round
+        Select(max_fd + 1, &read_fds, &write_fds, NULL, timeout);
 
-        // fprintf(stderr, "select encountered  %d active file descriptor(s)\n", num_active);
-        // : the following "for" loop can stop after processing numActive sockets
-        for (int i = 0; i <= max_fd; i++)
+        if (compress_fd != -1 && FD_ISSET(compress_fd, &read_fds))
         {
-            int fd = FD_ISSET(i, &read_fds) ? i : -1;
-            if (fd == -1)
+            // Compressed bodies are back from the helper thread
+            FD_CLR(compress_fd, &read_fds);
+            struct clientstate *cs;
+            while ((cs = compressedClient()) != NULL)
             {
-                continue;
-            }
-            // fprintf(stderr, "file descriptor %d is ready\n", fd);
-            // Check which type of descriptor is ready. We have 3 possibilities:
-            // (1) Listen socket for new connections
-            // (2) Sockets for receiving http requests
-            // (3) Pipes for receiving data from the CGI program
-            if (fd == listenfd)
-            {
-                int newfd = Accept(listenfd, NULL, NULL);
-                n_connections++;
-                if (n_connections > MAXCLIENTS)
-                {
-                    // fprintf(stderr, "Reached maximum number of clients allowed. Exiting now.\n");
-                    Close(newfd);
-                    exit_flag = 1;
-                    break;
-                }
-                // fprintf(stderr, "accepted new connection on socket %d\n", newfd);
-                int j = 0;
-                for (; j < MAXCLIENTS; j++)
-                {
-                    if (client[j].sock == -1)
-                    { // available entry; re-use
-                        client[j].sock = newfd;
-                        // fprintf(stderr, "client %d connected to socket %d\n", j, newfd);
-                        // Prepare for the next round of using "select"
-                        FD_SET(newfd, &shadow_fds);
-                        if (newfd > max_fd)
-                            max_fd = newfd;
-                        break;
-                    }
-                }
-                if (j == MAXCLIENTS)
+                int sock = cs->sock;
+                if (sendOK(cs) == CLIENT_SEND)
                 {
-                    // fprintf(stderr, "too many clients\n");
-                    Close(newfd);
+                    FD_SET(sock, &shadow_write_fds);
                 }
             }
-            else
+        }
+        if (upgrade_fd != -1 && FD_ISSET(upgrade_fd, &read_fds))
+        {
+            // SIGUSR2: start the new binary, keep serving until it is ready
+            FD_CLR(upgrade_fd, &read_fds);
+            int fd = upgradeStart(listenfd);
+            if (fd != -1)
             {
-                // There is data to be read on file descriptor "fd"
-                // Determine the right client for this descriptor and whether it's a socket or a pipe
-                int client_id = get_client_for_sock_fd(fd, client, MAXCLIENTS);
-                if (client_id == -1)
+                ready_fd = fd;
+                if (ready_fd > max_fd)
                 {
-                    // fprintf(stderr, "we are dealing with pipe fd %d\n", fd);
-                    client_id = get_client_for_pipe_fd(fd, client, MAXCLIENTS);
-                    if (client_id == -1)
-                    {
-                        // This case should only happen in case of a bug
-                        // fprintf(stderr, "error getting client for pipe fd %d\n", fd);
-                        exit(1);
-                    }
-                    struct clientstate *client_ptr = &client[client_id];
-                    int ret_code = handle_pipe_data(client_ptr);
-                    if (ret_code == -1)
-                    {
-                        // Server Error
-                        // fprintf(stderr, "error handling pipe data\n");
-                        printServerError(client_ptr->sock);
-                        Close(fd);
-                        Close(client_ptr->sock);
-                        resetClient(client_ptr);
-                    }
-                    else if (ret_code == 1)
-                    {
-                        // There is more data to be read from the CGI program
-                        FD_SET(fd, &shadow_fds);
-                    }
-                    else if (ret_code == 0)
-                    {
-                        // All data from the CGI program was received
-                        printOK(client_ptr->sock, client_ptr->output, client_ptr->optr - client_ptr->output);
-                        Close(fd);
-                        Close(client_ptr->sock);
-                        resetClient(client_ptr);
-                        // fprintf(stderr, "CGI program executed successfully. All data read and sent back to the http client\n");
-                    }
-                    else if (ret_code == 100)
-                    {
-                        // The CGI program has not been found
-                        printNotFound(client_ptr->sock);
-                        Close(fd);
-                        Close(client_ptr->sock);
-                        resetClient(client_ptr);
-                        // fprintf(stderr, "404 Not Found\n");
-                    }
+                    max_fd = ready_fd;
                 }
-                else
-                {
-                    // We have incoming data on socket fd for client_id
-                    char line[MAXLINE + 1]; // Add one extra byte for null terminator
-                    struct clientstate *client_ptr = &client[client_id];
-                    int n = read(fd, line, MAXLINE);
-                    if (n < 0)
-                    {
-                        perror("read error");
-                        exit(-1);
-                    }
-                    else if (n == 0)
-                    {
-                        // fprintf(stderr, "client %d disconnected from socket %d\n", client_id, fd);
-                        Close(fd); // Clean up if data in cs
-                        resetClient(client_ptr);
-                    }
-                    else
-                    {
-
-                        // fprintf(stderr, "client %d read %d bytes from socket %d\n", client_id, n, fd);
-                        line[n] = '\0'; // Add NULL terminator so that we can print it as string
-
-                        // Put all the code above inside handleClient
-                        int handle_code = handleClient(client_ptr, line);
-
-                        if (handle_code == -1)
-                        {
-                            // fprintf(stderr, "error parsing request from client %d\n", client_id);
-                            printINVALID(client_ptr->sock);
-                            Close(fd);
-                            resetClient(client_ptr);
-                            continue;
-                        }
-                        else if (handle_code == 0)
-                        {
-                            FD_SET(fd, &shadow_fds);
-                            continue;
-                        }
-                        else if (handle_code != 1)
-                        {
-                            // fprintf(stderr, "Bad Error Code");
-                            exit(1);
-                        }
-
-                        // Open a pipe, fork/exec and allocate buffer for incoming data
-                        int pipe_fd = do_pipe(client_ptr);
-
-                        if (pipe_fd == -1)
-                        {
-                            // fprintf(stderr, "error creating pipe or forking\n");
-                            printServerError(client_ptr->sock);
-                            Close(fd);
-                            resetClient(client_ptr);
-                            continue;
-                        }
-                        // fprintf(stderr, "fork succeeded\n");
+            }
+        }
+        if (ready_fd != -1 && FD_ISSET(ready_fd, &read_fds))
+        {
+            FD_CLR(ready_fd, &read_fds);
+            if (upgradeReady(ready_fd))
+            {
+                // The new process accepts from here on; finish what we have
+                accepting = 0;
+                FD_CLR(listenfd, &read_fds);
+            }
+            ready_fd = -1;
+        }
 
-                        if (pipe_fd > max_fd)
-                        {
-                            max_fd = pipe_fd;
-                        }
-                        FD_SET(pipe_fd, &shadow_fds);
-                    }
-                } // End of handling incoming data on socket
+        // Gather what is ready by class, scanning from a point that moves
+        // every round so that no descriptor is always served first
+        int num_io = 0, num_cgi = 0, accept_ready = 0;
+        for (int k = 0; k <= max_fd; k++)
+        {
+            int i = (k + rr_start) % (max_fd + 1);
+            int readable = FD_ISSET(i, &read_fds);
+            int writable = FD_ISSET(i, &write_fds);
+            // Arm again what was armed but is not ready
+            if (!writable && FD_ISSET(i, &armed_write_fds))
+            {
+                FD_SET(i, &shadow_write_fds);
+            }
+            if (!readable && i != listenfd && FD_ISSET(i, &armed_fds))
+            {
+                FD_SET(i, &shadow_fds);
+            }
+            if (!readable && !writable)
+            {
+                continue;
+            }
+            if (i == listenfd)
+            {
+                accept_ready = 1;
+            }
+            else if (get_client_for_pipe_fd(i, client, MAXCLIENTS) != -1)
+            {
+                cgi_queue[num_cgi++] = i;
             }
-        } // end 'for' loop iterating over active file descriptors
+            else
+            {
+                io_queue[num_io++] = i;
+            }
+        }
+        rr_start = (rr_start + 1) % (max_fd + 1);
+        // Connections we have come first, then the programs working for
+        // them, and only then new connections
+        runQueue(io_queue, num_io, client);
+        runQueue(cgi_queue, num_cgi, client);
+        if (accept_ready && accepting)
+        {
+            acceptClients(listenfd, client);
+        }
     }     // end 'while' loop
+    accessLogClose();
+    captureClose();
     return 0;
 }
-
-/* Update the client state cs with the request input in line.
- * Intializes cs->request if this is the first read call from the socket.
- * Note that line must be null-terminated string.
- *
- * Return 0 if the get request message is not complete and we need to wait for
- *     more data
- * Return -1 if there is an error and the socket should be closed
- *     - Request is not a GET request
- *     - The first line of the GET request is poorly formatted (getPath, getQuery)
- *
- * Return 1 if the get request message is complete and ready for processing
- *     cs->request will hold the complete request
- *     cs->path will hold the executable path for the CGI program
- *     cs->query will hold the query string
- *     cs->output will be allocated to hold the output of the CGI program
- *     cs->optr will point to the beginning of cs->output
- */
-int handleClient(struct clientstate *cs, char *line)
-{
-
-    int n = strlen(line);
-    // fprintf(stderr, "line: %s\n", line);
-    if (cs->request == NULL)
-    { // First read operation for this socket
-        cs->request = (char *)malloc((n + 1) * sizeof(char));
-        memcpy(cs->request, line, n + 1); // Copy received data, including the NULL terminator
-    }
-    else
-    {
-        // We need to append the data we just received to the older data
-        int previous_size = strlen(cs->request);
-        int new_size = previous_size + n + 1;
-        char *new_mem = (char *)malloc(new_size * sizeof(char));
-        memcpy(new_mem, cs->request, previous_size);  // Copy old data
-        memcpy(new_mem + previous_size, line, n + 1); // Append the new data, including the NULL terminator
-        free(cs->request);                            // Free the old buffer which is no longer needed
-        cs->request = new_mem;                        // Attach the new buffer to this client
-    }
-    // Check whether we have a full HTTP request
-    char *end_ptr = strstr(cs->request, "\r\n\r\n");
-    if (end_ptr == NULL)
-    {
-        // fprintf(stderr, "Request not received fully. Will arm this socket for the next 'select' operation\n");
-        return 0;
-    }
-    // fprintf(stderr, "server read entire HTTP request for client\n");
-    // Parse the HTTP request and make sure it meets all acceptance criteria
-    int parsable = parse_http_request(cs);
-    if (parsable == -1)
-    {
-        return -1;
-    }
-
-    // fprintf(stderr, "handleClient called with socket: %d\n", cs->sock);
-
-    // If the resource is favicon.ico we will ignore the request
-    if (strcmp("favicon.ico", cs->path) == 0)
-    {
-        // A suggestion for debugging output
-        // fprintf(stderr, "Client: sock = %d\n", cs->sock);
-        // fprintf(stderr, "        path = %s (ignoring)\n", cs->path);
-        printNotFound(cs->sock);
-        return -1;
-    }
-
-    // A suggestion for printing some information about each client.
-    // You are welcome to modify or remove these print statements
-    // fprintf(stderr, "Client: sock = %d\n", cs->sock);
-    // fprintf(stderr, "        path = %s\n", cs->path);
-    // fprintf(stderr, "        query_string = %s\n", cs->query_string);
-
-    return 1;
-}